@@ -0,0 +1,152 @@
+#include <dirent.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string>
+
+#include "autoindex.h"
+
+struct autoindex_state
+{
+    DIR* dir;
+    int stage; //0还没写页头，1逐项列目录，2页尾已经写出
+    std::string base; //请求的目录URL，去掉查询串，以/结尾
+    std::string line; //当前这一行，produce一次放不下时下次接着拷
+    size_t sent;
+};
+
+static void append_html( std::string* out, const char* text, size_t length )
+{
+    for( size_t i = 0; i < length; ++i )
+    {
+        switch( text[i] )
+        {
+            case '&': out->append( "&amp;" ); break;
+            case '<': out->append( "&lt;" ); break;
+            case '>': out->append( "&gt;" ); break;
+            case '"': out->append( "&quot;" ); break;
+            case '\'': out->append( "&#39;" ); break;
+            default: out->push_back( text[i] );
+        }
+    }
+}
+
+//文件名放进链接之前百分号编码，只留下RFC 3986的unreserved字符
+static void append_url( std::string* out, const char* name )
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for( const unsigned char* p = ( const unsigned char* )name; *p; ++p )
+    {
+        if( ( *p >= 'a' && *p <= 'z' ) || ( *p >= 'A' && *p <= 'Z' ) || ( *p >= '0' && *p <= '9' )
+            || *p == '-' || *p == '.' || *p == '_' || *p == '~' )
+        {
+            out->push_back( *p );
+        }
+        else
+        {
+            out->push_back( '%' );
+            out->push_back( hex[ *p >> 4 ] );
+            out->push_back( hex[ *p & 15 ] );
+        }
+    }
+}
+
+//生成下一行放进state->line，没有了返回false
+static bool next_line( autoindex_state* state )
+{
+    state->line.clear();
+    state->sent = 0;
+    if( state->stage == 0 )
+    {
+        state->stage = 1;
+        state->line.append( "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of " );
+        append_html( &state->line, state->base.data(), state->base.size() );
+        state->line.append( "</title></head>\n<body><h1>Index of " );
+        append_html( &state->line, state->base.data(), state->base.size() );
+        state->line.append( "</h1><hr><pre>\n" );
+        if( state->base != "/" )
+        {
+            state->line.append( "<a href=\"../\">../</a>\n" );
+        }
+        return true;
+    }
+    if( state->stage == 1 )
+    {
+        struct dirent* entry;
+        while( ( entry = readdir( state->dir ) ) != NULL )
+        {
+            const char* name = entry->d_name;
+            if( strcmp( name, "." ) == 0 || strcmp( name, ".." ) == 0 )
+            {
+                continue;
+            }
+            bool is_dir = entry->d_type == DT_DIR;
+            if( entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK )
+            {
+                struct stat st;
+                is_dir = fstatat( dirfd( state->dir ), name, &st, 0 ) == 0 && S_ISDIR( st.st_mode );
+            }
+            state->line.append( "<a href=\"" );
+            append_html( &state->line, state->base.data(), state->base.size() );
+            append_url( &state->line, name );
+            state->line.append( is_dir ? "/\">" : "\">" );
+            append_html( &state->line, name, strlen( name ) );
+            state->line.append( is_dir ? "/</a>\n" : "</a>\n" );
+            return true;
+        }
+        state->stage = 2;
+        state->line.append( "</pre><hr></body></html>\n" );
+        return true;
+    }
+    return false;
+}
+
+static void* autoindex_open( const char* url, const char* path )
+{
+    DIR* dir = opendir( path );
+    if( ! dir )
+    {
+        return NULL;
+    }
+    autoindex_state* state = new autoindex_state;
+    state->dir = dir;
+    state->stage = 0;
+    state->base.assign( url, strcspn( url, "?" ) );
+    if( state->base.empty() || state->base[ state->base.size() - 1 ] != '/' )
+    {
+        state->base.push_back( '/' );
+    }
+    state->sent = 0;
+    return state;
+}
+
+static int autoindex_produce( void* arg, char* buf, int size )
+{
+    autoindex_state* state = ( autoindex_state* )arg;
+    int length = 0;
+    while( length < size )
+    {
+        if( state->sent == state->line.size() && ! next_line( state ) )
+        {
+            break;
+        }
+        size_t n = state->line.size() - state->sent;
+        if( n > ( size_t )( size - length ) )
+        {
+            n = size - length;
+        }
+        memcpy( buf + length, state->line.data() + state->sent, n );
+        state->sent += n;
+        length += n;
+    }
+    return length;
+}
+
+static void autoindex_close( void* arg )
+{
+    autoindex_state* state = ( autoindex_state* )arg;
+    closedir( state->dir );
+    delete state;
+}
+
+const stream_handler autoindex_handler = { "text/html; charset=utf-8", autoindex_open, autoindex_produce, autoindex_close };
@@ -0,0 +1,12 @@
+#ifndef AUTOINDEX_H
+#define AUTOINDEX_H
+
+#include "http_conn.h"
+
+/*
+目录列表：开了--autoindex时，对目录的请求边readdir边生成HTML，用流式响应分块发出，
+目录再大每个连接也只占一块缓冲区和一个DIR。列表按readdir的顺序，不排序——排序就得先把整个目录读进内存
+*/
+extern const stream_handler autoindex_handler;
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef BENCH_HISTOGRAM_H
+#define BENCH_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+HDR风格的对数-线性直方图：小于128的值每个值一格；之后每个2的幂区间[2^k, 2^(k+1))再线性分成64格，
+相对误差不超过1/64。记录一个值只是一次clz和一次加法，不分配内存；各线程各记一个，最后merge。
+单位由调用者决定，负载生成器用微秒，微基准用纳秒。
+*/
+class histogram
+{
+public:
+    static const int LINEAR_BITS = 7; //小于2^7的值精确记录
+    static const int SUB_BITS = 6; //每个2的幂区间分成2^6格
+    static const int BUCKET_NUMBER = ( 1 << LINEAR_BITS ) + ( 64 - LINEAR_BITS ) * ( 1 << SUB_BITS );
+
+    histogram() { reset(); }
+
+    void reset()
+    {
+        memset( m_counts, 0, sizeof( m_counts ) );
+        m_count = 0;
+        m_sum = 0;
+        m_min = UINT64_MAX;
+        m_max = 0;
+    }
+
+    void record( uint64_t value )
+    {
+        ++m_counts[ index_of( value ) ];
+        ++m_count;
+        m_sum += value;
+        m_min = value < m_min ? value : m_min;
+        m_max = value > m_max ? value : m_max;
+    }
+
+    void merge( const histogram& other )
+    {
+        for( int i = 0; i < BUCKET_NUMBER; ++i )
+        {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        m_min = other.m_min < m_min ? other.m_min : m_min;
+        m_max = other.m_max > m_max ? other.m_max : m_max;
+    }
+
+    uint64_t count() const { return m_count; }
+    uint64_t min() const { return m_count ? m_min : 0; }
+    uint64_t max() const { return m_max; }
+    double mean() const { return m_count ? ( double )m_sum / m_count : 0; }
+
+    //percentile取0~100；返回所在格子的上界（不超过max），和HdrHistogram的highest equivalent value一样偏保守
+    uint64_t value_at( double percentile ) const
+    {
+        if( m_count == 0 )
+        {
+            return 0;
+        }
+        uint64_t rank = ( uint64_t )( percentile / 100.0 * m_count + 0.5 );
+        rank = rank < 1 ? 1 : ( rank > m_count ? m_count : rank );
+        uint64_t seen = 0;
+        for( int i = 0; i < BUCKET_NUMBER; ++i )
+        {
+            seen += m_counts[i];
+            if( seen >= rank )
+            {
+                uint64_t upper = highest_of( i );
+                return upper < m_max ? upper : m_max;
+            }
+        }
+        return m_max;
+    }
+
+private:
+    static int index_of( uint64_t value )
+    {
+        if( value < ( 1u << LINEAR_BITS ) )
+        {
+            return ( int )value;
+        }
+        int k = 63 - __builtin_clzll( value ); //k >= LINEAR_BITS
+        int sub = ( int )( value >> ( k - SUB_BITS ) ) - ( 1 << SUB_BITS );
+        return ( 1 << LINEAR_BITS ) + ( k - LINEAR_BITS ) * ( 1 << SUB_BITS ) + sub;
+    }
+
+    static uint64_t highest_of( int index )
+    {
+        if( index < ( 1 << LINEAR_BITS ) )
+        {
+            return index;
+        }
+        int k = ( index - ( 1 << LINEAR_BITS ) ) / ( 1 << SUB_BITS ) + LINEAR_BITS;
+        int sub = ( index - ( 1 << LINEAR_BITS ) ) % ( 1 << SUB_BITS );
+        uint64_t width = ( uint64_t )1 << ( k - SUB_BITS );
+        return ( ( uint64_t )( ( 1 << SUB_BITS ) + sub ) << ( k - SUB_BITS ) ) + width - 1;
+    }
+
+private:
+    uint64_t m_counts[ BUCKET_NUMBER ];
+    uint64_t m_count;
+    uint64_t m_sum;
+    uint64_t m_min;
+    uint64_t m_max;
+};
+
+#endif
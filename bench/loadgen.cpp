@@ -0,0 +1,793 @@
+/*
+HTTP负载生成器。每个线程一个epoll，管理自己的一批非阻塞连接。
+- 闭环（默认）：每个连接上始终有pipeline个请求在路上，收到一个响应就补发一个；
+- 开环（--rate）：按固定到达率排请求，延迟从“本该发出”的时刻算起，服务器变慢时排队的时间也算进去，
+  避免闭环测量的coordinated omission；
+- --no-keepalive：每个请求一个新连接（Connection: close），延迟包含建连；
+- --idle N：只建N个连接、各发一个请求后保持空闲，用来量服务器在大量空闲连接下的内存。
+结果是HDR风格的延迟直方图，--json把一次运行的结果作为一行JSON追加到文件里。
+*/
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct target
+{
+    std::string request;
+    int weight;
+};
+
+struct options
+{
+    const char* host;
+    int port;
+    int connections;
+    int threads;
+    double duration;
+    double warmup;
+    double rate; //开环的总到达率（请求/秒），0表示闭环
+    int pipeline;
+    bool keepalive;
+    int idle;
+    const char* label;
+    const char* json;
+    std::vector< std::string > urls; //形如 /index.html 或 /index.html:3（权重）
+    std::vector< std::string > headers;
+};
+
+static options g_options;
+static std::vector< target > g_targets;
+static int g_total_weight = 0;
+
+//一个连接的状态
+struct connection
+{
+    int fd;
+    bool connecting;
+    uint64_t connect_start;
+    std::deque< uint64_t > inflight; //已发出请求的起始时间，响应按顺序回来
+    std::string out; //还没写出去的请求字节
+    size_t out_offset;
+    bool want_write; //已经注册了EPOLLOUT
+    //响应解析
+    bool in_body;
+    std::string header;
+    long body_left;
+    int status;
+    bool server_close;
+};
+
+class worker
+{
+public:
+    worker( int id, int connections, double rate );
+    ~worker();
+    void run( uint64_t start, uint64_t measure_start, uint64_t end );
+
+    histogram m_latency; //微秒
+    uint64_t m_requests;
+    uint64_t m_bytes;
+    uint64_t m_status[6]; //下标是状态码的百位，[0]是解析不出状态码的
+    uint64_t m_connect_errors;
+    uint64_t m_read_errors;
+    uint64_t m_reconnects; //测量期间重建的连接
+    uint64_t m_incomplete; //结束时还没收到响应的请求
+    int m_idle_open; //--idle模式下成功建立并保持的连接数
+    pthread_t m_thread;
+
+private:
+    bool open_connection( connection& c, int index );
+    void close_connection( connection& c );
+    void send_request( connection& c, uint64_t start );
+    void flush( connection& c );
+    void update_events( connection& c, bool want_write );
+    void on_readable( connection& c, int index );
+    bool consume( connection& c, const char* p, size_t n, int index );
+    void parse_header( connection& c );
+    bool complete( connection& c, int index );
+    const target& pick();
+    bool dispatch( uint64_t start );
+
+    int m_id;
+    int m_epollfd;
+    std::vector< connection > m_conns;
+    double m_rate;
+    uint64_t m_measure_start;
+    uint64_t m_end;
+    uint64_t m_rng;
+    size_t m_next_conn; //开环时下一个尝试的连接，轮流分配
+    std::deque< uint64_t > m_pending; //开环时到点了但还没有连接可用的请求
+    char m_buf[ 65536 ];
+};
+
+worker::worker( int id, int connections, double rate ) :
+        m_requests( 0 ), m_bytes( 0 ), m_connect_errors( 0 ), m_read_errors( 0 ), m_reconnects( 0 ), m_incomplete( 0 ),
+        m_idle_open( 0 ), m_id( id ), m_conns( connections ), m_rate( rate ), m_measure_start( 0 ), m_end( 0 ),
+        m_rng( 0x9e3779b97f4a7c15ull * ( id + 1 ) ), m_next_conn( 0 )
+{
+    memset( m_status, 0, sizeof( m_status ) );
+    m_epollfd = epoll_create1( EPOLL_CLOEXEC );
+    for( size_t i = 0; i < m_conns.size(); ++i )
+    {
+        m_conns[i].fd = -1;
+    }
+}
+
+worker::~worker()
+{
+    for( size_t i = 0; i < m_conns.size(); ++i )
+    {
+        if( m_conns[i].fd != -1 )
+        {
+            close( m_conns[i].fd );
+        }
+    }
+    close( m_epollfd );
+}
+
+const target& worker::pick()
+{
+    if( g_targets.size() == 1 )
+    {
+        return g_targets[0];
+    }
+    //xorshift64
+    m_rng ^= m_rng << 13;
+    m_rng ^= m_rng >> 7;
+    m_rng ^= m_rng << 17;
+    int r = m_rng % g_total_weight;
+    for( size_t i = 0; i < g_targets.size(); ++i )
+    {
+        r -= g_targets[i].weight;
+        if( r < 0 )
+        {
+            return g_targets[i];
+        }
+    }
+    return g_targets.back();
+}
+
+bool worker::open_connection( connection& c, int index )
+{
+    int fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( fd < 0 )
+    {
+        ++m_connect_errors;
+        return false;
+    }
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    struct sockaddr_in address;
+    memset( &address, 0, sizeof( address ) );
+    address.sin_family = AF_INET;
+    address.sin_port = htons( g_options.port );
+    inet_pton( AF_INET, g_options.host, &address.sin_addr );
+    if( g_options.idle > 0 && ( ntohl( address.sin_addr.s_addr ) >> 24 ) == 127 )
+    {
+        //一个源地址只有两万多个临时端口，空闲连接多时轮流用127.0.0.x作源地址
+        struct sockaddr_in local;
+        memset( &local, 0, sizeof( local ) );
+        local.sin_family = AF_INET;
+        int global_index = m_id * m_conns.size() + index;
+        local.sin_addr.s_addr = htonl( ( 127u << 24 ) + 2 + global_index / 20000 );
+        bind( fd, ( struct sockaddr* )&local, sizeof( local ) );
+    }
+    c.fd = fd;
+    c.connect_start = now_ns();
+    c.out.clear();
+    c.out_offset = 0;
+    c.inflight.clear();
+    c.in_body = false;
+    c.header.clear();
+    c.body_left = 0;
+    c.server_close = false;
+    c.want_write = true;
+    if( connect( fd, ( struct sockaddr* )&address, sizeof( address ) ) < 0 && errno != EINPROGRESS )
+    {
+        ++m_connect_errors;
+        close( fd );
+        c.fd = -1;
+        return false;
+    }
+    c.connecting = true;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.u32 = index;
+    epoll_ctl( m_epollfd, EPOLL_CTL_ADD, fd, &event );
+    return true;
+}
+
+void worker::close_connection( connection& c )
+{
+    if( c.fd == -1 )
+    {
+        return;
+    }
+    close( c.fd ); //关闭时自动从epoll里移除
+    c.fd = -1;
+}
+
+void worker::update_events( connection& c, bool want_write )
+{
+    if( c.want_write == want_write )
+    {
+        return;
+    }
+    c.want_write = want_write;
+    struct epoll_event event;
+    event.events = EPOLLIN | ( want_write ? EPOLLOUT : 0 );
+    event.data.u32 = &c - &m_conns[0];
+    epoll_ctl( m_epollfd, EPOLL_CTL_MOD, c.fd, &event );
+}
+
+void worker::send_request( connection& c, uint64_t start )
+{
+    c.out += pick().request;
+    c.inflight.push_back( start );
+    if( ! c.connecting )
+    {
+        flush( c );
+    }
+}
+
+void worker::flush( connection& c )
+{
+    while( c.out_offset < c.out.size() )
+    {
+        ssize_t n = ::write( c.fd, c.out.data() + c.out_offset, c.out.size() - c.out_offset );
+        if( n < 0 )
+        {
+            if( errno == EAGAIN )
+            {
+                update_events( c, true );
+                return;
+            }
+            return; //错误在读的时候处理
+        }
+        c.out_offset += n;
+    }
+    c.out.clear();
+    c.out_offset = 0;
+    update_events( c, false );
+}
+
+void worker::parse_header( connection& c )
+{
+    const char* h = c.header.c_str();
+    c.status = 0;
+    if( strncmp( h, "HTTP/1.", 7 ) == 0 && strlen( h ) >= 12 )
+    {
+        c.status = atoi( h + 9 );
+    }
+    c.body_left = 0;
+    c.server_close = false;
+    //逐行找Content-Length和Connection，名字不区分大小写
+    const char* line = strstr( h, "\r\n" );
+    while( line && line[2] != '\r' )
+    {
+        line += 2;
+        if( strncasecmp( line, "Content-Length:", 15 ) == 0 )
+        {
+            c.body_left = atol( line + 15 );
+        }
+        else if( strncasecmp( line, "Connection:", 11 ) == 0 )
+        {
+            const char* v = line + 11;
+            while( *v == ' ' )
+            {
+                ++v;
+            }
+            c.server_close = strncasecmp( v, "close", 5 ) == 0;
+        }
+        line = strstr( line, "\r\n" );
+    }
+    if( c.status == 304 || c.status == 204 || ( c.status >= 100 && c.status < 200 ) )
+    {
+        c.body_left = 0;
+    }
+}
+
+//一个响应收完。返回false表示连接已经关闭（或者重建），剩下的字节不用再解析
+bool worker::complete( connection& c, int index )
+{
+    uint64_t now = now_ns();
+    uint64_t start = c.inflight.empty() ? now : c.inflight.front();
+    if( ! c.inflight.empty() )
+    {
+        c.inflight.pop_front();
+    }
+    if( start >= m_measure_start && now <= m_end )
+    {
+        m_latency.record( ( now - start ) / 1000 );
+        ++m_requests;
+        int cls = c.status / 100;
+        ++m_status[ cls >= 1 && cls <= 5 ? cls : 0 ];
+    }
+    if( g_options.idle > 0 )
+    {
+        ++m_idle_open;
+        return true; //保持空闲
+    }
+    if( c.server_close || ! g_options.keepalive )
+    {
+        //服务器要关或者每个请求一个连接：重建连接，没回来的请求作废
+        m_incomplete += c.inflight.size();
+        close_connection( c );
+        if( now < m_end )
+        {
+            m_reconnects += now >= m_measure_start;
+            if( open_connection( c, index ) && m_rate == 0 )
+            {
+                send_request( c, c.connect_start ); //建连时间也算在这个请求里
+            }
+        }
+        return false;
+    }
+    if( m_rate == 0 && now < m_end )
+    {
+        send_request( c, now );
+    }
+    return true;
+}
+
+bool worker::consume( connection& c, const char* p, size_t n, int index )
+{
+    while( n > 0 )
+    {
+        if( ! c.in_body )
+        {
+            size_t old = c.header.size();
+            c.header.append( p, n );
+            size_t pos = c.header.find( "\r\n\r\n", old >= 3 ? old - 3 : 0 );
+            if( pos == std::string::npos )
+            {
+                if( c.header.size() > 65536 )
+                {
+                    ++m_read_errors;
+                    return false;
+                }
+                return true;
+            }
+            size_t used = pos + 4 - old;
+            c.header.resize( pos + 4 );
+            p += used;
+            n -= used;
+            m_bytes += pos + 4;
+            parse_header( c );
+            c.header.clear();
+            if( c.body_left > 0 )
+            {
+                c.in_body = true;
+                continue;
+            }
+        }
+        else
+        {
+            size_t take = n < ( size_t )c.body_left ? n : c.body_left;
+            p += take;
+            n -= take;
+            c.body_left -= take;
+            m_bytes += take;
+            if( c.body_left > 0 )
+            {
+                return true;
+            }
+            c.in_body = false;
+        }
+        if( ! complete( c, index ) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void worker::on_readable( connection& c, int index )
+{
+    while( c.fd != -1 )
+    {
+        ssize_t n = ::read( c.fd, m_buf, sizeof( m_buf ) );
+        if( n > 0 )
+        {
+            if( ! consume( c, m_buf, n, index ) )
+            {
+                return;
+            }
+            continue;
+        }
+        if( n < 0 && errno == EAGAIN )
+        {
+            return;
+        }
+        //对端关闭或者出错：路上的请求算没完成，重建连接继续压
+        ++m_read_errors;
+        m_incomplete += c.inflight.size();
+        close_connection( c );
+        uint64_t now = now_ns();
+        if( now < m_end && g_options.idle == 0 )
+        {
+            m_reconnects += now >= m_measure_start;
+            if( open_connection( c, index ) && m_rate == 0 )
+            {
+                for( int i = 0; i < g_options.pipeline; ++i )
+                {
+                    send_request( c, c.connect_start );
+                }
+            }
+        }
+        return;
+    }
+}
+
+//开环：把排队的请求交给还有空位的连接，返回是否全部派发出去了
+bool worker::dispatch( uint64_t )
+{
+    size_t tried = 0;
+    while( ! m_pending.empty() && tried < m_conns.size() )
+    {
+        connection& c = m_conns[ m_next_conn ];
+        if( c.fd != -1 && ! c.connecting && ( int )c.inflight.size() < g_options.pipeline )
+        {
+            send_request( c, m_pending.front() );
+            m_pending.pop_front();
+            tried = 0;
+        }
+        else
+        {
+            ++tried;
+        }
+        m_next_conn = ( m_next_conn + 1 ) % m_conns.size();
+    }
+    return m_pending.empty();
+}
+
+void worker::run( uint64_t start, uint64_t measure_start, uint64_t end )
+{
+    m_measure_start = measure_start;
+    m_end = end;
+    for( size_t i = 0; i < m_conns.size(); ++i )
+    {
+        open_connection( m_conns[i], i );
+    }
+    uint64_t interval = m_rate > 0 ? ( uint64_t )( 1e9 / m_rate ) : 0;
+    uint64_t next_send = start;
+    struct epoll_event events[ 1024 ];
+    while( true )
+    {
+        uint64_t now = now_ns();
+        if( now >= end )
+        {
+            break;
+        }
+        int timeout = ( end - now ) / 1000000 + 1;
+        if( interval )
+        {
+            //到点的请求全部排上，延迟从计划时刻算起
+            while( next_send <= now )
+            {
+                m_pending.push_back( next_send );
+                next_send += interval;
+            }
+            dispatch( now );
+            //毫秒级的epoll超时：到达率高时每次醒来批量补发，计划时刻不变，所以不影响延迟的统计
+            int wait = ( next_send - now ) / 1000000;
+            timeout = wait < timeout ? wait : timeout;
+        }
+        int number = epoll_wait( m_epollfd, events, 1024, timeout );
+        for( int i = 0; i < number; ++i )
+        {
+            int index = events[i].data.u32;
+            connection& c = m_conns[ index ];
+            if( c.fd == -1 )
+            {
+                continue;
+            }
+            if( c.connecting && ( events[i].events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) ) )
+            {
+                int error = 0;
+                socklen_t len = sizeof( error );
+                getsockopt( c.fd, SOL_SOCKET, SO_ERROR, &error, &len );
+                if( error != 0 )
+                {
+                    ++m_connect_errors;
+                    close_connection( c );
+                    continue;
+                }
+                c.connecting = false;
+                if( m_rate == 0 && c.inflight.empty() )
+                {
+                    int depth = g_options.idle > 0 ? 1 : g_options.pipeline;
+                    for( int k = 0; k < depth; ++k )
+                    {
+                        send_request( c, g_options.keepalive ? now_ns() : c.connect_start );
+                    }
+                }
+                else
+                {
+                    flush( c );
+                }
+                continue;
+            }
+            if( events[i].events & EPOLLOUT )
+            {
+                flush( c );
+            }
+            if( events[i].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) )
+            {
+                on_readable( c, index );
+            }
+        }
+    }
+    for( size_t i = 0; i < m_conns.size(); ++i )
+    {
+        m_incomplete += m_conns[i].inflight.size();
+    }
+    m_incomplete += m_pending.size();
+}
+
+static void* thread_main( void* arg )
+{
+    void** args = ( void** )arg;
+    worker* w = ( worker* )args[0];
+    uint64_t* times = ( uint64_t* )args[1];
+    w->run( times[0], times[1], times[2] );
+    return NULL;
+}
+
+//--url /path:weight，按 --header 和 keep-alive 设置拼出完整的请求
+static void build_targets()
+{
+    if( g_options.urls.empty() )
+    {
+        g_options.urls.push_back( "/index.html" );
+    }
+    for( size_t i = 0; i < g_options.urls.size(); ++i )
+    {
+        std::string url = g_options.urls[i];
+        int weight = 1;
+        size_t colon = url.rfind( ':' );
+        if( colon != std::string::npos && colon > 0 )
+        {
+            weight = atoi( url.c_str() + colon + 1 );
+            url.resize( colon );
+        }
+        target t;
+        t.request = "GET " + url + " HTTP/1.1\r\nHost: " + g_options.host + "\r\n";
+        for( size_t k = 0; k < g_options.headers.size(); ++k )
+        {
+            t.request += g_options.headers[k] + "\r\n";
+        }
+        if( ! g_options.keepalive )
+        {
+            t.request += "Connection: close\r\n";
+        }
+        t.request += "\r\n";
+        t.weight = weight > 0 ? weight : 1;
+        g_total_weight += t.weight;
+        g_targets.push_back( t );
+    }
+}
+
+static void usage( const char* prog )
+{
+    printf( "usage: %s [options]\n", prog );
+    printf( "  -H, --host IP          server address (default 127.0.0.1)\n" );
+    printf( "  -p, --port N           server port (default 8080)\n" );
+    printf( "  -c, --connections N    connections in total (default 16)\n" );
+    printf( "  -t, --threads N        load generator threads, each with its own epoll (default 1)\n" );
+    printf( "  -d, --duration S       measured seconds (default 5)\n" );
+    printf( "  -w, --warmup S         seconds before measuring starts (default 1)\n" );
+    printf( "  -R, --rate N           open loop: N requests/s in total, latency measured from the\n" );
+    printf( "                         scheduled send time (default 0: closed loop)\n" );
+    printf( "  -P, --pipeline N       requests in flight per connection (default 1)\n" );
+    printf( "  -k, --no-keepalive     one connection per request (Connection: close)\n" );
+    printf( "  -u, --url PATH[:W]     request PATH with weight W; repeatable (default /index.html)\n" );
+    printf( "  -h, --header LINE      extra request header; repeatable\n" );
+    printf( "  -i, --idle N           open N connections, send one request on each and keep them idle\n" );
+    printf( "  -l, --label NAME       scenario name in the output\n" );
+    printf( "  -j, --json FILE        append the result as one JSON line to FILE\n" );
+}
+
+int main( int argc, char* argv[] )
+{
+    g_options.host = "127.0.0.1";
+    g_options.port = 8080;
+    g_options.connections = 16;
+    g_options.threads = 1;
+    g_options.duration = 5;
+    g_options.warmup = 1;
+    g_options.rate = 0;
+    g_options.pipeline = 1;
+    g_options.keepalive = true;
+    g_options.idle = 0;
+    g_options.label = "run";
+    g_options.json = NULL;
+
+    static const struct option long_options[] = {
+        { "host", required_argument, NULL, 'H' },
+        { "port", required_argument, NULL, 'p' },
+        { "connections", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "duration", required_argument, NULL, 'd' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "rate", required_argument, NULL, 'R' },
+        { "pipeline", required_argument, NULL, 'P' },
+        { "no-keepalive", no_argument, NULL, 'k' },
+        { "url", required_argument, NULL, 'u' },
+        { "header", required_argument, NULL, 'h' },
+        { "idle", required_argument, NULL, 'i' },
+        { "label", required_argument, NULL, 'l' },
+        { "json", required_argument, NULL, 'j' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while( ( opt = getopt_long( argc, argv, "H:p:c:t:d:w:R:P:ku:h:i:l:j:", long_options, NULL ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'H': g_options.host = optarg; break;
+            case 'p': g_options.port = atoi( optarg ); break;
+            case 'c': g_options.connections = atoi( optarg ); break;
+            case 't': g_options.threads = atoi( optarg ); break;
+            case 'd': g_options.duration = atof( optarg ); break;
+            case 'w': g_options.warmup = atof( optarg ); break;
+            case 'R': g_options.rate = atof( optarg ); break;
+            case 'P': g_options.pipeline = atoi( optarg ); break;
+            case 'k': g_options.keepalive = false; break;
+            case 'u': g_options.urls.push_back( optarg ); break;
+            case 'h': g_options.headers.push_back( optarg ); break;
+            case 'i': g_options.idle = atoi( optarg ); break;
+            case 'l': g_options.label = optarg; break;
+            case 'j': g_options.json = optarg; break;
+            default:
+                usage( argv[0] );
+                return 1;
+        }
+    }
+    if( g_options.idle > 0 )
+    {
+        g_options.connections = g_options.idle;
+        g_options.rate = 0;
+        g_options.warmup = 0;
+    }
+    if( ! g_options.keepalive )
+    {
+        g_options.pipeline = 1;
+    }
+    if( g_options.connections < 1 || g_options.threads < 1 || g_options.pipeline < 1 || g_options.duration <= 0 )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+    if( g_options.threads > g_options.connections )
+    {
+        g_options.threads = g_options.connections;
+    }
+
+    //连接多时需要足够的fd
+    struct rlimit limit;
+    if( getrlimit( RLIMIT_NOFILE, &limit ) == 0 && limit.rlim_cur < limit.rlim_max )
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &limit );
+    }
+
+    signal( SIGPIPE, SIG_IGN ); //服务器先关了连接时write返回EPIPE，由读端按错误处理
+    build_targets();
+
+    uint64_t start = now_ns();
+    uint64_t times[3];
+    times[0] = start;
+    times[1] = start + ( uint64_t )( g_options.warmup * 1e9 );
+    times[2] = times[1] + ( uint64_t )( g_options.duration * 1e9 );
+
+    std::vector< worker* > workers;
+    std::vector< void* > args( 2 * g_options.threads );
+    for( int i = 0; i < g_options.threads; ++i )
+    {
+        int connections = g_options.connections / g_options.threads + ( i < g_options.connections % g_options.threads ? 1 : 0 );
+        workers.push_back( new worker( i, connections, g_options.rate / g_options.threads ) );
+    }
+    for( int i = 0; i < g_options.threads; ++i )
+    {
+        args[ 2 * i ] = workers[i];
+        args[ 2 * i + 1 ] = times;
+        pthread_create( &workers[i]->m_thread, NULL, thread_main, &args[ 2 * i ] );
+    }
+
+    histogram latency;
+    uint64_t requests = 0, bytes = 0, connect_errors = 0, read_errors = 0, reconnects = 0, incomplete = 0;
+    uint64_t status[6] = { 0, 0, 0, 0, 0, 0 };
+    int idle_open = 0;
+    for( int i = 0; i < g_options.threads; ++i )
+    {
+        pthread_join( workers[i]->m_thread, NULL );
+        worker* w = workers[i];
+        latency.merge( w->m_latency );
+        requests += w->m_requests;
+        bytes += w->m_bytes;
+        connect_errors += w->m_connect_errors;
+        read_errors += w->m_read_errors;
+        reconnects += w->m_reconnects;
+        incomplete += w->m_incomplete;
+        idle_open += w->m_idle_open;
+        for( int k = 0; k < 6; ++k )
+        {
+            status[k] += w->m_status[k];
+        }
+    }
+
+    double seconds = g_options.duration;
+    printf( "%s: %d connections, %d threads, %s%s, pipeline %d\n", g_options.label, g_options.connections, g_options.threads,
+            g_options.rate > 0 ? "open loop" : "closed loop", g_options.keepalive ? "" : ", no keep-alive", g_options.pipeline );
+    if( g_options.idle > 0 )
+    {
+        printf( "  idle connections held: %d of %d\n", idle_open, g_options.idle );
+    }
+    printf( "  %.0f req/s, %.2f MB/s, %llu requests\n", requests / seconds, bytes / seconds / 1048576, ( unsigned long long )requests );
+    printf( "  latency us: p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu  mean %.1f\n",
+            ( unsigned long long )latency.value_at( 50 ), ( unsigned long long )latency.value_at( 90 ),
+            ( unsigned long long )latency.value_at( 99 ), ( unsigned long long )latency.value_at( 99.9 ),
+            ( unsigned long long )latency.max(), latency.mean() );
+    printf( "  status 2xx %llu  3xx %llu  4xx %llu  5xx %llu  other %llu; errors connect %llu read %llu; reconnects %llu; incomplete %llu\n",
+            ( unsigned long long )status[2], ( unsigned long long )status[3], ( unsigned long long )status[4],
+            ( unsigned long long )status[5], ( unsigned long long )( status[0] + status[1] ),
+            ( unsigned long long )connect_errors, ( unsigned long long )read_errors,
+            ( unsigned long long )reconnects, ( unsigned long long )incomplete );
+
+    if( g_options.json )
+    {
+        FILE* out = fopen( g_options.json, "a" );
+        if( ! out )
+        {
+            perror( "fopen" );
+            return 1;
+        }
+        fprintf( out, "{\"scenario\":\"%s\",\"connections\":%d,\"threads\":%d,\"mode\":\"%s\",\"target_rate\":%.0f,"
+                "\"pipeline\":%d,\"keepalive\":%s,\"duration_s\":%.1f,\"requests\":%llu,\"throughput_rps\":%.1f,"
+                "\"bytes_per_s\":%.0f,\"latency_us\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"mean\":%.1f},"
+                "\"status\":{\"2xx\":%llu,\"3xx\":%llu,\"4xx\":%llu,\"5xx\":%llu,\"other\":%llu},"
+                "\"errors\":{\"connect\":%llu,\"read\":%llu},\"reconnects\":%llu,\"incomplete\":%llu,\"idle_open\":%d}\n",
+                g_options.label, g_options.connections, g_options.threads, g_options.rate > 0 ? "open" : "closed",
+                g_options.rate, g_options.pipeline, g_options.keepalive ? "true" : "false", seconds,
+                ( unsigned long long )requests, requests / seconds, bytes / seconds,
+                ( unsigned long long )latency.value_at( 50 ), ( unsigned long long )latency.value_at( 90 ),
+                ( unsigned long long )latency.value_at( 99 ), ( unsigned long long )latency.value_at( 99.9 ),
+                ( unsigned long long )latency.max(), latency.mean(),
+                ( unsigned long long )status[2], ( unsigned long long )status[3], ( unsigned long long )status[4],
+                ( unsigned long long )status[5], ( unsigned long long )( status[0] + status[1] ),
+                ( unsigned long long )connect_errors, ( unsigned long long )read_errors,
+                ( unsigned long long )reconnects, ( unsigned long long )incomplete, idle_open );
+        fclose( out );
+    }
+    for( int i = 0; i < g_options.threads; ++i )
+    {
+        delete workers[i];
+    }
+    return 0;
+}
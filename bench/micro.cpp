@@ -0,0 +1,527 @@
+/*
+服务器内部组件的微基准，每项结果作为一行JSON追加到--json指定的文件：
+- queue：线程池任务队列，无锁mpmc_queue对比加锁的std::list（原来的实现），1到64个线程；
+- scan：找\r/\n的三种实现（标量、SSE4.2、AVX2），先校验结果一致；
+- header：头部名字的完美哈希查找对比逐个strncasecmp；
+- response：响应头用vsnprintf拼对比fast_utoa+memcpy的构建器；
+- layout：reactor处理一个事件时碰到的http_conn成员，冷热拆分前后的布局，内核允许时附带每次的cache miss数。
+用法：micro [--json FILE] [queue|scan|header|response|layout ...]，不给名字时全部运行
+*/
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <time.h>
+#include <atomic>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "../mpmc_queue.h"
+#include "../locker.h"
+#include "../simd_scan.h"
+#include "../http_header.h"
+#include "../fast_itoa.h"
+#include "histogram.h"
+
+static FILE* g_json = NULL;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void emit( const char* line )
+{
+    printf( "%s\n", line );
+    if( g_json )
+    {
+        fprintf( g_json, "%s\n", line );
+    }
+}
+
+//每项跑rounds轮，每轮的ns/op记进直方图，报告中位数和最差的一轮
+template< typename F >
+static void measure( const char* bench, const char* variant, long ops, int rounds, F body )
+{
+    histogram per_op;
+    for( int r = 0; r < rounds; ++r )
+    {
+        uint64_t start = now_ns();
+        body();
+        uint64_t elapsed = now_ns() - start;
+        per_op.record( elapsed * 1000 / ops ); //皮秒/次，保留小数
+    }
+    char line[ 256 ];
+    snprintf( line, sizeof( line ), "{\"bench\":\"%s\",\"variant\":\"%s\",\"ns_per_op_p50\":%.2f,\"ns_per_op_max\":%.2f}",
+              bench, variant, per_op.value_at( 50 ) / 1000.0, per_op.max() / 1000.0 );
+    emit( line );
+}
+
+/*---------------- queue ----------------*/
+
+//原来线程池里的工作队列：互斥锁保护的std::list
+class locked_queue
+{
+public:
+    bool push( long v )
+    {
+        m_lock.lock();
+        m_list.push_back( v );
+        m_lock.unlock();
+        return true;
+    }
+    bool pop( long& v )
+    {
+        m_lock.lock();
+        if( m_list.empty() )
+        {
+            m_lock.unlock();
+            return false;
+        }
+        v = m_list.front();
+        m_list.pop_front();
+        m_lock.unlock();
+        return true;
+    }
+
+private:
+    locker m_lock;
+    std::list< long > m_list;
+};
+
+template< typename Q >
+struct queue_run
+{
+    Q* queue;
+    long per_producer;
+    std::atomic< long >* consumed;
+    long total;
+};
+
+template< typename Q >
+static void* producer( void* arg )
+{
+    queue_run< Q >* run = ( queue_run< Q >* )arg;
+    for( long i = 1; i <= run->per_producer; ++i )
+    {
+        while( ! run->queue->push( i ) )
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+template< typename Q >
+static void* consumer( void* arg )
+{
+    queue_run< Q >* run = ( queue_run< Q >* )arg;
+    long v;
+    while( run->consumed->load( std::memory_order_relaxed ) < run->total )
+    {
+        if( run->queue->pop( v ) )
+        {
+            run->consumed->fetch_add( 1, std::memory_order_relaxed );
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+template< typename Q >
+static double queue_throughput( Q* queue, int threads, long items )
+{
+    int producers = threads > 1 ? threads / 2 : 1;
+    int consumers = threads > 1 ? threads - producers : 1;
+    std::atomic< long > consumed( 0 );
+    queue_run< Q > run;
+    run.queue = queue;
+    run.per_producer = items / producers;
+    run.consumed = &consumed;
+    run.total = run.per_producer * producers;
+    uint64_t start = now_ns();
+    if( threads == 1 )
+    {
+        //单线程：生产和消费交替进行，只量数据结构本身的开销
+        long v;
+        for( long i = 0; i < run.total; ++i )
+        {
+            queue->push( i );
+            queue->pop( v );
+        }
+    }
+    else
+    {
+        std::vector< pthread_t > ids( producers + consumers );
+        for( int i = 0; i < producers; ++i )
+        {
+            pthread_create( &ids[i], NULL, producer< Q >, &run );
+        }
+        for( int i = 0; i < consumers; ++i )
+        {
+            pthread_create( &ids[ producers + i ], NULL, consumer< Q >, &run );
+        }
+        for( size_t i = 0; i < ids.size(); ++i )
+        {
+            pthread_join( ids[i], NULL );
+        }
+    }
+    return run.total / ( ( now_ns() - start ) / 1e9 );
+}
+
+static void bench_queue()
+{
+    static const int thread_counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+    const long items = 1000000;
+    for( size_t i = 0; i < sizeof( thread_counts ) / sizeof( thread_counts[0] ); ++i )
+    {
+        int threads = thread_counts[i];
+        mpmc_queue< long > lock_free( 1024 );
+        locked_queue locked;
+        double a = queue_throughput( &lock_free, threads, items );
+        double b = queue_throughput( &locked, threads, items );
+        char line[ 256 ];
+        snprintf( line, sizeof( line ), "{\"bench\":\"queue\",\"threads\":%d,\"mpmc_ops_per_s\":%.0f,\"locked_list_ops_per_s\":%.0f}",
+                  threads, a, b );
+        emit( line );
+    }
+}
+
+/*---------------- scan ----------------*/
+
+static const char* sample_request =
+    "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\nAccept-Language: en-US,en;q=0.9,zh-CN;q=0.8\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Cookie: session=abcdef0123456789abcdef0123456789; theme=dark; _ga=GA1.2.1234567890.1234567890\r\n"
+    "Sec-Fetch-Dest: document\r\nSec-Fetch-Mode: navigate\r\nSec-Fetch-Site: none\r\n"
+    "Upgrade-Insecure-Requests: 1\r\nConnection: keep-alive\r\n\r\n";
+
+static void bench_scan()
+{
+    //随机输入上三种实现必须给出同一个位置
+    char buf[ 300 ];
+    srand( 1 );
+    for( int it = 0; it < 100000; ++it )
+    {
+        int n = rand() % 300;
+        for( int i = 0; i < n; ++i )
+        {
+            buf[i] = "ab \t\r\nxyz"[ rand() % 9 * ( rand() % 8 == 0 ) ];
+        }
+        int s = rand() % ( n + 1 );
+        const char* expect = find_either_scalar( buf + s, buf + n, '\r', '\n' );
+        if( find_either_sse42( buf + s, buf + n, '\r', '\n' ) != expect || find_either_avx2( buf + s, buf + n, '\r', '\n' ) != expect )
+        {
+            printf( "scan implementations disagree\n" );
+            exit( 1 );
+        }
+    }
+
+    const int length = strlen( sample_request );
+    const long requests = 200000;
+    static const struct { const char* name; scan_function fn; } impls[] = {
+        { "scalar", find_either_scalar }, { "sse42", find_either_sse42 }, { "avx2", find_either_avx2 } };
+    for( size_t k = 0; k < sizeof( impls ) / sizeof( impls[0] ); ++k )
+    {
+        scan_function fn = impls[k].fn;
+        measure( "scan_request", impls[k].name, requests, 5, [&]()
+        {
+            for( long it = 0; it < requests; ++it )
+            {
+                const char* p = sample_request;
+                const char* end = sample_request + length;
+                while( ( p = fn( p, end, '\r', '\n' ) ) < end )
+                {
+                    p += 2;
+                }
+                asm volatile( "" :: "r"( p ) );
+            }
+        } );
+    }
+}
+
+/*---------------- header ----------------*/
+
+static const char* header_names[] = {
+    "Host", "User-Agent", "Accept", "Accept-Encoding", "Accept-Language", "Cache-Control", "Cookie",
+    "Sec-Fetch-Dest", "Sec-Fetch-Mode", "Sec-Fetch-Site", "Upgrade-Insecure-Requests", "Connection", "Range", "If-None-Match" };
+
+//完美哈希之前的做法：拿名字和每个已知头部逐个比较
+static const char* known_names[] = {
+    "Connection", "Content-Length", "Host", "Range", "If-Range", "Accept", "Accept-Encoding", "If-None-Match",
+    "If-Modified-Since", "Expect", "Transfer-Encoding", "Content-Type", "User-Agent", "Cookie", "Referer", "TE" };
+
+static int linear_lookup( const char* name, size_t length )
+{
+    for( size_t i = 0; i < sizeof( known_names ) / sizeof( known_names[0] ); ++i )
+    {
+        if( strlen( known_names[i] ) == length && strncasecmp( known_names[i], name, length ) == 0 )
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static void bench_header()
+{
+    const int count = sizeof( header_names ) / sizeof( header_names[0] );
+    size_t lengths[ count ];
+    for( int i = 0; i < count; ++i )
+    {
+        lengths[i] = strlen( header_names[i] );
+    }
+    const long rounds = 500000;
+    measure( "header_lookup", "perfect_hash", rounds * count, 5, [&]()
+    {
+        int sum = 0;
+        for( long r = 0; r < rounds; ++r )
+        {
+            for( int i = 0; i < count; ++i )
+            {
+                sum += lookup_header( header_names[i], lengths[i] );
+            }
+        }
+        asm volatile( "" :: "r"( sum ) );
+    } );
+    measure( "header_lookup", "linear_strncasecmp", rounds * count, 5, [&]()
+    {
+        int sum = 0;
+        for( long r = 0; r < rounds; ++r )
+        {
+            for( int i = 0; i < count; ++i )
+            {
+                sum += linear_lookup( header_names[i], lengths[i] );
+            }
+        }
+        asm volatile( "" :: "r"( sum ) );
+    } );
+}
+
+/*---------------- response ----------------*/
+
+static char g_buf[ 1024 ];
+static int g_idx;
+
+static void add_response( const char* format, ... )
+{
+    va_list args;
+    va_start( args, format );
+    g_idx += vsnprintf( g_buf + g_idx, sizeof( g_buf ) - 1 - g_idx, format, args );
+    va_end( args );
+}
+
+static void add_bytes( const char* data, int length )
+{
+    memcpy( g_buf + g_idx, data, length );
+    g_idx += length;
+}
+
+template< int N >
+static void add_literal( const char ( &literal )[N] )
+{
+    add_bytes( literal, N - 1 );
+}
+
+static void bench_response()
+{
+    const long responses = 1000000;
+    measure( "response_headers", "vsnprintf", responses, 5, [&]()
+    {
+        for( long i = 0; i < responses; ++i )
+        {
+            g_idx = 0;
+            add_response( "%s %d %s\r\n", "HTTP/1.1", 200, "OK" );
+            add_response( "Content-Length: %ld\r\n", 1000 + i % 100000 );
+            add_response( "Connection: %s\r\n", ( i & 1 ) ? "keep-alive" : "close" );
+            add_response( "%s", "\r\n" );
+            asm volatile( "" :: "r"( g_buf ) : "memory" );
+        }
+    } );
+    measure( "response_headers", "builder", responses, 5, [&]()
+    {
+        for( long i = 0; i < responses; ++i )
+        {
+            g_idx = 0;
+            add_literal( "HTTP/1.1 200 OK\r\n" );
+            add_literal( "Content-Length: " );
+            g_idx += fast_utoa( 1000 + i % 100000, g_buf + g_idx );
+            add_literal( "\r\n" );
+            if( i & 1 )
+            {
+                add_literal( "Connection: keep-alive\r\n" );
+            }
+            else
+            {
+                add_literal( "Connection: close\r\n" );
+            }
+            add_literal( "\r\n" );
+            asm volatile( "" :: "r"( g_buf ) : "memory" );
+        }
+    } );
+}
+
+/*---------------- layout ----------------*/
+
+//按两种布局模拟reactor处理一次可读事件：定时器、m_in_pool、m_sockfd、读缓冲区指针、m_read_idx、
+//m_check_state、m_bytes_to_send、m_last_active。偏移是用offsetof量出来的：
+//拆分前对象880字节、没有对齐，这几个成员分布在第0到第13个缓存行；拆分后对象是对齐的192字节
+struct conn_layout
+{
+    const char* name;
+    size_t size;
+    size_t offsets[8];
+};
+
+static const conn_layout layouts[] = {
+    { "before_split", 880, { 0, 32, 56, 80, 96, 116, 784, 872 } },
+    { "hot_cold_split", 192, { 0, 40, 48, 64, 76, 96, 112, 184 } } };
+
+//本线程用户态的cache miss计数；没有硬件计数器或perf_event_paranoid不允许时返回-1
+static int open_cache_counter()
+{
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof( attr ) );
+    attr.size = sizeof( attr );
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+static void bench_layout()
+{
+    //连接数取得让两种布局都远大于末级缓存，随机挑连接，和大量连接时事件到来的顺序差不多
+    const long conns = 1 << 18;
+    const long events = 2000000;
+    std::vector< unsigned > order( events );
+    uint64_t x = 88172645463325252ull;
+    for( long i = 0; i < events; ++i )
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        order[i] = x % conns;
+    }
+    int counter = open_cache_counter();
+    for( size_t k = 0; k < sizeof( layouts ) / sizeof( layouts[0] ); ++k )
+    {
+        const conn_layout& layout = layouts[k];
+        char* users = ( char* )aligned_alloc( CACHE_LINE_SIZE, conns * layout.size );
+        memset( users, 0, conns * layout.size );
+        auto run = [&]()
+        {
+            uint64_t sum = 0;
+            for( long i = 0; i < events; ++i )
+            {
+                char* conn = users + order[i] * layout.size;
+                for( int f = 0; f < 7; ++f )
+                {
+                    sum += *( volatile uint32_t* )( conn + layout.offsets[f] );
+                }
+                *( volatile long* )( conn + layout.offsets[7] ) = sum; //m_last_active
+            }
+            asm volatile( "" :: "r"( sum ) );
+        };
+        measure( "conn_layout", layout.name, events, 5, run );
+        if( counter >= 0 )
+        {
+            uint64_t misses = 0;
+            ioctl( counter, PERF_EVENT_IOC_RESET, 0 );
+            ioctl( counter, PERF_EVENT_IOC_ENABLE, 0 );
+            run();
+            ioctl( counter, PERF_EVENT_IOC_DISABLE, 0 );
+            if( ::read( counter, &misses, sizeof( misses ) ) == sizeof( misses ) )
+            {
+                char line[ 256 ];
+                snprintf( line, sizeof( line ), "{\"bench\":\"conn_layout_cache_misses\",\"variant\":\"%s\",\"misses_per_event\":%.2f}",
+                          layout.name, ( double )misses / events );
+                emit( line );
+            }
+        }
+        free( users );
+    }
+    if( counter >= 0 )
+    {
+        close( counter );
+    }
+}
+
+int main( int argc, char* argv[] )
+{
+    std::vector< std::string > names;
+    for( int i = 1; i < argc; ++i )
+    {
+        if( strcmp( argv[i], "--json" ) == 0 && i + 1 < argc )
+        {
+            g_json = fopen( argv[ ++i ], "a" );
+            if( ! g_json )
+            {
+                perror( "fopen" );
+                return 1;
+            }
+        }
+        else
+        {
+            names.push_back( argv[i] );
+        }
+    }
+    if( names.empty() )
+    {
+        names.push_back( "queue" );
+        names.push_back( "scan" );
+        names.push_back( "header" );
+        names.push_back( "response" );
+        names.push_back( "layout" );
+    }
+    for( size_t i = 0; i < names.size(); ++i )
+    {
+        if( names[i] == "queue" )
+        {
+            bench_queue();
+        }
+        else if( names[i] == "scan" )
+        {
+            bench_scan();
+        }
+        else if( names[i] == "header" )
+        {
+            bench_header();
+        }
+        else if( names[i] == "response" )
+        {
+            bench_response();
+        }
+        else if( names[i] == "layout" )
+        {
+            bench_layout();
+        }
+        else
+        {
+            printf( "usage: %s [--json FILE] [queue|scan|header|response|layout ...]\n", argv[0] );
+            return 1;
+        }
+    }
+    if( g_json )
+    {
+        fclose( g_json );
+    }
+    return 0;
+}
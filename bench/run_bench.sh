@@ -0,0 +1,216 @@
+#!/bin/sh
+# 一条命令跑完标准场景，结果按行写成JSON（第一行是环境信息），不同提交的结果可以直接diff。
+# 用法：bench/run_bench.sh [输出文件，默认bench_results.jsonl]
+# 环境变量：
+#   BENCH_DURATION  每个场景测量的秒数（默认5）
+#   BENCH_PORT      服务器端口（默认18080）
+#   BENCH_CONNS     闭环场景的连接数（默认32）
+#   BENCH_HUGE_CONNS  1GB文件场景的连接数（默认4）
+#   BENCH_THREADS   负载生成器线程数（默认2）
+#   BENCH_RATE      开环场景的到达率，请求/秒（默认5000）
+#   BENCH_IDLE      空闲连接场景的连接数（默认100000，受两端RLIMIT_NOFILE限制）
+#   SERVER_ARGS     传给每个server实例的额外参数，比如 "-r 4" 或 "-u"
+set -e
+
+ROOT=$( cd "$( dirname "$0" )/.." && pwd )
+OUT=${1:-$ROOT/bench_results.jsonl}
+DURATION=${BENCH_DURATION:-5}
+PORT=${BENCH_PORT:-18080}
+CONNS=${BENCH_CONNS:-32}
+HUGE_CONNS=${BENCH_HUGE_CONNS:-4}
+THREADS=${BENCH_THREADS:-2}
+RATE=${BENCH_RATE:-5000}
+IDLE=${BENCH_IDLE:-100000}
+LOADGEN=$ROOT/bench/loadgen
+MICRO=$ROOT/bench/micro
+
+# 服务器的doc_root是工作目录下的./html，在临时目录里准备固定的测试文件
+WORK=$( mktemp -d )
+SERVER_PID=
+cleanup()
+{
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+mkdir "$WORK/html"
+awk 'BEGIN { for ( i = 0; i < 16; ++i ) printf "<p>mini-webserver benchmark page, line %02d ........................</p>\n", i }' > "$WORK/html/index.html"
+head -c 4096 /dev/urandom > "$WORK/html/4k.bin"
+head -c 1048576 /dev/urandom > "$WORK/html/1m.bin"
+# 1GB的文件用稀疏文件，不占磁盘，读的时候内核给零页；建不了稀疏文件的文件系统上退回fallocate
+truncate -s 1G "$WORK/html/1g.bin" 2>/dev/null || fallocate -l 1G "$WORK/html/1g.bin"
+
+: > "$OUT"
+printf '{"bench":"environment","commit":"%s","date":"%s","kernel":"%s","cpus":%s,"server_args":"%s","duration_s":%s}\n' \
+    "$( git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown )" "$( date -u +%Y-%m-%dT%H:%M:%SZ )" \
+    "$( uname -r )" "$( nproc )" "${SERVER_ARGS:-}" "$DURATION" >> "$OUT"
+
+start_server()
+{
+    ( cd "$WORK" && exec "$ROOT/server" ${SERVER_ARGS:-} "$@" 127.0.0.1 "$PORT" > /dev/null 2>&1 ) &
+    SERVER_PID=$!
+    sleep 1
+}
+
+stop_server()
+{
+    kill "$SERVER_PID" 2>/dev/null || true
+    wait "$SERVER_PID" 2>/dev/null || true
+    SERVER_PID=
+    sleep 1 # 让TIME_WAIT和端口释放
+}
+
+load()
+{
+    label=$1
+    shift
+    "$LOADGEN" -p "$PORT" -t "$THREADS" -d "$DURATION" -l "$label" -j "$OUT" "$@"
+}
+
+rss_kb()
+{
+    awk '/^VmRSS/ { print $2 }' "/proc/$SERVER_PID/status"
+}
+
+# startup_rss 连接表大小：刚启动、还没有连接时服务器的常驻内存，连接表按--max-conns一次建好
+startup_rss()
+{
+    printf '{"bench":"startup_rss","max_conns":%s,"rss_kb":%s}\n' "$1" "$( rss_kb )" | tee -a "$OUT"
+}
+
+# syscalls_per_request 场景名：对small再跑一轮，数服务器进程这期间的系统调用数，按请求数平均。
+# 有perf时数raw_syscalls:sys_enter，没有时用strace -c（它本身会拖慢服务器，所以不和测吞吐的那轮放在一起），都没有就跳过
+syscalls_per_request()
+{
+    scenario=$1 # load会改写label
+    if command -v perf > /dev/null 2>&1; then
+        tool=perf
+        perf stat -x, -e raw_syscalls:sys_enter -p "$SERVER_PID" -o "$WORK/syscalls.txt" -- sleep "$DURATION" &
+    elif command -v strace > /dev/null 2>&1; then
+        tool=strace
+        timeout -s INT "$DURATION" strace -c -f -p "$SERVER_PID" -o "$WORK/syscalls.txt" &
+    else
+        return 0
+    fi
+    TOOL_PID=$!
+    load "${scenario}_syscalls" -w 0 -c "$CONNS" -u /index.html
+    wait "$TOOL_PID" || true
+    requests=$( sed -n "s/^{\"scenario\":\"${scenario}_syscalls\",.*\"requests\":\([0-9]*\).*/\1/p" "$OUT" )
+    if [ "$tool" = perf ]; then
+        calls=$( awk -F, '$3 ~ /raw_syscalls:sys_enter/ { print $1 }' "$WORK/syscalls.txt" )
+    else
+        calls=$( awk '$NF == "total" { print $4 }' "$WORK/syscalls.txt" )
+    fi
+    awk -v scenario="$scenario" -v tool="$tool" -v requests="${requests:-0}" -v calls="${calls:-0}" 'BEGIN {
+        printf "{\"bench\":\"syscalls\",\"scenario\":\"%s\",\"tool\":\"%s\",\"requests\":%d,\"syscalls\":%d,\"syscalls_per_request\":%.2f}\n",
+            scenario, tool, requests, calls, ( requests > 0 ? calls / requests : 0 ) }' | tee -a "$OUT"
+}
+
+# 默认模式：文件体mmap+writev
+start_server
+startup_rss 65536
+load small -c "$CONNS" -u /index.html
+load small_pipelined -c "$CONNS" -P 8 -u /index.html
+load small_open_loop -c "$CONNS" -R "$RATE" -u /index.html
+# 文件体mmap+writev和下面-s的sendfile，在4KB、1MB、1GB三种大小上各跑一遍；
+# 1GB的请求在测量时间里完成不了几个，比较bytes_per_s
+load large_4k_mmap -c "$CONNS" -u /4k.bin
+load large_1m_mmap -c "$CONNS" -u /1m.bin
+load large_1g_mmap -c "$HUGE_CONNS" -u /1g.bin
+load not_found -c "$CONNS" -u /missing.html
+load churn -c "$CONNS" -k -u /index.html
+load mix -c "$CONNS" -u /index.html:8 -u /1m.bin:1 -u /missing.html:1
+# 装了perf时再跑一遍small，数服务器进程平均每个请求的cache miss，对比连接对象布局这类改动前后的结果
+if command -v perf > /dev/null 2>&1; then
+    perf stat -x, -e cache-misses,cache-references,instructions -p "$SERVER_PID" -o "$WORK/perf.txt" -- sleep "$DURATION" &
+    PERF_PID=$!
+    load small_perf_stat -w 0 -c "$CONNS" -u /index.html
+    wait "$PERF_PID" || true
+    requests=$( sed -n 's/^{"scenario":"small_perf_stat",.*"requests":\([0-9]*\).*/\1/p' "$OUT" )
+    awk -F, -v requests="${requests:-0}" '
+        BEGIN { printf "{\"bench\":\"perf_stat\",\"scenario\":\"small_perf_stat\",\"requests\":%d", requests }
+        $1 ~ /^[0-9]+$/ && requests > 0 { name = $3; sub( /:.*/, "", name ); gsub( /-/, "_", name ); printf ",\"%s_per_request\":%.1f", name, $1 / requests }
+        END { print "}" }' "$WORK/perf.txt" | tee -a "$OUT"
+fi
+stop_server
+
+# 过载：按上面small测出的吞吐量的2倍开环施压，看准入控制能否把延迟压住；
+# 被拒的请求在loadgen的5xx里，服务器端的排队时延看/__stats的queue阶段
+capacity=$( sed -n 's/^{"scenario":"small",.*"throughput_rps":\([0-9]*\).*/\1/p' "$OUT" )
+if [ -n "$capacity" ] && [ "$capacity" -gt 0 ]; then
+    start_server
+    load overload_2x -c $(( CONNS * 4 )) -R $(( capacity * 2 )) -u /index.html
+    stats=$( curl -s "http://127.0.0.1:$PORT/__stats" | tr -d '\n' )
+    shed=$( echo "$stats" | sed -n 's/.*"requests_shed":\([0-9]*\).*/\1/p' )
+    queue_p99=$( echo "$stats" | sed -n 's/.*"queue":{[^}]*"p99":\([0-9.]*\).*/\1/p' )
+    printf '{"bench":"overload_2x_server","rate":%s,"requests_shed":%s,"queue_p99_us":%s}\n' \
+        "$(( capacity * 2 ))" "${shed:-0}" "${queue_p99:-0}" | tee -a "$OUT"
+    stop_server
+fi
+
+# io_uring后端和-r 1的epoll reactor对比：都是一个线程就地解析，比较small的吞吐和每个请求的系统调用数。
+# 系统调用数的记法见syscalls_per_request
+start_server -r 1
+load small_epoll_r1 -c "$CONNS" -u /index.html
+syscalls_per_request small_epoll_r1
+stop_server
+
+start_server -u
+load small_io_uring -c "$CONNS" -u /index.html
+syscalls_per_request small_io_uring
+stop_server
+
+# 同样的文件换成sendfile
+start_server -s
+load large_4k_sendfile -c "$CONNS" -u /4k.bin
+load large_1m_sendfile -c "$CONNS" -u /1m.bin
+load large_1g_sendfile -c "$HUGE_CONNS" -u /1g.bin
+stop_server
+
+# 再换成MSG_ZEROCOPY；回环上内核总是退回拷贝（/__stats里的zerocopy_copied），要跨网卡测才看得出省下的拷贝
+start_server --zerocopy 65536
+load large_1m_zerocopy -c "$CONNS" -u /1m.bin
+stop_server
+
+# 大量空闲长连接时服务器的常驻内存：每个连接收发一次后空闲，连接对象以外不应再占缓冲区；
+# 默认的连接表装不下这么多连接，按需要的大小建表
+start_server --max-conns $(( IDLE + 1024 ))
+startup_rss $(( IDLE + 1024 ))
+before=$( rss_kb )
+"$LOADGEN" -p "$PORT" -t "$THREADS" -i "$IDLE" -d $(( DURATION + 5 )) -l idle_connections -j "$WORK/idle.jsonl" > "$WORK/idle.txt" &
+LOADGEN_PID=$!
+sleep $(( DURATION + 2 ))
+during=$( rss_kb )
+wait "$LOADGEN_PID" || true
+cat "$WORK/idle.txt"
+opened=$( sed -n 's/.*"idle_open":\([0-9]*\).*/\1/p' "$WORK/idle.jsonl" )
+opened=${opened:-0}
+per_conn=0
+if [ "$opened" -gt 0 ]; then
+    per_conn=$(( ( during - before ) * 1024 / opened ))
+fi
+printf '{"bench":"idle_rss","target":%s,"opened":%s,"rss_before_kb":%s,"rss_idle_kb":%s,"bytes_per_connection":%s}\n' \
+    "$IDLE" "$opened" "$before" "$during" "$per_conn" | tee -a "$OUT"
+stop_server
+
+# 上传：PUT一个256MB的请求体，大于--body-spill的部分从socket直接splice进文件；
+# 看吞吐和服务器的峰值常驻内存（VmHWM），请求体再大峰值内存也不该跟着涨
+if command -v curl > /dev/null 2>&1; then
+    mkdir -p "$WORK/html/up"
+    head -c 268435456 /dev/zero > "$WORK/upload.bin"
+    start_server --upload /up/
+    start=$( date +%s%N )
+    code=$( curl -s -o /dev/null -w '%{http_code}' -T "$WORK/upload.bin" "http://127.0.0.1:$PORT/up/upload.bin" || true )
+    elapsed_ms=$(( ( $( date +%s%N ) - start ) / 1000000 ))
+    peak=$( awk '/^VmHWM/ { print $2 }' "/proc/$SERVER_PID/status" )
+    printf '{"bench":"upload_256m","status":%s,"elapsed_ms":%s,"mb_per_second":%s,"peak_rss_kb":%s}\n' \
+        "$code" "$elapsed_ms" "$(( 256 * 1000 / ( elapsed_ms > 0 ? elapsed_ms : 1 ) ))" "$peak" | tee -a "$OUT"
+    stop_server
+fi
+
+# 组件微基准
+"$MICRO" --json "$OUT"
+
+echo "results written to $OUT"
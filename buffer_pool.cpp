@@ -0,0 +1,105 @@
+#include <sys/mman.h>
+
+#include "buffer_pool.h"
+#include "cpu_topology.h"
+
+buffer_pool::buffer_pool() : m_reserved( 0 ), m_in_use( 0 ), m_node_id( -1 )
+{
+    for( int i = 0; i < CLASS_NUMBER; ++i )
+    {
+        m_classes[i].free = NULL;
+    }
+}
+
+buffer_pool::~buffer_pool()
+{
+    //slab在进程退出时才释放，这里不逐块追踪
+}
+
+int buffer_pool::class_of( size_t size )
+{
+    int index = 0;
+    size_t class_size = MIN_SIZE;
+    while( class_size < size )
+    {
+        class_size <<= 1;
+        ++index;
+    }
+    return index;
+}
+
+size_t buffer_pool::round_size( size_t size )
+{
+    if( size > MAX_SIZE )
+    {
+        return 0;
+    }
+    return MIN_SIZE << class_of( size );
+}
+
+void buffer_pool::refill( int index )
+{
+    size_t size = MIN_SIZE << index;
+    size_t slab_size = size > SLAB_SIZE ? size : SLAB_SIZE;
+    //slab按页对齐才能mbind；绑定要在下面第一次写之前，页才会分配在指定节点上
+    char* slab = ( char* )mmap( 0, slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( slab == MAP_FAILED )
+    {
+        return;
+    }
+    cpu_topology::bind_memory( slab, slab_size, m_node_id );
+    m_reserved.fetch_add( slab_size, std::memory_order_relaxed );
+    for( size_t offset = 0; offset + size <= slab_size; offset += size )
+    {
+        free_node* node = ( free_node* )( slab + offset );
+        node->next = m_classes[ index ].free;
+        m_classes[ index ].free = node;
+    }
+}
+
+char* buffer_pool::acquire( size_t size, size_t* actual )
+{
+    if( size > MAX_SIZE )
+    {
+        return NULL;
+    }
+    int index = class_of( size );
+    size_class& sc = m_classes[ index ];
+
+    sc.lock.lock();
+    if( ! sc.free )
+    {
+        refill( index );
+    }
+    free_node* node = sc.free;
+    if( node )
+    {
+        sc.free = node->next;
+    }
+    sc.lock.unlock();
+
+    if( ! node )
+    {
+        return NULL;
+    }
+    *actual = MIN_SIZE << index;
+    m_in_use.fetch_add( *actual, std::memory_order_relaxed );
+    return ( char* )node;
+}
+
+void buffer_pool::release( char* buf, size_t size )
+{
+    if( ! buf )
+    {
+        return;
+    }
+    int index = class_of( size );
+    size_class& sc = m_classes[ index ];
+    free_node* node = ( free_node* )buf;
+
+    sc.lock.lock();
+    node->next = sc.free;
+    sc.free = node;
+    sc.lock.unlock();
+    m_in_use.fetch_sub( size, std::memory_order_relaxed );
+}
@@ -0,0 +1,58 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include <atomic>
+#include "locker.h"
+
+/*
+按2的幂分级的缓冲区池，从2KB到1MB。每一级从64KB的slab里切出等长的块，
+用完挂回这一级的空闲链表，不还给malloc。连接只在真正收发数据时借缓冲区，
+空闲的长连接不占缓冲区，大量空闲连接的内存占用就只剩连接对象本身。
+多NUMA节点时每个节点一个池，slab用mmap拿并绑定到这个节点上。
+*/
+class buffer_pool
+{
+public:
+    static const size_t MIN_SIZE = 2048;
+    static const size_t MAX_SIZE = 1 << 20;
+
+    buffer_pool();
+    ~buffer_pool();
+
+    //至少size字节，实际大小（向上取到级别）写进*actual；超过MAX_SIZE返回NULL
+    char* acquire( size_t size, size_t* actual );
+    void release( char* buf, size_t size ); //size必须是acquire给出的实际大小
+
+    void bind( int node_id ) { m_node_id = node_id; } //之后新拿的slab优先放在这个NUMA节点上，-1表示不绑定
+    static size_t round_size( size_t size );
+    size_t bytes_reserved() const { return m_reserved.load( std::memory_order_relaxed ); } //从系统拿到的总字节数
+    size_t bytes_in_use() const { return m_in_use.load( std::memory_order_relaxed ); }
+
+private:
+    static const int MIN_SHIFT = 11;
+    static const int CLASS_NUMBER = 10; //2KB ... 1MB
+    static const size_t SLAB_SIZE = 64 * 1024;
+
+    struct free_node
+    {
+        free_node* next;
+    };
+
+    struct size_class
+    {
+        locker lock;
+        free_node* free;
+    };
+
+    static int class_of( size_t size );
+    void refill( int index ); //调用时已持有这一级的锁
+
+private:
+    size_class m_classes[ CLASS_NUMBER ];
+    std::atomic< size_t > m_reserved;
+    std::atomic< size_t > m_in_use;
+    int m_node_id;
+};
+
+#endif
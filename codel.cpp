@@ -0,0 +1,32 @@
+#include "codel.h"
+
+codel::codel() : m_target( 0 ), m_interval( 0 ), m_interval_end( 0 ), m_min_sojourn( UINT64_MAX ), m_overloaded( false )
+{
+}
+
+void codel::configure( uint64_t target, uint64_t interval )
+{
+    m_target = target;
+    m_interval = interval;
+}
+
+bool codel::should_drop( uint64_t sojourn, uint64_t now )
+{
+    if( ! m_target )
+    {
+        return false;
+    }
+    //一个interval结束，由碰上的那个线程结算；这段时间一个请求都没有也不算过载
+    uint64_t end = m_interval_end.load( std::memory_order_relaxed );
+    if( now >= end && m_interval_end.compare_exchange_strong( end, now + m_interval ) )
+    {
+        uint64_t min = m_min_sojourn.exchange( UINT64_MAX, std::memory_order_relaxed );
+        m_overloaded.store( min != UINT64_MAX && min > m_target, std::memory_order_relaxed );
+    }
+    //多数请求的等待不比当前最小值小，只读不写，几个工作线程不会抢这一行
+    uint64_t min = m_min_sojourn.load( std::memory_order_relaxed );
+    while( sojourn < min && ! m_min_sojourn.compare_exchange_weak( min, sojourn, std::memory_order_relaxed ) )
+    {
+    }
+    return m_overloaded.load( std::memory_order_relaxed ) && sojourn > 2 * m_target;
+}
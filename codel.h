@@ -0,0 +1,34 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+线程池队列的CoDel式准入控制。每个请求出队时报告它在队列里等了多久（sojourn），
+每过一个interval看一次这段时间里的最小等待：最小值都超过target，说明队列不是偶尔的突发，
+而是一直排着消化不掉，进入过载状态；过载时等了超过2*target的请求直接回503，不再处理。
+这是服务器上常用的变体（folly/wangle的Codel）：网络里的CoDel按1/sqrt(n)的节奏一次丢一个包，
+对请求来说收敛太慢，2倍过载时要丢掉一半请求，这里直接按等待时间截断，排队时延就有了上界。
+时间的单位都是server_stats的滴答。
+*/
+class codel
+{
+public:
+    codel();
+
+    void configure( uint64_t target, uint64_t interval ); //target为0表示关闭
+    bool enabled() const { return m_target != 0; }
+    //出队时调用，返回true表示这个请求应该被拒绝
+    bool should_drop( uint64_t sojourn, uint64_t now );
+    bool overloaded() const { return m_overloaded.load( std::memory_order_relaxed ); }
+
+private:
+    uint64_t m_target;
+    uint64_t m_interval;
+    std::atomic< uint64_t > m_interval_end;
+    std::atomic< uint64_t > m_min_sojourn; //这个interval里见到的最小等待，没有样本时是UINT64_MAX
+    std::atomic< bool > m_overloaded;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "cpu_topology.h"
+#include "logger.h"
+
+int cpu_topology::m_mode = PIN_NONE;
+int cpu_topology::m_node_count = 1;
+int cpu_topology::m_node_ids[ MAX_NODES ] = { 0 };
+signed char cpu_topology::m_node_of_cpu[ CPU_SETSIZE ] = { 0 };
+int cpu_topology::m_order[ CPU_SETSIZE ];
+int cpu_topology::m_cpu_count = 0;
+
+#define MPOL_PREFERRED 1 //<numaif.h>里的值，不为它多依赖libnuma
+
+bool cpu_topology::parse_cpu_list( const char* text, cpu_set_t* set )
+{
+    CPU_ZERO( set );
+    const char* p = text;
+    while( *p )
+    {
+        char* end;
+        long first = strtol( p, &end, 10 );
+        if( end == p || first < 0 || first >= CPU_SETSIZE )
+        {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if( *p == '-' )
+        {
+            ++p;
+            last = strtol( p, &end, 10 );
+            if( end == p || last < first || last >= CPU_SETSIZE )
+            {
+                return false;
+            }
+            p = end;
+        }
+        for( long cpu = first; cpu <= last; ++cpu )
+        {
+            CPU_SET( cpu, set );
+        }
+        if( *p == ',' )
+        {
+            ++p;
+        }
+        else if( *p && *p != '\n' )
+        {
+            return false;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return CPU_COUNT( set ) > 0;
+}
+
+//读/sys下每个节点的cpulist，填好CPU到节点下标的映射
+static int read_nodes( int* node_ids, signed char* node_of_cpu, int max_nodes )
+{
+    DIR* dir = opendir( "/sys/devices/system/node" );
+    if( ! dir )
+    {
+        return 1;
+    }
+    int ids[ 64 ];
+    int count = 0;
+    struct dirent* entry;
+    while( ( entry = readdir( dir ) ) != NULL && count < 64 )
+    {
+        int id;
+        char tail;
+        if( sscanf( entry->d_name, "node%d%c", &id, &tail ) == 1 )
+        {
+            ids[ count++ ] = id;
+        }
+    }
+    closedir( dir );
+    if( count == 0 )
+    {
+        return 1;
+    }
+    //按编号排序，节点下标才稳定
+    for( int i = 1; i < count; ++i )
+    {
+        for( int j = i; j > 0 && ids[ j - 1 ] > ids[j]; --j )
+        {
+            int t = ids[j];
+            ids[j] = ids[ j - 1 ];
+            ids[ j - 1 ] = t;
+        }
+    }
+    for( int i = 0; i < count; ++i )
+    {
+        int node = i < max_nodes ? i : i % max_nodes;
+        if( i < max_nodes )
+        {
+            node_ids[ node ] = ids[i];
+        }
+        char path[ 64 ];
+        snprintf( path, sizeof( path ), "/sys/devices/system/node/node%d/cpulist", ids[i] );
+        FILE* fp = fopen( path, "r" );
+        if( ! fp )
+        {
+            continue;
+        }
+        char line[ 1024 ];
+        cpu_set_t set;
+        if( fgets( line, sizeof( line ), fp ) && cpu_topology::parse_cpu_list( line, &set ) )
+        {
+            for( int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+            {
+                if( CPU_ISSET( cpu, &set ) )
+                {
+                    node_of_cpu[ cpu ] = node;
+                }
+            }
+        }
+        fclose( fp );
+    }
+    return count < max_nodes ? count : max_nodes;
+}
+
+bool cpu_topology::init( const char* cpus, PIN_MODE mode, bool spread )
+{
+    cpu_set_t allowed;
+    if( sched_getaffinity( 0, sizeof( allowed ), &allowed ) != 0 )
+    {
+        return false;
+    }
+    if( cpus )
+    {
+        //只用进程本来就允许的那部分，不存在或被taskset排除的CPU忽略
+        cpu_set_t wanted;
+        if( ! parse_cpu_list( cpus, &wanted ) )
+        {
+            return false;
+        }
+        CPU_AND( &allowed, &allowed, &wanted );
+        if( CPU_COUNT( &allowed ) == 0 )
+        {
+            return false;
+        }
+    }
+    m_node_count = read_nodes( m_node_ids, m_node_of_cpu, MAX_NODES );
+    m_mode = mode;
+
+    m_cpu_count = 0;
+    if( ! spread )
+    {
+        for( int node = 0; node < m_node_count; ++node )
+        {
+            for( int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+            {
+                if( CPU_ISSET( cpu, &allowed ) && m_node_of_cpu[ cpu ] == node )
+                {
+                    m_order[ m_cpu_count++ ] = cpu;
+                }
+            }
+        }
+    }
+    else
+    {
+        //每轮从每个节点各取一个还没排过的CPU
+        int next[ MAX_NODES ] = { 0 };
+        int total = CPU_COUNT( &allowed );
+        while( m_cpu_count < total )
+        {
+            for( int node = 0; node < m_node_count; ++node )
+            {
+                while( next[ node ] < CPU_SETSIZE
+                       && ! ( CPU_ISSET( next[ node ], &allowed ) && m_node_of_cpu[ next[ node ] ] == node ) )
+                {
+                    ++next[ node ];
+                }
+                if( next[ node ] < CPU_SETSIZE )
+                {
+                    m_order[ m_cpu_count++ ] = next[ node ]++;
+                }
+            }
+        }
+    }
+    return m_cpu_count > 0;
+}
+
+void cpu_topology::place_thread( int slot )
+{
+    if( m_mode == PIN_NONE || slot < 0 || m_cpu_count == 0 )
+    {
+        return;
+    }
+    int cpu = m_order[ slot % m_cpu_count ];
+    int node = m_node_of_cpu[ cpu ];
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    if( m_mode == PIN_CORE )
+    {
+        CPU_SET( cpu, &set );
+    }
+    else
+    {
+        //固定到节点时，节点上所有允许的CPU都可以用，由调度器在节点内均衡
+        for( int i = 0; i < m_cpu_count; ++i )
+        {
+            if( m_node_of_cpu[ m_order[i] ] == node )
+            {
+                CPU_SET( m_order[i], &set );
+            }
+        }
+    }
+    if( sched_setaffinity( 0, sizeof( set ), &set ) != 0 )
+    {
+        LOG_WARN( "sched_setaffinity to cpu %d failed, errno is: %d", cpu, errno );
+        return;
+    }
+    cpu_topology_node = node;
+}
+
+void cpu_topology::bind_memory( void* addr, size_t length, int node_id )
+{
+    if( m_node_count <= 1 || node_id < 0 || node_id >= ( int )( 8 * sizeof( unsigned long ) ) )
+    {
+        return;
+    }
+    unsigned long mask = 1UL << node_id;
+    syscall( SYS_mbind, addr, length, MPOL_PREFERRED, &mask, 8 * sizeof( mask ), 0 );
+}
@@ -0,0 +1,54 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+#include <sched.h>
+#include <stddef.h>
+
+//当前线程所在的NUMA节点（cpu_topology里的下标），-1表示没有固定、每次现查
+inline thread_local int cpu_topology_node = -1;
+
+/*
+CPU和NUMA节点的布局，以及把reactor、工作线程固定到核上的策略。
+节点从/sys/devices/system/node读，没有这个目录（或者只有一个节点）时当作一个节点；
+内存绑定直接用mbind系统调用，不依赖libnuma。
+线程按启动时分到的编号slot在m_order里取CPU：单reactor模式按节点依次排满（compact），
+主reactor和工作线程尽量在同一个节点上共享缓存；多reactor和io_uring模式在节点间轮流排（spread），
+每个节点分到差不多一样多的reactor，各自处理自己的连接。
+*/
+class cpu_topology
+{
+public:
+    static const int MAX_NODES = 8; //更多的节点折叠到前面的节点上
+
+    enum PIN_MODE { PIN_NONE = 0, PIN_CORE, PIN_NODE };
+
+    //cpus为NULL时用进程当前允许的全部CPU；列表格式和taskset -c一样，如"0-3,8-11"
+    static bool init( const char* cpus, PIN_MODE mode, bool spread );
+    //由线程自己在开始干活前调用；不固定或slot<0时什么也不做
+    static void place_thread( int slot );
+    static int node_count() { return m_node_count; }
+    static int node_id( int node ) { return m_node_ids[ node ]; } //内核里的节点编号
+    static int cpu_count() { return m_cpu_count; }
+    static int current_node()
+    {
+        if( cpu_topology_node >= 0 || m_node_count == 1 )
+        {
+            return cpu_topology_node >= 0 ? cpu_topology_node : 0;
+        }
+        int cpu = sched_getcpu(); //没有固定的线程会被迁移，只能每次看一眼
+        return cpu >= 0 && cpu < CPU_SETSIZE ? m_node_of_cpu[ cpu ] : 0;
+    }
+    //让[addr, addr+length)的页优先从node_id上分配；失败（内核不支持NUMA）就保持默认的首次访问策略
+    static void bind_memory( void* addr, size_t length, int node_id );
+    static bool parse_cpu_list( const char* text, cpu_set_t* set );
+
+private:
+    static int m_mode;
+    static int m_node_count;
+    static int m_node_ids[ MAX_NODES ];
+    static signed char m_node_of_cpu[ CPU_SETSIZE ];
+    static int m_order[ CPU_SETSIZE ];
+    static int m_cpu_count;
+};
+
+#endif
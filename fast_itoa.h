@@ -0,0 +1,67 @@
+#ifndef FAST_ITOA_H
+#define FAST_ITOA_H
+
+/*
+无符号整数转十进制，不经过printf。每次从末尾取两位查表，除法次数减半；
+先算出位数，直接从右往左写，不用再翻转。不写结尾的\0，返回写入的字节数，out至少要有20字节。
+*/
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+inline int decimal_digits( unsigned long value )
+{
+    int digits = 1;
+    while( value >= 10000 )
+    {
+        value /= 10000;
+        digits += 4;
+    }
+    if( value >= 1000 )
+    {
+        return digits + 3;
+    }
+    if( value >= 100 )
+    {
+        return digits + 2;
+    }
+    if( value >= 10 )
+    {
+        return digits + 1;
+    }
+    return digits;
+}
+
+inline int fast_utoa( unsigned long value, char* out )
+{
+    int length = decimal_digits( value );
+    char* p = out + length;
+    while( value >= 100 )
+    {
+        int pair = ( value % 100 ) * 2;
+        value /= 100;
+        *--p = digit_pairs[ pair + 1 ];
+        *--p = digit_pairs[ pair ];
+    }
+    if( value >= 10 )
+    {
+        int pair = value * 2;
+        *--p = digit_pairs[ pair + 1 ];
+        *--p = digit_pairs[ pair ];
+    }
+    else
+    {
+        *--p = '0' + value;
+    }
+    return length;
+}
+
+#endif
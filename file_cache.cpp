@@ -0,0 +1,321 @@
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <exception>
+
+#include "file_cache.h"
+#include "logger.h"
+
+file_cache::file_cache( const char* doc_root, int capacity, bool map_files ) :
+        m_doc_root( doc_root ), m_shard_capacity( capacity / SHARD_NUMBER + 1 ), m_map_files( map_files ),
+        m_inotifyfd( -1 ), m_thread( 0 ), m_hits( 0 ), m_misses( 0 ), m_invalidations( 0 ), m_evictions( 0 )
+{
+    if( capacity <= 0 )
+    {
+        throw std::exception();
+    }
+    for( int i = 0; i < SHARD_NUMBER; ++i )
+    {
+        m_shards[i].generation = 0;
+    }
+}
+
+file_cache::~file_cache()
+{
+    invalidate_all();
+    if( m_inotifyfd != -1 )
+    {
+        close( m_inotifyfd );
+    }
+}
+
+file_cache::shard& file_cache::shard_of( const std::string& url )
+{
+    return m_shards[ std::hash< std::string >()( url ) % SHARD_NUMBER ];
+}
+
+//接管fd，失败时也负责关掉
+file_entry* file_cache::open_entry( int fd, const struct stat& st )
+{
+    char* address = NULL;
+    if( m_map_files && st.st_size > 0 )
+    {
+        address = ( char* )mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( address == MAP_FAILED )
+        {
+            close( fd );
+            return NULL;
+        }
+    }
+
+    file_entry* entry = new file_entry;
+    entry->fd = fd;
+    entry->st = st;
+    entry->address = address;
+    entry->refcount.store( 1, std::memory_order_relaxed ); //调用者的引用
+    return entry;
+}
+
+int file_cache::acquire( const char* url, file_entry** entry, struct stat* st )
+{
+    *entry = NULL;
+    std::string key( url );
+    shard& s = shard_of( key );
+
+    s.lock.lock();
+    std::unordered_map< std::string, slot >::iterator it = s.files.find( key );
+    if( it != s.files.end() )
+    {
+        file_entry* hit = it->second.entry;
+        hit->refcount.fetch_add( 1, std::memory_order_relaxed );
+        s.lru.splice( s.lru.begin(), s.lru, it->second.lru );
+        s.lock.unlock();
+        m_hits.fetch_add( 1, std::memory_order_relaxed );
+        *entry = hit;
+        *st = hit->st;
+        return 0;
+    }
+    unsigned long generation = s.generation;
+    s.lock.unlock();
+    m_misses.fetch_add( 1, std::memory_order_relaxed );
+
+    /*未命中：在锁外完成open/fstat/mmap，不阻塞同一分片上的其他查找。
+    先打开再对fd取fstat，st和fd一定是同一个inode；先stat再open的话，中间被rename换掉的文件会拿到旧的长度和ETag。
+    O_NONBLOCK是为了doc_root下的FIFO不把工作线程卡在open上，对普通文件没有影响*/
+    std::string path = m_doc_root + key;
+    int fd = open( path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC );
+    if( fd < 0 )
+    {
+        //打不开的（比如没有读权限）只要stat结果，由调用者按它回403或404
+        return stat( path.c_str(), st ) < 0 ? -1 : 0;
+    }
+    if( fstat( fd, st ) < 0 )
+    {
+        close( fd );
+        return -1;
+    }
+    if( ! S_ISREG( st->st_mode ) || ! ( st->st_mode & S_IROTH ) )
+    {
+        close( fd );
+        return 0; //目录、不可读文件不进缓存，由调用者按stat结果处理
+    }
+    file_entry* fresh = open_entry( fd, *st );
+    if( ! fresh )
+    {
+        return 0;
+    }
+
+    file_entry* evicted = NULL;
+    s.lock.lock();
+    it = s.files.find( key );
+    if( it != s.files.end() )
+    {
+        //别的线程抢先插入了，用已有的条目
+        file_entry* existing = it->second.entry;
+        existing->refcount.fetch_add( 1, std::memory_order_relaxed );
+        s.lru.splice( s.lru.begin(), s.lru, it->second.lru );
+        s.lock.unlock();
+        release( fresh );
+        *entry = existing;
+        *st = existing->st;
+        return 0;
+    }
+    //打开期间分片上有过失效，这个文件可能正是被改的那个，只给这次请求用，发送完release时释放
+    if( s.generation == generation )
+    {
+        if( ( int )s.files.size() >= m_shard_capacity )
+        {
+            //分片满了，淘汰最久没用的条目；正在发送它的连接还持有引用，不受影响
+            it = s.files.find( s.lru.back() );
+            evicted = it->second.entry;
+            s.files.erase( it );
+            s.lru.pop_back();
+            m_evictions.fetch_add( 1, std::memory_order_relaxed );
+        }
+        fresh->refcount.fetch_add( 1, std::memory_order_relaxed ); //缓存持有的引用
+        s.lru.push_front( key );
+        slot& sl = s.files[ key ];
+        sl.entry = fresh;
+        sl.lru = s.lru.begin();
+    }
+    s.lock.unlock();
+    if( evicted )
+    {
+        release( evicted );
+    }
+    *entry = fresh;
+    return 0;
+}
+
+void file_cache::release( file_entry* entry )
+{
+    if( entry->refcount.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+    {
+        if( entry->address )
+        {
+            munmap( entry->address, entry->st.st_size );
+        }
+        close( entry->fd );
+        delete entry;
+    }
+}
+
+void file_cache::invalidate( const std::string& url )
+{
+    shard& s = shard_of( url );
+    s.lock.lock();
+    ++s.generation; //没有条目也要加，可能有未命中正在锁外打开这个文件
+    std::unordered_map< std::string, slot >::iterator it = s.files.find( url );
+    if( it == s.files.end() )
+    {
+        s.lock.unlock();
+        return;
+    }
+    file_entry* entry = it->second.entry;
+    s.lru.erase( it->second.lru );
+    s.files.erase( it );
+    s.lock.unlock();
+    m_invalidations.fetch_add( 1, std::memory_order_relaxed );
+    release( entry );
+}
+
+void file_cache::invalidate_all()
+{
+    for( int i = 0; i < SHARD_NUMBER; ++i )
+    {
+        shard& s = m_shards[i];
+        s.lock.lock();
+        ++s.generation;
+        std::unordered_map< std::string, slot > files;
+        files.swap( s.files );
+        s.lru.clear();
+        s.lock.unlock();
+        for( std::unordered_map< std::string, slot >::iterator it = files.begin(); it != files.end(); ++it )
+        {
+            m_invalidations.fetch_add( 1, std::memory_order_relaxed );
+            release( it->second.entry );
+        }
+    }
+}
+
+bool file_cache::start()
+{
+    m_inotifyfd = inotify_init1( IN_CLOEXEC );
+    if( m_inotifyfd < 0 )
+    {
+        return false;
+    }
+    watch_dir( "/" );
+    if( pthread_create( &m_thread, NULL, watcher, this ) != 0 )
+    {
+        return false;
+    }
+    pthread_detach( m_thread );
+    return true;
+}
+
+//rel_dir形如"/"或"/img/"，和URL的前缀对应，递归监视所有子目录
+void file_cache::watch_dir( const std::string& rel_dir )
+{
+    std::string path = m_doc_root + rel_dir;
+    int wd = inotify_add_watch( m_inotifyfd, path.c_str(),
+            IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+            | IN_CREATE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR );
+    if( wd < 0 )
+    {
+        LOG_WARN( "inotify_add_watch %s failed, errno is: %d", path.c_str(), errno );
+        return;
+    }
+    m_watch_dirs[ wd ] = rel_dir;
+
+    DIR* dir = opendir( path.c_str() );
+    if( ! dir )
+    {
+        return;
+    }
+    struct dirent* ent;
+    while( ( ent = readdir( dir ) ) != NULL )
+    {
+        if( ent->d_type == DT_DIR && strcmp( ent->d_name, "." ) != 0 && strcmp( ent->d_name, ".." ) != 0 )
+        {
+            watch_dir( rel_dir + ent->d_name + "/" );
+        }
+    }
+    closedir( dir );
+}
+
+void* file_cache::watcher( void* arg )
+{
+    file_cache* cache = ( file_cache* )arg;
+    cache->run_watcher();
+    return cache;
+}
+
+void file_cache::run_watcher()
+{
+    char buf[ 4096 ] __attribute__( ( aligned( __alignof__( struct inotify_event ) ) ) );
+    while( true )
+    {
+        ssize_t len = ::read( m_inotifyfd, buf, sizeof( buf ) );
+        if( len <= 0 )
+        {
+            if( len < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            break;
+        }
+
+        for( char* p = buf; p < buf + len; )
+        {
+            struct inotify_event* event = ( struct inotify_event* )p;
+            p += sizeof( struct inotify_event ) + event->len;
+
+            if( event->mask & IN_Q_OVERFLOW )
+            {
+                invalidate_all(); //丢了事件，不知道哪些文件变了，只能全部作废
+                continue;
+            }
+            std::unordered_map< int, std::string >::iterator it = m_watch_dirs.find( event->wd );
+            if( it == m_watch_dirs.end() )
+            {
+                continue;
+            }
+            if( event->mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED ) )
+            {
+                //整个目录没了或被改名，它下面的URL全部失效
+                if( event->mask & IN_IGNORED )
+                {
+                    m_watch_dirs.erase( it );
+                }
+                invalidate_all();
+                continue;
+            }
+            if( event->len == 0 )
+            {
+                continue;
+            }
+
+            std::string url = it->second + event->name;
+            if( event->mask & IN_ISDIR )
+            {
+                if( event->mask & ( IN_CREATE | IN_MOVED_TO ) )
+                {
+                    watch_dir( url + "/" );
+                }
+                else if( event->mask & IN_MOVED_FROM )
+                {
+                    invalidate_all();
+                }
+                continue;
+            }
+            invalidate( url );
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <atomic>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+/*缓存中的一个文件：打开的fd、stat结果和只读映射。
+引用计数里包含缓存自己持有的一份，被失效踢出缓存后，正在发送它的连接仍然持有引用，
+最后一个release时才真正munmap/close，所以发送中的响应不会因为文件变化而失效*/
+struct file_entry
+{
+    int fd;
+    struct stat st;
+    char* address; //空文件或者只用sendfile时为NULL
+    std::atomic< int > refcount;
+};
+
+/*doc_root下 URL路径 -> file_entry 的共享缓存。按哈希分片加锁，命中时只需一次加锁查表和一次原子加，
+省掉每个请求的stat/open/mmap/close。后台线程用inotify监视doc_root，文件被修改、删除、改名时把对应条目踢出；
+分片满了按LRU淘汰最久没用的条目*/
+class file_cache
+{
+public:
+    file_cache( const char* doc_root, int capacity, bool map_files );
+    ~file_cache();
+
+    bool start(); //启动inotify监视线程
+
+    /*查找url对应的文件。文件不存在返回-1；否则返回0并填好st，
+    如果是可读的普通文件，*entry指向一个已经加了引用的条目，用完必须release*/
+    int acquire( const char* url, file_entry** entry, struct stat* st );
+    void release( file_entry* entry );
+
+    void invalidate( const std::string& url );
+    void invalidate_all();
+
+    unsigned long hits() const { return m_hits.load( std::memory_order_relaxed ); }
+    unsigned long misses() const { return m_misses.load( std::memory_order_relaxed ); }
+    unsigned long invalidations() const { return m_invalidations.load( std::memory_order_relaxed ); }
+    unsigned long evictions() const { return m_evictions.load( std::memory_order_relaxed ); }
+
+private:
+    static const int SHARD_NUMBER = 16;
+    struct slot
+    {
+        file_entry* entry;
+        std::list< std::string >::iterator lru;
+    };
+    struct shard
+    {
+        locker lock;
+        std::unordered_map< std::string, slot > files;
+        std::list< std::string > lru; //最近用过的在前面
+        /*每次失效加一。未命中时在锁外打开文件，这期间来的失效找不到条目可删，
+        插入前发现代数变了就不插，免得把失效前打开的旧文件留在缓存里*/
+        unsigned long generation;
+    };
+
+    shard& shard_of( const std::string& url );
+    file_entry* open_entry( int fd, const struct stat& st );
+    static void* watcher( void* arg );
+    void watch_dir( const std::string& rel_dir );
+    void run_watcher();
+
+private:
+    std::string m_doc_root;
+    int m_shard_capacity;
+    bool m_map_files;
+    shard m_shards[ SHARD_NUMBER ];
+
+    int m_inotifyfd;
+    std::unordered_map< int, std::string > m_watch_dirs; //inotify wd -> 相对doc_root的目录前缀，只在监视线程里访问
+    pthread_t m_thread;
+
+    std::atomic< unsigned long > m_hits;
+    std::atomic< unsigned long > m_misses;
+    std::atomic< unsigned long > m_invalidations;
+    std::atomic< unsigned long > m_evictions;
+};
+
+#endif
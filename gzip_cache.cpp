@@ -0,0 +1,309 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <exception>
+
+#include "gzip_cache.h"
+
+gzip_cache::gzip_cache( const char* doc_root, size_t capacity, int hot_threshold, int level ) :
+        m_doc_root( doc_root ), m_shard_capacity( capacity / SHARD_NUMBER ), m_hot_threshold( hot_threshold ),
+        m_level( level ), m_thread( 0 ), m_hits( 0 ), m_compressions( 0 ), m_evictions( 0 )
+{
+    if( capacity < ( size_t )SHARD_NUMBER || hot_threshold <= 0 || level < 1 || level > 9 )
+    {
+        throw std::exception();
+    }
+    for( int i = 0; i < SHARD_NUMBER; ++i )
+    {
+        m_shards[i].bytes = 0;
+    }
+}
+
+gzip_cache::~gzip_cache()
+{
+    for( int i = 0; i < SHARD_NUMBER; ++i )
+    {
+        shard& s = m_shards[i];
+        for( std::unordered_map< std::string, slot >::iterator it = s.slots.begin(); it != s.slots.end(); ++it )
+        {
+            if( it->second.entry )
+            {
+                release( it->second.entry );
+            }
+        }
+    }
+}
+
+gzip_cache::shard& gzip_cache::shard_of( const std::string& url )
+{
+    return m_shards[ std::hash< std::string >()( url ) % SHARD_NUMBER ];
+}
+
+bool gzip_cache::same_source( ino_t ino, off_t size, const struct timespec& mtime, const struct stat& st )
+{
+    return ino == st.st_ino && size == st.st_size && mtime.tv_sec == st.st_mtim.tv_sec && mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+void gzip_cache::drop_entry( shard& s, slot& sl, std::deque< gzip_entry* >* dropped )
+{
+    s.bytes -= sl.entry->length;
+    s.lru.erase( sl.lru );
+    dropped->push_back( sl.entry );
+    sl.entry = NULL;
+}
+
+//记录的URL太多时，把没有压缩结果、也不在排队的都忘掉
+void gzip_cache::sweep( shard& s )
+{
+    std::unordered_map< std::string, slot >::iterator it = s.slots.begin();
+    while( it != s.slots.end() )
+    {
+        if( ! it->second.entry && ! it->second.queued )
+        {
+            it = s.slots.erase( it );
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+gzip_entry* gzip_cache::acquire( const char* url, const struct stat& st )
+{
+    std::string key( url );
+    shard& s = shard_of( key );
+    std::deque< gzip_entry* > dropped;
+    gzip_entry* hit = NULL;
+    bool enqueue = false;
+
+    s.lock.lock();
+    std::unordered_map< std::string, slot >::iterator it = s.slots.find( key );
+    if( it == s.slots.end() )
+    {
+        if( s.slots.size() >= MAX_TRACKED )
+        {
+            sweep( s );
+        }
+        slot fresh;
+        fresh.entry = NULL;
+        fresh.hits = 0;
+        fresh.queued = false;
+        fresh.incompressible = false;
+        it = s.slots.insert( std::make_pair( key, fresh ) ).first;
+    }
+    slot& sl = it->second;
+    if( sl.entry && same_source( sl.entry->ino, sl.entry->size, sl.entry->mtime, st ) )
+    {
+        hit = sl.entry;
+        hit->refcount.fetch_add( 1, std::memory_order_relaxed );
+        s.lru.splice( s.lru.begin(), s.lru, sl.lru );
+    }
+    else
+    {
+        if( sl.entry )
+        {
+            drop_entry( s, sl, &dropped ); //源文件变了
+            sl.hits = 0;
+        }
+        if( sl.incompressible && ! same_source( sl.ino, sl.size, sl.mtime, st ) )
+        {
+            sl.incompressible = false;
+            sl.hits = 0;
+        }
+        if( ! sl.incompressible && ! sl.queued && ++sl.hits >= m_hot_threshold )
+        {
+            sl.queued = true;
+            enqueue = true;
+        }
+    }
+    s.lock.unlock();
+
+    for( size_t i = 0; i < dropped.size(); ++i )
+    {
+        release( dropped[i] );
+    }
+    if( hit )
+    {
+        m_hits.fetch_add( 1, std::memory_order_relaxed );
+    }
+    if( enqueue )
+    {
+        m_queue_lock.lock();
+        m_queue.push_back( key );
+        m_queue_lock.unlock();
+        m_queue_stat.post();
+    }
+    return hit;
+}
+
+void gzip_cache::release( gzip_entry* entry )
+{
+    if( entry->refcount.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+    {
+        free( entry->data );
+        delete entry;
+    }
+}
+
+bool gzip_cache::start()
+{
+    if( pthread_create( &m_thread, NULL, worker, this ) != 0 )
+    {
+        return false;
+    }
+    pthread_detach( m_thread );
+    return true;
+}
+
+void* gzip_cache::worker( void* arg )
+{
+    gzip_cache* cache = ( gzip_cache* )arg;
+    cache->run_worker();
+    return cache;
+}
+
+void gzip_cache::run_worker()
+{
+    while( true )
+    {
+        m_queue_stat.wait();
+        m_queue_lock.lock();
+        if( m_queue.empty() )
+        {
+            m_queue_lock.unlock();
+            continue;
+        }
+        std::string url = m_queue.front();
+        m_queue.pop_front();
+        m_queue_lock.unlock();
+        compress( url );
+    }
+}
+
+void gzip_cache::compress( const std::string& url )
+{
+    std::string path = m_doc_root + url;
+    struct stat st;
+    memset( &st, 0, sizeof( st ) );
+    char* data = NULL;
+    size_t length = 0;
+    int fd = open( path.c_str(), O_RDONLY );
+    if( fd >= 0 && fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0
+        && ( size_t )st.st_size <= m_shard_capacity / 2 )
+    {
+        /*用pread分块读进来再压缩，不映射源文件：压缩期间文件被原地截短的话，读映射会收到SIGBUS把整个服务器带走，
+        pread只是提前读到文件尾。只压stat时的长度，读不满说明文件正在变，这次放弃*/
+        z_stream zs;
+        memset( &zs, 0, sizeof( zs ) );
+        //windowBits加16输出带gzip头和尾的格式
+        if( deflateInit2( &zs, m_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) == Z_OK )
+        {
+            size_t bound = deflateBound( &zs, st.st_size );
+            data = ( char* )malloc( bound );
+            char* chunk = ( char* )malloc( READ_CHUNK );
+            zs.next_out = ( Bytef* )data;
+            zs.avail_out = bound;
+            off_t offset = 0;
+            int ret = data && chunk ? Z_OK : Z_MEM_ERROR;
+            while( ret == Z_OK )
+            {
+                size_t left = st.st_size - offset;
+                ssize_t n = pread( fd, chunk, left < READ_CHUNK ? left : READ_CHUNK, offset );
+                if( n < 0 && errno == EINTR )
+                {
+                    continue;
+                }
+                if( n <= 0 )
+                {
+                    break;
+                }
+                offset += n;
+                zs.next_in = ( Bytef* )chunk;
+                zs.avail_in = n;
+                ret = deflate( &zs, offset == st.st_size ? Z_FINISH : Z_NO_FLUSH );
+            }
+            if( ret == Z_STREAM_END )
+            {
+                length = zs.total_out;
+            }
+            free( chunk );
+            deflateEnd( &zs );
+        }
+    }
+    if( fd >= 0 )
+    {
+        close( fd );
+    }
+    //压缩后至少省下十分之一才值得占缓存和让客户端解压
+    bool worthwhile = length > 0 && length < ( size_t )st.st_size - st.st_size / 10;
+
+    gzip_entry* entry = NULL;
+    if( worthwhile )
+    {
+        entry = new gzip_entry;
+        char* shrunk = ( char* )realloc( data, length ); //deflateBound给得比实际大，还回多余的部分
+        entry->data = shrunk ? shrunk : data;
+        entry->length = length;
+        entry->ino = st.st_ino;
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtim;
+        entry->refcount.store( 1, std::memory_order_relaxed ); //缓存持有的引用
+        data = NULL;
+        m_compressions.fetch_add( 1, std::memory_order_relaxed );
+    }
+    free( data );
+
+    shard& s = shard_of( url );
+    std::deque< gzip_entry* > dropped;
+    s.lock.lock();
+    std::unordered_map< std::string, slot >::iterator it = s.slots.find( url );
+    if( it == s.slots.end() )
+    {
+        s.lock.unlock();
+        if( entry )
+        {
+            release( entry );
+        }
+        return;
+    }
+    slot& sl = it->second;
+    sl.queued = false;
+    sl.hits = 0;
+    if( ! entry )
+    {
+        //文件打不开、太大或者压不动，记下源文件，它不变就不再排队
+        sl.incompressible = fd >= 0;
+        if( sl.incompressible )
+        {
+            sl.ino = st.st_ino;
+            sl.size = st.st_size;
+            sl.mtime = st.st_mtim;
+        }
+        s.lock.unlock();
+        return;
+    }
+    if( sl.entry )
+    {
+        drop_entry( s, sl, &dropped );
+    }
+    sl.entry = entry;
+    s.lru.push_front( url );
+    sl.lru = s.lru.begin();
+    s.bytes += entry->length;
+    while( s.bytes > m_shard_capacity && s.lru.size() > 1 )
+    {
+        slot& victim = s.slots[ s.lru.back() ];
+        drop_entry( s, victim, &dropped );
+        m_evictions.fetch_add( 1, std::memory_order_relaxed );
+    }
+    s.lock.unlock();
+
+    for( size_t i = 0; i < dropped.size(); ++i )
+    {
+        release( dropped[i] );
+    }
+}
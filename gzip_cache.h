@@ -0,0 +1,95 @@
+#ifndef GZIP_CACHE_H
+#define GZIP_CACHE_H
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+/*一个压缩好的文件，连同压缩时源文件的身份（inode、大小、修改时间）。
+和file_entry一样，引用计数里包含缓存自己持有的一份，被淘汰后发送中的响应仍然可以用到发完*/
+struct gzip_entry
+{
+    char* data;
+    size_t length;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    std::atomic< int > refcount;
+};
+
+/*doc_root下热点文件的gzip版本，给没有预压缩.gz兄弟文件的资源用。
+请求路径上只查表和计数：同一个URL被要gzip的请求访问到hot_threshold次，才交给后台线程压缩一次，
+压缩永远不在请求路径上做。总大小按字节限制，每个分片各自按LRU淘汰。
+源文件变了（stat和压缩时不一致）时旧条目作废，再热起来重新压缩，不依赖inotify*/
+class gzip_cache
+{
+public:
+    gzip_cache( const char* doc_root, size_t capacity, int hot_threshold, int level );
+    ~gzip_cache();
+
+    bool start(); //启动后台压缩线程
+
+    //st是请求刚拿到的源文件stat。命中且和源文件一致时返回加了引用的条目，用完必须release；否则返回NULL
+    gzip_entry* acquire( const char* url, const struct stat& st );
+    void release( gzip_entry* entry );
+
+    unsigned long hits() const { return m_hits.load( std::memory_order_relaxed ); }
+    unsigned long compressions() const { return m_compressions.load( std::memory_order_relaxed ); }
+    unsigned long evictions() const { return m_evictions.load( std::memory_order_relaxed ); }
+
+private:
+    static const int SHARD_NUMBER = 16;
+    static const size_t MAX_TRACKED = 4096; //每个分片最多记多少个URL的访问次数
+    static const size_t READ_CHUNK = 65536; //压缩时每次从源文件读多少
+
+    struct slot
+    {
+        gzip_entry* entry; //还没压缩好时为NULL
+        int hits;
+        bool queued; //已经交给后台线程，还没压完
+        bool incompressible; //压了也省不了多少，源文件不变就不再尝试
+        ino_t ino; //incompressible对应的源文件
+        off_t size;
+        struct timespec mtime;
+        std::list< std::string >::iterator lru; //entry不为空时在分片的LRU链表里
+    };
+    struct shard
+    {
+        locker lock;
+        std::unordered_map< std::string, slot > slots;
+        std::list< std::string > lru; //最近用过的在前面
+        size_t bytes;
+    };
+
+    shard& shard_of( const std::string& url );
+    static bool same_source( ino_t ino, off_t size, const struct timespec& mtime, const struct stat& st );
+    void drop_entry( shard& s, slot& sl, std::deque< gzip_entry* >* dropped ); //调用时已持有分片的锁
+    void sweep( shard& s );
+    static void* worker( void* arg );
+    void run_worker();
+    void compress( const std::string& url );
+
+private:
+    std::string m_doc_root;
+    size_t m_shard_capacity;
+    int m_hot_threshold;
+    int m_level;
+    shard m_shards[ SHARD_NUMBER ];
+
+    //等待压缩的URL
+    locker m_queue_lock;
+    sem m_queue_stat;
+    std::deque< std::string > m_queue;
+    pthread_t m_thread;
+
+    std::atomic< unsigned long > m_hits;
+    std::atomic< unsigned long > m_compressions;
+    std::atomic< unsigned long > m_evictions;
+};
+
+#endif
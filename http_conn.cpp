@@ -1,14 +1,113 @@
 #include "http_conn.h"
+#include "threadpool.h"
+
+#include "fast_itoa.h"
+#include "http_date.h"
+#include "autoindex.h"
+#include <sys/random.h>
+#include <linux/errqueue.h>
+
+//错误响应的正文和长度，长度要写进预先拼好的响应头，编译期检查两者一致
+#define ERROR_400_FORM "Your request has bad syntax or is inherently impossible to satisfy.\n"
+#define ERROR_400_LENGTH 68
+#define ERROR_403_FORM "You do not have permission to get file from this server.\n"
+#define ERROR_403_LENGTH 57
+#define ERROR_404_FORM "The requested file was not found on this server.\n"
+#define ERROR_404_LENGTH 49
+#define ERROR_500_FORM "There was an unusual problem serving the requested file.\n"
+#define ERROR_500_LENGTH 57
+static_assert( sizeof( ERROR_400_FORM ) - 1 == ERROR_400_LENGTH, "ERROR_400_LENGTH" );
+static_assert( sizeof( ERROR_403_FORM ) - 1 == ERROR_403_LENGTH, "ERROR_403_LENGTH" );
+static_assert( sizeof( ERROR_404_FORM ) - 1 == ERROR_404_LENGTH, "ERROR_404_LENGTH" );
+static_assert( sizeof( ERROR_500_FORM ) - 1 == ERROR_500_LENGTH, "ERROR_500_LENGTH" );
+#define ERROR_503_FORM "The server is overloaded, please retry later.\n"
+#define ERROR_503_LENGTH 46
+static_assert( sizeof( ERROR_503_FORM ) - 1 == ERROR_503_LENGTH, "ERROR_503_LENGTH" );
+#define ERROR_405_FORM "The requested URL does not accept a request body.\n"
+#define ERROR_405_LENGTH 50
+#define ERROR_411_FORM "A request body needs a Content-Length.\n"
+#define ERROR_411_LENGTH 39
+#define ERROR_413_FORM "The request body is larger than this server accepts.\n"
+#define ERROR_413_LENGTH 53
+#define ERROR_414_FORM "The requested URL is longer than this server accepts.\n"
+#define ERROR_414_LENGTH 54
+#define ERROR_417_FORM "The expectation given in the Expect header cannot be met.\n"
+#define ERROR_417_LENGTH 58
+#define ERROR_501_FORM "Transfer-Encoding on requests is not supported.\n"
+#define ERROR_501_LENGTH 48
+static_assert( sizeof( ERROR_405_FORM ) - 1 == ERROR_405_LENGTH, "ERROR_405_LENGTH" );
+static_assert( sizeof( ERROR_411_FORM ) - 1 == ERROR_411_LENGTH, "ERROR_411_LENGTH" );
+static_assert( sizeof( ERROR_413_FORM ) - 1 == ERROR_413_LENGTH, "ERROR_413_LENGTH" );
+static_assert( sizeof( ERROR_414_FORM ) - 1 == ERROR_414_LENGTH, "ERROR_414_LENGTH" );
+static_assert( sizeof( ERROR_417_FORM ) - 1 == ERROR_417_LENGTH, "ERROR_417_LENGTH" );
+static_assert( sizeof( ERROR_501_FORM ) - 1 == ERROR_501_LENGTH, "ERROR_501_LENGTH" );
+
+#define STRINGIFY_( x ) #x
+#define STRINGIFY( x ) STRINGIFY_( x )
+#define STATIC_RESPONSE( s ) { s, sizeof( s ) - 1 }
+#define ERROR_RESPONSE( status, title, form, length, connection ) \
+    STATIC_RESPONSE( "HTTP/1.1 " #status " " title "\r\nContent-Length: " STRINGIFY( length ) \
+                     "\r\nConnection: " connection "\r\n\r\n" form )
+
+//完整的错误响应（状态行、头部、正文），下标是m_linger：[0]关闭连接，[1]保持连接
+static const static_response error_400[2] = {
+    ERROR_RESPONSE( 400, "Bad Request", ERROR_400_FORM, ERROR_400_LENGTH, "close" ),
+    ERROR_RESPONSE( 400, "Bad Request", ERROR_400_FORM, ERROR_400_LENGTH, "keep-alive" ) };
+static const static_response error_403[2] = {
+    ERROR_RESPONSE( 403, "Forbidden", ERROR_403_FORM, ERROR_403_LENGTH, "close" ),
+    ERROR_RESPONSE( 403, "Forbidden", ERROR_403_FORM, ERROR_403_LENGTH, "keep-alive" ) };
+static const static_response error_404[2] = {
+    ERROR_RESPONSE( 404, "Not Found", ERROR_404_FORM, ERROR_404_LENGTH, "close" ),
+    ERROR_RESPONSE( 404, "Not Found", ERROR_404_FORM, ERROR_404_LENGTH, "keep-alive" ) };
+static const static_response error_500[2] = {
+    ERROR_RESPONSE( 500, "Internal Error", ERROR_500_FORM, ERROR_500_LENGTH, "close" ),
+    ERROR_RESPONSE( 500, "Internal Error", ERROR_500_FORM, ERROR_500_LENGTH, "keep-alive" ) };
+//过载时的拒绝总是关闭连接，让客户端按Retry-After退避后重连，连接本身也不再占着服务器
+static const static_response error_503 = STATIC_RESPONSE( "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: "
+    STRINGIFY( ERROR_503_LENGTH ) "\r\nConnection: close\r\n\r\n" ERROR_503_FORM );
+
+//拒绝请求体时它可能已经在路上了，剩下的字节没法当请求解析，这几种总是关闭连接
+static const static_response error_405 = STATIC_RESPONSE( "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: "
+    STRINGIFY( ERROR_405_LENGTH ) "\r\nConnection: close\r\n\r\n" ERROR_405_FORM );
+static const static_response error_411 = ERROR_RESPONSE( 411, "Length Required", ERROR_411_FORM, ERROR_411_LENGTH, "close" );
+static const static_response error_413 = ERROR_RESPONSE( 413, "Content Too Large", ERROR_413_FORM, ERROR_413_LENGTH, "close" );
+//请求行就被拒绝了，后面跟着的头部和请求体都没看，同样关闭连接
+static const static_response error_414 = ERROR_RESPONSE( 414, "URI Too Long", ERROR_414_FORM, ERROR_414_LENGTH, "close" );
+static const static_response error_417 = ERROR_RESPONSE( 417, "Expectation Failed", ERROR_417_FORM, ERROR_417_LENGTH, "close" );
+static const static_response error_501 = ERROR_RESPONSE( 501, "Not Implemented", ERROR_501_FORM, ERROR_501_LENGTH, "close" );
+static const static_response status_100 = STATIC_RESPONSE( "HTTP/1.1 100 Continue\r\n\r\n" );
+
+//常用的状态行，直接拷贝
+static const static_response status_200 = STATIC_RESPONSE( "HTTP/1.1 200 OK\r\n" );
+static const static_response status_304 = STATIC_RESPONSE( "HTTP/1.1 304 Not Modified\r\n" );
+static const static_response status_206 = STATIC_RESPONSE( "HTTP/1.1 206 Partial Content\r\n" );
+static const static_response status_416 = STATIC_RESPONSE( "HTTP/1.1 416 Range Not Satisfiable\r\n" );
+static const static_response last_chunk = STATIC_RESPONSE( "0\r\n\r\n" );
+
+//multipart/byteranges的分隔符，进程启动时随机生成一次，文件内容里恰好出现它的概率可以忽略
+static const int BOUNDARY_LENGTH = 16;
+static char range_boundary[ BOUNDARY_LENGTH + 1 ];
+static const int MULTIPART_CLOSE_LENGTH = sizeof( "\r\n--" ) - 1 + BOUNDARY_LENGTH + sizeof( "--\r\n" ) - 1;
+
+static bool make_boundary()
+{
+    unsigned char random[ BOUNDARY_LENGTH / 2 ];
+    if ( getrandom( random, sizeof( random ), 0 ) != ( ssize_t )sizeof( random ) )
+    {
+        unsigned long seed = ( unsigned long )time( NULL ) * 6364136223846793005UL + getpid();
+        memcpy( random, &seed, sizeof( random ) );
+    }
+    static const char hex[] = "0123456789abcdef";
+    for ( int i = 0; i < BOUNDARY_LENGTH / 2; ++i )
+    {
+        range_boundary[ 2 * i ] = hex[ random[i] >> 4 ];
+        range_boundary[ 2 * i + 1 ] = hex[ random[i] & 15 ];
+    }
+    return true;
+}
+static bool boundary_ready = make_boundary();
 
 const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
-const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
-const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
-const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
-const char* error_500_form = "There was an unusual problem serving the requested file.\n";
 //const char* doc_root = "/var/www/html";
 const char* doc_root = "./html";
 //根据协议规定，我们判断HTTP头部结束的依据是遇到一个空行，该空行仅包含一对回车换行符（＜CR＞＜LF＞）。
@@ -26,7 +125,7 @@ int setnonblocking(int fd)
     return old_option;
 }
 
-//边缘触发epoll加非阻塞netfd
+//边缘触发epoll加非阻塞netfd；fd在创建时（accept4/socket带SOCK_NONBLOCK）就已经是非阻塞的
 void addfd( int epollfd, int fd, bool one_shot )
 {
     epoll_event event;
@@ -38,7 +137,6 @@ void addfd( int epollfd, int fd, bool one_shot )
         event.events |= EPOLLONESHOT;
     }
     epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
-    setnonblocking( fd );
 }
 
 void removefd( int epollfd, int fd )
@@ -55,55 +153,288 @@ void modfd( int epollfd, int fd, int ev )
     epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
 }
 
-int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+//热数据多出一个字节就会多占一行，改成员时留意
+static_assert( sizeof( http_conn ) == 3 * CACHE_LINE_SIZE, "http_conn hot fields must fit in three cache lines" );
+
+std::atomic< int > http_conn::m_user_count( 0 );
+const char* http_conn::m_stats_path = "/__stats";
+bool http_conn::m_use_sendfile = false;
+file_cache* http_conn::m_file_cache = NULL;
+bool http_conn::m_precompressed = false;
+gzip_cache* http_conn::m_gzip_cache = NULL;
+cache_rule http_conn::m_cache_rules[ MAX_CACHE_RULES ];
+int http_conn::m_cache_rule_count = 0;
+int http_conn::m_header_timeout = 10000;
+int http_conn::m_body_timeout = 30000;
+int http_conn::m_idle_timeout = 60000;
+int http_conn::m_write_timeout = 30000;
+int http_conn::m_max_read_buffer = 8192;
+buffer_pool http_conn::m_buffer_pools[ cpu_topology::MAX_NODES ];
+codel http_conn::m_codel;
+long http_conn::m_zerocopy_threshold = 0;
+stream_route http_conn::m_stream_routes[ MAX_STREAM_ROUTES ];
+int http_conn::m_stream_route_count = 0;
+bool http_conn::m_autoindex = false;
+body_route http_conn::m_body_routes[ MAX_BODY_ROUTES ];
+int http_conn::m_body_route_count = 0;
+long http_conn::m_max_body = 1L << 30;
+long http_conn::m_body_spill = 1L << 20;
+const char* http_conn::m_spool_dir = "/tmp";
+
+static_assert( 2 * http_conn::MAX_PIPELINE <= 32, "mapped_iovs has one bit per iovec" );
 
 void http_conn::close_conn( bool real_close )
 {
     if( real_close && ( m_sockfd != -1 ) )
     {
+        unmap(); //发送中途断开的连接也要释放映射/文件
+        //也不再等零拷贝的完成通知：页被发送队列里的skb引用着不会被回收，零拷贝只用于文件映射，内容也不会被改写
+        release_bodies( m_cold->pinned, m_cold->pinned_count );
+        m_cold->pinned_count = 0;
+        end_stream(); //流式响应发到一半断开
+        release_stream_buf();
+        end_body(); //请求体收到一半断开
+
+        release_read_buf();
+        release_write_buf();
         //modfd( m_epollfd, m_sockfd, EPOLLIN );
-        removefd( m_epollfd, m_sockfd );
+        /*
+        工作线程出错时也在这里关闭：先标记成已关闭再放开m_in_pool，reactor的超时处理看到连接不在池里时
+        一定也看到它已关闭，不会再关一次。fd最后才关，关掉后这个号马上可能被accept复用，之后不能再碰连接对象
+        */
+        int sockfd = m_sockfd;
         m_sockfd = -1;
-        m_user_count--;
+        m_in_pool.store( false, std::memory_order_release );
+        if ( m_epollfd != -1 )
+        {
+            removefd( m_epollfd, sockfd );
+        }
+        else
+        {
+            close( sockfd ); //io_uring后端，没有注册到epoll
+        }
+        m_user_count.fetch_sub( 1, std::memory_order_relaxed );
+        server_stats::add( STAT_CLOSED );
     }
 }
 
-void http_conn::init( int sockfd, const sockaddr_in& addr )
+http_conn::~http_conn()
 {
+    delete m_cold;
+}
+
+void http_conn::init( int sockfd, const sockaddr_in& addr, int epollfd )
+{
+    if ( ! m_cold )
+    {
+        m_cold = new cold_state; //fd槽位第一次被用到，之后复用这个fd的连接都沿用它
+    }
+    m_epollfd = epollfd;
     m_sockfd = sockfd;
-    m_address = addr;
-    int error = 0;
-    socklen_t len = sizeof( error );
-    getsockopt( m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len );
-    //SO_ERROR 是要获取的具体选项，用于获取套接字的错误状态。
-    //如果套接字发生了错误，error 变量将被设置为相应的错误码；如果没有错误，error 将为 0。
-    //？？？？
-    int reuse = 1;
-    setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
-    addfd( m_epollfd, sockfd, true );
-    m_user_count++;
+    m_cold->address = addr;
+    m_cold->file_address = 0;
+    m_file_fd = -1;
+    m_cold->entry = 0;
+    m_cold->compressed = 0;
+    m_cold->zerocopy = 0;
+    m_cold->zerocopy_batch = false;
+    m_cold->zerocopy_issued = 0;
+    m_cold->zerocopy_completed = 0;
+    m_cold->pinned_count = 0;
+    m_cold->stream = 0;
+    m_cold->stream_buf = 0;
+    m_cold->body = 0;
+    m_cold->body_fd = -1;
+    m_cold->body_pipe[0] = -1;
+    m_cold->body_pipe[1] = -1;
+    m_read_buf = 0;
+    m_read_buf_size = 0;
+    m_read_node = 0;
+    m_write_node = 0;
+    m_write_block = 0;
+    m_write_buf = 0;
+    m_iv = 0;
+    m_worker_hint = -1;
+    m_in_pool.store( false, std::memory_order_relaxed );
+    m_queued_at = 0;
+    m_cold->write_start = 0;
+    m_request_start = timer_wheel::now_ms();
+    if ( m_epollfd != -1 )
+    {
+        addfd( m_epollfd, sockfd, true );
+    }
+    m_user_count.fetch_add( 1, std::memory_order_relaxed );
+    server_stats::add( STAT_ACCEPTED );
 
     init(); //调用重载的 init 函数进行其他初始化工作
 }
 
 void http_conn::init()
 {
-    m_check_state = CHECK_STATE_REQUESTLINE;
-    m_linger = false;
-
-    m_method = GET;
-    m_url = 0;
-    m_version = 0;
-    m_content_length = 0;
-    m_host = 0;
-    m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
+    init_request();
+    m_keep_alive = true;
+    m_write_idx = 0;
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    m_body_count = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+    m_file_offset = 0;
+    m_file_end = 0;
+    m_last_active = timer_wheel::now_ms();
+}
+
+//只重置解析一个请求用的状态，读缓冲区里m_checked_idx之后的字节（流水线的下一个请求）保留
+void http_conn::init_request()
+{
+    m_check_state = CHECK_STATE_REQUESTLINE;
+    m_linger = true; //HTTP/1.1默认长连接，除非对方发了Connection: close
+
+    m_cold->method = GET;
+    m_cold->url = 0;
+    m_cold->version = 0;
+    m_cold->content_length = -1;
+    end_body(); //上一个请求的请求体被拒绝或者处理出错时，在这里放掉处理函数和暂存文件
+    m_cold->range_count = 0;
+    m_cold->content_encoding = ENCODING_IDENTITY;
+    m_cold->vary = false;
+    m_cold->header_count = 0;
+    memset( m_cold->known_headers, 0, sizeof( m_cold->known_headers ) );
+    m_start_line = m_checked_idx;
+    m_request_begin = m_checked_idx;
+}
+
+//一批响应全部发完：清空写状态，把还没处理完的请求字节挪到读缓冲区开头
+void http_conn::finish_response()
+{
     m_write_idx = 0;
-    memset( m_read_buf, '\0', READ_BUFFER_SIZE );
-    memset( m_write_buf, '\0', WRITE_BUFFER_SIZE );
-    memset( m_real_file, '\0', FILENAME_LEN );
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    m_body_count = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+    m_file_offset = 0;
+    m_file_end = 0;
+    compact_read_buf();
+    release_write_buf();
+    release_stream_buf(); //流式响应的最后一块也发完了
+    m_last_active = timer_wheel::now_ms();
+    if ( m_read_idx > 0 )
+    {
+        m_request_start = m_last_active; //流水线的下一个请求从现在开始计头部超时
+    }
+    else
+    {
+        release_read_buf(); //空闲的长连接不占缓冲区
+    }
+}
+
+bool http_conn::acquire_read_buf()
+{
+    size_t size = 0;
+    m_read_node = cpu_topology::current_node();
+    m_read_buf = m_buffer_pools[ m_read_node ].acquire( READ_BUFFER_SIZE, &size );
+    m_read_buf_size = size;
+    return m_read_buf != 0;
+}
+
+//头部超过当前缓冲区：换一块两倍大的，已经解析出来的指针跟着搬过去
+bool http_conn::grow_read_buf()
+{
+    size_t size = 0;
+    if ( m_read_buf_size * 2 > m_max_read_buffer )
+    {
+        return false;
+    }
+    char* old_buf = m_read_buf;
+    int node = cpu_topology::current_node();
+    char* new_buf = m_buffer_pools[ node ].acquire( m_read_buf_size * 2, &size );
+    if ( ! new_buf )
+    {
+        return false;
+    }
+    memcpy( new_buf, old_buf, m_read_idx );
+    if ( m_cold->url )
+    {
+        m_cold->url = new_buf + ( m_cold->url - old_buf );
+    }
+    if ( m_cold->version )
+    {
+        m_cold->version = new_buf + ( m_cold->version - old_buf );
+    }
+    m_buffer_pools[ m_read_node ].release( old_buf, m_read_buf_size );
+    m_read_node = node;
+    m_read_buf = new_buf;
+    m_read_buf_size = size;
+    return true;
+}
+
+bool http_conn::acquire_write_buf()
+{
+    size_t size = 0;
+    m_write_node = cpu_topology::current_node();
+    m_write_block = ( write_block* )m_buffer_pools[ m_write_node ].acquire( sizeof( write_block ), &size );
+    if ( ! m_write_block )
+    {
+        return false;
+    }
+    m_write_buf = m_write_block->buf;
+    m_iv = m_write_block->iv;
+    m_write_block->mapped_iovs = 0;
+    return true;
+}
+
+void http_conn::release_read_buf()
+{
+    if ( m_read_buf )
+    {
+        m_buffer_pools[ m_read_node ].release( m_read_buf, m_read_buf_size );
+        m_read_buf = 0;
+        m_read_buf_size = 0;
+    }
+}
+
+void http_conn::release_write_buf()
+{
+    if ( m_write_block )
+    {
+        m_buffer_pools[ m_write_node ].release( ( char* )m_write_block, buffer_pool::round_size( sizeof( write_block ) ) );
+        m_write_block = 0;
+        m_write_buf = 0;
+        m_iv = 0;
+    }
+}
+
+void http_conn::compact_read_buf()
+{
+    int shift = m_request_begin;
+    if ( shift == 0 )
+    {
+        return;
+    }
+    memmove( m_read_buf, m_read_buf + shift, m_read_idx - shift );
+    m_read_idx -= shift;
+    m_checked_idx -= shift;
+    m_start_line -= shift;
+    m_request_begin = 0;
+    //下一个请求可能已经解析了一部分，指向缓冲区的指针跟着平移
+    if ( m_cold->url )
+    {
+        m_cold->url -= shift;
+    }
+    if ( m_cold->version )
+    {
+        m_cold->version -= shift;
+    }
+}
+
+//还能不能把下一个流水线请求的响应也排进这一批：sendfile的文件体必须最后发，写缓冲区和iovec也要有余量
+bool http_conn::can_pipeline() const
+{
+    return m_write_block && m_file_fd == -1 && m_body_count < MAX_PIPELINE && m_iv_count + 2 <= 2 * MAX_PIPELINE
+            && WRITE_BUFFER_SIZE - m_write_idx >= PIPELINE_WRITE_RESERVE && ! m_cold->stream;
 }
 
 
@@ -114,47 +445,60 @@ parse_line 方法的主要作用是从读取缓冲区中解析出一行 HTTP 请
 */
 http_conn::LINE_STATUS http_conn::parse_line()
 {
-    char temp;
-    for ( ; m_checked_idx < m_read_idx; ++m_checked_idx )
+    //向量化地跳过普通字符，直接停在下一个\r或\n上
+    const char* end = m_read_buf + m_read_idx;
+    m_checked_idx = find_either( m_read_buf + m_checked_idx, end, '\r', '\n' ) - m_read_buf;
+    if ( m_checked_idx >= m_read_idx )
     {
-        temp = m_read_buf[ m_checked_idx ];
-        if ( temp == '\r' )
-        {
-            if ( ( m_checked_idx + 1 ) == m_read_idx )
-            {
-                return LINE_OPEN;
-            }
-            else if ( m_read_buf[ m_checked_idx + 1 ] == '\n' )
-            {
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                return LINE_OK;
-            }
+        return LINE_OPEN;
+    }
 
-            return LINE_BAD;
+    char temp = m_read_buf[ m_checked_idx ];
+    if ( temp == '\r' )
+    {
+        if ( ( m_checked_idx + 1 ) == m_read_idx )
+        {
+            return LINE_OPEN; //下次从这个\r重新开始找
         }
-        else if( temp == '\n' )
+        else if ( m_read_buf[ m_checked_idx + 1 ] == '\n' )
         {
-            if( ( m_checked_idx > 1 ) && ( m_read_buf[ m_checked_idx - 1 ] == '\r' ) )
-            {
-                m_read_buf[ m_checked_idx-1 ] = '\0';
-                m_read_buf[ m_checked_idx++ ] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+            m_read_buf[ m_checked_idx++ ] = '\0';
+            m_read_buf[ m_checked_idx++ ] = '\0';
+            return LINE_OK;
         }
-    }
 
-    return LINE_OPEN;
+        return LINE_BAD;
+    }
+    if( ( m_checked_idx > 1 ) && ( m_read_buf[ m_checked_idx - 1 ] == '\r' ) )
+    {
+        m_read_buf[ m_checked_idx-1 ] = '\0';
+        m_read_buf[ m_checked_idx++ ] = '\0';
+        return LINE_OK;
+    }
+    return LINE_BAD;
 }
 
 bool http_conn::read()
 {
-    if( m_read_idx >= READ_BUFFER_SIZE )
+    if( spooling() )
+    {
+        return splice_body();
+    }
+    if( ! m_read_buf && ! acquire_read_buf() )
     {
         return false;
     }
+    if( m_read_idx >= m_read_buf_size )
+    {
+        compact_read_buf(); //前面是处理完的流水线请求，腾出来还能接着读
+        if( m_read_idx >= m_read_buf_size && ! grow_read_buf() )
+        {
+            return false; //头部超过了m_max_read_buffer
+        }
+    }
 
+    uint64_t start = server_stats::now();
+    long total = 0;
     int bytes_read = 0;
     while( true )
     {
@@ -163,7 +507,11 @@ bool http_conn::read()
         每次 recv 函数只能读取到当前已经到达的数据。
         因此，需要通过循环多次调用 recv 函数，将所有分段的数据依次读取到缓冲区中。
         */
-        bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        if( m_read_idx >= m_read_buf_size && ! grow_read_buf() )
+        {
+            break; //缓冲区满了，先把已有的交给解析；放不下的头部下次read会失败
+        }
+        bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, m_read_buf_size - m_read_idx, 0 );
 
         /*
         在非阻塞模式下，当调用 recv、send 等 I/O 操作函数时，
@@ -179,6 +527,10 @@ bool http_conn::read()
         {
             if( errno == EAGAIN || errno == EWOULDBLOCK )
             {
+                if( m_read_idx == 0 )
+                {
+                    release_read_buf(); //没有读到任何数据，缓冲区先还回去
+                }
                 break;
             }
             return false;
@@ -188,378 +540,2171 @@ bool http_conn::read()
             return false;
         }
 
+        if ( m_read_idx == 0 )
+        {
+            m_request_start = timer_wheel::now_ms(); //新请求的第一个字节，头部超时从这里开始算
+            m_last_active = m_request_start;
+        }
+        else
+        {
+            m_last_active = timer_wheel::now_ms();
+        }
         m_read_idx += bytes_read;
+        total += bytes_read;
+    }
+    server_stats::add( STAT_BYTES_READ, total );
+    server_stats::record( PHASE_READ, start );
+    return true;
+}
+
+//io_uring后端：数据已经由内核收进了提供的缓冲区，这里只是拷进读缓冲区
+bool http_conn::receive( const char* data, size_t length )
+{
+    uint64_t start = server_stats::now();
+    server_stats::add( STAT_BYTES_READ, length );
+    if ( length > 0 )
+    {
+        if ( m_read_idx == 0 )
+        {
+            m_request_start = timer_wheel::now_ms();
+            m_last_active = m_request_start;
+        }
+        else
+        {
+            m_last_active = timer_wheel::now_ms();
+        }
+    }
+    while ( length > 0 )
+    {
+        if( ! m_read_buf && ! acquire_read_buf() )
+        {
+            return false;
+        }
+        if( m_read_idx >= m_read_buf_size )
+        {
+            compact_read_buf();
+            if( m_read_idx >= m_read_buf_size && ! grow_read_buf() )
+            {
+                return false;
+            }
+        }
+        size_t n = m_read_buf_size - m_read_idx;
+        if ( n > length )
+        {
+            n = length;
+        }
+        memcpy( m_read_buf + m_read_idx, data, n );
+        m_read_idx += n;
+        data += n;
+        length -= n;
+    }
+    server_stats::record( PHASE_READ, start );
+    return true;
+}
+
+static int hex_value( char c )
+{
+    if ( c >= '0' && c <= '9' )
+    {
+        return c - '0';
+    }
+    if ( ( c | 0x20 ) >= 'a' && ( c | 0x20 ) <= 'f' )
+    {
+        return ( c | 0x20 ) - 'a' + 10;
+    }
+    return -1;
+}
+
+/*
+URL的路径部分就地做百分号解码，之后拼路径、查缓存、匹配路由用的都是解码后的名字；查询串原样留着。
+解码出NUL或者?的、转义不完整的、有..路径段的都不收，拼到doc_root后面不会跑出去
+*/
+static bool decode_path( char* url )
+{
+    char* out = url;
+    const char* in = url;
+    while ( *in && *in != '?' )
+    {
+        if ( *in == '%' )
+        {
+            int high = hex_value( in[1] );
+            int low = high < 0 ? -1 : hex_value( in[2] );
+            if ( low < 0 || ( high == 0 && low == 0 ) || ( high << 4 | low ) == '?' )
+            {
+                return false;
+            }
+            *out++ = high << 4 | low;
+            in += 3;
+        }
+        else
+        {
+            *out++ = *in++;
+        }
+    }
+    for ( const char* dots = url; dots + 3 <= out; ++dots )
+    {
+        if ( dots[0] == '/' && dots[1] == '.' && dots[2] == '.' && ( dots + 3 == out || dots[3] == '/' ) )
+        {
+            return false;
+        }
     }
+    memmove( out, in, strlen( in ) + 1 );
     return true;
 }
 
 //  GET /index.html HTTP/1.1
 
 //纯粹对于字符串的解析
-http_conn::HTTP_CODE http_conn::parse_request_line( char* text )
+http_conn::HTTP_CODE http_conn::parse_request_line( char* text, char* end )
 {
-    m_url = strpbrk( text, " \t" ); //匹配空格或者制表符
-    if ( ! m_url ) //如果未找到空格或制表符，说明请求行格式错误
+    m_cold->url = ( char* )find_either( text, end, ' ', '\t' ); //匹配空格或者制表符
+    if ( m_cold->url == end ) //如果未找到空格或制表符，说明请求行格式错误
     {
         return BAD_REQUEST;
     }
-    *m_url++ = '\0';
+    *m_cold->url++ = '\0';
 
     char* method = text;
     if ( strcasecmp( method, "GET" ) == 0 )
     {
-        m_method = GET;
+        m_cold->method = GET;
+    }
+    else if ( strcasecmp( method, "POST" ) == 0 )
+    {
+        m_cold->method = POST;
+    }
+    else if ( strcasecmp( method, "PUT" ) == 0 )
+    {
+        m_cold->method = PUT;
     }
     else
     {
         return BAD_REQUEST;
     }
 
-    m_url += strspn( m_url, " \t" );
-    m_version = strpbrk( m_url, " \t" );
-    if ( ! m_version )
+    m_cold->url += strspn( m_cold->url, " \t" );
+    m_cold->version = ( char* )find_either( m_cold->url, end, ' ', '\t' );
+    if ( m_cold->version == end )
     {
         return BAD_REQUEST;
     }
-    *m_version++ = '\0';
-    m_version += strspn( m_version, " \t" );
-    if ( strcasecmp( m_version, "HTTP/1.1" ) != 0 )
+    *m_cold->version++ = '\0';
+    m_cold->version += strspn( m_cold->version, " \t" );
+    if ( strcasecmp( m_cold->version, "HTTP/1.1" ) != 0 )
     {
         return BAD_REQUEST;
     }
     //检查 URL 是否以 http:// 开头，如果是则跳过该前缀。
-    if ( strncasecmp( m_url, "http://", 7 ) == 0 )
+    if ( strncasecmp( m_cold->url, "http://", 7 ) == 0 )
     {
-        m_url += 7;
-        m_url = strchr( m_url, '/' );
+        m_cold->url += 7;
+        m_cold->url = strchr( m_cold->url, '/' );
     }
-    //如果未找到 / 或 m_url 不以 / 开头，说明请求行格式错误
-    if ( ! m_url || m_url[ 0 ] != '/' )
+    //如果未找到 / 或 url 不以 / 开头，说明请求行格式错误
+    if ( ! m_cold->url || m_cold->url[ 0 ] != '/' || ! decode_path( m_cold->url ) )
     {
         return BAD_REQUEST;
     }
+    //拼到doc_root后面放不进FILENAME_LEN的直接拒绝，截断后的路径会指向另一个文件，PUT还会写到那里去
+    if ( strlen( doc_root ) + strlen( m_cold->url ) >= ( size_t )FILENAME_LEN )
+    {
+        return URI_TOO_LONG;
+    }
 /*HTTP请求行处理完毕，状态转移到头部字段的分析*/
     m_check_state = CHECK_STATE_HEADER;
     return NO_REQUEST;
 }
 
-http_conn::HTTP_CODE http_conn::parse_headers( char* text )
+http_conn::HTTP_CODE http_conn::parse_headers( char* text, char* end )
 {
     if( text[ 0 ] == '\0' )
     {
-        if ( m_method == HEAD )
-        {
-            return GET_REQUEST;
-        }
-
-        if ( m_content_length != 0 )
-        {
-            m_check_state = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
-        }
-
-        return GET_REQUEST;
-    }
-    else if ( strncasecmp( text, "Connection:", 11 ) == 0 )
-    {
-        text += 11;
-        text += strspn( text, " \t" );
-        if ( strcasecmp( text, "keep-alive" ) == 0 )
-        {
-            m_linger = true;
-        }
-    }
-    else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 )
-    {
-        text += 15;
-        text += strspn( text, " \t" );
-        m_content_length = atol( text );
+        return start_body();
     }
-    else if ( strncasecmp( text, "Host:", 5 ) == 0 )
+
+    //name: value，名字不能为空也不能有空白（"Name : v"、续行都算），值去掉首尾空白。
+    //前面的代理对这种名字的理解可能和我们不一样，放过去就是请求走私的口子
+    char* colon = ( char* )memchr( text, ':', end - text );
+    if ( ! colon || colon == text || find_either( text, colon, ' ', '\t' ) != colon || m_cold->header_count >= MAX_HEADERS )
     {
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
+        return BAD_REQUEST;
     }
-    else
+    char* value = colon + 1;
+    value += strspn( value, " \t" );
+    char* value_end = end;
+    while ( value_end > value && ( value_end[ -1 ] == ' ' || value_end[ -1 ] == '\t' ) )
     {
-        printf( "oop! unknow header %s\n", text );
+        --value_end;
     }
+    *value_end = '\0';
 
-    return NO_REQUEST;
-
-}
+    //只记位置，不拷贝
+    const char* base = m_read_buf + m_request_begin;
+    header_view& view = m_cold->headers[ m_cold->header_count++ ];
+    view.name_offset = text - base;
+    view.name_length = colon - text;
+    view.value_offset = value - base;
+    view.value_length = value_end - value;
 
-//GET请求一般没有请求体 虽然 GET 请求在技术上可以携带请求体，但是在实际使用中，
-// 一般不会在 GET 请求中携带请求体。
-http_conn::HTTP_CODE http_conn::parse_content( char* text )
-{
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
+    HEADER_ID id = lookup_header( text, colon - text );
+    if ( id == HDR_UNKNOWN )
     {
-        text[ m_content_length ] = '\0';
-        return GET_REQUEST;
+        return NO_REQUEST;
     }
+    m_cold->known_headers[ id ] = m_cold->header_count;
 
-    return NO_REQUEST; //如果还没有读取到完整的请求体，函数返回 NO_REQUEST，表示请求还不完整，需要继续读取数据。
-}
-
-/*主状态机 解析的入口函数
-负责调用不同的解析函数来解析 HTTP 请求的各个部分*/
-http_conn::HTTP_CODE http_conn::process_read()
-{
-    LINE_STATUS line_status = LINE_OK; //用于判断parse_line()是否成功获取了一行
-    HTTP_CODE ret = NO_REQUEST; //标识当前请求是否合法
-    char* text = 0;
-
-    while ( ( ( m_check_state == CHECK_STATE_CONTENT ) && ( line_status == LINE_OK  ) )
-                || ( ( line_status = parse_line() ) == LINE_OK ) )
+    switch ( id )
     {
-        text = get_line();
-        m_start_line = m_checked_idx;
-        printf( "got 1 http line: %s\n", text );
-
-        switch ( m_check_state )
+        case HDR_CONNECTION:
         {
-            case CHECK_STATE_REQUESTLINE:
-            {
-                ret = parse_request_line( text );
-                if ( ret == BAD_REQUEST )
-                {
-                    return BAD_REQUEST;
-                }
-                break;
-            }
-            case CHECK_STATE_HEADER:
+            if ( strcasecmp( value, "keep-alive" ) == 0 )
             {
-                ret = parse_headers( text );
-                if ( ret == BAD_REQUEST )
-                {
-                    return BAD_REQUEST;
-                }
-                else if ( ret == GET_REQUEST )
-                {
-                    return do_request();  //解析完header就知道要请求的文件路径了，就可以使用do_request进行映射了
-                }
-                break;
+                m_linger = true;
             }
-            case CHECK_STATE_CONTENT:
+            else if ( strcasecmp( value, "close" ) == 0 )
             {
-                ret = parse_content( text );
-                if ( ret == GET_REQUEST )
-                {
-                    return do_request();
-                }
-                line_status = LINE_OPEN;
-                break;
+                m_linger = false;
             }
-            default:
+            break;
+        }
+        case HDR_CONTENT_LENGTH:
+        {
+            //只接受十进制数字，出现两次必须一样：请求体的长度决定下一个请求从哪开始，不能含糊
+            char* digits_end = NULL;
+            errno = 0;
+            long length = strtol( value, &digits_end, 10 );
+            if ( value[0] < '0' || value[0] > '9' || *digits_end != '\0' || errno == ERANGE
+                || ( m_cold->content_length != -1 && m_cold->content_length != length ) )
             {
-                return INTERNAL_ERROR;
+                return BAD_REQUEST;
             }
+            m_cold->content_length = length;
+            break;
+        }
+        default:
+        {
+            break; //其余的头部等用到时再通过header()取
         }
     }
 
     return NO_REQUEST;
 }
 
-http_conn::HTTP_CODE http_conn::do_request()
+const char* http_conn::header( HEADER_ID id, int* length ) const
 {
-    strcpy( m_real_file, doc_root );
-    int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 ); //拼接出完整文件路径
-    if ( stat( m_real_file, &m_file_stat ) < 0 )
-    {
-        return NO_RESOURCE;
-    }
-
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) )
+    int index = m_cold->known_headers[ id ];
+    if ( index == 0 )
     {
-        return FORBIDDEN_REQUEST;
+        return NULL;
     }
-
-    if ( S_ISDIR( m_file_stat.st_mode ) )
+    const header_view& view = m_cold->headers[ index - 1 ];
+    if ( length )
     {
-        return BAD_REQUEST;
+        *length = view.value_length;
     }
-
-    int fd = open( m_real_file, O_RDONLY );
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
-    return FILE_REQUEST;
+    return m_read_buf + m_request_begin + view.value_offset;
 }
 
-void http_conn::unmap() //解除文件映射
+const char* http_conn::header( const char* name, int* length ) const
 {
-    if( m_file_address )
+    size_t name_length = strlen( name );
+    const char* base = m_read_buf + m_request_begin;
+    for ( int i = m_cold->header_count - 1; i >= 0; --i )
     {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
-    }
+        const header_view& view = m_cold->headers[ i ];
+        if ( view.name_length == name_length && strncasecmp( base + view.name_offset, name, name_length ) == 0 )
+        {
+            if ( length )
+            {
+                *length = view.value_length;
+            }
+            return base + view.value_offset;
+        }
+    }
+    return NULL;
+}
+
+http_conn::HTTP_CODE http_conn::start_body()
+{
+    if ( header( HDR_TRANSFER_ENCODING ) )
+    {
+        m_linger = false; //不支持分块的请求体，不知道它在哪结束
+        return NOT_IMPLEMENTED;
+    }
+    if ( m_cold->method == GET )
+    {
+        //GET一般不带请求体，带了就边收边丢
+        if ( m_cold->content_length > 0 )
+        {
+            m_cold->body_remaining = m_cold->content_length;
+            m_check_state = CHECK_STATE_CONTENT;
+            return NO_REQUEST;
+        }
+        return GET_REQUEST;
+    }
+
+    //POST/PUT：先看长度、路由和Expect，拒绝的请求体不收
+    const body_handler* handler = NULL;
+    for ( int i = 0; i < m_body_route_count && ! handler; ++i )
+    {
+        if ( strncmp( m_cold->url, m_body_routes[i].prefix, m_body_routes[i].prefix_length ) == 0 )
+        {
+            handler = m_body_routes[i].handler;
+        }
+    }
+    const char* expect = header( HDR_EXPECT );
+    HTTP_CODE refused = NO_REQUEST;
+    if ( m_cold->content_length < 0 )
+    {
+        refused = LENGTH_REQUIRED;
+    }
+    else if ( m_cold->content_length > m_max_body )
+    {
+        refused = PAYLOAD_TOO_LARGE;
+    }
+    else if ( ! handler )
+    {
+        refused = METHOD_NOT_ALLOWED;
+    }
+    else if ( expect && strcasecmp( expect, "100-continue" ) != 0 )
+    {
+        refused = EXPECTATION_FAILED;
+    }
+    if ( refused != NO_REQUEST )
+    {
+        m_linger = false;
+        return refused;
+    }
+
+    char real_file[ FILENAME_LEN ];
+    build_path( real_file );
+    void* state = handler->open( m_cold->url, real_file, m_cold->content_length );
+    if ( ! state )
+    {
+        m_linger = false;
+        return errno == ENOENT || errno == ENOTDIR ? NO_RESOURCE : errno == EACCES ? FORBIDDEN_REQUEST : INTERNAL_ERROR;
+    }
+    m_cold->body = handler;
+    m_cold->body_state = state;
+    m_cold->body_remaining = m_cold->content_length;
+    if ( m_cold->content_length > m_body_spill )
+    {
+        int fd = handler->spool ? handler->spool( state ) : open( m_spool_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600 );
+        if ( fd < 0 )
+        {
+            LOG_WARN( "cannot create a spool file for %s: %s", m_cold->url, strerror( errno ) );
+            m_linger = false;
+            return INTERNAL_ERROR; //处理函数由init_request里的end_body放掉
+        }
+        m_cold->body_fd = fd;
+        m_cold->body_fd_owned = ! handler->spool;
+    }
+    if ( m_cold->content_length == 0 )
+    {
+        return GET_REQUEST;
+    }
+
+    if ( expect && m_read_idx == m_checked_idx )
+    {
+        //客户端在等我们同意再发请求体。前面还有没发完的流水线响应时排在它们后面，否则直接交给内核
+        if ( m_bytes_to_send > 0 )
+        {
+            queue_static( status_100 );
+        }
+        else if ( send( m_sockfd, status_100.data, status_100.length, MSG_DONTWAIT | MSG_NOSIGNAL ) > 0 )
+        {
+            server_stats::add( STAT_BYTES_SENT, status_100.length );
+        }
+    }
+    m_check_state = CHECK_STATE_CONTENT;
+    return NO_REQUEST;
+}
+
+/*
+请求体不在读缓冲区里攒着：收到多少就交出去多少（给处理函数、写进暂存文件，GET带的直接丢掉），
+腾出来的地方接着收，后面流水线请求的字节挪上来。头部还留在缓冲区里，finish之前url和头部都还能用
+*/
+http_conn::HTTP_CODE http_conn::parse_content( char* text )
+{
+    long length = m_read_idx - m_checked_idx;
+    if ( length > m_cold->body_remaining )
+    {
+        length = m_cold->body_remaining;
+    }
+    if ( length > 0 )
+    {
+        if ( ! deliver_body( m_read_buf + m_checked_idx, length ) )
+        {
+            m_linger = false; //请求体还没收完，后面的字节没法当请求解析
+            return INTERNAL_ERROR;
+        }
+        memmove( m_read_buf + m_checked_idx, m_read_buf + m_checked_idx + length, m_read_idx - m_checked_idx - length );
+        m_read_idx -= length;
+        m_cold->body_remaining -= length;
+    }
+
+    return m_cold->body_remaining == 0 ? GET_REQUEST : NO_REQUEST; //还没收完时返回 NO_REQUEST，等下一次数据到来
+}
+
+bool http_conn::deliver_body( const char* data, long length )
+{
+    if ( ! m_cold->body )
+    {
+        return true;
+    }
+    if ( m_cold->body_fd == -1 )
+    {
+        return m_cold->body->consume( m_cold->body_state, data, length ) >= 0;
+    }
+    //和头部一起收进读缓冲区的那部分请求体（io_uring后端是全部）写进暂存文件，接在splice搬进去的数据后面
+    while ( length > 0 )
+    {
+        ssize_t n = ::write( m_cold->body_fd, data, length );
+        if ( n < 0 )
+        {
+            LOG_WARN( "writing the body of %s to its spool file failed: %s", m_cold->url, strerror( errno ) );
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool http_conn::splice_body()
+{
+    if ( m_cold->body_pipe[0] == -1 && pipe2( m_cold->body_pipe, O_NONBLOCK | O_CLOEXEC ) < 0 )
+    {
+        m_cold->body_pipe[0] = -1;
+        m_cold->body_pipe[1] = -1;
+        return false;
+    }
+    long total = 0;
+    while ( m_cold->body_remaining > 0 )
+    {
+        size_t want = m_cold->body_remaining < SPLICE_CHUNK ? m_cold->body_remaining : SPLICE_CHUNK;
+        ssize_t n = splice( m_sockfd, NULL, m_cold->body_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if ( n == -1 )
+        {
+            if ( errno == EAGAIN )
+            {
+                break;
+            }
+            return false;
+        }
+        if ( n == 0 )
+        {
+            return false; //对端在请求体中途关闭
+        }
+        //刚搬进管道的n字节全部送进文件，管道每次都清空，socket那头就不会因为管道满而停下
+        for ( ssize_t left = n; left > 0; )
+        {
+            ssize_t moved = splice( m_cold->body_pipe[0], NULL, m_cold->body_fd, NULL, left, SPLICE_F_MOVE );
+            if ( moved <= 0 )
+            {
+                LOG_WARN( "splicing the body of %s to its spool file failed: %s", m_cold->url, strerror( errno ) );
+                return false;
+            }
+            left -= moved;
+        }
+        m_cold->body_remaining -= n;
+        total += n;
+    }
+    if ( total > 0 )
+    {
+        m_last_active = timer_wheel::now_ms();
+        server_stats::add( STAT_BYTES_READ, total );
+    }
+    return true;
+}
+
+http_conn::HTTP_CODE http_conn::finish_body()
+{
+    int status = m_cold->body->finish( m_cold->body_state, m_cold->body_fd );
+    end_body();
+    if ( status != 200 && status != 201 )
+    {
+        return INTERNAL_ERROR;
+    }
+    m_cold->body_status = status;
+    return BODY_REQUEST;
+}
+
+void http_conn::end_body()
+{
+    if ( m_cold->body )
+    {
+        m_cold->body->close( m_cold->body_state );
+        m_cold->body = 0;
+        m_cold->body_state = 0;
+    }
+    if ( m_cold->body_fd != -1 )
+    {
+        if ( m_cold->body_fd_owned )
+        {
+            close( m_cold->body_fd ); //匿名临时文件，关掉就没了
+        }
+        m_cold->body_fd = -1;
+    }
+    if ( m_cold->body_pipe[0] != -1 )
+    {
+        close( m_cold->body_pipe[0] );
+        close( m_cold->body_pipe[1] );
+        m_cold->body_pipe[0] = -1;
+        m_cold->body_pipe[1] = -1;
+    }
+}
+
+bool http_conn::add_body_route( const char* prefix, const body_handler* handler )
+{
+    int length = strlen( prefix );
+    if ( m_body_route_count >= MAX_BODY_ROUTES || prefix[0] != '/' || length >= ( int )sizeof( m_body_routes[0].prefix ) )
+    {
+        return false;
+    }
+    body_route& route = m_body_routes[ m_body_route_count ];
+    memcpy( route.prefix, prefix, length + 1 );
+    route.prefix_length = length;
+    route.handler = handler;
+    ++m_body_route_count;
+    return true;
+}
+
+/*主状态机 解析的入口函数
+负责调用不同的解析函数来解析 HTTP 请求的各个部分*/
+http_conn::HTTP_CODE http_conn::process_read()
+{
+    LINE_STATUS line_status = LINE_OK; //用于判断parse_line()是否成功获取了一行
+    HTTP_CODE ret = NO_REQUEST; //标识当前请求是否合法
+    char* text = 0;
+
+    while ( ( ( m_check_state == CHECK_STATE_CONTENT ) && ( line_status == LINE_OK  ) )
+                || ( ( line_status = parse_line() ) == LINE_OK ) )
+    {
+        text = get_line();
+        m_start_line = m_checked_idx;
+        LOG_DEBUG( "got 1 http line: %s", text );
+
+        switch ( m_check_state )
+        {
+            case CHECK_STATE_REQUESTLINE:
+            {
+                //parse_line刚把这一行末尾的\r\n换成了\0\0，行尾就在m_checked_idx前两个字节
+                ret = parse_request_line( text, m_read_buf + m_checked_idx - 2 );
+                if ( ret == BAD_REQUEST || ret == URI_TOO_LONG )
+                {
+                    return ret;
+                }
+                break;
+            }
+            case CHECK_STATE_HEADER:
+            {
+                ret = parse_headers( text, m_read_buf + m_checked_idx - 2 );
+                if ( ret == GET_REQUEST )
+                {
+                    return handle_request();  //解析完header就知道要请求的文件路径了，就可以使用do_request进行映射了
+                }
+                else if ( ret != NO_REQUEST )
+                {
+                    return ret; //格式错误，或者在收请求体之前就拒绝了
+                }
+                break;
+            }
+            case CHECK_STATE_CONTENT:
+            {
+                ret = parse_content( text );
+                if ( ret == GET_REQUEST )
+                {
+                    return handle_request();
+                }
+                else if ( ret != NO_REQUEST )
+                {
+                    return ret;
+                }
+                line_status = LINE_OPEN;
+                break;
+            }
+            default:
+            {
+                return INTERNAL_ERROR;
+            }
+        }
+    }
+
+    return NO_REQUEST;
+}
+
+http_conn::HTTP_CODE http_conn::handle_request()
+{
+    uint64_t parsed = server_stats::record( PHASE_PARSE, m_cold->parse_start );
+    HTTP_CODE ret = do_request();
+    server_stats::record( PHASE_REQUEST, parsed );
+    return ret;
+}
+
+void http_conn::build_path( char* real_file )
+{
+    strcpy( real_file, doc_root );
+    int len = strlen( doc_root );
+    strcpy( real_file + len, m_cold->url ); //拼接出完整文件路径，长度在parse_request_line里检查过
+}
+
+http_conn::HTTP_CODE http_conn::do_request()
+{
+    if ( m_cold->body )
+    {
+        return finish_body(); //POST/PUT的请求体收完了，由处理函数决定结果
+    }
+    if ( m_stats_path )
+    {
+        //保留的统计URL，可以带?format=prometheus
+        int len = strlen( m_stats_path );
+        if ( strncmp( m_cold->url, m_stats_path, len ) == 0 && ( m_cold->url[ len ] == '\0' || m_cold->url[ len ] == '?' ) )
+        {
+            m_cold->stats_prometheus = m_cold->url[ len ] == '?' && strstr( m_cold->url + len, "format=prometheus" ) != NULL;
+            return render_stats();
+        }
+    }
+
+    char real_file[ FILENAME_LEN ]; //只在这次请求里用，不必占着连接对象的空间
+    for ( int i = 0; i < m_stream_route_count; ++i )
+    {
+        //注册的流式路由按前缀匹配，先注册的优先
+        if ( strncmp( m_cold->url, m_stream_routes[i].prefix, m_stream_routes[i].prefix_length ) == 0 )
+        {
+            build_path( real_file );
+            return start_stream( m_stream_routes[i].handler, real_file );
+        }
+    }
+
+    if ( m_file_cache )
+    {
+        //命中缓存时不用拼路径，也没有stat/open/mmap/close，只有一次分片加锁和引用计数加一
+        if ( m_file_cache->acquire( m_cold->url, &m_cold->entry, &m_cold->file_stat ) < 0 )
+        {
+            return NO_RESOURCE;
+        }
+    }
+    else
+    {
+        build_path( real_file );
+        if ( stat( real_file, &m_cold->file_stat ) < 0 )
+        {
+            return NO_RESOURCE;
+        }
+    }
+
+    if ( ! ( m_cold->file_stat.st_mode & S_IROTH ) )
+    {
+        return FORBIDDEN_REQUEST;
+    }
+
+    if ( S_ISDIR( m_cold->file_stat.st_mode ) )
+    {
+        if ( ! m_autoindex )
+        {
+            return BAD_REQUEST;
+        }
+        if ( m_file_cache )
+        {
+            build_path( real_file ); //缓存不收目录，命中缓存时没拼过路径
+        }
+        return start_stream( &autoindex_handler, real_file );
+    }
+
+    if ( m_cold->file_stat.st_size == 0 )
+    {
+        return FILE_REQUEST; //空文件不需要映射也不需要打开，也没有可以取的范围
+    }
+
+    negotiate_encoding( real_file );
+
+    //条件请求只需要stat（或者缓存命中），在打开、映射文件之前判断
+    if ( not_modified() )
+    {
+        return NOT_MODIFIED;
+    }
+
+    //Range在open/mmap之前就定下来，之后只打开、映射请求的那部分
+    m_cold->range_count = 0;
+    const char* range = header( HDR_RANGE );
+    if ( range && if_range_matches() )
+    {
+        int count = parse_range( range );
+        if ( count == 0 )
+        {
+            return RANGE_NOT_SATISFIABLE;
+        }
+        //多段响应的分段头放不进这一批的写缓冲区时，按协议允许的做法忽略Range
+        if ( count > 1 && ! multipart_fits( count ) )
+        {
+            count = 0;
+        }
+        m_cold->range_count = count > 0 ? count : 0;
+    }
+
+    //要发送的文件范围[begin, end)，多段时是能盖住所有段的最小区间
+    off_t begin = 0;
+    off_t end = m_cold->file_stat.st_size;
+    if ( m_cold->range_count > 0 )
+    {
+        begin = m_cold->ranges[0].first;
+        end = m_cold->ranges[0].last + 1;
+        for ( int i = 1; i < m_cold->range_count; ++i )
+        {
+            begin = m_cold->ranges[i].first < begin ? m_cold->ranges[i].first : begin;
+            end = m_cold->ranges[i].last + 1 > end ? m_cold->ranges[i].last + 1 : end;
+        }
+    }
+    if ( m_cold->compressed )
+    {
+        //压缩数据本来就在内存里，不论哪种模式都用iovec发
+        m_cold->file_address = m_cold->compressed->data;
+        m_cold->map_offset = 0;
+        m_cold->map_length = m_cold->compressed->length;
+        return FILE_REQUEST;
+    }
+    //sendfile一次只能发一段连续的文件，多段响应的各段之间夹着分段头，要走映射
+    bool need_map = ! m_use_sendfile || m_cold->range_count > 1;
+
+    if ( m_file_cache )
+    {
+        if ( ! m_cold->entry )
+        {
+            return INTERNAL_ERROR; //普通可读文件却没拿到条目，说明open/mmap失败了
+        }
+        //fd和映射都归缓存所有，这里只是借用，unmap时release
+        if ( ! need_map )
+        {
+            m_file_fd = m_cold->entry->fd;
+            m_file_offset = 0;
+            return FILE_REQUEST;
+        }
+        if ( m_cold->entry->address )
+        {
+            m_cold->file_address = m_cold->entry->address;
+            m_cold->map_offset = 0;
+            m_cold->map_length = m_cold->file_stat.st_size;
+            return FILE_REQUEST;
+        }
+        //只缓存了fd（sendfile模式）的多段请求：自己映射需要的范围，映射不依赖fd，条目可以马上还回去
+        bool mapped = map_file( m_cold->entry->fd, begin, end );
+        m_file_cache->release( m_cold->entry );
+        m_cold->entry = 0;
+        return mapped ? FILE_REQUEST : INTERNAL_ERROR;
+    }
+
+    int fd = open( real_file, O_RDONLY );
+    if ( fd < 0 )
+    {
+        return INTERNAL_ERROR;
+    }
+    if ( ! need_map )
+    {
+        //保留fd，文件体在write()中用sendfile发送，省掉mmap/munmap的页表开销和事件线程上的缺页
+        m_file_fd = fd;
+        m_file_offset = 0;
+        return FILE_REQUEST;
+    }
+    bool mapped = map_file( fd, begin, end );
+    close( fd );
+    return mapped ? FILE_REQUEST : INTERNAL_ERROR;
+}
+
+/*
+把各线程的统计加起来渲染好，放进一块匿名映射里，之后和文件映射一样由iovec发送、发完munmap，
+发送队列不用为它多一种所有权。统计请求很少，多一次mmap无所谓
+*/
+http_conn::HTTP_CODE http_conn::render_stats()
+{
+    stat_value extra[ 12 ];
+    int count = 0;
+    extra[ count++ ] = { "connections_active", "Open client connections.", ( unsigned long )m_user_count.load( std::memory_order_relaxed ), false };
+    unsigned long reserved = 0, in_use = 0;
+    for ( int i = 0; i < cpu_topology::node_count(); ++i )
+    {
+        reserved += m_buffer_pools[i].bytes_reserved();
+        in_use += m_buffer_pools[i].bytes_in_use();
+    }
+    extra[ count++ ] = { "buffer_pool_bytes_reserved", "Bytes the buffer pool has taken from the system.", reserved, false };
+    extra[ count++ ] = { "buffer_pool_bytes_in_use", "Bytes of pooled buffers lent to connections.", in_use, false };
+    extra[ count++ ] = { "log_records_dropped", "Log records dropped because a thread's log ring was full.", logger::dropped(), true };
+    if ( m_file_cache )
+    {
+        extra[ count++ ] = { "file_cache_hits", "Open file cache hits.", m_file_cache->hits(), true };
+        extra[ count++ ] = { "file_cache_misses", "Open file cache misses.", m_file_cache->misses(), true };
+        extra[ count++ ] = { "file_cache_invalidations", "Open file cache entries invalidated by inotify.", m_file_cache->invalidations(), true };
+        extra[ count++ ] = { "file_cache_evictions", "Open file cache entries evicted to make room.", m_file_cache->evictions(), true };
+    }
+    if ( m_gzip_cache )
+    {
+        extra[ count++ ] = { "gzip_cache_hits", "Responses served from the gzip cache.", m_gzip_cache->hits(), true };
+        extra[ count++ ] = { "gzip_cache_compressions", "Files compressed into the gzip cache.", m_gzip_cache->compressions(), true };
+        extra[ count++ ] = { "gzip_cache_evictions", "Entries evicted from the gzip cache.", m_gzip_cache->evictions(), true };
+    }
+    std::string body;
+    server_stats::render( &body, m_cold->stats_prometheus, extra, count );
+
+    char* address = ( char* )mmap( 0, body.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( address == MAP_FAILED )
+    {
+        return INTERNAL_ERROR;
+    }
+    memcpy( address, body.data(), body.size() );
+    m_cold->file_address = address;
+    m_cold->map_offset = 0;
+    m_cold->map_length = body.size();
+    return STATS_REQUEST;
+}
+
+//映射文件的[begin, end)，起点向下对齐到页；10GB的文件取一小段也只映射这一小段
+bool http_conn::map_file( int fd, off_t begin, off_t end )
+{
+    static const off_t page_size = sysconf( _SC_PAGESIZE );
+    off_t offset = begin & ~( page_size - 1 );
+    size_t length = end - offset;
+    char* address = ( char* )mmap( 0, length, PROT_READ, MAP_PRIVATE, fd, offset );
+    if ( address == MAP_FAILED )
+    {
+        return false;
+    }
+    m_cold->file_address = address;
+    m_cold->map_offset = offset;
+    m_cold->map_length = length;
+    return true;
+}
+
+//文本类的资源才值得压缩，图片、视频、压缩包本身已经压过了
+static bool compressible( const char* url )
+{
+    static const char* const extensions[] = { "html", "htm", "css", "js", "mjs", "json", "svg", "txt", "xml", "map", "wasm" };
+    const char* dot = strrchr( url, '.' );
+    if ( ! dot || strchr( dot, '/' ) )
+    {
+        return false;
+    }
+    for ( size_t i = 0; i < sizeof( extensions ) / sizeof( extensions[0] ); ++i )
+    {
+        if ( strcasecmp( dot + 1, extensions[i] ) == 0 )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//q=0、q=0.0之类表示明确拒绝这种编码
+static bool q_is_zero( const char* q )
+{
+    if ( *q != '0' )
+    {
+        return false;
+    }
+    ++q;
+    if ( *q == '.' )
+    {
+        ++q;
+        while ( *q == '0' )
+        {
+            ++q;
+        }
+    }
+    return ! ( *q >= '1' && *q <= '9' );
+}
+
+//Accept-Encoding: gzip, br;q=0.8, *;q=0 → 可接受编码的位掩码。只区分接受和拒绝，不按q值排序，br优先
+static int parse_accept_encoding( const char* value )
+{
+    int accepted = 0;
+    int rejected = 0;
+    bool wildcard = false;
+    const char* p = value;
+    while ( *p )
+    {
+        while ( *p == ' ' || *p == '\t' || *p == ',' )
+        {
+            ++p;
+        }
+        const char* token = p;
+        while ( *p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t' )
+        {
+            ++p;
+        }
+        size_t length = p - token;
+        bool zero = false;
+        while ( *p && *p != ',' )
+        {
+            if ( *p == ';' )
+            {
+                ++p;
+                while ( *p == ' ' || *p == '\t' )
+                {
+                    ++p;
+                }
+                if ( ( *p == 'q' || *p == 'Q' ) && p[1] == '=' )
+                {
+                    zero = q_is_zero( p + 2 );
+                }
+            }
+            else
+            {
+                ++p;
+            }
+        }
+        int coding = 0;
+        if ( ( length == 4 && strncasecmp( token, "gzip", 4 ) == 0 ) || ( length == 6 && strncasecmp( token, "x-gzip", 6 ) == 0 ) )
+        {
+            coding = http_conn::ENCODING_GZIP;
+        }
+        else if ( length == 2 && strncasecmp( token, "br", 2 ) == 0 )
+        {
+            coding = http_conn::ENCODING_BR;
+        }
+        else if ( length == 1 && *token == '*' )
+        {
+            wildcard = ! zero;
+            continue;
+        }
+        if ( zero )
+        {
+            rejected |= coding;
+        }
+        else
+        {
+            accepted |= coding;
+        }
+    }
+    if ( wildcard )
+    {
+        accepted |= http_conn::ENCODING_GZIP | http_conn::ENCODING_BR;
+    }
+    return accepted & ~rejected;
+}
+
+//按Accept-Encoding选要发的表示：先找预先压缩好的.br/.gz兄弟文件，再找后台压缩好的gzip，都没有就发原文件
+void http_conn::negotiate_encoding( char* real_file )
+{
+    if ( ( ! m_precompressed && ! m_gzip_cache ) || ! compressible( m_cold->url ) )
+    {
+        return;
+    }
+    m_cold->vary = true; //不管这次选了哪个，同一个URL会按Accept-Encoding返回不同的内容，共享缓存要区分
+    const char* value = header( HDR_ACCEPT_ENCODING );
+    int accepted = value ? parse_accept_encoding( value ) : 0;
+    if ( m_precompressed )
+    {
+        if ( ( accepted & ENCODING_BR ) && open_sibling( real_file, ".br" ) )
+        {
+            m_cold->content_encoding = ENCODING_BR;
+            return;
+        }
+        if ( ( accepted & ENCODING_GZIP ) && open_sibling( real_file, ".gz" ) )
+        {
+            m_cold->content_encoding = ENCODING_GZIP;
+            return;
+        }
+    }
+    if ( m_gzip_cache && ( accepted & ENCODING_GZIP ) )
+    {
+        //只查表计数，没压缩好就先发原文件，压缩由后台线程做
+        gzip_entry* entry = m_gzip_cache->acquire( m_cold->url, m_cold->file_stat );
+        if ( entry )
+        {
+            release_file(); //不再需要原文件的缓存条目
+            m_cold->compressed = entry;
+            m_cold->file_stat.st_size = entry->length; //修改时间等仍是原文件的
+            m_cold->content_encoding = ENCODING_GZIP;
+        }
+    }
+}
+
+//改用url加后缀的兄弟文件，它必须是非空的可读普通文件；成功时file_stat换成它的
+bool http_conn::open_sibling( char* real_file, const char* suffix )
+{
+    if ( m_file_cache )
+    {
+        char url[ FILENAME_LEN ];
+        if ( snprintf( url, sizeof( url ), "%s%s", m_cold->url, suffix ) >= ( int )sizeof( url ) )
+        {
+            return false;
+        }
+        file_entry* entry = 0;
+        struct stat st;
+        if ( m_file_cache->acquire( url, &entry, &st ) < 0 || ! entry )
+        {
+            return false;
+        }
+        if ( st.st_size == 0 )
+        {
+            m_file_cache->release( entry );
+            return false;
+        }
+        release_file();
+        m_cold->entry = entry;
+        m_cold->file_stat = st;
+        return true;
+    }
+    size_t length = strlen( real_file );
+    size_t suffix_length = strlen( suffix );
+    if ( length + suffix_length >= ( size_t )FILENAME_LEN )
+    {
+        return false;
+    }
+    struct stat st;
+    memcpy( real_file + length, suffix, suffix_length + 1 );
+    if ( stat( real_file, &st ) == 0 && S_ISREG( st.st_mode ) && ( st.st_mode & S_IROTH ) && st.st_size > 0 )
+    {
+        m_cold->file_stat = st;
+        return true;
+    }
+    real_file[ length ] = '\0';
+    return false;
+}
+
+//If-Range的校验器和当前文件一致时才按Range返回部分内容，否则返回整个新文件
+bool http_conn::if_range_matches() const
+{
+    const char* value = header( HDR_IF_RANGE );
+    if ( ! value )
+    {
+        return true;
+    }
+    if ( value[0] == 'W' && value[1] == '/' )
+    {
+        return false; //If-Range要求强比较，弱标签永远不匹配
+    }
+    if ( value[0] == '"' )
+    {
+        char etag[ ETAG_LENGTH ];
+        int length = format_etag( etag );
+        return strlen( value ) == ( size_t )length && memcmp( value, etag, length ) == 0;
+    }
+    //日期必须和Last-Modified完全相同
+    time_t date = parse_http_date( value );
+    return date != -1 && date == m_cold->file_stat.st_mtime;
+}
+
+static int put_hex( unsigned long value, char* out )
+{
+    static const char hex[] = "0123456789abcdef";
+    char digits[ 16 ];
+    int count = 0;
+    do
+    {
+        digits[ count++ ] = hex[ value & 15 ];
+        value >>= 4;
+    } while ( value );
+    for ( int i = 0; i < count; ++i )
+    {
+        out[i] = digits[ count - 1 - i ];
+    }
+    return count;
+}
+
+//强ETag：inode、大小、修改时间（到纳秒）都相同才是同一个表示；压缩的表示再加上编码，和原文件区分开
+int http_conn::format_etag( char* out ) const
+{
+    char* p = out;
+    *p++ = '"';
+    p += put_hex( m_cold->file_stat.st_ino, p );
+    *p++ = '-';
+    p += put_hex( m_cold->file_stat.st_size, p );
+    *p++ = '-';
+    p += put_hex( m_cold->file_stat.st_mtim.tv_sec, p );
+    *p++ = '.';
+    p += put_hex( m_cold->file_stat.st_mtim.tv_nsec, p );
+    if ( m_cold->content_encoding == ENCODING_GZIP )
+    {
+        memcpy( p, "-gz", 3 );
+        p += 3;
+    }
+    else if ( m_cold->content_encoding == ENCODING_BR )
+    {
+        memcpy( p, "-br", 3 );
+        p += 3;
+    }
+    *p++ = '"';
+    return p - out;
+}
+
+//If-None-Match里的实体标签列表，用弱比较：W/前缀不影响匹配
+static bool etag_listed( const char* value, const char* etag, int length )
+{
+    const char* p = value;
+    while ( *p )
+    {
+        while ( *p == ' ' || *p == '\t' || *p == ',' )
+        {
+            ++p;
+        }
+        if ( *p == '*' )
+        {
+            return true;
+        }
+        if ( p[0] == 'W' && p[1] == '/' )
+        {
+            p += 2;
+        }
+        if ( *p != '"' )
+        {
+            return false; //格式不对，当作不匹配
+        }
+        const char* close = strchr( p + 1, '"' );
+        if ( ! close )
+        {
+            return false;
+        }
+        if ( close + 1 - p == length && memcmp( p, etag, length ) == 0 )
+        {
+            return true;
+        }
+        p = close + 1;
+    }
+    return false;
+}
+
+//有If-None-Match时只看它，If-Modified-Since被忽略；日期精确到秒
+bool http_conn::not_modified() const
+{
+    const char* value = header( HDR_IF_NONE_MATCH );
+    if ( value )
+    {
+        char etag[ ETAG_LENGTH ];
+        int length = format_etag( etag );
+        return etag_listed( value, etag, length );
+    }
+    value = header( HDR_IF_MODIFIED_SINCE );
+    if ( value )
+    {
+        time_t date = parse_http_date( value );
+        return date != -1 && m_cold->file_stat.st_mtime <= date;
+    }
+    return false;
+}
+
+bool http_conn::add_cache_rule( const char* spec )
+{
+    const char* equal = strchr( spec, '=' );
+    if ( ! equal || m_cache_rule_count >= MAX_CACHE_RULES || spec[0] != '/' )
+    {
+        return false;
+    }
+    cache_rule& rule = m_cache_rules[ m_cache_rule_count ];
+    rule.prefix_length = equal - spec;
+    rule.value_length = strlen( equal + 1 );
+    if ( rule.prefix_length >= ( int )sizeof( rule.prefix ) || rule.value_length == 0
+        || rule.value_length >= ( int )sizeof( rule.value ) || strpbrk( equal + 1, "\r\n" ) )
+    {
+        return false;
+    }
+    memcpy( rule.prefix, spec, rule.prefix_length );
+    memcpy( rule.value, equal + 1, rule.value_length );
+    ++m_cache_rule_count;
+    return true;
+}
+
+const cache_rule* http_conn::find_cache_rule() const
+{
+    const cache_rule* best = NULL;
+    for ( int i = 0; i < m_cache_rule_count; ++i )
+    {
+        const cache_rule& rule = m_cache_rules[i];
+        if ( ( ! best || rule.prefix_length > best->prefix_length )
+            && strncmp( m_cold->url, rule.prefix, rule.prefix_length ) == 0 )
+        {
+            best = &rule;
+        }
+    }
+    return best;
+}
+
+//读一个非负十进制数，*p停在数字后面；没有数字或者溢出时返回false
+static bool parse_offset( const char** p, off_t* value )
+{
+    const char* s = *p;
+    off_t v = 0;
+    while ( *s >= '0' && *s <= '9' )
+    {
+        if ( v > ( ( ( off_t )1 << 62 ) - 1 ) / 10 )
+        {
+            return false;
+        }
+        v = v * 10 + ( *s - '0' );
+        ++s;
+    }
+    if ( s == *p )
+    {
+        return false;
+    }
+    *p = s;
+    *value = v;
+    return true;
+}
+
+//解析 bytes=first-last, first-, -suffix 组成的列表，可满足的段按文件大小截断后存进ranges
+int http_conn::parse_range( const char* value )
+{
+    if ( strncasecmp( value, "bytes=", 6 ) != 0 )
+    {
+        return -1; //不认识的单位，忽略
+    }
+    const char* p = value + 6;
+    off_t size = m_cold->file_stat.st_size;
+    int specs = 0;
+    int count = 0;
+    while ( true )
+    {
+        while ( *p == ' ' || *p == '\t' || *p == ',' )
+        {
+            ++p;
+        }
+        if ( *p == '\0' )
+        {
+            break;
+        }
+        if ( ++specs > MAX_RANGES )
+        {
+            return -1;
+        }
+        off_t first = 0;
+        off_t last = size - 1;
+        bool satisfiable = true;
+        if ( *p == '-' )
+        {
+            //最后suffix个字节
+            off_t suffix = 0;
+            ++p;
+            if ( ! parse_offset( &p, &suffix ) )
+            {
+                return -1;
+            }
+            satisfiable = suffix > 0;
+            first = suffix < size ? size - suffix : 0;
+        }
+        else
+        {
+            if ( ! parse_offset( &p, &first ) || *p++ != '-' )
+            {
+                return -1;
+            }
+            if ( *p >= '0' && *p <= '9' )
+            {
+                if ( ! parse_offset( &p, &last ) || last < first )
+                {
+                    return -1;
+                }
+                last = last < size - 1 ? last : size - 1;
+            }
+            satisfiable = first < size;
+        }
+        while ( *p == ' ' || *p == '\t' )
+        {
+            ++p;
+        }
+        if ( *p != ',' && *p != '\0' )
+        {
+            return -1;
+        }
+        if ( satisfiable )
+        {
+            m_cold->ranges[ count ].first = first;
+            m_cold->ranges[ count ].last = last;
+            ++count;
+        }
+    }
+    return specs > 0 ? count : -1;
+}
+
+//多段响应要占的iovec和写缓冲区：每段一个分段头一个文件段，最后一个结束分隔符，再加上响应头
+bool http_conn::multipart_fits( int count ) const
+{
+    int iv_count = m_write_block ? m_iv_count : 0;
+    int write_idx = m_write_block ? m_write_idx : 0;
+    if ( iv_count + 2 * count + 1 > 2 * MAX_PIPELINE )
+    {
+        return false;
+    }
+    int bytes = PIPELINE_WRITE_RESERVE + MULTIPART_CLOSE_LENGTH; //状态行和响应头按一个普通响应的预留算
+    for ( int i = 0; i < count; ++i )
+    {
+        bytes += part_header_length( m_cold->ranges[i] );
+    }
+    return bytes <= WRITE_BUFFER_SIZE - 1 - write_idx;
+}
+
+void http_conn::unmap() //解除所有已排队响应的文件映射，sendfile模式下关闭文件
+{
+    if ( m_body_count > 0 )
+    {
+        release_bodies( m_write_block->bodies, m_body_count );
+        m_body_count = 0;
+    }
+    release_file();
+}
+
+void http_conn::release_bodies( body_ref* bodies, int count )
+{
+    for ( int i = 0; i < count; ++i )
+    {
+        if ( bodies[i].entry )
+        {
+            m_file_cache->release( bodies[i].entry );
+        }
+        else if ( bodies[i].compressed )
+        {
+            m_gzip_cache->release( bodies[i].compressed );
+        }
+        else
+        {
+            munmap( bodies[i].address, bodies[i].length );
+        }
+    }
+}
+
+//批次发完了但还有零拷贝没确认：文件体交给pinned保管，收到全部完成通知时再放掉
+void http_conn::pin_bodies()
+{
+    for ( int i = 0; i < m_body_count; ++i )
+    {
+        m_cold->pinned[ m_cold->pinned_count++ ] = m_write_block->bodies[i];
+    }
+    m_body_count = 0;
+}
+
+//释放当前请求在do_request里拿到、还没排进发送队列的文件
+void http_conn::release_file()
+{
+    if( m_cold->entry )
+    {
+        //映射和fd属于缓存条目，只放掉引用
+        m_file_cache->release( m_cold->entry );
+        m_cold->entry = 0;
+        m_cold->file_address = 0;
+        m_file_fd = -1;
+    }
+    if( m_cold->compressed )
+    {
+        m_gzip_cache->release( m_cold->compressed );
+        m_cold->compressed = 0;
+        m_cold->file_address = 0;
+    }
+    if( m_cold->file_address )
+    {
+        munmap( m_cold->file_address, m_cold->map_length );
+        m_cold->file_address = 0;
+    }
+    if( m_file_fd != -1 )
+    {
+        close( m_file_fd );
+        m_file_fd = -1;
+    }
+}
+
+//把m_write_buf里[start, m_write_idx)这段排进iovec，和前一段相邻时直接合并
+void http_conn::queue_write_buf( int start )
+{
+    int len = m_write_idx - start;
+    if ( len <= 0 )
+    {
+        return;
+    }
+    if ( m_iv_count > 0 && ( char* )m_iv[ m_iv_count - 1 ].iov_base + m_iv[ m_iv_count - 1 ].iov_len == m_write_buf + start )
+    {
+        m_iv[ m_iv_count - 1 ].iov_len += len;
+    }
+    else
+    {
+        m_iv[ m_iv_count ].iov_base = m_write_buf + start;
+        m_iv[ m_iv_count ].iov_len = len;
+        ++m_iv_count;
+    }
+    m_bytes_to_send += len;
+}
+
+//排进当前文件的[first, last]：sendfile模式下记下偏移，由write()/后端发送；否则iovec指向映射里的这一段
+void http_conn::queue_file( off_t first, off_t last )
+{
+    size_t length = last - first + 1;
+    if ( m_file_fd != -1 )
+    {
+        //文件体不进iovec，内存里的数据发完后由sendfile发送，所以它必须是这一批的最后一个响应
+        m_file_offset = first;
+        m_file_end = last + 1;
+    }
+    else
+    {
+        m_iv[ m_iv_count ].iov_base = m_cold->file_address + ( first - m_cold->map_offset );
+        m_iv[ m_iv_count ].iov_len = length;
+        if ( ! m_cold->compressed )
+        {
+            m_write_block->mapped_iovs |= 1u << m_iv_count;
+        }
+        ++m_iv_count;
+    }
+    m_bytes_to_send += length;
+}
+
+//映射的所有权转给发送队列，file_address/entry留给下一个流水线请求；sendfile的fd发完才关
+void http_conn::hand_over_file()
+{
+    if ( ! m_cold->file_address )
+    {
+        return;
+    }
+    m_write_block->bodies[ m_body_count ].address = m_cold->file_address;
+    m_write_block->bodies[ m_body_count ].length = m_cold->map_length;
+    m_write_block->bodies[ m_body_count ].entry = m_cold->entry;
+    m_write_block->bodies[ m_body_count ].compressed = m_cold->compressed;
+    ++m_body_count;
+    m_cold->file_address = 0;
+    m_cold->entry = 0;
+    m_cold->compressed = 0;
+}
+
+//调整iovec，下一次writev跳过已经发出去的部分
+void http_conn::advance_iov( size_t bytes )
+{
+    while ( bytes > 0 && m_iv_idx < m_iv_count )
+    {
+        struct iovec& iv = m_iv[ m_iv_idx ];
+        if ( bytes >= iv.iov_len )
+        {
+            bytes -= iv.iov_len;
+            iv.iov_len = 0;
+            ++m_iv_idx;
+        }
+        else
+        {
+            iv.iov_base = ( char* )iv.iov_base + bytes;
+            iv.iov_len -= bytes;
+            bytes = 0;
+        }
+    }
+    while ( m_iv_idx < m_iv_count && m_iv[ m_iv_idx ].iov_len == 0 )
+    {
+        ++m_iv_idx;
+    }
 }
 
 bool http_conn::write()
 {
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
-    if ( bytes_to_send == 0 ) //这是什么时候才会发生？
+    ssize_t temp = 0;
+    if ( m_bytes_to_send == 0 ) //这是什么时候才会发生？
     {
+        finish_response(); //重新初始化这个连接的写状态
         modfd( m_epollfd, m_sockfd, EPOLLIN );
         //将套接字的事件类型修改为 EPOLLIN，表示监听可读事件。
-        init(); //重新初始化这个连接
         return true;
     }
 
     while( 1 )
     {
-        temp = writev( m_sockfd, m_iv, m_iv_count );
-        if ( temp <= -1 )
+        bool from_iov = m_iv_idx < m_iv_count;
+        if ( from_iov )
+        {
+            //后面还要sendfile文件体时带上MSG_MORE，内核会把头部和文件的第一段合并成满载的报文再发
+            struct msghdr msg;
+            memset( &msg, 0, sizeof( msg ) );
+            msg.msg_iov = m_iv + m_iv_idx;
+            msg.msg_iovlen = m_iv_count - m_iv_idx;
+            int flags = m_file_fd != -1 ? MSG_MORE : 0;
+            bool zerocopy = false;
+            if ( m_zerocopy_threshold > 0 )
+            {
+                msg.msg_iovlen = next_send_span( &zerocopy );
+                if ( m_iv_idx + ( int )msg.msg_iovlen < m_iv_count )
+                {
+                    flags |= MSG_MORE; //一批里分几次发，后面还有数据
+                }
+            }
+            temp = sendmsg( m_sockfd, &msg, flags | ( zerocopy ? MSG_ZEROCOPY : 0 ) );
+            if ( zerocopy && temp > 0 )
+            {
+                ++m_cold->zerocopy_issued;
+                m_cold->zerocopy_batch = true;
+                server_stats::add( STAT_ZEROCOPY_BYTES, temp );
+            }
+            else if ( zerocopy && temp < 0 && errno == ENOBUFS )
+            {
+                temp = sendmsg( m_sockfd, &msg, flags ); //没确认的零拷贝太多，超过了optmem的限制，这次先拷贝
+            }
+        }
+        else
+        {
+            //sendfile模式：文件体从m_file_offset续传，偏移量由sent()推进
+            off_t offset = m_file_offset;
+            temp = sendfile( m_sockfd, m_file_fd, &offset, m_file_end - m_file_offset );
+            if ( temp == 0 )
+            {
+                unmap(); //文件被截短了，再也发不够Content-Length
+                return false;
+            }
+        }
+        if ( temp <= -1 )
+        {
+            if( errno == EAGAIN )
+            {
+                //发送缓冲区满了，等下一次EPOLLOUT从已发送的位置继续
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                return true;
+            }
+            unmap();
+            return false;
+        }
+
+        if ( ! sent( temp, ! from_iov ) )
+        {
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return false;
+        }
+        if ( m_bytes_to_send == 0 )
+        {
+            //缓冲区里还有请求字节时先不注册EPOLLIN，由reactor看pending_input()再交给process处理
+            if ( ! pending_input() )
+            {
+                modfd( m_epollfd, m_sockfd, EPOLLIN );
+            }
+            return true;
+        }
+    }
+}
+
+//记录发出去的字节；整批响应发完时返回是否保持连接，没发完时返回true
+bool http_conn::sent( size_t bytes, bool from_file )
+{
+    m_bytes_to_send -= bytes;
+    m_bytes_have_send += bytes;
+    m_last_active = timer_wheel::now_ms();
+    if ( from_file )
+    {
+        m_file_offset += bytes;
+    }
+    else
+    {
+        advance_iov( bytes );
+    }
+
+    server_stats::add( STAT_BYTES_SENT, bytes );
+    if ( m_bytes_to_send > 0 )
+    {
+        return true;
+    }
+    server_stats::record( PHASE_WRITE, m_cold->write_start );
+    if ( m_cold->zerocopy_batch )
+    {
+        m_cold->zerocopy_batch = false;
+        if ( m_cold->zerocopy_completed != m_cold->zerocopy_issued )
+        {
+            pin_bodies(); //内核还引用着映射里的页
+        }
+    }
+    unmap();
+    if ( m_cold->stream )
+    {
+        //流式响应的一块发完了：写状态清零，连接交回reactor，由pending_input()再送去process生成下一块
+        m_write_idx = 0;
+        m_iv_count = 0;
+        m_iv_idx = 0;
+        m_bytes_have_send = 0;
+        m_write_block->mapped_iovs = 0;
+        m_request_start = m_last_active; //后面流水线请求的头部超时等流式响应结束后才开始算
+        return true;
+    }
+    if( m_keep_alive )
+    {
+        //客户端希望保持连接：重置写状态，把流水线里还没处理的请求挪到缓冲区开头
+        finish_response();
+        return true;
+    }
+    //连接socket从监听socket继承了SO_LINGER{1,0}，直接close会发RST丢掉还在发送缓冲区里的数据，
+    //大文件的尾部会被截断；响应已经完整交给内核了，这里改回正常的FIN关闭
+    struct linger tmp = { 0, 0 };
+    setsockopt( m_sockfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
+    return false;
+}
+
+/*
+从m_iv_idx开始这次sendmsg发哪几个iovec。文件映射里连续的一段够m_zerocopy_threshold时单独用MSG_ZEROCOPY发；
+其余的（头部、write_buf、静态响应、gzip缓存的数据，以及不够大的文件体）照常拷贝，一直发到下一段能零拷贝的文件体之前。
+write_buf发完就还给池子了，gzip缓存的数据放掉引用后可能被释放重用，它们都不能让内核引用着页慢慢发
+*/
+int http_conn::next_send_span( bool* zerocopy )
+{
+    uint32_t mapped = m_write_block->mapped_iovs;
+    int i = m_iv_idx;
+    while ( i < m_iv_count )
+    {
+        int end = i;
+        size_t bytes = 0;
+        while ( end < m_iv_count && ( mapped >> end & 1 ) )
+        {
+            bytes += m_iv[ end ].iov_len;
+            ++end;
+        }
+        if ( end > i && bytes >= ( size_t )m_zerocopy_threshold && m_cold->pinned_count + m_body_count <= MAX_PIPELINE
+             && enable_zerocopy() )
+        {
+            if ( i == m_iv_idx )
+            {
+                *zerocopy = true;
+                return end - i;
+            }
+            return i - m_iv_idx;
+        }
+        i = end > i ? end : i + 1;
+    }
+    *zerocopy = false;
+    return m_iv_count - m_iv_idx;
+}
+
+//连接第一次零拷贝发送前在socket上打开SO_ZEROCOPY，失败了这个连接就一直拷贝
+bool http_conn::enable_zerocopy()
+{
+    if ( m_cold->zerocopy == 0 )
+    {
+        int on = 1;
+        m_cold->zerocopy = setsockopt( m_sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof( on ) ) == 0 ? 1 : -1;
+    }
+    return m_cold->zerocopy == 1;
+}
+
+bool http_conn::reap_zerocopy()
+{
+    if ( m_cold->zerocopy_issued == 0 )
+    {
+        return false;
+    }
+    while ( true )
+    {
+        char control[ 128 ];
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof( control );
+        if ( recvmsg( m_sockfd, &msg, MSG_ERRQUEUE ) < 0 )
         {
-            if( errno == EAGAIN )
+            if ( errno == EAGAIN )
             {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
-                return true;
+                break;
             }
-            unmap();
             return false;
         }
-
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if ( bytes_to_send <= bytes_have_send )
+        for ( struct cmsghdr* cm = CMSG_FIRSTHDR( &msg ); cm; cm = CMSG_NXTHDR( &msg, cm ) )
         {
-            unmap();
-            if( m_linger )
+            if ( ! ( cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR ) )
             {
-                /*
-                如果 m_linger 为 true，表示客户端希望保持连接，
-                调用 init 函数重新初始化 http_conn 对象，调用 modfd 函数将套接字的事件类型修改为 EPOLLIN，然后返回 true
-                */
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return true;
+                return false;
             }
-            else
+            struct sock_extended_err* err = ( struct sock_extended_err* )CMSG_DATA( cm );
+            if ( err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0 )
             {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
                 return false;
-            } 
+            }
+            //一条通知覆盖编号[ee_info, ee_data]，内核会把连续的几次合并成一条
+            m_cold->zerocopy_completed += err->ee_data - err->ee_info + 1;
+            if ( err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+            {
+                //内核还是拷贝了（回环、网卡不支持分散聚集等），零拷贝只剩额外开销，这个连接以后不再用
+                server_stats::add( STAT_ZEROCOPY_COPIED );
+                m_cold->zerocopy = -1;
+            }
         }
     }
+    //错误队列里只有完成通知时SO_ERROR是0，否则连接确实出错了
+    int error = 0;
+    socklen_t length = sizeof( error );
+    if ( getsockopt( m_sockfd, SOL_SOCKET, SO_ERROR, &error, &length ) != 0 || error != 0 )
+    {
+        return false;
+    }
+    if ( m_cold->zerocopy_completed == m_cold->zerocopy_issued && m_cold->pinned_count > 0 )
+    {
+        release_bodies( m_cold->pinned, m_cold->pinned_count );
+        m_cold->pinned_count = 0;
+    }
+    return true;
+}
+
+void http_conn::rearm()
+{
+    modfd( m_epollfd, m_sockfd, m_bytes_to_send > 0 ? EPOLLOUT : EPOLLIN );
+}
+
+int http_conn::output_iov( struct iovec** iov ) const
+{
+    *iov = m_iv + m_iv_idx;
+    return m_iv_count - m_iv_idx;
+}
+
+int http_conn::output_file( off_t* offset, size_t* length ) const
+{
+    *offset = m_file_offset;
+    *length = m_file_end - m_file_offset;
+    return m_file_fd;
 }
 
-//将格式化的响应信息添加到响应缓冲区 m_write_buf 中
-bool http_conn::add_response( const char* format, ... )
+bool http_conn::add_bytes( const char* data, int length )
 {
-    if( m_write_idx >= WRITE_BUFFER_SIZE )
+    if( length > WRITE_BUFFER_SIZE - 1 - m_write_idx )
     {
         return false;
     }
-    va_list arg_list;
-    va_start( arg_list, format );
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) )
+    memcpy( m_write_buf + m_write_idx, data, length );
+    m_write_idx += length;
+    return true;
+}
+
+bool http_conn::add_number( unsigned long value )
+{
+    if( WRITE_BUFFER_SIZE - 1 - m_write_idx < 20 )
     {
         return false;
     }
-    m_write_idx += len;
-    va_end( arg_list );
+    m_write_idx += fast_utoa( value, m_write_buf + m_write_idx );
     return true;
 }
 
 bool http_conn::add_status_line( int status, const char* title )
 {
-    return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+    const static_response* line = NULL;
+    switch ( status )
+    {
+        case 200:
+        {
+            line = &status_200;
+            break;
+        }
+        case 304:
+        {
+            line = &status_304;
+            break;
+        }
+        case 206:
+        {
+            line = &status_206;
+            break;
+        }
+        case 416:
+        {
+            line = &status_416;
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+    if ( line )
+    {
+        return add_bytes( line->data, line->length );
+    }
+    return add_literal( "HTTP/1.1 " ) && add_number( status ) && add_literal( " " )
+            && add_bytes( title, strlen( title ) ) && add_literal( "\r\n" );
+}
+
+bool http_conn::add_headers( long content_len )
+{
+    return add_content_length( content_len ) && add_encoding() && add_linger() && add_blank_line();
+}
+
+bool http_conn::add_content_length( long content_len )
+{
+    return add_literal( "Content-Length: " ) && add_number( content_len ) && add_literal( "\r\n" );
+}
+
+//多段响应里每段前面的分隔符和Content-Range
+bool http_conn::add_part_header( const byte_range& range )
+{
+    return add_literal( "\r\n--" ) && add_bytes( range_boundary, BOUNDARY_LENGTH )
+            && add_literal( "\r\nContent-Range: bytes " ) && add_number( range.first ) && add_literal( "-" )
+            && add_number( range.last ) && add_literal( "/" ) && add_number( m_cold->file_stat.st_size )
+            && add_literal( "\r\n\r\n" );
+}
+
+//分段头的长度，和add_part_header写出来的一致；Content-Length在最前面，要先算出来
+int http_conn::part_header_length( const byte_range& range ) const
+{
+    return sizeof( "\r\n--" ) - 1 + BOUNDARY_LENGTH + sizeof( "\r\nContent-Range: bytes " ) - 1
+            + decimal_digits( range.first ) + 1 + decimal_digits( range.last ) + 1
+            + decimal_digits( m_cold->file_stat.st_size ) + sizeof( "\r\n\r\n" ) - 1;
+}
+
+//multipart/byteranges：分段头和文件段交替排进iovec，文件段都指向同一个映射
+bool http_conn::add_multipart_response( int start )
+{
+    long length = MULTIPART_CLOSE_LENGTH;
+    for ( int i = 0; i < m_cold->range_count; ++i )
+    {
+        length += part_header_length( m_cold->ranges[i] ) + m_cold->ranges[i].last - m_cold->ranges[i].first + 1;
+    }
+    if ( ! add_status_line( 206, "Partial Content" ) || ! add_content_length( length )
+        || ! add_literal( "Content-Type: multipart/byteranges; boundary=" ) || ! add_bytes( range_boundary, BOUNDARY_LENGTH )
+        || ! add_literal( "\r\n" ) || ! add_validators() || ! add_encoding() || ! add_linger() || ! add_blank_line() )
+    {
+        return false;
+    }
+    int segment = start;
+    for ( int i = 0; i < m_cold->range_count; ++i )
+    {
+        if ( ! add_part_header( m_cold->ranges[i] ) )
+        {
+            return false;
+        }
+        queue_write_buf( segment );
+        segment = m_write_idx;
+        queue_file( m_cold->ranges[i].first, m_cold->ranges[i].last );
+    }
+    if ( ! add_literal( "\r\n--" ) || ! add_bytes( range_boundary, BOUNDARY_LENGTH ) || ! add_literal( "--\r\n" ) )
+    {
+        return false;
+    }
+    queue_write_buf( segment );
+    hand_over_file();
+    return true;
+}
+
+bool http_conn::add_encoding()
+{
+    if ( m_cold->content_encoding == ENCODING_GZIP && ! add_literal( "Content-Encoding: gzip\r\n" ) )
+    {
+        return false;
+    }
+    if ( m_cold->content_encoding == ENCODING_BR && ! add_literal( "Content-Encoding: br\r\n" ) )
+    {
+        return false;
+    }
+    return add_vary();
 }
 
-bool http_conn::add_headers( int content_len )
+bool http_conn::add_vary()
 {
-    add_content_length( content_len );
-    add_linger();
-    add_blank_line();
+    return ! m_cold->vary || add_literal( "Vary: Accept-Encoding\r\n" );
 }
 
-bool http_conn::add_content_length( int content_len )
+bool http_conn::add_validators()
 {
-    return add_response( "Content-Length: %d\r\n", content_len );
+    if ( WRITE_BUFFER_SIZE - 1 - m_write_idx < ETAG_LENGTH + HTTP_DATE_LENGTH + 32 )
+    {
+        return false;
+    }
+    //上面已经留够了ETag和Last-Modified的空间，下面几个add不会失败
+    add_literal( "ETag: " );
+    m_write_idx += format_etag( m_write_buf + m_write_idx );
+    add_literal( "\r\nLast-Modified: " );
+    format_http_date( m_cold->file_stat.st_mtime, m_write_buf + m_write_idx );
+    m_write_idx += HTTP_DATE_LENGTH;
+    add_literal( "\r\n" );
+    const cache_rule* rule = find_cache_rule();
+    if ( rule )
+    {
+        return add_literal( "Cache-Control: " ) && add_bytes( rule->value, rule->value_length ) && add_literal( "\r\n" );
+    }
+    return true;
 }
 
 bool http_conn::add_linger()
 {
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+    return m_linger ? add_literal( "Connection: keep-alive\r\n" ) : add_literal( "Connection: close\r\n" );
 }
 
 bool http_conn::add_blank_line()
 {
-    return add_response( "%s", "\r\n" );
+    return add_literal( "\r\n" );
 }
 
 bool http_conn::add_content( const char* content )
 {
-    return add_response( "%s", content );
+    return add_bytes( content, strlen( content ) );
+}
+
+//不经过m_write_buf，iovec直接指向只读的静态数据
+void http_conn::queue_static( const static_response& response )
+{
+    m_iv[ m_iv_count ].iov_base = ( void* )response.data;
+    m_iv[ m_iv_count ].iov_len = response.length;
+    ++m_iv_count;
+    m_bytes_to_send += response.length;
+}
+
+http_conn::HTTP_CODE http_conn::start_stream( const stream_handler* handler, const char* path )
+{
+    void* state = handler->open( m_cold->url, path );
+    if ( ! state )
+    {
+        return errno == ENOENT || errno == ENOTDIR ? NO_RESOURCE : INTERNAL_ERROR;
+    }
+    m_cold->stream = handler;
+    m_cold->stream_state = state;
+    return STREAM_REQUEST;
+}
+
+/*
+每次只生成一块：缓冲区前面空出块长度的位置，生成完再倒着填十六进制长度，块尾的\r\n（生成器结束时再加上0\r\n\r\n）
+跟在数据后面，整块一个iovec。这一块发完之前不会再调用这里，客户端读得慢时生成器就停着，内存不随响应长度增长
+*/
+bool http_conn::queue_chunk()
+{
+    static const int CHUNK_HEAD = 10; //最多8位十六进制长度加\r\n
+    static const int CHUNK_TAIL = 7; //\r\n加0\r\n\r\n
+    if ( ! m_cold->stream_buf )
+    {
+        size_t size = 0;
+        m_cold->stream_node = cpu_topology::current_node();
+        m_cold->stream_buf = m_buffer_pools[ m_cold->stream_node ].acquire( STREAM_BUFFER_SIZE, &size );
+        if ( ! m_cold->stream_buf )
+        {
+            return false;
+        }
+        m_cold->stream_buf_size = size;
+    }
+    char* data = m_cold->stream_buf + CHUNK_HEAD;
+    int room = m_cold->stream_buf_size - CHUNK_HEAD - CHUNK_TAIL;
+    int length = 0;
+    bool ended = false;
+    while ( length < room )
+    {
+        int n = m_cold->stream->produce( m_cold->stream_state, data + length, room - length );
+        if ( n < 0 )
+        {
+            return false;
+        }
+        if ( n == 0 )
+        {
+            ended = true;
+            break;
+        }
+        length += n;
+    }
+
+    if ( length > 0 )
+    {
+        static const char hex[] = "0123456789abcdef";
+        char* begin = data - 2;
+        begin[0] = '\r';
+        begin[1] = '\n';
+        for ( int rest = length; rest > 0; rest >>= 4 )
+        {
+            *--begin = hex[ rest & 15 ];
+        }
+        char* end = data + length;
+        memcpy( end, "\r\n", 2 );
+        end += 2;
+        if ( ended )
+        {
+            memcpy( end, last_chunk.data, last_chunk.length );
+            end += last_chunk.length;
+        }
+        m_iv[ m_iv_count ].iov_base = begin;
+        m_iv[ m_iv_count ].iov_len = end - begin;
+        ++m_iv_count;
+        m_bytes_to_send += end - begin;
+    }
+    else
+    {
+        queue_static( last_chunk );
+        release_stream_buf();
+    }
+    if ( ended )
+    {
+        end_stream(); //最后一块发完以后走正常的长连接流程
+    }
+    return true;
+}
+
+void http_conn::end_stream()
+{
+    if ( m_cold->stream )
+    {
+        m_cold->stream->close( m_cold->stream_state );
+        m_cold->stream = 0;
+        m_cold->stream_state = 0;
+    }
+}
+
+void http_conn::release_stream_buf()
+{
+    if ( m_cold->stream_buf )
+    {
+        m_buffer_pools[ m_cold->stream_node ].release( m_cold->stream_buf, m_cold->stream_buf_size );
+        m_cold->stream_buf = 0;
+    }
+}
+
+bool http_conn::add_stream_route( const char* prefix, const stream_handler* handler )
+{
+    int length = strlen( prefix );
+    if ( m_stream_route_count >= MAX_STREAM_ROUTES || prefix[0] != '/' || length >= ( int )sizeof( m_stream_routes[0].prefix ) )
+    {
+        return false;
+    }
+    stream_route& route = m_stream_routes[ m_stream_route_count ];
+    memcpy( route.prefix, prefix, length + 1 );
+    route.prefix_length = length;
+    route.handler = handler;
+    ++m_stream_route_count;
+    return true;
 }
 
 bool http_conn::process_write( HTTP_CODE ret )
 {
+    if ( ! m_write_block && ! acquire_write_buf() )
+    {
+        return false;
+    }
+    int start = m_write_idx; //这个响应在m_write_buf里的起点，流水线时前面可能还排着别的响应
     switch ( ret )
     {
+        //错误响应都是预先拼好的，一个iovec发出
         case INTERNAL_ERROR:
         {
-            add_status_line( 500, error_500_title );
-            add_headers( strlen( error_500_form ) );
-            if ( ! add_content( error_500_form ) )
+            queue_static( error_500[ m_linger ] );
+            return true;
+        }
+        case BAD_REQUEST:
+        {
+            queue_static( error_400[ m_linger ] );
+            return true;
+        }
+        case NO_RESOURCE:
+        {
+            queue_static( error_404[ m_linger ] );
+            return true;
+        }
+        case FORBIDDEN_REQUEST:
+        {
+            queue_static( error_403[ m_linger ] );
+            return true;
+        }
+        case SERVICE_UNAVAILABLE:
+        {
+            queue_static( error_503 );
+            return true;
+        }
+        case METHOD_NOT_ALLOWED:
+        {
+            queue_static( error_405 );
+            return true;
+        }
+        case LENGTH_REQUIRED:
+        {
+            queue_static( error_411 );
+            return true;
+        }
+        case PAYLOAD_TOO_LARGE:
+        {
+            queue_static( error_413 );
+            return true;
+        }
+        case URI_TOO_LONG:
+        {
+            queue_static( error_414 );
+            return true;
+        }
+        case EXPECTATION_FAILED:
+        {
+            queue_static( error_417 );
+            return true;
+        }
+        case NOT_IMPLEMENTED:
+        {
+            queue_static( error_501 );
+            return true;
+        }
+        case BODY_REQUEST:
+        {
+            if ( ! add_status_line( m_cold->body_status, m_cold->body_status == 201 ? "Created" : ok_200_title )
+                || ! add_headers( 0 ) )
             {
                 return false;
             }
             break;
         }
-        case BAD_REQUEST:
+        case NOT_MODIFIED:
         {
-            add_status_line( 400, error_400_title );
-            add_headers( strlen( error_400_form ) );
-            if ( ! add_content( error_400_form ) )
+            //只有头部：校验器和Vary要和200时一致，不带Content-Length
+            release_file();
+            if ( ! add_status_line( 304, "Not Modified" ) || ! add_validators() || ! add_vary()
+                || ! add_linger() || ! add_blank_line() )
             {
                 return false;
             }
             break;
         }
-        case NO_RESOURCE:
+        case RANGE_NOT_SATISFIABLE:
         {
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) )
+            release_file();
+            if ( ! add_status_line( 416, "Range Not Satisfiable" ) || ! add_literal( "Content-Range: bytes */" )
+                || ! add_number( m_cold->file_stat.st_size ) || ! add_literal( "\r\n" ) || ! add_headers( 0 ) )
             {
                 return false;
             }
             break;
         }
-        case FORBIDDEN_REQUEST:
+        case STREAM_REQUEST:
         {
-            add_status_line( 403, error_403_title );
-            add_headers( strlen( error_403_form ) );
-            if ( ! add_content( error_403_form ) )
+            //长度事先不知道，分块发；第一块和头部排进同一批
+            if ( ! add_status_line( 200, ok_200_title ) || ! add_literal( "Content-Type: " )
+                || ! add_content( m_cold->stream->content_type ) || ! add_literal( "\r\nTransfer-Encoding: chunked\r\n" )
+                || ! add_literal( "Cache-Control: no-store\r\n" ) || ! add_linger() || ! add_blank_line() )
             {
                 return false;
             }
-            break;
+            queue_write_buf( start );
+            return queue_chunk();
+        }
+        case STATS_REQUEST:
+        {
+            //统计每次都不一样，不能缓存
+            if ( ! add_status_line( 200, ok_200_title ) || ! add_literal( "Cache-Control: no-store\r\n" )
+                || ( m_cold->stats_prometheus ? ! add_literal( "Content-Type: text/plain; version=0.0.4\r\n" )
+                                        : ! add_literal( "Content-Type: application/json\r\n" ) )
+                || ! add_headers( m_cold->map_length ) )
+            {
+                return false;
+            }
+            queue_write_buf( start );
+            queue_file( 0, m_cold->map_length - 1 );
+            hand_over_file();
+            return true;
         }
         case FILE_REQUEST:
         {
+            if ( m_cold->range_count > 1 )
+            {
+                return add_multipart_response( start );
+            }
+            if ( m_cold->range_count == 1 )
+            {
+                const byte_range& range = m_cold->ranges[0];
+                if ( ! add_status_line( 206, "Partial Content" ) || ! add_literal( "Content-Range: bytes " )
+                    || ! add_number( range.first ) || ! add_literal( "-" ) || ! add_number( range.last )
+                    || ! add_literal( "/" ) || ! add_number( m_cold->file_stat.st_size ) || ! add_literal( "\r\n" )
+                    || ! add_validators() || ! add_headers( range.last - range.first + 1 ) )
+                {
+                    return false;
+                }
+                queue_write_buf( start );
+                queue_file( range.first, range.last );
+                hand_over_file();
+                return true;
+            }
             add_status_line( 200, ok_200_title );
-            if ( m_file_stat.st_size != 0 )
+            if ( m_cold->file_stat.st_size != 0 )
             {
-                add_headers( m_file_stat.st_size );
+                //告诉客户端可以用Range续传或者跳着取
+                if ( ! add_literal( "Accept-Ranges: bytes\r\n" ) || ! add_validators() || ! add_headers( m_cold->file_stat.st_size ) )
+                {
+                    return false;
+                }
                 //将文件大小作为参数传入，该函数会添加 Content-Length、Connection 等响应头部信息到 m_write_buf 缓冲区
-                m_iv[ 0 ].iov_base = m_write_buf;
-                m_iv[ 0 ].iov_len = m_write_idx;
-                //第一个m_iv指向响应头部的缓冲区 m_write_buf
-                m_iv[ 1 ].iov_base = m_file_address; //指向文件的内存映射地址
-                m_iv[ 1 ].iov_len = m_file_stat.st_size;
-                m_iv_count = 2;
+                queue_write_buf( start );
+                queue_file( 0, m_cold->file_stat.st_size - 1 );
+                hand_over_file();
                 return true;
             }
             else
             { //如果请求的文件长度为0  则返回一个空的html文档
+                release_file();
                 const char* ok_string = "<html><body></body></html>";
                 add_headers( strlen( ok_string ) );
                 if ( ! add_content( ok_string ) )
@@ -567,6 +2712,7 @@ bool http_conn::process_write( HTTP_CODE ret )
                     return false;
                 }
             }
+            break;
         }
         default:
         {
@@ -574,27 +2720,168 @@ bool http_conn::process_write( HTTP_CODE ret )
         }
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
+    queue_write_buf( start );
     return true;
 }
 
+//不借缓冲区、不解析，一次send把503交给内核；发不完（几乎不会）也不等，反正马上关闭
+void http_conn::shed()
+{
+    ssize_t n = send( m_sockfd, error_503.data, error_503.length, MSG_DONTWAIT | MSG_NOSIGNAL );
+    if ( n > 0 )
+    {
+        server_stats::add( STAT_BYTES_SENT, n );
+    }
+    server_stats::add( STAT_STATUS_5XX );
+    server_stats::add( STAT_SHED );
+    if ( logger::access_enabled() )
+    {
+        logger::access( m_cold->address, NULL, 503, error_503.length, 0 );
+    }
+}
+
+//响应的状态码，要在init_request()之前调用
+int http_conn::response_status( HTTP_CODE code ) const
+{
+    switch ( code )
+    {
+        case FILE_REQUEST:
+            return m_cold->range_count > 0 ? 206 : 200;
+        case STATS_REQUEST:
+        case STREAM_REQUEST:
+            return 200;
+        case BODY_REQUEST:
+            return m_cold->body_status;
+        case NOT_MODIFIED:
+            return 304;
+        case BAD_REQUEST:
+            return 400;
+        case FORBIDDEN_REQUEST:
+            return 403;
+        case NO_RESOURCE:
+            return 404;
+        case METHOD_NOT_ALLOWED:
+            return 405;
+        case LENGTH_REQUIRED:
+            return 411;
+        case PAYLOAD_TOO_LARGE:
+            return 413;
+        case URI_TOO_LONG:
+            return 414;
+        case EXPECTATION_FAILED:
+            return 417;
+        case RANGE_NOT_SATISFIABLE:
+            return 416;
+        case NOT_IMPLEMENTED:
+            return 501;
+        case SERVICE_UNAVAILABLE:
+            return 503;
+        default:
+            return 500;
+    }
+}
+
 void http_conn::process()
 {
-    HTTP_CODE read_ret = process_read();
-    if ( read_ret == NO_REQUEST ) //NO_REQUEST表示请求不完整，需要继续读取客户数据；
+    m_worker_hint = threadpool_worker_index;
+    uint64_t arrived = 0; //访问日志里的耗时从交给线程池算起，流水线里后面的请求从开始解析算起
+    bool shed = false;
+    if ( m_queued_at )
     {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
-        return;
+        uint64_t now = server_stats::record( PHASE_QUEUE, m_queued_at );
+        //在队列里等太久的请求不解析，直接回503；响应还是由reactor线程发出
+        shed = m_codel.should_drop( now - m_queued_at, now );
+        arrived = m_queued_at;
+        m_queued_at = 0;
+    }
+    bool queued = false;
+    bool streaming = m_cold->stream != NULL;
+    if ( streaming )
+    {
+        //上一块已经发完，接着生成下一块；流式响应结束之前不解析后面的请求
+        if ( ! queue_chunk() )
+        {
+            close_conn(); //close_conn在关掉fd之前放开m_in_pool
+            return;
+        }
+        queued = true;
+    }
+    //流水线：缓冲区里可能有多个完整请求，逐个解析并把响应排进同一批，最后一次writev发出
+    while ( ! streaming )
+    {
+        m_cold->parse_start = server_stats::now();
+        arrived = arrived ? arrived : m_cold->parse_start;
+        HTTP_CODE read_ret = shed ? SERVICE_UNAVAILABLE : process_read();
+        if ( read_ret == NO_REQUEST ) //NO_REQUEST表示请求不完整，需要继续读取客户数据；
+        {
+            break;
+        }
+        if ( read_ret == BAD_REQUEST || read_ret == URI_TOO_LONG || read_ret == SERVICE_UNAVAILABLE )
+        {
+            m_linger = false; //出错的请求边界不可信，后面的字节不能再当请求解析；拒绝的请求连同连接一起放弃
+        }
+
+        long queued_before = m_bytes_to_send;
+        bool write_ret = process_write( read_ret );
+        if ( ! write_ret )
+        {
+            close_conn(); //出错则关闭连接，close_conn在关掉fd之前放开m_in_pool
+            return;
+        }
+        queued = true;
+        int status = response_status( read_ret );
+        server_stats::add( ( STAT_COUNTER )( STAT_STATUS_2XX + status / 100 - 2 ) );
+        if ( read_ret == SERVICE_UNAVAILABLE )
+        {
+            server_stats::add( STAT_SHED );
+        }
+        if ( logger::access_enabled() )
+        {
+            logger::access( m_cold->address, m_cold->url, status, m_bytes_to_send - queued_before, server_stats::now() - arrived );
+        }
+        arrived = 0;
+        m_keep_alive = m_linger;
+        init_request(); //从紧跟着的字节开始解析下一个请求
+        if ( ! m_keep_alive || ! can_pipeline() )
+        {
+            break;
+        }
     }
 
-    bool write_ret = process_write( read_ret );
-    if ( ! write_ret )
+    if ( queued )
+    {
+        m_cold->write_start = server_stats::now();
+    }
+    /*先modfd再清掉标记：标记一清，reactor的超时处理就可能关掉连接、fd号还可能被新连接复用，
+    之后就不能再碰m_sockfd了。modfd之后、清标记之前到的事件，reactor会等标记清掉再处理；
+    这期间到期的超时看到还在池里，下一个tick再看*/
+    int sockfd = m_sockfd;
+    if ( m_epollfd != -1 ) //io_uring后端由reactor看has_output()决定接下来发还是收
     {
-        close_conn(); //出错则关闭连接
+        modfd( m_epollfd, sockfd, queued ? EPOLLOUT : EPOLLIN );
     }
+    m_in_pool.store( false, std::memory_order_release );
+}
 
-    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+//按连接当前所处的阶段给出超时的绝对时间（毫秒），0表示这个阶段不限时
+long http_conn::deadline() const
+{
+    if ( m_bytes_to_send > 0 )
+    {
+        //响应发不出去：对端一直不读，按最后一次发送有进展的时间算
+        return m_write_timeout > 0 ? m_last_active + m_write_timeout : 0;
+    }
+    if ( m_read_idx == 0 )
+    {
+        //两个请求之间的空闲长连接
+        return m_idle_timeout > 0 ? m_last_active + m_idle_timeout : 0;
+    }
+    if ( m_check_state == CHECK_STATE_CONTENT )
+    {
+        //请求体可以很大，只要求持续有数据进来
+        return m_body_timeout > 0 ? m_last_active + m_body_timeout : 0;
+    }
+    //请求行和头部必须在限定时间内收完，从第一个字节算起，每次只滴几个字节的慢速攻击也拖不过去
+    return m_header_timeout > 0 ? m_request_start + m_header_timeout : 0;
 }
 
@@ -16,19 +16,120 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
-#include <stdarg.h>
 #include <errno.h>
 #include<sys/uio.h>
+#include <sys/sendfile.h>
 //分散 - 聚集 I/O 允许程序在一次系统调用中读写多个非连续的内存块，而不需要多次调用系统 I/O 函数
 #include "locker.h"
+#include "file_cache.h"
+#include "gzip_cache.h"
+#include "timer_wheel.h"
+#include "buffer_pool.h"
+#include "cpu_topology.h"
+#include "codel.h"
+#include "simd_scan.h"
+#include "http_header.h"
+#include "server_stats.h"
+#include "logger.h"
+#include <atomic>
 
-class http_conn
+extern const char* doc_root;
+
+//Range请求里的一段，first和last都是闭区间的文件偏移
+struct byte_range
+{
+    off_t first;
+    off_t last;
+};
+
+//按URL前缀配置的Cache-Control，最长的前缀优先
+struct cache_rule
+{
+    char prefix[ 64 ];
+    int prefix_length;
+    char value[ 128 ];
+    int value_length;
+};
+
+/*
+流式响应的内容生成器，长度事先不知道的内容边生成边用chunked编码发出。
+open在工作线程里解析完请求后调用，url是请求的URL，path是它在doc_root下对应的路径；返回的state之后原样传给
+produce和close，返回NULL表示出错（errno是ENOENT/ENOTDIR时回404，否则500）。produce往buf里写不超过size字节，返回写了多少，0表示内容结束，
+-1表示出错（连接直接关掉，客户端收不到结尾的0块，知道内容不完整）。上一块全部交给内核之后才会要下一块，
+对端读得慢时生成器就停着，每个连接只占一块缓冲区。close在结束、出错或者连接中途断开时调用一次
+*/
+struct stream_handler
+{
+    const char* content_type;
+    void* ( *open )( const char* url, const char* path );
+    int ( *produce )( void* state, char* buf, int size );
+    void ( *close )( void* state );
+};
+
+/*
+POST/PUT请求体的处理函数，请求体不在内存里攒齐：收到多少交出去多少。
+open在头部收完后调用，length是Content-Length，返回NULL表示拒绝（errno是ENOENT/ENOTDIR时回404，EACCES时回403，否则500）。
+请求体不超过m_body_spill时，每收到一段就调用consume（一次最多一个读缓冲区），返回-1表示出错；
+更大的请求体在reactor线程里用splice直接从socket搬进文件，不经过用户态也不占工作线程：spool不为NULL时搬进它返回的fd，
+否则搬进m_spool_dir下的一个匿名临时文件。收完后调用finish，spool_fd是搬进去的那个文件（没有暂存时为-1），
+返回响应的状态码（200或201，其他都当500）。close在结束、出错或者连接中途断开时调用一次
+*/
+struct body_handler
+{
+    void* ( *open )( const char* url, const char* path, long length );
+    int ( *spool )( void* state );
+    int ( *consume )( void* state, const char* data, int size );
+    int ( *finish )( void* state, int spool_fd );
+    void ( *close )( void* state );
+};
+
+//URL前缀到流式生成器的映射，先注册的优先
+struct stream_route
+{
+    char prefix[ 64 ];
+    int prefix_length;
+    const stream_handler* handler;
+};
+
+//URL前缀到请求体处理函数的映射，先注册的优先
+struct body_route
+{
+    char prefix[ 64 ];
+    int prefix_length;
+    const body_handler* handler;
+};
+
+//编译期就拼好的整段响应数据，发送时iovec直接指向它
+struct static_response
+{
+    const char* data;
+    int length;
+};
+
+/*
+连接对象按缓存行对齐，users[]里相邻的两个连接不会落在同一行上，主线程改一个、工作线程改另一个时互不干扰。
+对象本身只放每个事件都要碰的状态（热数据，正好三个缓存行，见下面成员的分组）；
+请求行、头部、Range、文件的stat这些只在解析和组装响应时才用的放在m_cold指向的cold_state里（冷数据），
+reactor处理可读可写事件、检查超时时不会把它们带进缓存
+*/
+class alignas( CACHE_LINE_SIZE ) http_conn
 {
 public:
     static const int FILENAME_LEN = 200;
-    static const int READ_BUFFER_SIZE = 2048;
+    static const int READ_BUFFER_SIZE = 2048; //读缓冲区的初始大小，头部更长时按2倍增长到m_max_read_buffer
     static const int WRITE_BUFFER_SIZE = 1024;
-    /*HTTP请求方法，但我们仅支持GET*/
+    static const int MAX_PIPELINE = 16; //一次writev最多合并发送的流水线响应数
+    static const int PIPELINE_WRITE_RESERVE = 512; //m_write_buf剩余空间少于这个数就不再合并下一个响应
+    static const int MAX_HEADERS = 32; //一个请求最多多少个头部，再多按错误请求处理
+    static const int MAX_HEADER_BUFFER = 65536; //header_view的偏移是16位的，读缓冲区不能超过这么大
+    static const int MAX_RANGES = 8; //Range头部最多接受几段，再多就忽略Range返回整个文件
+    static const int MAX_CACHE_RULES = 16;
+    static const int ETAG_LENGTH = 80; //format_etag输出的上限
+    static const int STREAM_BUFFER_SIZE = 16384; //流式响应每一块的缓冲区，从m_buffer_pools借
+    static const int MAX_STREAM_ROUTES = 8;
+    static const int MAX_BODY_ROUTES = 8;
+    static const int SPLICE_CHUNK = 65536; //splice每次从socket搬多少，也就是管道的默认容量
+    /*HTTP请求方法，我们支持GET，以及有处理函数的URL上的POST/PUT*/
     enum METHOD { GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATCH };
     /*主状态机的三种可能状态，分别表示：当前正在分析请求行，当前正在分析头部字段 正在分析请求体*/
     enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
@@ -36,82 +137,282 @@ public:
 据；GET_REQUEST表示获得了一个完整的客户请求；BAD_REQUEST表示客户请求有语法错
 误；FORBIDDEN_REQUEST表示客户对资源没有足够的访问权限；INTERNAL_ERROR表示服
 务器内部错误；CLOSED_CONNECTION表示客户端已经关闭连接了*/
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, STATS_REQUEST, STREAM_REQUEST, BODY_REQUEST, NOT_MODIFIED, RANGE_NOT_SATISFIABLE, METHOD_NOT_ALLOWED, LENGTH_REQUIRED, PAYLOAD_TOO_LARGE, URI_TOO_LONG, EXPECTATION_FAILED, NOT_IMPLEMENTED, SERVICE_UNAVAILABLE, INTERNAL_ERROR, CLOSED_CONNECTION };
+    /*响应体的内容编码，也用作Accept-Encoding里可接受编码的位掩码*/
+    enum ENCODING { ENCODING_IDENTITY = 0, ENCODING_GZIP = 1, ENCODING_BR = 2 };
     /*从状态机的三种可能状态，即行的读取状态，分别表示：读取到一个完整的行、行出错和行数据尚且不完整*/
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
     /*行的读取状态？？？？？*/
 
 public:
-    http_conn(){}
-    ~http_conn(){}
+    http_conn() : m_cold( NULL ) {}
+    ~http_conn();
 
 public:
-    void init( int sockfd, const sockaddr_in& addr );
+    void init( int sockfd, const sockaddr_in& addr, int epollfd );
     void close_conn( bool real_close = true );
     void process();
     bool read();
     bool write();
+    //EPOLLERR时调用：取走错误队列里MSG_ZEROCOPY的完成通知，放掉内核已经用完的映射。
+    //返回false表示连接真的出错了（或者没开零拷贝），要关闭
+    bool reap_zerocopy();
+    void rearm(); //事件里只有完成通知时，按连接现在等的事件重新注册EPOLLONESHOT
+    //线程池收不下时由reactor线程直接回预先拼好的503，之后由调用方关闭连接
+    void shed();
+    int worker_hint() const { return m_worker_hint; }
+    long deadline() const;
+    bool closed() const { return m_sockfd == -1; }
+    //响应已经发完，读缓冲区里还有没解析的字节（流水线请求），或者流式响应要生成下一块，需要再process一次
+    bool pending_input() const;
+    //请求体正在splice进暂存文件，读缓冲区里没有要解析的：read()之后直接等下一次EPOLLIN，不用交给线程池
+    bool spooling() const;
+
+    //完成驱动的后端（io_uring）用这几个接口：收发由后端提交，连接对象只维护缓冲区和状态。
+    //这种连接init时epollfd传-1
+    bool receive( const char* data, size_t length ); //收到的数据放进读缓冲区，头部超长时返回false
+    bool has_output() const { return m_bytes_to_send > 0; }
+    int output_iov( struct iovec** iov ) const; //还没发完的内存数据
+    int output_file( off_t* offset, size_t* length ) const; //iovec之后要发的文件体，没有时返回-1
+    bool sent( size_t bytes, bool from_file ); //返回false表示响应发完了且要关闭连接
 
 private:
     void init();
+    void init_request();
+    void finish_response();
+    void compact_read_buf();
+    bool can_pipeline() const;
+    int response_status( HTTP_CODE code ) const;
     HTTP_CODE process_read();
     bool process_write( HTTP_CODE ret );
 
-    HTTP_CODE parse_request_line( char* text );
-    HTTP_CODE parse_headers( char* text );
+    HTTP_CODE parse_request_line( char* text, char* end );
+    HTTP_CODE parse_headers( char* text, char* end );
     HTTP_CODE parse_content( char* text );
+    HTTP_CODE start_body(); //头部收完，决定请求体交给谁、要不要先回100 Continue
+    bool deliver_body( const char* data, long length );
+    bool splice_body(); //reactor线程里把socket上的请求体直接搬进暂存文件
+    HTTP_CODE finish_body();
+    void end_body();
+    HTTP_CODE handle_request(); //do_request外面包一层，分别记下解析和处理的耗时
     HTTP_CODE do_request();
+    void build_path( char* real_file );
+    HTTP_CODE render_stats();
+    HTTP_CODE start_stream( const stream_handler* handler, const char* path );
+    bool queue_chunk(); //生成流式响应的下一块排进发送队列，返回false表示生成器出错
+    void end_stream();
+    void release_stream_buf();
+    int parse_range( const char* value ); //返回可满足的段数，0表示都不可满足，-1表示格式不对（忽略Range）
+    bool if_range_matches() const;
+    bool not_modified() const;
+    int format_etag( char* out ) const;
+    const cache_rule* find_cache_rule() const;
+    bool multipart_fits( int count ) const;
+    bool map_file( int fd, off_t begin, off_t end );
+    void negotiate_encoding( char* real_file );
+    bool open_sibling( char* real_file, const char* suffix );
     //获取当前正在解析的行的起始地址
     char* get_line() { return m_read_buf + m_start_line; }
     /*从状态机，用于解析出一行内容*/
     LINE_STATUS parse_line();
+    //按头部取值（已去掉首尾空白、以\0结尾），没有这个头部时返回NULL；同名头部取最后一个
+    const char* header( HEADER_ID id, int* length = NULL ) const;
+    const char* header( const char* name, int* length = NULL ) const; //不在HEADER_ID里的头部，逐个比较名字
+
+    bool acquire_read_buf();
+    bool grow_read_buf();
+    bool acquire_write_buf();
+    void release_read_buf();
+    void release_write_buf();
 
     void unmap();
-    bool add_response( const char* format, ... );
+    struct body_ref;
+    void release_bodies( body_ref* bodies, int count );
+    int next_send_span( bool* zerocopy ); //write()下一次sendmsg发几个iovec，是否用MSG_ZEROCOPY
+    bool enable_zerocopy();
+    void pin_bodies();
+    void release_file();
+    void queue_write_buf( int start );
+    void queue_file( off_t first, off_t last );
+    void hand_over_file();
+    bool add_part_header( const byte_range& range );
+    int part_header_length( const byte_range& range ) const;
+    bool add_multipart_response( int start );
+    void advance_iov( size_t bytes );
+    void queue_static( const static_response& response );
+    bool add_bytes( const char* data, int length );
+    template< int N >
+    bool add_literal( const char ( &literal )[N] ) { return add_bytes( literal, N - 1 ); }
+    bool add_number( unsigned long value );
     bool add_content( const char* content );
     bool add_status_line( int status, const char* title );//status:200 title:OK 
-    bool add_headers( int content_length );
-    bool add_content_length( int content_length ); //content-length:
+    bool add_headers( long content_length );
+    bool add_content_length( long content_length ); //content-length:
+    bool add_encoding(); //Content-Encoding和Vary
+    bool add_vary();
+    bool add_validators(); //ETag、Last-Modified、Cache-Control
     bool add_linger(); //connection:keep-alive
     bool add_blank_line();
     //向 HTTP 响应缓冲区添加一个空行。在 HTTP 协议中，空行用于分隔响应头和响应内容
 
 public:
-    static int m_epollfd;
-    static int m_user_count; //所有类对象共享的用户数量
+    static std::atomic< int > m_user_count; //所有类对象共享的用户数量，多个reactor线程同时增减
+    static const char* m_stats_path; //访问这个URL返回运行统计，为NULL时不提供
+    static bool m_use_sendfile; //为true时文件体用sendfile从fd直接发送，不再mmap
+    static file_cache* m_file_cache; //不为空时do_request通过共享的打开文件缓存取fd/stat/映射
+    static bool m_precompressed; //客户端接受时改发同目录下预先压缩好的.br/.gz文件
+    static gzip_cache* m_gzip_cache; //不为空时热点文件由后台线程压缩成gzip缓存起来
+    static cache_rule m_cache_rules[ MAX_CACHE_RULES ];
+    static int m_cache_rule_count;
+    static bool add_cache_rule( const char* spec ); //spec形如 /static/=public, max-age=31536000
+    static stream_route m_stream_routes[ MAX_STREAM_ROUTES ];
+    static int m_stream_route_count;
+    static bool add_stream_route( const char* prefix, const stream_handler* handler ); //以prefix开头的URL交给handler生成
+    static bool m_autoindex; //对目录的请求流式返回文件列表，否则回400
+    static body_route m_body_routes[ MAX_BODY_ROUTES ];
+    static int m_body_route_count;
+    static bool add_body_route( const char* prefix, const body_handler* handler ); //以prefix开头的URL接受POST/PUT
+    static long m_max_body; //Content-Length的上限，超过的回413
+    static long m_body_spill; //请求体超过这么大就不再交给consume，splice进文件
+    static const char* m_spool_dir; //处理函数不提供fd时，暂存文件建在这里
+    //各阶段的超时（毫秒），0表示不限：收完请求行和头部、请求体两次数据之间、长连接空闲、响应发送停滞
+    static int m_header_timeout;
+    static int m_body_timeout;
+    static int m_idle_timeout;
+    static int m_write_timeout;
+    static int m_max_read_buffer; //读缓冲区最大能长到多大，也就是请求头部的长度上限
+    static long m_zerocopy_threshold; //一段文件体至少这么大才用MSG_ZEROCOPY发，0表示不用；只对epoll后端的mmap发送起作用
+    static buffer_pool m_buffer_pools[ cpu_topology::MAX_NODES ]; //每个NUMA节点一个读写缓冲区池，连接从当前线程所在节点的池里借
+    static codel m_codel; //线程池队列的准入控制，只在单reactor加线程池的模式下起作用
+
+    //第0行：reactor每个事件都要看的，以及和线程池交接用的
+    wheel_timer m_timer; //挂在所属reactor的时间轮上，只由reactor线程操作
+    uint64_t m_queued_at; //交给线程池的时刻（server_stats::now()），process开始时记成排队耗时
+    std::atomic< bool > m_in_pool; //已交给线程池还没处理完，这期间超时不能关闭连接
 
 private:
+    int m_epollfd; //连接所属reactor的epoll实例，多reactor模式下每个reactor各有一个
     int m_sockfd;
-    sockaddr_in m_address;
+    int m_worker_hint; //上次处理这个连接的线程池线程，工作窃取模式下下一个请求优先交给它
+    struct cold_state;
+    cold_state* m_cold; //第一次init时分配，之后一直跟着这个fd槽位
 
-    char m_read_buf[ READ_BUFFER_SIZE ];
+    //第1行：读缓冲区、解析进度和本次响应的发送进度
+    //读写缓冲区都是第一次用到时才从m_buffer_pools借，连接空闲时还回去
+    char* m_read_buf;
+    int m_read_buf_size;
     int m_read_idx; //m_read_idx 指向缓冲区中当前已读取数据的末尾位置
     /*在 read 函数中，当从套接字读取数据到 m_read_buf 时，会更新 m_read_idx 的值，以反映当前已读取数据的长度。*/
     int m_checked_idx; 
     //m_checked_idx 指向当前正在解析的数据的位置。
     int m_start_line; 
     //该变量用于记录当前正在解析的行在 m_read_buf 缓冲区中的起始位置。
-    char m_write_buf[ WRITE_BUFFER_SIZE ];
+    int m_request_begin; //当前请求在m_read_buf中的起点，它之前的字节都属于已经处理完的请求
     int m_write_idx;
-
     CHECK_STATE m_check_state; //主状态机的当前状态
-    METHOD m_method;
-
-    char m_real_file[ FILENAME_LEN ];
-    char* m_url;
-    char* m_version;
-    char* m_host;
-    int m_content_length;
     bool m_linger; //表示 HTTP 连接是否需要保持长连接（Keep - Alive）
+    bool m_keep_alive; //已排队的最后一个响应之后是否保持连接
+    unsigned char m_read_node; //读缓冲区和写缓冲区各自是从哪个节点的池借的，还要还回那里
+    unsigned char m_write_node;
+    long m_request_start; //当前请求第一个字节到达的时间
+    ssize_t m_bytes_to_send; //本次响应还剩多少字节没发
+    ssize_t m_bytes_have_send; //本次响应已经发了多少字节
 
-    char* m_file_address; //该指针用于指向通过内存映射（mmap）将磁盘文件映射到进程地址空间后的起始地址
-    //在 do_request 函数中，当服务器确定客户端请求的是一个文件时，会调用 mmap 函数将文件映射到内存，并将映射后的起始地址赋值给 m_file_address。
-    //之后，在 process_write 函数中，会使用这个指针将文件内容发送给客户端。
-    struct stat m_file_stat;
+    //第2行：发送队列
+    //已排队等待发送的文件映射，全部发完后才能释放；多段响应的几个iovec共用同一个映射
+    struct body_ref
+    {
+        char* address;
+        size_t length;
+        file_entry* entry; //不为空时映射属于缓存条目
+        gzip_entry* compressed; //不为空时是gzip缓存里的数据；两个都为空时是自己mmap的
+    };
+    //只有组装和发送响应时才需要的状态，整块从m_buffer_pools借
+    struct write_block
+    {
+        struct iovec iv[ 2 * MAX_PIPELINE ];
+        body_ref bodies[ MAX_PIPELINE ];
+        uint32_t mapped_iovs; //第i位为1表示iv[i]指向文件映射（不含gzip缓存的数据），只有这些可以零拷贝
+        char buf[ WRITE_BUFFER_SIZE ];
+    };
+    write_block* m_write_block;
+    char* m_write_buf; //它和m_iv都指向m_write_block里面，没借到时为NULL
     /*我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示
-被写内存块的数量*/
-    struct iovec m_iv[2];
+被写内存块的数量。流水线时多个响应的头部和文件体依次排在这里，一次writev发出*/
+    struct iovec* m_iv;
     int m_iv_count;
+    int m_iv_idx; //第一个还没发完的iovec
+    int m_body_count; //m_write_block->bodies里排了几个
+    int m_file_fd; //sendfile模式下打开的文件，响应发完后才关闭
+    off_t m_file_offset; //sendfile模式下文件体的发送进度，由sendfile自己推进
+    off_t m_file_end; //sendfile发到这里为止
+    long m_last_active; //最近一次读写有进展的时间
 };
 
+//只在解析请求、组装响应和响应发完释放文件时才用到的状态
+struct alignas( CACHE_LINE_SIZE ) http_conn::cold_state
+{
+    sockaddr_in address;
+    METHOD method;
+    char* url;
+    char* version;
+    long content_length; //-1表示没有Content-Length
+    header_view headers[ MAX_HEADERS ]; //当前请求的所有头部，按出现的顺序
+    int header_count;
+    unsigned char known_headers[ HDR_NUMBER ]; //已知头部在headers里的下标+1，0表示没有
+    byte_range ranges[ MAX_RANGES ]; //Range头部里可满足的各段，按请求的顺序
+    int range_count; //0表示返回整个文件
+    ENCODING content_encoding; //选中的表示的编码，Range和Content-Length都针对它
+    bool vary; //这个URL按Accept-Encoding有不同的表示，响应要带Vary
+    bool stats_prometheus; //统计请求要的是Prometheus文本格式
+
+    char* file_address; //通过mmap把请求的文件映射到进程地址空间后的起始地址，process_write里用它把文件内容排进iovec
+    off_t map_offset; //file_address对应的文件偏移，只映射了请求的范围时不为0
+    size_t map_length;
+    struct stat file_stat;
+    file_entry* entry; //从缓存借来的文件，响应发完前一直持有引用
+    gzip_entry* compressed; //从gzip缓存借来的压缩数据，file_address指向它
+
+    /*
+    零拷贝发送的状态。每次带MSG_ZEROCOPY成功的sendmsg内核都按顺序编一个号，发完后通过错误队列通知；
+    通知到之前页还被内核引用着，批次发完时用过零拷贝的文件体先挪进pinned，等发出的全部确认了再放掉
+    */
+    signed char zerocopy; //0还没在socket上打开SO_ZEROCOPY，1已打开，-1这个连接不用零拷贝
+    bool zerocopy_batch; //当前这批响应有零拷贝发出的部分
+    uint32_t zerocopy_issued; //发出了多少次零拷贝sendmsg
+    uint32_t zerocopy_completed; //收到了其中多少次的完成通知
+    body_ref pinned[ MAX_PIPELINE ];
+    int pinned_count;
+
+    //流式响应：stream不为空时还在生成；最后一块发完之前stream_buf一直借着
+    const stream_handler* stream;
+    void* stream_state;
+    char* stream_buf;
+    size_t stream_buf_size;
+    unsigned char stream_node;
+
+    //请求体：body不为空时请求体交给它；body_fd不为-1时请求体搬进这个文件，body_fd_owned表示它是m_spool_dir下的临时文件
+    const body_handler* body;
+    void* body_state;
+    long body_remaining; //请求体还有多少字节没收
+    int body_fd;
+    bool body_fd_owned;
+    int body_pipe[2]; //splice用的管道，第一次splice时才创建
+    int body_status; //finish返回的状态码
+
+    uint64_t parse_start; //这一轮解析开始的时刻
+    uint64_t write_start; //这一批响应排好的时刻，全部交给内核时记成发送耗时
+};
+
+inline bool http_conn::pending_input() const
+{
+    return m_bytes_to_send == 0 && ( m_read_idx > m_checked_idx || m_cold->stream );
+}
+
+inline bool http_conn::spooling() const
+{
+    return m_check_state == CHECK_STATE_CONTENT && m_cold->body_fd != -1 && m_cold->body_remaining > 0
+            && m_read_idx == m_checked_idx;
+}
+
 #endif
@@ -0,0 +1,94 @@
+#ifndef HTTP_DATE_H
+#define HTTP_DATE_H
+
+#include <time.h>
+#include <string.h>
+
+/*
+HTTP日期（RFC 9110的IMF-fixdate），形如"Sun, 06 Nov 1994 08:49:37 GMT"，固定29个字节。
+格式化不走strftime，不受locale影响；解析只认IMF-fixdate，过时的RFC 850/asctime格式按无效处理。
+*/
+static const int HTTP_DATE_LENGTH = 29;
+
+static const char http_weekdays[] = "SunMonTueWedThuFriSat";
+static const char http_months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+inline void put_two_digits( char* out, int value )
+{
+    out[0] = '0' + value / 10;
+    out[1] = '0' + value % 10;
+}
+
+//写HTTP_DATE_LENGTH个字节，不写结尾的\0
+inline void format_http_date( time_t t, char* out )
+{
+    struct tm tm;
+    gmtime_r( &t, &tm );
+    memcpy( out, http_weekdays + tm.tm_wday * 3, 3 );
+    out[3] = ',';
+    out[4] = ' ';
+    put_two_digits( out + 5, tm.tm_mday );
+    out[7] = ' ';
+    memcpy( out + 8, http_months + tm.tm_mon * 3, 3 );
+    out[11] = ' ';
+    int year = tm.tm_year + 1900;
+    put_two_digits( out + 12, year / 100 );
+    put_two_digits( out + 14, year % 100 );
+    out[16] = ' ';
+    put_two_digits( out + 17, tm.tm_hour );
+    out[19] = ':';
+    put_two_digits( out + 20, tm.tm_min );
+    out[22] = ':';
+    put_two_digits( out + 23, tm.tm_sec );
+    memcpy( out + 25, " GMT", 4 );
+}
+
+inline bool parse_digits( const char* p, int count, int* value )
+{
+    *value = 0;
+    for( int i = 0; i < count; ++i )
+    {
+        if( p[i] < '0' || p[i] > '9' )
+        {
+            return false;
+        }
+        *value = *value * 10 + ( p[i] - '0' );
+    }
+    return true;
+}
+
+//格式不对返回-1
+inline time_t parse_http_date( const char* text )
+{
+    if( strlen( text ) != ( size_t )HTTP_DATE_LENGTH || text[3] != ',' || text[4] != ' ' || text[7] != ' '
+        || text[11] != ' ' || text[16] != ' ' || text[19] != ':' || text[22] != ':' || memcmp( text + 25, " GMT", 4 ) != 0 )
+    {
+        return -1;
+    }
+    struct tm tm;
+    memset( &tm, 0, sizeof( tm ) );
+    int year = 0;
+    if( ! parse_digits( text + 5, 2, &tm.tm_mday ) || ! parse_digits( text + 12, 4, &year )
+        || ! parse_digits( text + 17, 2, &tm.tm_hour ) || ! parse_digits( text + 20, 2, &tm.tm_min )
+        || ! parse_digits( text + 23, 2, &tm.tm_sec ) )
+    {
+        return -1;
+    }
+    tm.tm_mon = -1;
+    for( int i = 0; i < 12; ++i )
+    {
+        if( memcmp( text + 8, http_months + i * 3, 3 ) == 0 )
+        {
+            tm.tm_mon = i;
+            break;
+        }
+    }
+    if( tm.tm_mon < 0 || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60 )
+    {
+        return -1;
+    }
+    tm.tm_year = year - 1900;
+    return timegm( &tm );
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef HTTP_HEADER_H
+#define HTTP_HEADER_H
+
+#include <cstddef>
+#include <strings.h>
+
+/*
+请求头部表。每个头部只记(偏移, 长度)，指向读缓冲区里的原始字节，不拷贝；偏移从请求
+开始处算起，读缓冲区压缩或扩容搬动数据时不用改。解析器认识的头部用一个编译期验证过
+的完美哈希识别：对小写化的名字做FNV-1a，取32个槽中的一个，每个槽最多一个已知名字，
+命中后再比一次名字就能确定，不必逐个strncasecmp。
+*/
+enum HEADER_ID
+{
+    HDR_UNKNOWN = 0,
+    HDR_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_HOST,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_EXPECT,
+    HDR_TRANSFER_ENCODING,
+    HDR_CONTENT_TYPE,
+    HDR_USER_AGENT,
+    HDR_COOKIE,
+    HDR_REFERER,
+    HDR_TE,
+    HDR_NUMBER
+};
+
+struct header_view
+{
+    unsigned short name_offset;
+    unsigned short name_length;
+    unsigned short value_offset;
+    unsigned short value_length;
+};
+
+namespace header_hash
+{
+    static const unsigned int SEED = 2166136435u; //在FNV偏移基数附近挑的，能让下面的名字各占一个槽
+    static const int SLOT_BITS = 5;
+    static const int SLOT_NUMBER = 1 << SLOT_BITS;
+
+    //下标就是HEADER_ID
+    constexpr const char* names[ HDR_NUMBER ] = {
+        "", "connection", "content-length", "host", "range", "if-range", "accept",
+        "accept-encoding", "if-none-match", "if-modified-since", "expect",
+        "transfer-encoding", "content-type", "user-agent", "cookie", "referer", "te"
+    };
+
+    constexpr char lower( char c )
+    {
+        return ( c >= 'A' && c <= 'Z' ) ? c + ( 'a' - 'A' ) : c;
+    }
+
+    constexpr int slot( const char* name, size_t length )
+    {
+        unsigned int h = SEED;
+        for( size_t i = 0; i < length; ++i )
+        {
+            h = ( h ^ ( unsigned char )lower( name[i] ) ) * 16777619u;
+        }
+        return ( h >> 8 ) & ( SLOT_NUMBER - 1 );
+    }
+
+    constexpr size_t length( const char* s )
+    {
+        size_t n = 0;
+        while( s[n] )
+        {
+            ++n;
+        }
+        return n;
+    }
+
+    struct slot_table
+    {
+        unsigned char id[ SLOT_NUMBER ];
+        unsigned char name_length[ HDR_NUMBER ];
+        bool perfect;
+    };
+
+    constexpr slot_table build()
+    {
+        slot_table table = {};
+        table.perfect = true;
+        for( int id = 1; id < HDR_NUMBER; ++id )
+        {
+            table.name_length[id] = length( names[id] );
+            int s = slot( names[id], table.name_length[id] );
+            if( table.id[s] != 0 )
+            {
+                table.perfect = false;
+            }
+            table.id[s] = id;
+        }
+        return table;
+    }
+
+    constexpr slot_table table = build();
+    static_assert( table.perfect, "header names collide, pick another SEED" );
+}
+
+//name不必以\0结尾，大小写不敏感；不认识的返回HDR_UNKNOWN
+inline HEADER_ID lookup_header( const char* name, size_t length )
+{
+    int id = header_hash::table.id[ header_hash::slot( name, length ) ];
+    if( id != HDR_UNKNOWN && header_hash::table.name_length[id] == length
+        && strncasecmp( name, header_hash::names[id], length ) == 0 )
+    {
+        return ( HEADER_ID )id;
+    }
+    return HDR_UNKNOWN;
+}
+
+#endif
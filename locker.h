@@ -4,6 +4,7 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
 
 class sem
 {
@@ -23,6 +24,20 @@ public:
     {
         return sem_wait( &m_sem ) == 0;
     }
+    //最多等ms毫秒，超时或被信号打断返回false
+    bool wait_for( int ms )
+    {
+        struct timespec deadline;
+        clock_gettime( CLOCK_REALTIME, &deadline );
+        deadline.tv_sec += ms / 1000;
+        deadline.tv_nsec += ( long )( ms % 1000 ) * 1000000;
+        if( deadline.tv_nsec >= 1000000000 )
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+        return sem_timedwait( &m_sem, &deadline ) == 0;
+    }
     bool post()
     {
         return sem_post( &m_sem ) == 0;
@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "logger.h"
+#include "server_stats.h"
+
+int logger::m_level = LEVEL_INFO;
+int logger::m_fd = STDERR_FILENO;
+int logger::m_access_fd = -1;
+std::atomic< int > logger::m_ring_count( 0 );
+std::atomic< log_ring* > logger::m_rings[ MAX_THREADS ];
+std::atomic< unsigned long > logger::m_unattached( 0 );
+std::atomic< bool > logger::m_idle( false );
+sem logger::m_wakeup;
+std::atomic< bool > logger::m_stop( false );
+pthread_t logger::m_thread;
+
+//后台线程自己用的输出缓冲，攒满或者一轮取完才write一次
+static const int OUTPUT_SIZE = 64 * 1024;
+static char log_output[ OUTPUT_SIZE ];
+static int log_used = 0;
+static char access_output[ OUTPUT_SIZE ];
+static int access_used = 0;
+static const char* const level_names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+void log_record::capture_string( const char* value )
+{
+    if( ! value )
+    {
+        value = "(null)";
+    }
+    types[ argc ] = ARG_STRING;
+    int room = ( int )sizeof( text ) - text_used - 1;
+    if( room < 0 )
+    {
+        args[ argc++ ] = sizeof( text ) - 1; //text写满时最后一个字节是上一个字符串的结尾，当空串用
+        return;
+    }
+    int len = strlen( value );
+    len = len < room ? len : room; //放不下的部分截掉
+    args[ argc++ ] = text_used;
+    memcpy( text + text_used, value, len );
+    text[ text_used + len ] = '\0';
+    text_used += len + 1;
+}
+
+static int open_log( const char* path )
+{
+    int fd = open( path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+    if( fd < 0 )
+    {
+        printf( "cannot open log file %s: %s\n", path, strerror( errno ) );
+    }
+    return fd;
+}
+
+bool logger::start( const char* path, const char* access_path, int level )
+{
+    m_level = level;
+    if( path )
+    {
+        m_fd = open_log( path );
+        if( m_fd < 0 )
+        {
+            return false;
+        }
+    }
+    if( access_path )
+    {
+        m_access_fd = open_log( access_path );
+        if( m_access_fd < 0 )
+        {
+            return false;
+        }
+    }
+    if( pthread_create( &m_thread, NULL, worker, NULL ) != 0 )
+    {
+        return false;
+    }
+    return true;
+}
+
+void logger::stop()
+{
+    m_stop = true;
+    m_wakeup.post();
+    pthread_join( m_thread, NULL );
+}
+
+unsigned long logger::dropped()
+{
+    unsigned long total = m_unattached.load( std::memory_order_relaxed );
+    int number = m_ring_count.load( std::memory_order_relaxed );
+    number = number < MAX_THREADS ? number : MAX_THREADS;
+    for( int i = 0; i < number; ++i )
+    {
+        log_ring* ring = m_rings[i].load( std::memory_order_acquire );
+        if( ring )
+        {
+            total += ring->dropped.load( std::memory_order_relaxed );
+        }
+    }
+    return total;
+}
+
+log_ring* logger::attach()
+{
+    int index = m_ring_count.fetch_add( 1, std::memory_order_relaxed );
+    if( index >= MAX_THREADS )
+    {
+        return NULL;
+    }
+    log_ring* ring = new log_ring;
+    m_rings[ index ].store( ring, std::memory_order_release );
+    logger_local_ring = ring;
+    return ring;
+}
+
+log_record* logger::claim()
+{
+    log_ring* ring = local();
+    if( ! ring )
+    {
+        m_unattached.fetch_add( 1, std::memory_order_relaxed );
+        return NULL;
+    }
+    unsigned int tail = ring->tail.load( std::memory_order_relaxed );
+    if( tail - ring->cached_head >= log_ring::CAPACITY )
+    {
+        ring->cached_head = ring->head.load( std::memory_order_acquire );
+        if( tail - ring->cached_head >= log_ring::CAPACITY )
+        {
+            ring->dropped.store( ring->dropped.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+            return NULL;
+        }
+    }
+    log_record* record = &ring->records[ tail & ( log_ring::CAPACITY - 1 ) ];
+    clock_gettime( CLOCK_REALTIME_COARSE, &record->time ); //vDSO里读一下，不进内核
+    record->argc = 0;
+    record->text_used = 0;
+    return record;
+}
+
+void logger::publish()
+{
+    log_ring* ring = logger_local_ring;
+    unsigned int tail = ring->tail.load( std::memory_order_relaxed ) + 1;
+    ring->tail.store( tail, std::memory_order_release );
+    //看起来过半了才去读一次消费者的位置；确实过半而后台线程在睡，叫醒它，免得等到超时环已经满了
+    if( tail - ring->cached_head >= log_ring::CAPACITY / 2 )
+    {
+        ring->cached_head = ring->head.load( std::memory_order_acquire );
+        if( tail - ring->cached_head >= log_ring::CAPACITY / 2 && m_idle.load( std::memory_order_relaxed ) && m_idle.exchange( false ) )
+        {
+            m_wakeup.post();
+        }
+    }
+}
+
+void logger::access( const sockaddr_in& client, const char* url, int status, long bytes, uint64_t latency )
+{
+    log_record* record = claim();
+    if( ! record )
+    {
+        return;
+    }
+    record->kind = log_record::KIND_ACCESS;
+    record->level = LEVEL_INFO;
+    record->format = NULL;
+    record->capture( client.sin_addr.s_addr );
+    record->capture( ntohs( client.sin_port ) );
+    record->capture( status );
+    record->capture( bytes );
+    record->capture( latency );
+    record->capture_string( url ? url : "-" );
+    publish();
+}
+
+void* logger::worker( void* arg )
+{
+    run();
+    return NULL;
+}
+
+void logger::run()
+{
+    while( true )
+    {
+        int number = drain();
+        flush();
+        if( number == 0 && m_stop.load() )
+        {
+            break;
+        }
+        if( number >= ( int )log_ring::CAPACITY / 4 )
+        {
+            continue; //积压得多就接着取
+        }
+        //刚取到过记录就隔1ms再取，攒成一批再write；空闲时最多睡20ms，日志最多晚这么久落盘。
+        //生产者的环过半时会提前叫醒
+        m_idle.store( true );
+        m_wakeup.wait_for( number ? 1 : 20 );
+        m_idle.store( false );
+    }
+}
+
+static void append( char* output, int* used, const char* data, int len )
+{
+    if( len > OUTPUT_SIZE - *used )
+    {
+        len = OUTPUT_SIZE - *used;
+    }
+    memcpy( output + *used, data, len );
+    *used += len;
+}
+
+static void write_all( int fd, const char* data, int len )
+{
+    while( len > 0 )
+    {
+        ssize_t n = write( fd, data, len );
+        if( n < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            return; //日志写不出去也不能影响服务
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+void logger::flush()
+{
+    if( log_used > 0 )
+    {
+        write_all( m_fd, log_output, log_used );
+        log_used = 0;
+    }
+    if( access_used > 0 )
+    {
+        write_all( m_access_fd, access_output, access_used );
+        access_used = 0;
+    }
+}
+
+//把所有环里已经发布的记录都取出来，返回取到的条数
+int logger::drain()
+{
+    static unsigned long reported = 0;
+    int number = 0;
+    double ticks_per_us = 0;
+    int ring_number = m_ring_count.load( std::memory_order_relaxed );
+    ring_number = ring_number < MAX_THREADS ? ring_number : MAX_THREADS;
+    for( int i = 0; i < ring_number; ++i )
+    {
+        log_ring* ring = m_rings[i].load( std::memory_order_acquire );
+        if( ! ring )
+        {
+            continue;
+        }
+        unsigned int head = ring->head.load( std::memory_order_relaxed );
+        unsigned int tail = ring->tail.load( std::memory_order_acquire );
+        for( ; head != tail; ++head )
+        {
+            const log_record& record = ring->records[ head & ( log_ring::CAPACITY - 1 ) ];
+            if( record.kind == log_record::KIND_ACCESS && ticks_per_us == 0 )
+            {
+                ticks_per_us = server_stats::ticks_per_ns() * 1000.0;
+            }
+            format_record( record, ticks_per_us );
+            ++number;
+            //一批记录的位置一起还给生产者，中途输出缓冲快满了先写出去
+            if( log_used > OUTPUT_SIZE - 1024 || access_used > OUTPUT_SIZE - 1024 )
+            {
+                ring->head.store( head + 1, std::memory_order_release );
+                flush();
+            }
+        }
+        ring->head.store( head, std::memory_order_release );
+    }
+    unsigned long lost = dropped();
+    if( lost != reported )
+    {
+        char line[ 96 ];
+        int len = snprintf( line, sizeof( line ), "logger: %lu records dropped because a ring was full\n", lost - reported );
+        append( log_output, &log_used, line, len );
+        reported = lost;
+    }
+    return number;
+}
+
+static int format_time( char* out, int size, const struct timespec& time, bool iso )
+{
+    //同一秒里的记录只做一次gmtime
+    static time_t cached_second = -1;
+    static char cached[ 32 ];
+    if( time.tv_sec != cached_second )
+    {
+        struct tm tm;
+        gmtime_r( &time.tv_sec, &tm );
+        strftime( cached, sizeof( cached ), "%Y-%m-%dT%H:%M:%S", &tm );
+        cached_second = time.tv_sec;
+    }
+    if( iso )
+    {
+        return snprintf( out, size, "%s.%03ldZ", cached, time.tv_nsec / 1000000 );
+    }
+    return snprintf( out, size, "%.10s %s.%03ld", cached, cached + 11, time.tv_nsec / 1000000 );
+}
+
+/*
+按格式串逐个转换说明格式化：标志、宽度和精度原样保留，长度修饰符一律换成参数实际存下来的类型，
+所以"%d"配long、"%s"配不是字符串的参数都不会出错。不支持"*"宽度。
+*/
+static int format_message( char* out, int size, const log_record& record )
+{
+    int used = 0;
+    int arg = 0;
+    const char* p = record.format;
+    while( *p && used < size - 1 )
+    {
+        if( *p != '%' )
+        {
+            out[ used++ ] = *p++;
+            continue;
+        }
+        if( p[1] == '%' )
+        {
+            out[ used++ ] = '%';
+            p += 2;
+            continue;
+        }
+        char spec[ 32 ];
+        int n = 0;
+        spec[ n++ ] = *p++;
+        while( *p && strchr( "-+ #0123456789.", *p ) && n < 20 )
+        {
+            spec[ n++ ] = *p++;
+        }
+        while( *p && strchr( "hlLqjzt", *p ) )
+        {
+            ++p;
+        }
+        char conversion = *p;
+        if( ! conversion )
+        {
+            break;
+        }
+        ++p;
+        int room = size - used;
+        int len = 0;
+        if( arg >= record.argc )
+        {
+            len = snprintf( out + used, room, "<?>" );
+        }
+        else
+        {
+            uint64_t value = record.args[ arg ];
+            int type = record.types[ arg ];
+            ++arg;
+            if( conversion == 's' )
+            {
+                spec[ n++ ] = 's';
+                spec[ n ] = '\0';
+                len = snprintf( out + used, room, spec, type == log_record::ARG_STRING ? record.text + value : "<?>" );
+            }
+            else if( type == log_record::ARG_STRING )
+            {
+                len = snprintf( out + used, room, "%s", record.text + value );
+            }
+            else if( strchr( "feEgGaA", conversion ) )
+            {
+                double d;
+                if( type == log_record::ARG_DOUBLE )
+                {
+                    memcpy( &d, &value, sizeof( d ) );
+                }
+                else
+                {
+                    d = type == log_record::ARG_INT ? ( double )( int64_t )value : ( double )value;
+                }
+                spec[ n++ ] = conversion;
+                spec[ n ] = '\0';
+                len = snprintf( out + used, room, spec, d );
+            }
+            else if( conversion == 'p' )
+            {
+                len = snprintf( out + used, room, "%p", ( void* )( uintptr_t )value );
+            }
+            else if( conversion == 'c' )
+            {
+                len = snprintf( out + used, room, "%c", ( int )value );
+            }
+            else
+            {
+                if( type == log_record::ARG_DOUBLE )
+                {
+                    double d;
+                    memcpy( &d, &value, sizeof( d ) );
+                    value = ( uint64_t )( int64_t )d;
+                }
+                spec[ n++ ] = 'l';
+                spec[ n++ ] = 'l';
+                spec[ n++ ] = strchr( "diuxXo", conversion ) ? conversion : 'd';
+                spec[ n ] = '\0';
+                if( spec[ n - 1 ] == 'd' || spec[ n - 1 ] == 'i' )
+                {
+                    len = snprintf( out + used, room, spec, ( long long )value );
+                }
+                else
+                {
+                    len = snprintf( out + used, room, spec, ( unsigned long long )value );
+                }
+            }
+        }
+        used += len < room ? len : room - 1;
+    }
+    out[ used ] = '\0';
+    return used;
+}
+
+//JSON字符串转义，URL里可能有引号、反斜杠和控制字符
+static int json_escape( char* out, int size, const char* text )
+{
+    int used = 0;
+    for( ; *text && used < size - 7; ++text )
+    {
+        unsigned char c = *text;
+        if( c == '"' || c == '\\' )
+        {
+            out[ used++ ] = '\\';
+            out[ used++ ] = c;
+        }
+        else if( c < 0x20 || c == 0x7f )
+        {
+            used += snprintf( out + used, size - used, "\\u%04x", c );
+        }
+        else
+        {
+            out[ used++ ] = c;
+        }
+    }
+    out[ used ] = '\0';
+    return used;
+}
+
+void logger::format_record( const log_record& record, double ticks_per_us )
+{
+    char line[ 1024 ];
+    int len = format_time( line, sizeof( line ), record.time, record.kind == log_record::KIND_ACCESS );
+    if( record.kind == log_record::KIND_ACCESS )
+    {
+        if( m_access_fd == -1 )
+        {
+            return;
+        }
+        char time[ 40 ];
+        memcpy( time, line, len + 1 );
+        struct in_addr address;
+        address.s_addr = ( in_addr_t )record.args[0];
+        char ip[ INET_ADDRSTRLEN ];
+        inet_ntop( AF_INET, &address, ip, sizeof( ip ) );
+        char url[ 512 ];
+        json_escape( url, sizeof( url ), record.text + record.args[5] );
+        len = snprintf( line, sizeof( line ),
+                        "{\"time\":\"%s\",\"client\":\"%s:%u\",\"url\":\"%s\",\"status\":%d,\"bytes\":%ld,\"latency_us\":%.1f}\n",
+                        time, ip, ( unsigned int )record.args[1], url, ( int )record.args[2], ( long )record.args[3],
+                        record.args[4] / ticks_per_us );
+        len = len < ( int )sizeof( line ) ? len : ( int )sizeof( line ) - 1;
+        append( access_output, &access_used, line, len );
+        return;
+    }
+    len += snprintf( line + len, sizeof( line ) - len, " %s ", level_names[ record.level & 3 ] );
+    len += format_message( line + len, sizeof( line ) - len - 1, record );
+    line[ len++ ] = '\n';
+    append( log_output, &log_used, line, len );
+}
@@ -0,0 +1,180 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <type_traits>
+#include "locker.h"
+#include "mpmc_queue.h"
+
+enum LOG_LEVEL { LEVEL_DEBUG = 0, LEVEL_INFO, LEVEL_WARN, LEVEL_ERROR };
+
+//编译期的最低级别，低于它的日志调用连参数都不会求值；编译时加-DLOG_MIN_LEVEL=0打开调试日志
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LEVEL_INFO
+#endif
+
+//format必须是字符串字面量：记录里只存指针，由后台线程格式化
+#define LOG_AT( log_level, ... ) \
+    do { \
+        if constexpr ( ( log_level ) >= LOG_MIN_LEVEL ) \
+        { \
+            if ( ( log_level ) >= logger::level() ) \
+            { \
+                logger::log( ( log_level ), __VA_ARGS__ ); \
+            } \
+        } \
+    } while ( 0 )
+#define LOG_DEBUG( ... ) LOG_AT( LEVEL_DEBUG, __VA_ARGS__ )
+#define LOG_INFO( ... ) LOG_AT( LEVEL_INFO, __VA_ARGS__ )
+#define LOG_WARN( ... ) LOG_AT( LEVEL_WARN, __VA_ARGS__ )
+#define LOG_ERROR( ... ) LOG_AT( LEVEL_ERROR, __VA_ARGS__ )
+
+/*
+定长的二进制日志记录：工作线程只把格式串指针和参数的原始值拷进来，字符串参数拷进text，
+不调printf、不加锁；格式化和write都在后台线程里做
+*/
+struct log_record
+{
+    static const int MAX_ARGS = 8;
+    enum KIND { KIND_LOG = 0, KIND_ACCESS };
+    enum ARG_TYPE { ARG_INT = 0, ARG_UINT, ARG_DOUBLE, ARG_STRING, ARG_POINTER };
+
+    struct timespec time;
+    const char* format;
+    unsigned char kind;
+    unsigned char level;
+    unsigned char argc;
+    unsigned char text_used;
+    unsigned char types[ MAX_ARGS ];
+    uint64_t args[ MAX_ARGS ]; //ARG_STRING时是在text里的偏移
+    char text[ 256 - 40 - 8 * MAX_ARGS ];
+
+    template< typename T >
+    void capture( const T& value );
+    void capture_string( const char* value );
+};
+static_assert( sizeof( log_record ) == 256, "log_record" );
+
+/*
+每个线程一个单生产者单消费者的环，生产者是这个线程，消费者是后台线程。
+head和tail各占一个缓存行，生产者另外缓存一份head，环没满时不用去读消费者的那一行
+*/
+struct alignas( CACHE_LINE_SIZE ) log_ring
+{
+    static const unsigned int CAPACITY = 4096; //必须是2的幂
+
+    log_ring() : head( 0 ), tail( 0 ), cached_head( 0 ), dropped( 0 ) {}
+
+    alignas( CACHE_LINE_SIZE ) std::atomic< unsigned int > head; //消费者的位置
+    alignas( CACHE_LINE_SIZE ) std::atomic< unsigned int > tail; //生产者的位置
+    unsigned int cached_head;
+    std::atomic< unsigned long > dropped; //环满时丢掉的记录数
+    log_record records[ CAPACITY ];
+};
+
+//当前线程的环，第一次写日志时才分配
+inline thread_local log_ring* logger_local_ring = NULL;
+
+/*
+异步日志：错误日志和访问日志共用同一套环，后台线程轮流取出所有环里的记录，格式化后攒成一批再write。
+环满了就丢弃并计数，工作线程永远不会因为日志阻塞。
+*/
+class logger
+{
+public:
+    static const int MAX_THREADS = 256; //更多的线程没有自己的环，它们的日志直接丢弃并计数
+
+    //path为NULL时错误日志写到stderr；access_path为NULL时不记访问日志
+    static bool start( const char* path, const char* access_path, int level );
+    static void stop(); //把环里剩下的都写出去，然后结束后台线程
+
+    static int level() { return m_level; }
+    static bool access_enabled() { return m_access_fd != -1; }
+    static unsigned long dropped();
+
+    template< typename... Args >
+    static void log( int level, const char* format, const Args&... args )
+    {
+        log_record* record = claim();
+        if ( ! record )
+        {
+            return;
+        }
+        record->kind = log_record::KIND_LOG;
+        record->level = level;
+        record->format = format;
+        ( record->capture( args ), ... );
+        publish();
+    }
+    //一个响应排进发送队列时记一条；latency是server_stats的滴答数
+    static void access( const sockaddr_in& client, const char* url, int status, long bytes, uint64_t latency );
+
+private:
+    static log_ring* local()
+    {
+        log_ring* ring = logger_local_ring;
+        if ( __builtin_expect( ring == NULL, 0 ) )
+        {
+            ring = attach();
+        }
+        return ring;
+    }
+    static log_ring* attach();
+    static log_record* claim();
+    static void publish();
+    static void* worker( void* arg );
+    static void run();
+    static int drain();
+    static void format_record( const log_record& record, double ticks_per_us );
+    static void flush();
+
+private:
+    static int m_level;
+    static int m_fd;
+    static int m_access_fd;
+    static std::atomic< int > m_ring_count;
+    static std::atomic< log_ring* > m_rings[ MAX_THREADS ];
+    static std::atomic< unsigned long > m_unattached; //没有环的线程丢掉的记录数
+    static std::atomic< bool > m_idle; //后台线程正要睡下，生产者发现环过半时叫醒它
+    static sem m_wakeup;
+    static std::atomic< bool > m_stop;
+    static pthread_t m_thread;
+};
+
+template< typename T >
+void log_record::capture( const T& value )
+{
+    if ( argc >= MAX_ARGS )
+    {
+        return;
+    }
+    if constexpr ( std::is_convertible< T, const char* >::value )
+    {
+        capture_string( value );
+        return;
+    }
+    else if constexpr ( std::is_floating_point< T >::value )
+    {
+        double d = value;
+        types[ argc ] = ARG_DOUBLE;
+        memcpy( &args[ argc ], &d, sizeof( d ) );
+    }
+    else if constexpr ( std::is_pointer< T >::value )
+    {
+        types[ argc ] = ARG_POINTER;
+        args[ argc ] = ( uint64_t )( uintptr_t )value;
+    }
+    else
+    {
+        static_assert( std::is_integral< T >::value || std::is_enum< T >::value, "unsupported log argument" );
+        types[ argc ] = std::is_signed< T >::value ? ARG_INT : ARG_UINT;
+        args[ argc ] = ( uint64_t )value;
+    }
+    ++argc;
+}
+
+#endif
@@ -8,17 +8,16 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <cassert>
+#include <getopt.h>
 #include <sys/epoll.h>
 
 #include "locker.h"
+#include "logger.h"
 #include "threadpool.h"
 #include "http_conn.h"
-
-#define MAX_FD 65536
-#define MAX_EVENT_NUMBER 10000
-
-extern int addfd( int epollfd, int fd, bool one_shot );
-extern int removefd( int epollfd, int fd );
+#include "reactor.h"
+#include "uring_reactor.h"
+#include "upload.h"
 
 void addsig( int sig, void( handler )(int), bool restart = true )
 {
@@ -33,138 +32,509 @@ void addsig( int sig, void( handler )(int), bool restart = true )
     assert( sigaction( sig, &sa, NULL ) != -1 );
 }
 
-void show_error( int connfd, const char* info )
+//只有长选项的参数，编号避开单字符选项
+enum
 {
-    printf( "%s", info );
-    send( connfd, info, strlen( info ), 0 );
-    close( connfd );
+    OPT_HEADER_TIMEOUT = 256,
+    OPT_BODY_TIMEOUT,
+    OPT_IDLE_TIMEOUT,
+    OPT_WRITE_TIMEOUT,
+    OPT_MAX_HEADER_SIZE,
+    OPT_PRECOMPRESSED,
+    OPT_GZIP_CACHE,
+    OPT_GZIP_HOT,
+    OPT_GZIP_LEVEL,
+    OPT_CACHE_CONTROL,
+    OPT_STATS_PATH,
+    OPT_BACKLOG,
+    OPT_DEFER_ACCEPT,
+    OPT_FASTOPEN,
+    OPT_SHARED_LISTENER,
+    OPT_LOG_FILE,
+    OPT_LOG_LEVEL,
+    OPT_ACCESS_LOG,
+    OPT_WORKERS,
+    OPT_MIN_WORKERS,
+    OPT_CPUS,
+    OPT_PIN,
+    OPT_CODEL_TARGET,
+    OPT_CODEL_INTERVAL,
+    OPT_ZEROCOPY,
+    OPT_AUTOINDEX,
+    OPT_UPLOAD,
+    OPT_MAX_BODY,
+    OPT_BODY_SPILL,
+    OPT_SPOOL_DIR,
+    OPT_MAX_CONNS
+};
+
+//TCP从4.14起支持SO_ZEROCOPY，更早的内核上setsockopt会失败
+static bool zerocopy_supported()
+{
+    int fd = socket( PF_INET, SOCK_STREAM, 0 );
+    if( fd < 0 )
+    {
+        return false;
+    }
+    int on = 1;
+    bool supported = setsockopt( fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof( on ) ) == 0;
+    close( fd );
+    return supported;
 }
 
+static void usage( const char* prog )
+{
+    printf( "usage: %s [options] ip_address port_number\n", prog );
+    printf( "  -r, --reactors N   run N reactor threads, each with its own epoll and SO_REUSEPORT listener\n" );
+    printf( "                     (default 0: one main reactor plus the worker threadpool, the classic mode;\n" );
+    printf( "                     -w, --workers, --min-workers and --codel-* only apply there and are\n" );
+    printf( "                     rejected together with -r N or -u)\n" );
+    printf( "  -s, --sendfile     send file bodies with sendfile() instead of mmap+writev\n" );
+    printf( "  -u, --io-uring     use the io_uring backend (multishot accept/recv, linked splice for\n" );
+    printf( "                     file bodies); requests are parsed on the ring threads, -r N runs N rings.\n" );
+    printf( "                     falls back to epoll when the kernel lacks support\n" );
+    printf( "  -w, --work-stealing  use per-worker Chase-Lev deques with random stealing instead of\n" );
+    printf( "                     the shared FIFO queue (classic mode only)\n" );
+    printf( "  --shared-listener  requires -r N: all reactors accept from one listening socket registered\n" );
+    printf( "                     with EPOLLEXCLUSIVE, instead of one SO_REUSEPORT socket each\n" );
+    printf( "                     (epoll reactors only, the io_uring rings keep one socket each)\n" );
+    printf( "  --workers N        threadpool size in classic mode (default 8)\n" );
+    printf( "  --min-workers N    with N < --workers, start N workers and grow or shrink between the two\n" );
+    printf( "                     from queue depth and worker wait time (default: fixed size)\n" );
+    printf( "  --cpus LIST        CPUs to place threads on, e.g. 0-7,16-23 (default: all allowed CPUs)\n" );
+    printf( "  --pin core|node    pin each reactor and worker to one CPU, or to every CPU of one NUMA node;\n" );
+    printf( "                     buffers then come from a pool bound to that node (default: no pinning)\n" );
+    printf( "  --codel-target MS  classic mode: once every request in an interval waited longer than MS in the\n" );
+    printf( "                     threadpool queue, answer those waiting over 2*MS with 503 and pause accept\n" );
+    printf( "                     (default 10, 0: off)\n" );
+    printf( "  --codel-interval MS  window for the overload check above (default 100)\n" );
+    printf( "  --zerocopy BYTES   send mapped file bodies of at least BYTES with MSG_ZEROCOPY, keeping them\n" );
+    printf( "                     mapped until the kernel reports completion (epoll backends without -s;\n" );
+    printf( "                     default 0: off, smaller bodies are always copied)\n" );
+    printf( "  --autoindex        list directories as HTML, generated while sending with chunked encoding\n" );
+    printf( "                     (default: directory requests get 400)\n" );
+    printf( "  --upload PREFIX    accept PUT/POST under PREFIX and store the body as the file at that URL;\n" );
+    printf( "                     repeatable (default: only GET)\n" );
+    printf( "  -c, --file-cache N cache up to N open files (fd, stat, mapping) under doc_root,\n" );
+    printf( "                     invalidated through inotify (default 0: disabled)\n" );
+    printf( "  --max-conns N        size of the connection table, indexed by fd; the soft RLIMIT_NOFILE is\n" );
+    printf( "                       raised towards N when needed (default %d, at most %d)\n", MAX_FD, 1 << 22 );
+    printf( "  --backlog N          listen() backlog, capped by net.core.somaxconn (default %d)\n", listen_options().backlog );
+    printf( "  --defer-accept SEC   TCP_DEFER_ACCEPT: only accept a connection once its request has arrived,\n" );
+    printf( "                       waiting up to SEC seconds (default %d, 0: off)\n", listen_options().defer_accept );
+    printf( "  --fastopen N         enable TCP Fast Open with a queue of N pending requests (default 0: off)\n" );
+    printf( "  --header-timeout MS  max time to receive request line and headers (default %d, 0: off)\n", http_conn::m_header_timeout );
+    printf( "  --body-timeout MS    max gap between request body reads (default %d, 0: off)\n", http_conn::m_body_timeout );
+    printf( "  --idle-timeout MS    max idle time of a keep-alive connection (default %d, 0: off)\n", http_conn::m_idle_timeout );
+    printf( "  --write-timeout MS   max time a response may stall on a full socket (default %d, 0: off)\n", http_conn::m_write_timeout );
+    printf( "  --max-header-size N  largest read buffer a request's headers may grow to (default %d)\n", http_conn::m_max_read_buffer );
+    printf( "  --max-body BYTES     largest request body accepted, larger ones get 413 (default %ld)\n", http_conn::m_max_body );
+    printf( "  --body-spill BYTES   bodies larger than this are spliced from the socket straight into a file\n" );
+    printf( "                       instead of being passed through memory (default %ld)\n", http_conn::m_body_spill );
+    printf( "  --spool-dir DIR      where such files are created when the handler has none (default %s)\n", http_conn::m_spool_dir );
+    printf( "  --precompressed      serve file.br / file.gz next to a text file when the client accepts it\n" );
+    printf( "  --gzip-cache MB      gzip hot text files in a background thread and keep up to MB megabytes\n" );
+    printf( "                       of them in memory (default 0: disabled)\n" );
+    printf( "  --gzip-hot N         requests for a file before it is compressed (default 2)\n" );
+    printf( "  --gzip-level N       zlib compression level 1-9 for the gzip cache (default 6)\n" );
+    printf( "  --cache-control PREFIX=VALUE  send Cache-Control: VALUE for files under PREFIX, e.g.\n" );
+    printf( "                       /static/=public,max-age=31536000,immutable; repeatable, longest prefix wins\n" );
+    printf( "  --stats-path PATH    serve live statistics as JSON at PATH, or as Prometheus text at\n" );
+    printf( "                       PATH?format=prometheus (default %s, empty: disabled)\n", http_conn::m_stats_path );
+    printf( "  --log-file PATH      append the error log to PATH instead of stderr\n" );
+    printf( "  --log-level LEVEL    debug, info, warn or error (default info; debug logs need a build with\n" );
+    printf( "                       -DLOG_MIN_LEVEL=0)\n" );
+    printf( "  --access-log PATH    append one JSON line per response (client, url, status, bytes, latency)\n" );
+}
+
+//--log-level的取值，不认识的返回-1
+static int parse_log_level( const char* name )
+{
+    static const char* const names[] = { "debug", "info", "warn", "error" };
+    for( int i = LEVEL_DEBUG; i <= LEVEL_ERROR; ++i )
+    {
+        if( strcmp( name, names[i] ) == 0 )
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//每个环一个监听socket，和多reactor模式一样靠SO_REUSEPORT分配连接；内核不支持时返回false，由调用方改用epoll
+static bool run_io_uring( const char* ip, int port, const listen_options& options, http_conn* users, int max_fd, int number )
+{
+    int* listenfds = new int[ number ];
+    uring_reactor** rings = new uring_reactor*[ number ];
+    for( int i = 0; i < number; ++i )
+    {
+        listenfds[i] = create_listenfd( ip, port, number > 1, options );
+        rings[i] = new uring_reactor( listenfds[i], users, max_fd );
+        if( ! rings[i]->init() )
+        {
+            LOG_WARN( "io_uring is not supported by this kernel, falling back to epoll" );
+            for( int j = 0; j <= i; ++j )
+            {
+                delete rings[j];
+                close( listenfds[j] );
+            }
+            delete [] rings;
+            delete [] listenfds;
+            return false;
+        }
+    }
+    for( int i = 0; i < number; ++i )
+    {
+        if( ! rings[i]->start( i ) )
+        {
+            printf( "failed to start io_uring reactor %d\n", i );
+            exit( 1 );
+        }
+    }
+    for( int i = 0; i < number; ++i )
+    {
+        rings[i]->join();
+        delete rings[i];
+        close( listenfds[i] );
+    }
+    delete [] rings;
+    delete [] listenfds;
+    return true;
+}
 
 int main( int argc, char* argv[] )
 {  //./server 127.0.0.1 54321
-    if( argc <= 2 )
+    int reactor_number = 0;
+    int file_cache_capacity = 0;
+    bool use_io_uring = false;
+    bool shared_listener = false;
+    listen_options listener;
+    int gzip_cache_mb = 0;
+    int gzip_hot = 2;
+    int gzip_level = 6;
+    threadpool< http_conn >::POLICY pool_policy = threadpool< http_conn >::FIFO;
+    const char* log_file = NULL;
+    const char* access_log = NULL;
+    int log_level = LEVEL_INFO;
+    int worker_number = 8;
+    int min_workers = 0;
+    const char* cpus = NULL;
+    int pin_mode = cpu_topology::PIN_NONE;
+    int codel_target = 10;
+    int codel_interval = 100;
+    int max_conns = MAX_FD;
+    bool pool_options = false; //给了只对线程池模式有效的选项
+
+    static const struct option long_options[] = {
+        { "reactors", required_argument, NULL, 'r' },
+        { "sendfile", no_argument, NULL, 's' },
+        { "io-uring", no_argument, NULL, 'u' },
+        { "file-cache", required_argument, NULL, 'c' },
+        { "work-stealing", no_argument, NULL, 'w' },
+        { "header-timeout", required_argument, NULL, OPT_HEADER_TIMEOUT },
+        { "body-timeout", required_argument, NULL, OPT_BODY_TIMEOUT },
+        { "idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT },
+        { "write-timeout", required_argument, NULL, OPT_WRITE_TIMEOUT },
+        { "max-header-size", required_argument, NULL, OPT_MAX_HEADER_SIZE },
+        { "precompressed", no_argument, NULL, OPT_PRECOMPRESSED },
+        { "gzip-cache", required_argument, NULL, OPT_GZIP_CACHE },
+        { "gzip-hot", required_argument, NULL, OPT_GZIP_HOT },
+        { "gzip-level", required_argument, NULL, OPT_GZIP_LEVEL },
+        { "cache-control", required_argument, NULL, OPT_CACHE_CONTROL },
+        { "stats-path", required_argument, NULL, OPT_STATS_PATH },
+        { "backlog", required_argument, NULL, OPT_BACKLOG },
+        { "defer-accept", required_argument, NULL, OPT_DEFER_ACCEPT },
+        { "fastopen", required_argument, NULL, OPT_FASTOPEN },
+        { "shared-listener", no_argument, NULL, OPT_SHARED_LISTENER },
+        { "log-file", required_argument, NULL, OPT_LOG_FILE },
+        { "log-level", required_argument, NULL, OPT_LOG_LEVEL },
+        { "access-log", required_argument, NULL, OPT_ACCESS_LOG },
+        { "workers", required_argument, NULL, OPT_WORKERS },
+        { "min-workers", required_argument, NULL, OPT_MIN_WORKERS },
+        { "cpus", required_argument, NULL, OPT_CPUS },
+        { "pin", required_argument, NULL, OPT_PIN },
+        { "codel-target", required_argument, NULL, OPT_CODEL_TARGET },
+        { "codel-interval", required_argument, NULL, OPT_CODEL_INTERVAL },
+        { "zerocopy", required_argument, NULL, OPT_ZEROCOPY },
+        { "autoindex", no_argument, NULL, OPT_AUTOINDEX },
+        { "upload", required_argument, NULL, OPT_UPLOAD },
+        { "max-body", required_argument, NULL, OPT_MAX_BODY },
+        { "body-spill", required_argument, NULL, OPT_BODY_SPILL },
+        { "spool-dir", required_argument, NULL, OPT_SPOOL_DIR },
+        { "max-conns", required_argument, NULL, OPT_MAX_CONNS },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while( ( opt = getopt_long( argc, argv, "r:suc:wh", long_options, NULL ) ) != -1 )
     {
-        printf( "usage: %s ip_address port_number\n", basename( argv[0] ) );
+        switch( opt )
+        {
+            case 'r':
+                reactor_number = atoi( optarg );
+                break;
+            case 's':
+                http_conn::m_use_sendfile = true;
+                break;
+            case 'u':
+                use_io_uring = true;
+                break;
+            case 'c':
+                file_cache_capacity = atoi( optarg );
+                break;
+            case 'w':
+                pool_policy = threadpool< http_conn >::WORK_STEALING;
+                pool_options = true;
+                break;
+            case OPT_HEADER_TIMEOUT:
+                http_conn::m_header_timeout = atoi( optarg );
+                break;
+            case OPT_BODY_TIMEOUT:
+                http_conn::m_body_timeout = atoi( optarg );
+                break;
+            case OPT_IDLE_TIMEOUT:
+                http_conn::m_idle_timeout = atoi( optarg );
+                break;
+            case OPT_WRITE_TIMEOUT:
+                http_conn::m_write_timeout = atoi( optarg );
+                break;
+            case OPT_MAX_HEADER_SIZE:
+                http_conn::m_max_read_buffer = atoi( optarg );
+                break;
+            case OPT_PRECOMPRESSED:
+                http_conn::m_precompressed = true;
+                break;
+            case OPT_GZIP_CACHE:
+                gzip_cache_mb = atoi( optarg );
+                break;
+            case OPT_GZIP_HOT:
+                gzip_hot = atoi( optarg );
+                break;
+            case OPT_GZIP_LEVEL:
+                gzip_level = atoi( optarg );
+                break;
+            case OPT_CACHE_CONTROL:
+                if( ! http_conn::add_cache_rule( optarg ) )
+                {
+                    usage( basename( argv[0] ) );
+                    return 1;
+                }
+                break;
+            case OPT_STATS_PATH:
+                http_conn::m_stats_path = optarg[0] ? optarg : NULL;
+                break;
+            case OPT_BACKLOG:
+                listener.backlog = atoi( optarg );
+                break;
+            case OPT_DEFER_ACCEPT:
+                listener.defer_accept = atoi( optarg );
+                break;
+            case OPT_FASTOPEN:
+                listener.fastopen = atoi( optarg );
+                break;
+            case OPT_SHARED_LISTENER:
+                shared_listener = true;
+                break;
+            case OPT_LOG_FILE:
+                log_file = optarg;
+                break;
+            case OPT_LOG_LEVEL:
+                log_level = parse_log_level( optarg );
+                break;
+            case OPT_ACCESS_LOG:
+                access_log = optarg;
+                break;
+            case OPT_WORKERS:
+                worker_number = atoi( optarg );
+                pool_options = true;
+                break;
+            case OPT_MIN_WORKERS:
+                min_workers = atoi( optarg );
+                pool_options = true;
+                break;
+            case OPT_CPUS:
+                cpus = optarg;
+                break;
+            case OPT_CODEL_TARGET:
+                codel_target = atoi( optarg );
+                pool_options = true;
+                break;
+            case OPT_CODEL_INTERVAL:
+                codel_interval = atoi( optarg );
+                pool_options = true;
+                break;
+            case OPT_ZEROCOPY:
+                http_conn::m_zerocopy_threshold = atol( optarg );
+                break;
+            case OPT_AUTOINDEX:
+                http_conn::m_autoindex = true;
+                break;
+            case OPT_UPLOAD:
+                if( ! http_conn::add_body_route( optarg, &upload_handler ) )
+                {
+                    usage( basename( argv[0] ) );
+                    return 1;
+                }
+                break;
+            case OPT_MAX_BODY:
+                http_conn::m_max_body = atol( optarg );
+                break;
+            case OPT_BODY_SPILL:
+                http_conn::m_body_spill = atol( optarg );
+                break;
+            case OPT_SPOOL_DIR:
+                http_conn::m_spool_dir = optarg;
+                break;
+            case OPT_MAX_CONNS:
+                max_conns = atoi( optarg );
+                break;
+            case OPT_PIN:
+                pin_mode = strcmp( optarg, "core" ) == 0 ? cpu_topology::PIN_CORE
+                           : strcmp( optarg, "node" ) == 0 ? cpu_topology::PIN_NODE : -1;
+                break;
+            default:
+                usage( basename( argv[0] ) );
+                return 1;
+        }
+    }
+    //--shared-listener只在多reactor模式下有意义，线程池的选项（-w、--workers、--min-workers、--codel-*）只在
+    //单reactor加线程池的模式下有意义，给错了模式时悄悄忽略会让人以为生效了
+    if( argc - optind < 2 || reactor_number < 0 || ( shared_listener && reactor_number == 0 )
+        || ( pool_options && ( reactor_number > 0 || use_io_uring ) ) || file_cache_capacity < 0
+        || max_conns <= 0 || max_conns > ( 1 << 22 )
+        || listener.backlog <= 0 || listener.defer_accept < 0 || listener.fastopen < 0 || log_level < 0
+        || worker_number <= 0 || min_workers < 0 || min_workers > worker_number || pin_mode < 0
+        || codel_target < 0 || codel_interval <= 0 || http_conn::m_zerocopy_threshold < 0
+        || http_conn::m_max_body < 0 || http_conn::m_body_spill < 0
+        || gzip_cache_mb < 0 || gzip_hot <= 0 || gzip_level < 1 || gzip_level > 9
+        || http_conn::m_max_read_buffer < http_conn::READ_BUFFER_SIZE
+        || http_conn::m_max_read_buffer > http_conn::MAX_HEADER_BUFFER
+        || ( http_conn::m_stats_path && http_conn::m_stats_path[0] != '/' ) )
+    {
+        usage( basename( argv[0] ) );
         return 1;
     }
-    const char* ip = argv[1];
-    int port = atoi( argv[2] );
+    const char* ip = argv[optind];
+    int port = atoi( argv[optind + 1] );
 
     addsig( SIGPIPE, SIG_IGN ); //忽略SIGPIPE信号 防止服务器崩溃
 
-    threadpool< http_conn >* pool = NULL;
-    try
+    if( ! logger::start( log_file, access_log, log_level ) )
     {
-        pool = new threadpool< http_conn >;
+        printf( "failed to start logger\n" );
+        return 1;
     }
-    catch( ... )
+
+    //多reactor时各reactor在节点间轮流排开，单reactor时主reactor和工作线程挤在同一个节点上
+    if( ! cpu_topology::init( cpus, ( cpu_topology::PIN_MODE )pin_mode, reactor_number > 0 || use_io_uring ) )
     {
+        printf( "invalid cpu list: %s\n", cpus ? cpus : "(affinity)" );
         return 1;
     }
+    if( codel_target > 0 )
+    {
+        double ticks_per_ms = server_stats::ticks_per_ns() * 1e6;
+        http_conn::m_codel.configure( ( uint64_t )( codel_target * ticks_per_ms ), ( uint64_t )( codel_interval * ticks_per_ms ) );
+    }
+    if( http_conn::m_zerocopy_threshold > 0 && ! zerocopy_supported() )
+    {
+        LOG_WARN( "SO_ZEROCOPY is not supported by the kernel, large bodies will be copied" );
+        http_conn::m_zerocopy_threshold = 0;
+    }
 
-    http_conn* users = new http_conn[ MAX_FD ];
-    //当前实现更准确的说是连接对象预分配表，而非传统意义的可复用连接池。
-    assert( users ); //检查 users 指针是否为 nullptr。如果 new 运算符在分配内存时失败，它会返回 nullptr
-    int user_count = 0;
-
-    int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
-    assert( listenfd >= 0 );
-    struct linger tmp = { 1, 0 };
-    /*
-    tmp = { 1, 0 };：将 l_onoff 设置为 1，表示开启 SO_LINGER 选项；将 l_linger 设置为 0，
-    表示在调用 close 函数关闭套接字时，会立即发送一个 RST 段给对端，而不是进行正常的 TCP 四次挥手关闭连接。
-    这样可以避免在某些情况下出现的 TIME - WAIT 状态。
-    */
-    setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
-
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero( &address, sizeof( address ) );
-    address.sin_family = AF_INET;
-    inet_pton( AF_INET, ip, &address.sin_addr );
-    address.sin_port = htons( port );
-
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
-    assert( ret >= 0 );
-
-    ret = listen( listenfd, 5 );
-    assert( ret >= 0 );
-
-    epoll_event events[ MAX_EVENT_NUMBER ];
-    int epollfd = epoll_create( 5 );
-    assert( epollfd != -1 );
-    addfd( epollfd, listenfd, false );
-    http_conn::m_epollfd = epollfd;
-
-    while( true )
-    {
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
-        if ( ( number < 0 ) && ( errno != EINTR ) )
+    if( cpu_topology::node_count() > 1 )
+    {
+        for( int i = 0; i < cpu_topology::node_count(); ++i )
+        {
+            http_conn::m_buffer_pools[i].bind( cpu_topology::node_id( i ) );
+        }
+    }
+
+    if( file_cache_capacity > 0 )
+    {
+        //sendfile模式只需要fd，不必为缓存的文件建立映射
+        http_conn::m_file_cache = new file_cache( doc_root, file_cache_capacity, ! http_conn::m_use_sendfile );
+        if( ! http_conn::m_file_cache->start() )
+        {
+            printf( "failed to start file cache watcher, errno is: %d\n", errno );
+            return 1;
+        }
+    }
+
+    if( gzip_cache_mb > 0 )
+    {
+        http_conn::m_gzip_cache = new gzip_cache( doc_root, ( size_t )gzip_cache_mb << 20, gzip_hot, gzip_level );
+        if( ! http_conn::m_gzip_cache->start() )
         {
-            printf( "epoll failure\n" );
-            break;
+            printf( "failed to start gzip cache worker, errno is: %d\n", errno );
+            return 1;
         }
+    }
 
-        for ( int i = 0; i < number; i++ )
+    int max_fd = max_fd_limit( max_conns );
+    http_conn* users = new http_conn[ max_fd ];
+    //当前实现更准确的说是连接对象预分配表，而非传统意义的可复用连接池。
+    assert( users ); //检查 users 指针是否为 nullptr。如果 new 运算符在分配内存时失败，它会返回 nullptr
+
+    //内核不支持io_uring时run_io_uring返回false，退回epoll后端
+    bool served = use_io_uring && run_io_uring( ip, port, listener, users, max_fd, reactor_number > 0 ? reactor_number : 1 );
+    if( ! served )
+    {
+        if( reactor_number == 0 )
         {
-            int sockfd = events[i].data.fd;
-            if( sockfd == listenfd )
+            threadpool< http_conn >* pool = NULL;
+            try
             {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof( client_address );
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                if ( connfd < 0 )
-                {
-                    printf( "errno is: %d\n", errno );
-                    continue;
-                }
-                if( http_conn::m_user_count >= MAX_FD )
-                {
-                    show_error( connfd, "Internal server busy" );
-                    continue;
-                }
-                
-                users[connfd].init( connfd, client_address );
-                //满巧妙的，直接设置成数组下标 以后访问更方便
+                //编号0留给主reactor，工作线程从1开始排
+                pool = new threadpool< http_conn >( worker_number, 10000, pool_policy, min_workers, 1 );
             }
-            else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+            catch( ... )
             {
-                //检测某个就绪的文件描述符是否发生了错误或连接关闭
-                /*
-                EPOLLRDHUP：表示对端关闭连接或者半关闭（关闭写端）。
-                EPOLLHUP：表示套接字对应的文件描述符被挂起，通常意味着连接已经断开。
-                EPOLLERR：表示套接字发生了错误，可能是网络问题、资源耗尽等原因导致。
-                */
-                users[sockfd].close_conn();
+                return 1;
             }
-            else if( events[i].events & EPOLLIN )
+
+            int listenfd = create_listenfd( ip, port, false, listener );
+            reactor* main_reactor = new reactor( listenfd, users, max_fd, pool );
+            cpu_topology::place_thread( 0 );
+            main_reactor->loop();
+
+            delete main_reactor;
+            close( listenfd );
+            delete pool;
+        }
+        else
+        {
+            //默认每个reactor一个独立的监听socket，由内核按四元组哈希分配新连接，accept不再有惊群和共享锁；
+            //--shared-listener时共用一个socket，新连接交给正空闲的reactor，负载不均时更好
+            int* listenfds = new int[ reactor_number ];
+            reactor** reactors = new reactor*[ reactor_number ];
+            for( int i = 0; i < reactor_number; ++i )
             {
-                if( users[sockfd].read() )
-                {
-                    pool->append( users + sockfd );
-                }
-                else
+                listenfds[i] = shared_listener && i > 0 ? listenfds[0] : create_listenfd( ip, port, ! shared_listener, listener );
+                reactors[i] = new reactor( listenfds[i], users, max_fd, NULL, shared_listener );
+                if( ! reactors[i]->start( i ) )
                 {
-                    users[sockfd].close_conn();
+                    printf( "failed to start reactor %d\n", i );
+                    return 1;
                 }
             }
-            else if( events[i].events & EPOLLOUT )
+            for( int i = 0; i < reactor_number; ++i )
             {
-                if( !users[sockfd].write() )
+                reactors[i]->join();
+                delete reactors[i];
+                if( ! shared_listener || i == 0 )
                 {
-                    users[sockfd].close_conn();
+                    close( listenfds[i] );
                 }
             }
-            else
-            {}
-            //读和写都是由主线程来完成 子线程负责利用已有的缓冲区的buf处理业务逻辑
+            delete [] reactors;
+            delete [] listenfds;
         }
     }
 
-    close( epollfd );
-    close( listenfd );
     delete [] users;
-    delete pool;
+    delete http_conn::m_file_cache;
+    delete http_conn::m_gzip_cache;
+    logger::stop();
     return 0;
 }
@@ -0,0 +1,154 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+
+#define CACHE_LINE_SIZE 64
+
+inline void cpu_relax()
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+    __builtin_ia32_pause();
+#elif defined( __aarch64__ )
+    asm volatile( "yield" ::: "memory" );
+#endif
+}
+
+/*
+有界无锁多生产者多消费者环形队列（Dmitry Vyukov的算法）。
+每个槽位带一个序号：序号==pos表示空、可以写；序号==pos+1表示已写入、可以读。
+生产者和消费者各自用CAS抢占下标，槽位用序号发布，不需要任何锁，也不为每个元素分配节点。
+入队和出队下标分别独占一个缓存行，避免生产者和消费者之间的伪共享。
+*/
+template< typename T >
+class mpmc_queue
+{
+public:
+    explicit mpmc_queue( size_t capacity );
+    ~mpmc_queue();
+
+    bool push( const T& data ); //满则返回false
+    bool pop( T& data ); //空则返回false
+    size_t size_approx() const;
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    struct cell
+    {
+        std::atomic< size_t > sequence;
+        T data;
+    };
+
+    mpmc_queue( const mpmc_queue& );
+    mpmc_queue& operator=( const mpmc_queue& );
+
+private:
+    cell* m_buffer;
+    size_t m_mask;
+    alignas( CACHE_LINE_SIZE ) std::atomic< size_t > m_enqueue_pos;
+    alignas( CACHE_LINE_SIZE ) std::atomic< size_t > m_dequeue_pos;
+    char m_pad[ CACHE_LINE_SIZE - sizeof( std::atomic< size_t > ) ];
+};
+
+template< typename T >
+mpmc_queue< T >::mpmc_queue( size_t capacity ) : m_buffer( NULL ), m_mask( 0 )
+{
+    if( capacity < 2 )
+    {
+        throw std::exception();
+    }
+    size_t size = 2;
+    while( size < capacity )
+    {
+        size <<= 1; //容量取2的幂，下标用位与取模
+    }
+    m_buffer = new cell[ size ];
+    m_mask = size - 1;
+    for( size_t i = 0; i < size; ++i )
+    {
+        m_buffer[i].sequence.store( i, std::memory_order_relaxed );
+    }
+    m_enqueue_pos.store( 0, std::memory_order_relaxed );
+    m_dequeue_pos.store( 0, std::memory_order_relaxed );
+}
+
+template< typename T >
+mpmc_queue< T >::~mpmc_queue()
+{
+    delete [] m_buffer;
+}
+
+template< typename T >
+bool mpmc_queue< T >::push( const T& data )
+{
+    cell* c;
+    size_t pos = m_enqueue_pos.load( std::memory_order_relaxed );
+    while( true )
+    {
+        c = &m_buffer[ pos & m_mask ];
+        size_t seq = c->sequence.load( std::memory_order_acquire );
+        intptr_t diff = ( intptr_t )seq - ( intptr_t )pos;
+        if( diff == 0 )
+        {
+            if( m_enqueue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+            {
+                break;
+            }
+        }
+        else if( diff < 0 )
+        {
+            return false; //槽位还没被消费者取走，队列满
+        }
+        else
+        {
+            pos = m_enqueue_pos.load( std::memory_order_relaxed );
+        }
+    }
+    c->data = data;
+    c->sequence.store( pos + 1, std::memory_order_release );
+    return true;
+}
+
+template< typename T >
+bool mpmc_queue< T >::pop( T& data )
+{
+    cell* c;
+    size_t pos = m_dequeue_pos.load( std::memory_order_relaxed );
+    while( true )
+    {
+        c = &m_buffer[ pos & m_mask ];
+        size_t seq = c->sequence.load( std::memory_order_acquire );
+        intptr_t diff = ( intptr_t )seq - ( intptr_t )( pos + 1 );
+        if( diff == 0 )
+        {
+            if( m_dequeue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+            {
+                break;
+            }
+        }
+        else if( diff < 0 )
+        {
+            return false; //队列空
+        }
+        else
+        {
+            pos = m_dequeue_pos.load( std::memory_order_relaxed );
+        }
+    }
+    data = c->data;
+    c->sequence.store( pos + m_mask + 1, std::memory_order_release ); //留给下一圈的生产者
+    return true;
+}
+
+template< typename T >
+size_t mpmc_queue< T >::size_approx() const
+{
+    size_t tail = m_enqueue_pos.load( std::memory_order_relaxed );
+    size_t head = m_dequeue_pos.load( std::memory_order_relaxed );
+    return tail > head ? tail - head : 0;
+}
+
+#endif
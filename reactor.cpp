@@ -0,0 +1,367 @@
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <cassert>
+
+#include "reactor.h"
+
+extern void addfd( int epollfd, int fd, bool one_shot );
+
+static void show_error( int connfd, const char* info )
+{
+    LOG_WARN( "refused connection: %s", info );
+    send( connfd, info, strlen( info ), 0 );
+    close( connfd );
+}
+
+int create_listenfd( const char* ip, int port, bool reuse_port, const listen_options& options )
+{
+    //accept4要求监听socket是非阻塞的，才能在边缘触发下一直收到EAGAIN
+    int listenfd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    assert( listenfd >= 0 );
+    struct linger tmp = { 1, 0 };
+    /*
+    tmp = { 1, 0 };：将 l_onoff 设置为 1，表示开启 SO_LINGER 选项；将 l_linger 设置为 0，
+    表示在调用 close 函数关闭套接字时，会立即发送一个 RST 段给对端，而不是进行正常的 TCP 四次挥手关闭连接。
+    这样可以避免在某些情况下出现的 TIME - WAIT 状态。
+    */
+    setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
+    int reuse = 1;
+    setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) ); //短连接正常关闭会留下TIME_WAIT，重启时仍要能bind
+    if( reuse_port )
+    {
+        //多个socket绑定同一端口，由内核按四元组哈希把新连接分给各个reactor的监听socket
+        setsockopt( listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) );
+    }
+    if( options.defer_accept > 0 )
+    {
+        //只连不发的连接留在内核里，不占连接对象、不唤醒epoll；accept到的连接读缓冲区里已经有请求了
+        setsockopt( listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options.defer_accept, sizeof( options.defer_accept ) );
+    }
+    if( options.fastopen > 0 && setsockopt( listenfd, IPPROTO_TCP, TCP_FASTOPEN, &options.fastopen, sizeof( options.fastopen ) ) < 0 )
+    {
+        LOG_WARN( "TCP_FASTOPEN is not supported, errno is: %d", errno );
+    }
+
+    int ret = 0;
+    struct sockaddr_in address;
+    bzero( &address, sizeof( address ) );
+    address.sin_family = AF_INET;
+    inet_pton( AF_INET, ip, &address.sin_addr );
+    address.sin_port = htons( port );
+
+    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
+    assert( ret >= 0 );
+
+    ret = listen( listenfd, options.backlog );
+    assert( ret >= 0 );
+    return listenfd;
+}
+
+int max_fd_limit( int wanted )
+{
+    /*连接表按fd下标一次建好，每个槽都要构造，表的大小就是启动时的常驻内存。
+    只按要求的大小建表，软限制不够时才往硬限制的方向提，不会因为硬限制很大就建一张很大的表*/
+    struct rlimit limit;
+    if( getrlimit( RLIMIT_NOFILE, &limit ) < 0 )
+    {
+        return wanted;
+    }
+    if( limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < ( rlim_t )wanted )
+    {
+        struct rlimit raised = limit;
+        raised.rlim_cur = limit.rlim_max == RLIM_INFINITY || limit.rlim_max > ( rlim_t )wanted ? ( rlim_t )wanted : limit.rlim_max;
+        if( setrlimit( RLIMIT_NOFILE, &raised ) == 0 )
+        {
+            limit = raised;
+        }
+    }
+    if( limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > ( rlim_t )wanted )
+    {
+        return wanted;
+    }
+    return ( int )limit.rlim_cur;
+}
+
+reactor::reactor( int listenfd, http_conn* users, int max_fd, threadpool< http_conn >* pool, bool shared_listener ) :
+        m_epollfd( -1 ), m_listenfd( listenfd ), m_users( users ), m_max_fd( max_fd ), m_pool( pool ),
+        m_accept_pending( false ), m_spare_fd( -1 ), m_thread( 0 ), m_slot( -1 ), m_wheel( TIMER_TICK_MS )
+{
+    m_epollfd = epoll_create( 5 );
+    if( m_epollfd == -1 )
+    {
+        throw std::exception();
+    }
+    if( shared_listener )
+    {
+        //几个epoll实例监视同一个socket时，没有EPOLLEXCLUSIVE每个新连接都会把所有reactor叫醒
+        epoll_event event;
+        event.data.fd = m_listenfd;
+        event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+        epoll_ctl( m_epollfd, EPOLL_CTL_ADD, m_listenfd, &event );
+    }
+    else
+    {
+        addfd( m_epollfd, m_listenfd, false );
+    }
+    m_spare_fd = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+}
+
+reactor::~reactor()
+{
+    close( m_epollfd );
+    if( m_spare_fd != -1 )
+    {
+        close( m_spare_fd );
+    }
+}
+
+bool reactor::start( int slot )
+{
+    m_slot = slot;
+    return pthread_create( &m_thread, NULL, worker, this ) == 0;
+}
+
+void reactor::join()
+{
+    pthread_join( m_thread, NULL );
+}
+
+void* reactor::worker( void* arg )
+{
+    reactor* r = ( reactor* )arg;
+    cpu_topology::place_thread( r->m_slot ); //先固定再跑loop，之后这个线程分配的内存都落在它的节点上
+    r->loop();
+    return r;
+}
+
+/*
+监听socket是边缘触发的，一次通知之后必须一直accept到EAGAIN，否则积压的连接要等下一个新连接到来才会被收。
+一轮最多收ACCEPT_BATCH个，连接风暴时已有连接上的事件也能及时处理；返回true表示队列里可能还有
+*/
+bool reactor::handle_accept()
+{
+    for( int i = 0; i < ACCEPT_BATCH; ++i )
+    {
+        uint64_t start = server_stats::now();
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof( client_address );
+        //新连接直接就是非阻塞的，省掉两次fcntl
+        int connfd = accept4( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if ( connfd < 0 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                return false;
+            }
+            if( errno == EINTR || errno == ECONNABORTED )
+            {
+                continue; //对端在accept之前就重置了连接
+            }
+            if( ( errno == EMFILE || errno == ENFILE ) && m_spare_fd != -1 )
+            {
+                drop_connection();
+                continue;
+            }
+            LOG_ERROR( "accept failure, errno is: %d", errno );
+            return false;
+        }
+        if( connfd >= m_max_fd || http_conn::m_user_count >= m_max_fd )
+        {
+            show_error( connfd, "Internal server busy" );
+            continue;
+        }
+
+        m_users[connfd].init( connfd, client_address, m_epollfd );
+        //满巧妙的，直接设置成数组下标 以后访问更方便
+        refresh_timer( connfd );
+        server_stats::record( PHASE_ACCEPT, start );
+    }
+    return true;
+}
+
+//fd用光了：队首的连接不收下来就一直占着队列，边缘触发下也不会再有通知。放掉预留的fd把它接下来马上关掉
+void reactor::drop_connection()
+{
+    close( m_spare_fd );
+    int connfd = accept( m_listenfd, NULL, NULL );
+    if( connfd >= 0 )
+    {
+        close( connfd );
+    }
+    m_spare_fd = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+}
+
+//每次处理完连接上的事件后，按它现在所处的阶段重新设置超时；只是摘链挂链，不分配内存
+void reactor::refresh_timer( int sockfd )
+{
+    http_conn& conn = m_users[sockfd];
+    long deadline = conn.deadline();
+    if( deadline == 0 )
+    {
+        m_wheel.remove( &conn.m_timer );
+        return;
+    }
+    conn.m_timer.data = &conn;
+    m_wheel.schedule( &conn.m_timer, deadline );
+}
+
+//读缓冲区里有待解析的请求：单reactor模式交给线程池，多reactor模式就地处理
+void reactor::dispatch( int sockfd )
+{
+    refresh_timer( sockfd );
+    if( m_pool )
+    {
+        m_users[sockfd].m_in_pool.store( true, std::memory_order_relaxed );
+        m_users[sockfd].m_queued_at = server_stats::now();
+        if( ! m_pool->append( m_users + sockfd, m_users[sockfd].worker_hint() ) )
+        {
+            //队列满了：连接已经是EPOLLONESHOT，不回应也不关掉就会一直挂着，直接回503关闭
+            m_users[sockfd].m_queued_at = 0;
+            m_users[sockfd].m_in_pool.store( false, std::memory_order_relaxed );
+            server_stats::add( STAT_POOL_REJECTED );
+            m_users[sockfd].shed();
+            close_conn( sockfd );
+        }
+    }
+    else
+    {
+        m_users[sockfd].process(); //多reactor模式下就地解析，省去线程间的交接
+        if( ! m_users[sockfd].closed() )
+        {
+            refresh_timer( sockfd );
+        }
+    }
+}
+
+//线程池排不过来了：CoDel判定过载，或者队列已经过半。这时再accept新连接只会让排队更长
+bool reactor::saturated() const
+{
+    return m_pool && ( http_conn::m_codel.overloaded() || m_pool->queued() >= ( size_t )m_pool->max_requests() / 2 );
+}
+
+void reactor::close_conn( int sockfd )
+{
+    m_wheel.remove( &m_users[sockfd].m_timer );
+    m_users[sockfd].close_conn();
+}
+
+void reactor::on_timeout( void* data, void* arg )
+{
+    reactor* r = ( reactor* )arg;
+    http_conn* conn = ( http_conn* )data;
+    //先看m_in_pool：工作线程关闭连接时先标记已关闭再放开它，看到不在池里之后再看closed()才可靠
+    if( conn->m_in_pool.load( std::memory_order_acquire ) )
+    {
+        //正在线程池里处理，下一个tick再看
+        r->m_wheel.schedule( &conn->m_timer, timer_wheel::now_ms() + TIMER_TICK_MS );
+        return;
+    }
+    if( conn->closed() )
+    {
+        return; //已经被工作线程关掉了，定时器是残留的
+    }
+    long deadline = conn->deadline();
+    if( deadline != 0 && deadline > timer_wheel::now_ms() )
+    {
+        r->m_wheel.schedule( &conn->m_timer, deadline ); //到期前又有了进展
+        return;
+    }
+    conn->close_conn();
+}
+
+void reactor::loop()
+{
+    while( true )
+    {
+        //有定时器时按tick醒来推进时间轮，否则一直等到有事件；监听队列还没收完时只是看一眼
+        //过载时暂停accept，监听队列留在内核里，每毫秒看一次是否恢复
+        bool accept_ready = m_accept_pending && ! saturated();
+        int timeout = accept_ready ? 0 : ( m_accept_pending ? 1 : ( m_wheel.empty() ? -1 : TIMER_TICK_MS ) );
+        int number = epoll_wait( m_epollfd, m_events, MAX_EVENT_NUMBER, timeout );
+        if ( ( number < 0 ) && ( errno != EINTR ) )
+        {
+            LOG_ERROR( "epoll failure, errno is: %d", errno );
+            break;
+        }
+
+        for ( int i = 0; i < number; i++ )
+        {
+            int sockfd = m_events[i].data.fd;
+            uint32_t events = m_events[i].events;
+            //工作线程modfd之后才放开m_in_pool，事件可能在这两步之间就到了。等它放开再处理，
+            //否则这边重新派发设上的标记会被它随后的清除覆盖掉
+            while( m_pool && sockfd != m_listenfd && m_users[sockfd].m_in_pool.load( std::memory_order_acquire ) )
+            {
+                sched_yield();
+            }
+            if( sockfd != m_listenfd && ( events & EPOLLERR ) && m_users[sockfd].reap_zerocopy() )
+            {
+                events &= ~EPOLLERR; //错误队列里只是MSG_ZEROCOPY的完成通知
+            }
+            if( sockfd == m_listenfd )
+            {
+                m_accept_pending = true; //先处理已有连接上的事件，这一轮最后再accept
+            }
+            else if( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+            {
+                //检测某个就绪的文件描述符是否发生了错误或连接关闭
+                /*
+                EPOLLRDHUP：表示对端关闭连接或者半关闭（关闭写端）。
+                EPOLLHUP：表示套接字对应的文件描述符被挂起，通常意味着连接已经断开。
+                EPOLLERR：表示套接字发生了错误，可能是网络问题、资源耗尽等原因导致。
+                */
+                close_conn( sockfd );
+            }
+            else if( events & EPOLLIN )
+            {
+                if( ! m_users[sockfd].read() )
+                {
+                    close_conn( sockfd );
+                }
+                else if( m_users[sockfd].spooling() )
+                {
+                    m_users[sockfd].rearm(); //请求体还在往文件里搬，没有要解析的，等下一次EPOLLIN
+                    refresh_timer( sockfd );
+                }
+                else
+                {
+                    dispatch( sockfd );
+                }
+            }
+            else if( events & EPOLLOUT )
+            {
+                if( !m_users[sockfd].write() )
+                {
+                    close_conn( sockfd );
+                }
+                else if( m_users[sockfd].pending_input() )
+                {
+                    dispatch( sockfd ); //读缓冲区里还有流水线请求，不用等新数据
+                }
+                else
+                {
+                    refresh_timer( sockfd );
+                }
+            }
+            else
+            {
+                m_users[sockfd].rearm(); //只有完成通知，EPOLLONESHOT已经把连接摘下来了
+            }
+            //单reactor模式下读和写都是由主线程来完成 子线程负责利用已有的缓冲区的buf处理业务逻辑
+        }
+        if( m_accept_pending && ! saturated() )
+        {
+            m_accept_pending = handle_accept();
+        }
+        m_wheel.advance( timer_wheel::now_ms(), on_timeout, this );
+    }
+}
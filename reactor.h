@@ -0,0 +1,68 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <sys/epoll.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+#include "http_conn.h"
+#include "timer_wheel.h"
+
+#define MAX_FD 65536 //默认的连接表大小，--max-conns可以改
+#define MAX_EVENT_NUMBER 10000
+#define TIMER_TICK_MS 100
+#define ACCEPT_BATCH 64 //一轮最多accept多少个连接，剩下的等这一轮的事件处理完再接着收
+
+//监听socket的参数，由main按命令行填好
+struct listen_options
+{
+    listen_options() : backlog( 4096 ), defer_accept( 1 ), fastopen( 0 ) {}
+    int backlog; //内核还会按net.core.somaxconn截断
+    int defer_accept; //TCP_DEFER_ACCEPT的秒数：握手完成后等到请求数据到了才唤醒accept，0表示不用
+    int fastopen; //TCP Fast Open的队列长度，0表示不开
+};
+
+/*
+一个reactor对应一个epoll实例和一个监听socket，负责其上所有连接的accept/recv/writev。
+pool不为空时是经典的单reactor模式：主线程读完数据后交给线程池执行process()；
+pool为空时是多reactor模式：每个reactor线程自己完成I/O和解析，连接始终留在同一个线程上。
+shared_listener为true时几个reactor共用同一个监听socket，用EPOLLEXCLUSIVE注册，新连接只唤醒其中一个。
+*/
+class reactor
+{
+public:
+    reactor( int listenfd, http_conn* users, int max_fd, threadpool< http_conn >* pool, bool shared_listener = false );
+    ~reactor();
+
+    void loop();
+    bool start( int slot = -1 ); //在新线程中运行loop，slot是cpu_topology里的线程编号，-1表示不固定
+    void join();
+
+private:
+    static void* worker( void* arg );
+    static void on_timeout( void* data, void* arg );
+    bool handle_accept();
+    bool saturated() const;
+    void drop_connection();
+    void refresh_timer( int sockfd );
+    void dispatch( int sockfd );
+    void close_conn( int sockfd );
+
+private:
+    int m_epollfd;
+    int m_listenfd;
+    http_conn* m_users; //所有reactor共享同一张按fd下标的连接表，fd在进程内唯一，不会冲突
+    int m_max_fd; //连接表的大小
+    threadpool< http_conn >* m_pool;
+    bool m_accept_pending; //上一轮accept收满了一批，监听队列里可能还有
+    int m_spare_fd; //预留的fd，进程fd用光时放掉它好把队首的连接接下来关掉
+    pthread_t m_thread;
+    int m_slot;
+    timer_wheel m_wheel; //本reactor上所有连接的超时
+    epoll_event m_events[ MAX_EVENT_NUMBER ];
+};
+
+int create_listenfd( const char* ip, int port, bool reuse_port, const listen_options& options );
+int max_fd_limit( int wanted ); //连接表大小：wanted和RLIMIT_NOFILE里小的那个，需要时把软限制提上去
+
+#endif
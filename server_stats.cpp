@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <vector>
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <cpuid.h>
+#endif
+
+#include "server_stats.h"
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool server_stats::m_use_tsc = server_stats::detect_tsc();
+uint64_t server_stats::m_start_ticks = server_stats::now();
+uint64_t server_stats::m_start_ns = monotonic_ns();
+std::atomic< int > server_stats::m_slot_count( 0 );
+std::atomic< stat_slot* > server_stats::m_slots[ MAX_THREADS ];
+stat_slot server_stats::m_overflow( true );
+
+stat_slot::stat_slot( bool shared ) : shared( shared )
+{
+    for( int i = 0; i < STAT_COUNTER_NUMBER; ++i )
+    {
+        counters[i].store( 0, std::memory_order_relaxed );
+    }
+    for( int i = 0; i < PHASE_NUMBER; ++i )
+    {
+        for( int j = 0; j < BUCKET_NUMBER; ++j )
+        {
+            phases[i].buckets[j].store( 0, std::memory_order_relaxed );
+        }
+        phases[i].sum.store( 0, std::memory_order_relaxed );
+        phases[i].max.store( 0, std::memory_order_relaxed );
+    }
+}
+
+uint64_t stat_slot::highest_of( int index )
+{
+    if( index < ( 1 << SUB_BITS ) )
+    {
+        return index;
+    }
+    int k = ( index - ( 1 << SUB_BITS ) ) / ( 1 << SUB_BITS ) + SUB_BITS;
+    int sub = ( index - ( 1 << SUB_BITS ) ) % ( 1 << SUB_BITS );
+    uint64_t width = ( uint64_t )1 << ( k - SUB_BITS );
+    return ( ( uint64_t )( ( 1 << SUB_BITS ) + sub ) << ( k - SUB_BITS ) ) + width - 1;
+}
+
+//只有不变TSC（频率不随降频、睡眠改变，各核同步）才能直接拿rdtsc计时
+bool server_stats::detect_tsc()
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+    unsigned int eax, ebx, ecx, edx;
+    if( __get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx ) )
+    {
+        return ( edx & ( 1u << 8 ) ) != 0;
+    }
+#endif
+    return false;
+}
+
+//TSC的频率用启动以来的滴答数除以单调时钟的纳秒数算出来，运行越久越准
+double server_stats::ticks_per_ns()
+{
+    if( ! m_use_tsc )
+    {
+        return 1.0;
+    }
+    uint64_t elapsed = monotonic_ns() - m_start_ns;
+    if( elapsed < 10000000 )
+    {
+        struct timespec pause = { 0, ( long )( 10000000 - elapsed ) };
+        nanosleep( &pause, NULL );
+        elapsed = monotonic_ns() - m_start_ns;
+    }
+    return ( double )( now() - m_start_ticks ) / elapsed;
+}
+
+stat_slot* server_stats::attach()
+{
+    stat_slot* slot = &m_overflow;
+    int index = m_slot_count.fetch_add( 1, std::memory_order_relaxed );
+    if( index < MAX_THREADS )
+    {
+        slot = new stat_slot( false );
+        m_slots[ index ].store( slot, std::memory_order_release );
+    }
+    stats_local_slot = slot;
+    return slot;
+}
+
+static void appendf( std::string* out, const char* format, ... )
+{
+    char line[ 512 ];
+    va_list arg_list;
+    va_start( arg_list, format );
+    int len = vsnprintf( line, sizeof( line ), format, arg_list );
+    va_end( arg_list );
+    if( len > 0 )
+    {
+        out->append( line, len < ( int )sizeof( line ) ? len : ( int )sizeof( line ) - 1 );
+    }
+}
+
+static const char* const counter_names[ STAT_COUNTER_NUMBER ] = {
+    "connections_accepted", "connections_closed", "responses_2xx", "responses_3xx", "responses_4xx", "responses_5xx",
+    "bytes_read", "bytes_sent", "pool_rejected", "requests_shed",
+    "bytes_sent_zerocopy", "zerocopy_copied" };
+static const char* const counter_help[ STAT_COUNTER_NUMBER ] = {
+    "Connections accepted.", "Connections closed.", "Responses with a 2xx status.", "Responses with a 3xx status.",
+    "Responses with a 4xx status.", "Responses with a 5xx status.", "Bytes received from clients.",
+    "Bytes handed to the kernel for sending.", "Requests dropped because the threadpool queue was full.",
+    "Requests answered with 503 because the server was overloaded.", "Bytes sent with MSG_ZEROCOPY.",
+    "Zerocopy sends the kernel completed by copying." };
+static const char* const phase_names[ PHASE_NUMBER ] = { "accept", "read", "queue", "parse", "request", "write" };
+
+//Prometheus直方图的桶边界（秒），直方图的格子跨过边界时算进下一个桶
+static const char* const le_names[] = { "0.000001", "0.000005", "0.00001", "0.00005", "0.0001", "0.0005", "0.001",
+                                        "0.005", "0.01", "0.05", "0.1", "0.5", "1", "5" };
+static const double le_values[] = { 1e-6, 5e-6, 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3, 1e-2, 5e-2, 1e-1, 5e-1, 1, 5 };
+static const int LE_NUMBER = sizeof( le_values ) / sizeof( le_values[0] );
+
+struct merged_phase
+{
+    std::vector< uint64_t > buckets;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+//percentile取0~100，返回所在格子的上界（不超过max），单位是滴答
+static uint64_t value_at( const merged_phase& phase, double percentile )
+{
+    if( phase.count == 0 )
+    {
+        return 0;
+    }
+    uint64_t rank = ( uint64_t )( percentile / 100.0 * phase.count + 0.5 );
+    rank = rank < 1 ? 1 : ( rank > phase.count ? phase.count : rank );
+    uint64_t seen = 0;
+    for( int i = 0; i < stat_slot::BUCKET_NUMBER; ++i )
+    {
+        seen += phase.buckets[i];
+        if( seen >= rank )
+        {
+            uint64_t upper = stat_slot::highest_of( i );
+            return upper < phase.max ? upper : phase.max;
+        }
+    }
+    return phase.max;
+}
+
+void server_stats::render( std::string* out, bool prometheus, const stat_value* extra, int extra_count )
+{
+    uint64_t counters[ STAT_COUNTER_NUMBER ] = { 0 };
+    merged_phase phases[ PHASE_NUMBER ];
+    for( int i = 0; i < PHASE_NUMBER; ++i )
+    {
+        phases[i].buckets.assign( stat_slot::BUCKET_NUMBER, 0 );
+        phases[i].count = 0;
+        phases[i].sum = 0;
+        phases[i].max = 0;
+    }
+
+    int registered = m_slot_count.load( std::memory_order_relaxed );
+    int slot_number = registered < MAX_THREADS ? registered : MAX_THREADS;
+    for( int s = 0; s <= slot_number; ++s )
+    {
+        //最后一轮是共用的槽；注册到一半的线程槽还是NULL，下一次再算它
+        const stat_slot* slot = s < slot_number ? m_slots[s].load( std::memory_order_acquire ) : &m_overflow;
+        if( ! slot )
+        {
+            continue;
+        }
+        for( int i = 0; i < STAT_COUNTER_NUMBER; ++i )
+        {
+            counters[i] += slot->counters[i].load( std::memory_order_relaxed );
+        }
+        for( int i = 0; i < PHASE_NUMBER; ++i )
+        {
+            const stat_slot::histogram& h = slot->phases[i];
+            for( int j = 0; j < stat_slot::BUCKET_NUMBER; ++j )
+            {
+                uint64_t n = h.buckets[j].load( std::memory_order_relaxed );
+                phases[i].buckets[j] += n;
+                phases[i].count += n;
+            }
+            //sum和桶是分开读的，可能差几个正在写的样本
+            phases[i].sum += h.sum.load( std::memory_order_relaxed );
+            uint64_t max = h.max.load( std::memory_order_relaxed );
+            phases[i].max = max > phases[i].max ? max : phases[i].max;
+        }
+    }
+    double tpn = ticks_per_ns();
+    double uptime = ( monotonic_ns() - m_start_ns ) / 1e9;
+    out->clear();
+    if( ! prometheus )
+    {
+        appendf( out, "{\"uptime_seconds\":%.3f,\"threads\":%d,\"counters\":{", uptime, registered );
+        for( int i = 0; i < STAT_COUNTER_NUMBER; ++i )
+        {
+            appendf( out, "%s\"%s\":%lu", i ? "," : "", counter_names[i], ( unsigned long )counters[i] );
+        }
+        for( int i = 0; i < extra_count; ++i )
+        {
+            if( extra[i].counter )
+            {
+                appendf( out, ",\"%s\":%lu", extra[i].name, extra[i].value );
+            }
+        }
+        out->append( "},\"gauges\":{" );
+        bool first = true;
+        for( int i = 0; i < extra_count; ++i )
+        {
+            if( ! extra[i].counter )
+            {
+                appendf( out, "%s\"%s\":%lu", first ? "" : ",", extra[i].name, extra[i].value );
+                first = false;
+            }
+        }
+        out->append( "},\"latency_us\":{" );
+        for( int i = 0; i < PHASE_NUMBER; ++i )
+        {
+            const merged_phase& p = phases[i];
+            double scale = 1.0 / ( tpn * 1000.0 );
+            appendf( out, "%s\"%s\":{\"count\":%lu,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+                     i ? "," : "", phase_names[i], ( unsigned long )p.count, p.count ? p.sum * scale / p.count : 0.0,
+                     value_at( p, 50 ) * scale, value_at( p, 90 ) * scale, value_at( p, 99 ) * scale,
+                     value_at( p, 99.9 ) * scale, p.max * scale );
+        }
+        out->append( "}}\n" );
+        return;
+    }
+
+    appendf( out, "# HELP mini_webserver_uptime_seconds Seconds since the server started.\n"
+                  "# TYPE mini_webserver_uptime_seconds gauge\nmini_webserver_uptime_seconds %.3f\n", uptime );
+    appendf( out, "# HELP mini_webserver_threads Threads that have recorded statistics.\n"
+                  "# TYPE mini_webserver_threads gauge\nmini_webserver_threads %d\n", registered );
+    for( int i = 0; i < STAT_COUNTER_NUMBER; ++i )
+    {
+        appendf( out, "# HELP mini_webserver_%s_total %s\n# TYPE mini_webserver_%s_total counter\nmini_webserver_%s_total %lu\n",
+                 counter_names[i], counter_help[i], counter_names[i], counter_names[i], ( unsigned long )counters[i] );
+    }
+    for( int i = 0; i < extra_count; ++i )
+    {
+        const char* suffix = extra[i].counter ? "_total" : "";
+        const char* type = extra[i].counter ? "counter" : "gauge";
+        appendf( out, "# HELP mini_webserver_%s%s %s\n# TYPE mini_webserver_%s%s %s\nmini_webserver_%s%s %lu\n",
+                 extra[i].name, suffix, extra[i].help, extra[i].name, suffix, type, extra[i].name, suffix, extra[i].value );
+    }
+    out->append( "# HELP mini_webserver_phase_seconds Time spent in each phase of a request.\n"
+                 "# TYPE mini_webserver_phase_seconds histogram\n" );
+    for( int i = 0; i < PHASE_NUMBER; ++i )
+    {
+        const merged_phase& p = phases[i];
+        uint64_t cumulative = 0;
+        int bucket = 0;
+        for( int le = 0; le < LE_NUMBER; ++le )
+        {
+            //格子的上界换算成秒还不超过边界的，都算进这个桶
+            while( bucket < stat_slot::BUCKET_NUMBER && stat_slot::highest_of( bucket ) / tpn / 1e9 <= le_values[ le ] )
+            {
+                cumulative += p.buckets[ bucket ];
+                ++bucket;
+            }
+            appendf( out, "mini_webserver_phase_seconds_bucket{phase=\"%s\",le=\"%s\"} %lu\n",
+                     phase_names[i], le_names[ le ], ( unsigned long )cumulative );
+        }
+        appendf( out, "mini_webserver_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", phase_names[i], ( unsigned long )p.count );
+        appendf( out, "mini_webserver_phase_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[i], p.sum / tpn / 1e9 );
+        appendf( out, "mini_webserver_phase_seconds_count{phase=\"%s\"} %lu\n", phase_names[i], ( unsigned long )p.count );
+    }
+}
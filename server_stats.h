@@ -0,0 +1,178 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#endif
+#include "mpmc_queue.h"
+
+//只增不减的计数器
+enum STAT_COUNTER
+{
+    STAT_ACCEPTED = 0,
+    STAT_CLOSED,
+    STAT_STATUS_2XX,
+    STAT_STATUS_3XX,
+    STAT_STATUS_4XX,
+    STAT_STATUS_5XX,
+    STAT_BYTES_READ,
+    STAT_BYTES_SENT,
+    STAT_POOL_REJECTED, //线程池队列满，没能交出去的请求
+    STAT_SHED, //过载时回了503的请求，包括队列满和排队太久两种
+    STAT_ZEROCOPY_BYTES, //用MSG_ZEROCOPY交给内核的字节，也算在STAT_BYTES_SENT里
+    STAT_ZEROCOPY_COPIED, //内核最后还是拷贝了的零拷贝发送（完成通知里带SO_EE_CODE_ZEROCOPY_COPIED）
+    STAT_COUNTER_NUMBER
+};
+
+//请求经过的各个阶段，每个阶段一个耗时直方图
+enum STAT_PHASE
+{
+    PHASE_ACCEPT = 0, //accept加连接初始化
+    PHASE_READ, //一次read()里的recv循环（io_uring后端是拷进读缓冲区）
+    PHASE_QUEUE, //在线程池队列里等待
+    PHASE_PARSE, //解析请求行和头部
+    PHASE_REQUEST, //do_request
+    PHASE_WRITE, //响应排好到最后一个字节交给内核
+    PHASE_NUMBER
+};
+
+//由使用方在渲染时临时提供的值，比如当前连接数、缓存命中数
+struct stat_value
+{
+    const char* name;
+    const char* help;
+    unsigned long value;
+    bool counter; //false表示瞬时值
+};
+
+/*
+每个线程一个按缓存行对齐的槽，只有这个线程写，所以加一不需要lock前缀，只是一次普通的读和写；
+别的线程渲染时用relaxed读，看到的可能晚一点但不会撕裂。耗时直方图和bench/histogram.h一样是对数-线性的，
+单位是时钟滴答（有不变TSC时是rdtsc，否则是CLOCK_MONOTONIC的纳秒），渲染时才换算成时间。
+*/
+struct alignas( CACHE_LINE_SIZE ) stat_slot
+{
+    static const int SUB_BITS = 4; //每个2的幂区间分成16格，相对误差不超过1/16
+    static const int BUCKET_NUMBER = ( 1 << SUB_BITS ) + ( 64 - SUB_BITS ) * ( 1 << SUB_BITS );
+
+    struct histogram
+    {
+        std::atomic< uint64_t > buckets[ BUCKET_NUMBER ]; //样本数就是各格之和，不另外记
+        std::atomic< uint64_t > sum;
+        std::atomic< uint64_t > max;
+    };
+
+    explicit stat_slot( bool shared );
+
+    void add( STAT_COUNTER counter, uint64_t n ) { bump( counters[ counter ], n ); }
+    void record( STAT_PHASE phase, uint64_t ticks )
+    {
+        histogram& h = phases[ phase ];
+        bump( h.buckets[ index_of( ticks ) ], 1 );
+        bump( h.sum, ticks );
+        if( ticks > h.max.load( std::memory_order_relaxed ) )
+        {
+            h.max.store( ticks, std::memory_order_relaxed ); //共享的槽上偶尔丢一次最大值可以接受
+        }
+    }
+
+    static int index_of( uint64_t value )
+    {
+        if( value < ( 1u << SUB_BITS ) )
+        {
+            return ( int )value;
+        }
+        int k = 63 - __builtin_clzll( value );
+        int sub = ( int )( value >> ( k - SUB_BITS ) ) - ( 1 << SUB_BITS );
+        return ( 1 << SUB_BITS ) + ( k - SUB_BITS ) * ( 1 << SUB_BITS ) + sub;
+    }
+    static uint64_t highest_of( int index ); //这一格里最大的值
+
+    std::atomic< uint64_t > counters[ STAT_COUNTER_NUMBER ];
+    histogram phases[ PHASE_NUMBER ];
+    bool shared; //线程太多时后来的线程共用一个槽，只有它要用原子加
+
+private:
+    void bump( std::atomic< uint64_t >& value, uint64_t n )
+    {
+        if( shared )
+        {
+            value.fetch_add( n, std::memory_order_relaxed );
+        }
+        else
+        {
+            value.store( value.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+        }
+    }
+};
+
+//当前线程的槽，第一次记录时才分配
+inline thread_local stat_slot* stats_local_slot = NULL;
+
+/*
+全进程的运行统计：各线程只写自己的槽，/__stats之类的请求到来时才把所有槽加起来，
+渲染成JSON或者Prometheus文本格式。记录一次只是读一次TSC和几次不带锁的加法，可以一直开着。
+*/
+class server_stats
+{
+public:
+    static const int MAX_THREADS = 256; //超过这么多线程，后面的共用一个槽
+
+    static uint64_t now()
+    {
+#if defined( __x86_64__ ) || defined( __i386__ )
+        if( m_use_tsc )
+        {
+            return __rdtsc();
+        }
+#endif
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ( uint64_t )ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    static void add( STAT_COUNTER counter, uint64_t n = 1 ) { local()->add( counter, n ); }
+    //记下从start到现在的耗时，返回现在的时刻，方便接着给下一个阶段计时
+    static uint64_t record( STAT_PHASE phase, uint64_t start )
+    {
+        uint64_t end = now();
+        local()->record( phase, end > start ? end - start : 0 );
+        return end;
+    }
+    static void record_between( STAT_PHASE phase, uint64_t start, uint64_t end )
+    {
+        local()->record( phase, end > start ? end - start : 0 );
+    }
+
+    //把所有线程的计数和直方图加起来，连同extra一起渲染到out
+    static void render( std::string* out, bool prometheus, const stat_value* extra, int extra_count );
+    //每纳秒多少滴答，换算别处记下的滴答数用；启动后不到10ms时会先睡到10ms
+    static double ticks_per_ns();
+
+private:
+    static stat_slot* local()
+    {
+        stat_slot* slot = stats_local_slot;
+        if( __builtin_expect( slot == NULL, 0 ) )
+        {
+            slot = attach();
+        }
+        return slot;
+    }
+    static stat_slot* attach();
+    static bool detect_tsc();
+
+private:
+    static bool m_use_tsc;
+    static uint64_t m_start_ticks; //进程启动时的滴答和单调时钟，渲染时据此换算TSC频率和运行时长
+    static uint64_t m_start_ns;
+    static std::atomic< int > m_slot_count;
+    static std::atomic< stat_slot* > m_slots[ MAX_THREADS ];
+    static stat_slot m_overflow;
+};
+
+#endif
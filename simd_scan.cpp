@@ -0,0 +1,105 @@
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#endif
+
+#include "simd_scan.h"
+
+const char* find_either_scalar( const char* begin, const char* end, char a, char b )
+{
+    for( ; begin < end; ++begin )
+    {
+        if( *begin == a || *begin == b )
+        {
+            break;
+        }
+    }
+    return begin;
+}
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+
+//只有这两个函数用对应指令集编译，其余代码仍按基线生成，老CPU上不会碰到非法指令
+__attribute__(( target( "sse4.2" ) ))
+const char* find_either_sse42( const char* begin, const char* end, char a, char b )
+{
+    const __m128i set = _mm_setr_epi8( a, b, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 );
+    while( end - begin >= 16 )
+    {
+        __m128i chunk = _mm_loadu_si128( ( const __m128i* )begin );
+        //集合里只有前2个字节有效，与chunk中任意一个相等的最低位置；没有时返回16
+        int index = _mm_cmpestri( set, 2, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT );
+        if( index < 16 )
+        {
+            return begin + index;
+        }
+        begin += 16;
+    }
+    return find_either_scalar( begin, end, a, b );
+}
+
+__attribute__(( target( "avx2" ) ))
+const char* find_either_avx2( const char* begin, const char* end, char a, char b )
+{
+    const __m256i va = _mm256_set1_epi8( a );
+    const __m256i vb = _mm256_set1_epi8( b );
+    while( end - begin >= 32 )
+    {
+        __m256i chunk = _mm256_loadu_si256( ( const __m256i* )begin );
+        __m256i hit = _mm256_or_si256( _mm256_cmpeq_epi8( chunk, va ), _mm256_cmpeq_epi8( chunk, vb ) );
+        unsigned int mask = _mm256_movemask_epi8( hit );
+        if( mask )
+        {
+            return begin + __builtin_ctz( mask );
+        }
+        begin += 32;
+    }
+    return find_either_sse42( begin, end, a, b ); //剩下不足32字节时再用16字节的走一轮
+}
+
+static scan_function select_scan()
+{
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) )
+    {
+        return find_either_avx2;
+    }
+    if( __builtin_cpu_supports( "sse4.2" ) )
+    {
+        return find_either_sse42;
+    }
+    return find_either_scalar;
+}
+
+#else
+
+const char* find_either_sse42( const char* begin, const char* end, char a, char b )
+{
+    return find_either_scalar( begin, end, a, b );
+}
+
+const char* find_either_avx2( const char* begin, const char* end, char a, char b )
+{
+    return find_either_scalar( begin, end, a, b );
+}
+
+static scan_function select_scan()
+{
+    return find_either_scalar;
+}
+
+#endif
+
+scan_function find_either = select_scan();
+
+const char* scan_implementation()
+{
+    if( find_either == find_either_avx2 )
+    {
+        return "avx2";
+    }
+    if( find_either == find_either_sse42 )
+    {
+        return "sse4.2";
+    }
+    return "scalar";
+}
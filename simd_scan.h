@@ -0,0 +1,20 @@
+#ifndef SIMD_SCAN_H
+#define SIMD_SCAN_H
+
+/*
+在[begin, end)里找第一个等于a或b的字节，找不到返回end。解析器用它找行结束符(\r \n)
+和请求行里的分隔符(空格 \t)。启动时按CPU能力选一次实现：AVX2每次比较32字节，
+SSE4.2用pcmpestri每次16字节，都不支持时逐字节比较。不足一个向量的尾部逐字节处理，
+不会读到end之后。
+*/
+typedef const char* ( *scan_function )( const char* begin, const char* end, char a, char b );
+
+extern scan_function find_either;
+
+const char* find_either_scalar( const char* begin, const char* end, char a, char b );
+const char* find_either_sse42( const char* begin, const char* end, char a, char b );
+const char* find_either_avx2( const char* begin, const char* end, char a, char b );
+
+const char* scan_implementation(); //当前选中的实现，"avx2"、"sse4.2"或"scalar"
+
+#endif
@@ -0,0 +1,237 @@
+#!/bin/sh
+# 协议行为的回归测试：在临时目录里起一个服务器，用curl发请求检查状态码和内容，有一项不对就以非0退出。
+# 用法：tests/http_test.sh（make test），需要curl和python3
+# 环境变量：
+#   TEST_PORT   服务器端口（默认18081）
+set -e
+
+ROOT=$( cd "$( dirname "$0" )/.." && pwd )
+PORT=${TEST_PORT:-18081}
+URL=http://127.0.0.1:$PORT
+WORK=$( mktemp -d )
+SERVER_PID=
+FAILED=0
+
+cleanup()
+{
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+start_server()
+{
+    ( cd "$WORK" && exec "$ROOT/server" "$@" 127.0.0.1 "$PORT" > /dev/null 2>&1 ) &
+    SERVER_PID=$!
+    sleep 1
+}
+
+stop_server()
+{
+    kill "$SERVER_PID" 2>/dev/null || true
+    wait "$SERVER_PID" 2>/dev/null || true
+    SERVER_PID=
+}
+
+# check 名字 期望值 实际值
+check()
+{
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$2', got '$3'"
+        FAILED=1
+    fi
+}
+
+status()
+{
+    curl -s -o /dev/null -w '%{http_code}' "$@" || true
+}
+
+# raw 片段...：curl会改写或丢掉畸形的请求，也不会流水线，这种用python直接发字节。
+# 每个参数是printf格式的一段，段与段之间停100ms；一直读到服务器关闭连接，按顺序打印每个响应的状态码。
+# raw_bodies 片段...：同上，但输出各个响应的正文，首尾相接
+RAW_CLIENT='
+import base64, re, socket, sys, time
+s = socket.create_connection( ( "127.0.0.1", int( sys.argv[1] ) ) )
+s.settimeout( 5 )
+for i, line in enumerate( sys.stdin.read().split() ):
+    if i > 0:
+        time.sleep( 0.1 )
+    s.sendall( base64.b64decode( line ) )
+data = b""
+while True:
+    chunk = s.recv( 65536 )
+    if not chunk:
+        break
+    data += chunk
+statuses, bodies = [], b""
+while data:
+    head, _, data = data.partition( b"\r\n\r\n" )
+    length = re.search( rb"\r\nContent-Length: (\d+)", head, re.I )
+    length = int( length.group( 1 ) ) if length else 0
+    statuses.append( head.split()[1].decode() )
+    bodies += data[:length]
+    data = data[length:]
+if sys.argv[2] == "status":
+    print( " ".join( statuses ) )
+else:
+    sys.stdout.buffer.write( bodies )'
+
+raw_send()
+{
+    mode=$1
+    shift
+    for piece in "$@"; do
+        printf "$piece" | base64 -w 0
+        echo
+    done | python3 -c "$RAW_CLIENT" "$PORT" "$mode" || true
+}
+
+raw()
+{
+    raw_send status "$@"
+}
+
+raw_bodies()
+{
+    raw_send bodies "$@"
+}
+
+# get 路径 [额外的头部行]：拼一个GET请求的printf格式串，交给raw
+get()
+{
+    printf 'GET /%s HTTP/1.1\\r\\nHost: x\\r\\n%s\\r\\n' "$1" "${2:+$2\\r\\n}"
+}
+
+mkdir -p "$WORK/html/dir"
+printf 'space and angle brackets\n' > "$WORK/html/dir/f1 <x>.txt"
+printf 'percent and hash\n' > "$WORK/html/dir/50%#off.txt"
+printf 'utf-8 name\n' > "$WORK/html/dir/$( printf '\346\226\207\344\273\266' ).txt"
+printf 'plain\n' > "$WORK/html/index.html"
+
+start_server --autoindex
+
+# 目录列表里的链接是百分号编码的，逐个跟过去都要取回对应的文件
+curl -s "$URL/dir/" > "$WORK/listing.html"
+for href in $( sed -n 's/.*<a href="\(\/dir\/[^"]*\)">.*/\1/p' "$WORK/listing.html" ); do
+    check "autoindex link $href" 200 "$( status "$URL$href" )"
+done
+check "autoindex lists every entry" 3 "$( grep -c '<a href="/dir/' "$WORK/listing.html" )"
+check "decoded name serves the file" "space and angle brackets" "$( curl -s "$URL/dir/f1%20%3Cx%3E.txt" )"
+check "escaped dot-dot segment" 400 "$( status --path-as-is "$URL/dir/%2e%2e/index.html" )"
+check "plain dot-dot segment" 400 "$( status --path-as-is "$URL/dir/../index.html" )"
+check "escaped NUL" 400 "$( status "$URL/dir/a%00b" )"
+check "truncated escape" 400 "$( status "$URL/dir/a%2" )"
+
+# 头部名字里有空白的、名字为空的、续行的都回400，不能当成认识的头部处理
+check "space before colon" 400 "$( status -H 'Content-Length : 0' "$URL/index.html" )"
+check "space inside name" 400 "$( status -H 'Conn ection: close' "$URL/index.html" )"
+check "empty header name" 400 "$( raw 'GET /index.html HTTP/1.1\r\nHost: x\r\n: v\r\n\r\n' )"
+check "folded header line" 400 "$( raw 'GET /index.html HTTP/1.1\r\nHost: x\r\n\tConnection: close\r\n\r\n' )"
+check "well-formed header" 200 "$( status -H 'X-Name: a b' "$URL/index.html" )"
+
+stop_server
+
+# Range：单段、后缀、开区间回206且内容对得上，多段回multipart/byteranges，整段越界回416，写错的Range当作没有
+head -c 4096 /dev/urandom > "$WORK/html/4k.bin"
+start_server
+check "range 0-99" 206 "$( status -r 0-99 "$URL/4k.bin" )"
+check "range 0-99 body" "$( head -c 100 "$WORK/html/4k.bin" | cksum )" "$( curl -s -r 0-99 "$URL/4k.bin" | cksum )"
+check "suffix range body" "$( tail -c 300 "$WORK/html/4k.bin" | cksum )" "$( curl -s -r -300 "$URL/4k.bin" | cksum )"
+check "open range body" "$( tail -c 96 "$WORK/html/4k.bin" | cksum )" "$( curl -s -r 4000- "$URL/4k.bin" | cksum )"
+check "range past the end is clamped" "bytes 4000-4095/4096" \
+    "$( curl -s -D - -o /dev/null -r 4000-9999 "$URL/4k.bin" | tr -d '\r' | sed -n 's/^Content-Range: //p' )"
+check "multipart range" "206 multipart/byteranges" \
+    "$( curl -s -o "$WORK/parts" -w '%{http_code} %{content_type}' -r 0-1,10-19 "$URL/4k.bin" | sed 's/;.*//' )"
+check "multipart parts" 2 "$( grep -ac -e '^Content-Range: bytes 0-1/4096' -e '^Content-Range: bytes 10-19/4096' "$WORK/parts" )"
+check "unsatisfiable range" 416 "$( status -r 5000- "$URL/4k.bin" )"
+check "416 names the length" "bytes */4096" \
+    "$( curl -s -D - -o /dev/null -r 5000- "$URL/4k.bin" | tr -d '\r' | sed -n 's/^Content-Range: //p' )"
+check "unsatisfiable part is dropped" "206 2" "$( curl -s -o /dev/null -w '%{http_code} %{size_download}' -r 0-1,5000-6000 "$URL/4k.bin" )"
+check "reversed range is ignored" "200 4096" "$( curl -s -o /dev/null -w '%{http_code} %{size_download}' -H 'Range: bytes=5-1' "$URL/4k.bin" )"
+check "other range unit is ignored" 200 "$( status -H 'Range: items=0-1' "$URL/4k.bin" )"
+stop_server
+
+# 条件请求：If-None-Match（弱比较，可以是列表或*）和If-Modified-Since回304，两个都有时只看If-None-Match；
+# If-Range对得上才按Range回206，否则回整个文件；--cache-control按前缀加Cache-Control
+mkdir -p "$WORK/html/static"
+printf 'body { }\n' > "$WORK/html/static/site.css"
+start_server --cache-control /static/=public,max-age=60
+curl -s -D "$WORK/validators" -o /dev/null "$URL/4k.bin"
+ETAG=$( tr -d '\r' < "$WORK/validators" | sed -n 's/^ETag: //p' )
+LAST_MODIFIED=$( tr -d '\r' < "$WORK/validators" | sed -n 's/^Last-Modified: //p' )
+OLD_DATE="Mon, 01 Jan 2001 00:00:00 GMT"
+check "If-None-Match hit" "304 0" "$( curl -s -o /dev/null -w '%{http_code} %{size_download}' -H "If-None-Match: $ETAG" "$URL/4k.bin" )"
+check "304 repeats the ETag" "$ETAG" "$( curl -s -D - -o /dev/null -H "If-None-Match: $ETAG" "$URL/4k.bin" | tr -d '\r' | sed -n 's/^ETag: //p' )"
+check "If-None-Match miss" 200 "$( status -H 'If-None-Match: "other"' "$URL/4k.bin" )"
+check "If-None-Match list" 304 "$( status -H "If-None-Match: \"other\", $ETAG" "$URL/4k.bin" )"
+check "If-None-Match weak" 304 "$( status -H "If-None-Match: W/$ETAG" "$URL/4k.bin" )"
+check "If-None-Match star" 304 "$( status -H 'If-None-Match: *' "$URL/4k.bin" )"
+check "If-Modified-Since unchanged" 304 "$( status -H "If-Modified-Since: $LAST_MODIFIED" "$URL/4k.bin" )"
+check "If-Modified-Since older" 200 "$( status -H "If-Modified-Since: $OLD_DATE" "$URL/4k.bin" )"
+check "If-None-Match wins over If-Modified-Since" 200 \
+    "$( status -H 'If-None-Match: "other"' -H "If-Modified-Since: $LAST_MODIFIED" "$URL/4k.bin" )"
+check "If-Range ETag match" "206 2" "$( curl -s -o /dev/null -w '%{http_code} %{size_download}' -r 0-1 -H "If-Range: $ETAG" "$URL/4k.bin" )"
+check "If-Range ETag mismatch" "200 4096" "$( curl -s -o /dev/null -w '%{http_code} %{size_download}' -r 0-1 -H 'If-Range: "other"' "$URL/4k.bin" )"
+check "If-Range date match" 206 "$( status -r 0-1 -H "If-Range: $LAST_MODIFIED" "$URL/4k.bin" )"
+check "If-Range date mismatch" 200 "$( status -r 0-1 -H "If-Range: $OLD_DATE" "$URL/4k.bin" )"
+check "Cache-Control by prefix" "public,max-age=60" \
+    "$( curl -s -D - -o /dev/null "$URL/static/site.css" | tr -d '\r' | sed -n 's/^Cache-Control: //p' )"
+check "no Cache-Control outside the prefix" "" \
+    "$( curl -s -D - -o /dev/null "$URL/4k.bin" | tr -d '\r' | sed -n 's/^Cache-Control: //p' )"
+stop_server
+
+# 流水线：一次发来的多个请求按顺序各回一个响应，拆成几段到的请求要拼起来，GET带的请求体要丢掉，
+# 出错的请求之后不再解析，连接关闭
+start_server
+check "pipelined requests" "200 404 206 200" \
+    "$( raw "$( get index.html )$( get missing.html )$( get 4k.bin 'Range: bytes=0-1' )$( get 4k.bin 'Connection: close' )" )"
+check "request split across reads" "200 200" \
+    "$( raw 'GET /index.ht' 'ml HTTP/1.1\r\nHo' 'st: x\r\n\r\nGET /4k.bin HTTP/1.1\r' '\nConnection: close\r\n\r\n' )"
+check "GET body is skipped" "200 200" \
+    "$( raw "GET /index.html HTTP/1.1\\r\\nContent-Length: 5\\r\\n\\r\\nhello$( get 4k.bin 'Connection: close' )" )"
+check "nothing after a bad request" "200 400" \
+    "$( raw "$( get index.html )BROKEN\\r\\n\\r\\n$( get 4k.bin 'Connection: close' )" )"
+check "responses carry the right bodies" "$( cat "$WORK/html/index.html" "$WORK/html/4k.bin" "$WORK/html/index.html" | cksum )" \
+    "$( raw_bodies "$( get index.html )$( get 4k.bin )$( get index.html 'Connection: close' )" | cksum )"
+stop_server
+
+# 拼到doc_root后面超过FILENAME_LEN的URL回414，不能截断成另一个路径去读写
+mkdir -p "$WORK/html/up"
+LONG=$( printf 'a%.0s' $( seq 1 250 ) )
+start_server --upload /up
+printf 'body\n' > "$WORK/body.txt"
+check "over-long PUT" 414 "$( status -T "$WORK/body.txt" "$URL/up/$LONG" )"
+check "over-long PUT wrote nothing" 0 "$( ls "$WORK/html/up" | wc -l )"
+check "over-long GET" 414 "$( status "$URL/up/$LONG" )"
+check "short PUT still works" 201 "$( status -T "$WORK/body.txt" "$URL/up/short.txt" )"
+stop_server
+
+# 打开文件缓存：上传是写临时文件再rename，缓存要换成新文件，长度也要跟着变；容量很小时要能淘汰
+mkdir -p "$WORK/html/many"
+for i in $( seq 1 40 ); do
+    printf 'file %s\n' "$i" > "$WORK/html/many/$i.txt"
+done
+start_server -c 4 --upload /up
+check "cached before replace" "body" "$( curl -s "$URL/up/short.txt" )"
+printf 'a longer replacement body\n' > "$WORK/body.txt"
+check "replace cached file" 200 "$( status -T "$WORK/body.txt" "$URL/up/short.txt" )"
+sleep 0.2
+check "cache follows the rename" "a longer replacement body" "$( curl -s "$URL/up/short.txt" )"
+MISMATCH=0
+for round in 1 2; do
+    for i in $( seq 1 40 ); do
+        [ "$( curl -s "$URL/many/$i.txt" )" = "file $i" ] || MISMATCH=$(( MISMATCH + 1 ))
+    done
+done
+check "full cache evicts and still serves" 0 "$MISMATCH"
+stop_server
+
+if [ "$FAILED" -ne 0 ]; then
+    exit 1
+fi
+echo "all tests passed"
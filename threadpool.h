@@ -1,52 +1,128 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
 #include <exception>
+#include <atomic>
 #include <pthread.h>
+#include <time.h>
 #include "locker.h"
+#include "mpmc_queue.h"
+#include "ws_deque.h"
+#include "logger.h"
+#include "cpu_topology.h"
+
+//当前线程在线程池里的编号，不是工作线程时为-1。任务可以据此记住上次是哪个线程处理的
+inline thread_local int threadpool_worker_index = -1;
 
 template< typename T >
 class threadpool
 {
 public:
-    threadpool( int thread_number = 8, int max_requests = 10000 );
+    /*FIFO：所有工作线程共用一个无锁队列；
+    WORK_STEALING：每个工作线程有自己的Chase-Lev双端队列，自己的队列空了再随机挑一个线程去偷*/
+    enum POLICY { FIFO = 0, WORK_STEALING };
+
+    /*min_threads小于thread_number时按队列长度和等待时间在两者之间调整干活的线程数，多出来的线程挂起不抢CPU；
+    first_slot>=0时第i个工作线程按cpu_topology的第first_slot+i个位置固定*/
+    threadpool( int thread_number = 8, int max_requests = 10000, POLICY policy = FIFO, int min_threads = 0, int first_slot = -1 );
     ~threadpool();
-    bool append( T* request );
+    //hint是上次处理该任务的工作线程编号，工作窃取模式下优先投递给它，-1表示没有偏好
+    bool append( T* request, int hint = -1 );
+    size_t queued() const; //排着还没被取走的任务数，近似值
+    int max_requests() const { return m_max_requests; }
 
 private:
     static void* worker( void* arg );
     void run();
 
+    T* take( int self );
+    bool try_take( int self, T*& request );
+    void notify();
+    void adjust();
+    static uint64_t now_ns()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ( uint64_t )ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
 private:
+    static const int SPIN_COUNT = 2000; //空闲工作线程挂起前自旋检查队列的次数
+    static const int LOCAL_QUEUE_SIZE = 1024;
+    static const uint64_t ADJUST_INTERVAL_NS = 100000000; //自适应模式下每100ms评估一次
+
+    /*工作窃取模式下每个线程的本地队列。deque只有本线程push/pop，别的线程从另一端steal；
+    inbox接收其他线程（如主reactor）按亲和性投递过来的任务*/
+    struct worker_queue
+    {
+        explicit worker_queue( int capacity ) : deque( capacity ), inbox( capacity ) {}
+        ws_deque< T* > deque;
+        mpmc_queue< T* > inbox;
+    };
+
     int m_thread_number;
+    int m_min_threads;
+    int m_first_slot;
     int m_max_requests;
+    POLICY m_policy;
+    bool m_adaptive;
     pthread_t* m_threads;
-    std::list< T* > m_workqueue;
-    locker m_queuelocker;
-    sem m_queuestat;
+    mpmc_queue< T* > m_workqueue; //无锁有界环形队列，入队出队不加锁也不分配节点；工作窃取模式下作为没有亲和性的全局注入队列
+    worker_queue** m_local;
+    std::atomic< int > m_next_worker; //给新启动的工作线程分配编号
+    sem m_queuestat; //只有真正空闲挂起的线程才在这里等
+    alignas( CACHE_LINE_SIZE ) std::atomic< int > m_idle; //挂起（或准备挂起）的工作线程数
+    /*池里还没被取走的任务总数，max_requests靠它来限制：无锁队列的容量会向上取到2的幂，
+    工作窃取模式下任务还分散在各线程的队列里，都不能直接当上限用*/
+    alignas( CACHE_LINE_SIZE ) std::atomic< int > m_pending;
+    //自适应模式：编号小于m_active的线程干活，其余停在各自的m_parked上；m_wait_ns是这一轮干活的线程等任务的总时间
+    alignas( CACHE_LINE_SIZE ) std::atomic< int > m_active;
+    std::atomic< uint64_t > m_wait_ns;
+    std::atomic< uint64_t > m_next_adjust;
+    sem* m_parked;
     bool m_stop;
 };
 
 template< typename T >
-threadpool< T >::threadpool( int thread_number, int max_requests ) : 
-        m_thread_number( thread_number ), m_max_requests( max_requests ), m_stop( false ), m_threads( NULL )
+threadpool< T >::threadpool( int thread_number, int max_requests, POLICY policy, int min_threads, int first_slot ) : 
+        m_thread_number( thread_number ), m_min_threads( min_threads > 0 && min_threads < thread_number ? min_threads : thread_number ),
+        m_first_slot( first_slot ), m_max_requests( max_requests ), m_policy( policy ), m_adaptive( m_min_threads < thread_number ),
+        m_threads( NULL ), m_workqueue( max_requests > 1 ? max_requests : 2 ), m_local( NULL ), m_next_worker( 0 ), m_idle( 0 ), m_pending( 0 ),
+        m_active( thread_number ), m_wait_ns( 0 ), m_next_adjust( 0 ), m_parked( NULL ), m_stop( false )
 {
     if( ( thread_number <= 0 ) || ( max_requests <= 0 ) )
     {
         throw std::exception();
     }
 
+    if( m_adaptive )
+    {
+        //从下限起步，有积压再逐个唤醒
+        m_parked = new sem[ m_thread_number ];
+        m_active.store( m_min_threads, std::memory_order_relaxed );
+        m_next_adjust.store( now_ns() + ADJUST_INTERVAL_NS, std::memory_order_relaxed );
+    }
+
     m_threads = new pthread_t[ m_thread_number ];
     if( ! m_threads )
     {
         throw std::exception();
     }
 
+    if( m_policy == WORK_STEALING )
+    {
+        //本地队列必须在工作线程启动前建好
+        m_local = new worker_queue*[ m_thread_number ];
+        for ( int i = 0; i < thread_number; ++i )
+        {
+            m_local[i] = new worker_queue( LOCAL_QUEUE_SIZE );
+        }
+    }
+
     for ( int i = 0; i < thread_number; ++i )
     {
-        printf( "create the %dth thread\n", i );
+        LOG_DEBUG( "create the %dth thread", i );
         if( pthread_create( m_threads + i, NULL, worker, this ) != 0 )
         {
             delete [] m_threads;
@@ -68,24 +144,78 @@ template< typename T >
 threadpool< T >::~threadpool()
 {
     delete [] m_threads;
+    if( m_local )
+    {
+        for ( int i = 0; i < m_thread_number; ++i )
+        {
+            delete m_local[i];
+        }
+        delete [] m_local;
+    }
+    delete [] m_parked;
     m_stop = true;
 }
 
 template< typename T >
-bool threadpool< T >::append( T* request )
+bool threadpool< T >::append( T* request, int hint )
 {
-    m_queuelocker.lock();
-    if ( m_workqueue.size() > m_max_requests )
+    if ( m_pending.fetch_add( 1, std::memory_order_relaxed ) >= m_max_requests )
+    {
+        m_pending.fetch_sub( 1, std::memory_order_relaxed );
+        return false;
+    }
+    if ( m_policy == WORK_STEALING )
+    {
+        int self = threadpool_worker_index;
+        if ( self >= 0 && self < m_thread_number && m_local[ self ]->deque.push( request ) )
+        {
+            //工作线程自己产生的后续任务留在本地，缓存还是热的
+            notify();
+            return true;
+        }
+        if ( hint >= 0 && hint < m_active.load( std::memory_order_relaxed ) && m_local[ hint ]->inbox.push( request ) )
+        {
+            //同一连接的下一个请求优先交给上次处理它的线程
+            notify();
+            return true;
+        }
+    }
+    if ( ! m_workqueue.push( request ) )
     { //满则返回false
-        m_queuelocker.unlock();
+        m_pending.fetch_sub( 1, std::memory_order_relaxed );
         return false;
     }
-    m_workqueue.push_back( request );
-    m_queuelocker.unlock();
-    m_queuestat.post();
+    notify();
     return true;
 }
 
+//全局队列加上各线程的inbox；本地双端队列里是工作线程自己产生的后续任务，不算积压
+template< typename T >
+size_t threadpool< T >::queued() const
+{
+    size_t depth = m_workqueue.size_approx();
+    if ( m_local )
+    {
+        for ( int i = 0; i < m_thread_number; ++i )
+        {
+            depth += m_local[i]->inbox.size_approx();
+        }
+    }
+    return depth;
+}
+
+template< typename T >
+void threadpool< T >::notify()
+{
+    //工作线程都在忙（或还在自旋）时不需要post，省掉futex系统调用；
+    //这里的全屏障和take()里m_idle加一之后的屏障配对，保证不会丢失唤醒
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    if ( m_idle.load( std::memory_order_relaxed ) > 0 )
+    {
+        m_queuestat.post();
+    }
+}
+
 template< typename T >
 void* threadpool< T >::worker( void* arg )
 {
@@ -94,21 +224,139 @@ void* threadpool< T >::worker( void* arg )
     return pool;
 }
 
+//工作窃取模式的取任务顺序：本地双端队列 -> 自己的inbox -> 全局队列 -> 从随机的一个线程开始挨个偷
+template< typename T >
+bool threadpool< T >::try_take( int self, T*& request )
+{
+    if ( m_policy == FIFO )
+    {
+        if ( ! m_workqueue.pop( request ) )
+        {
+            return false;
+        }
+        m_pending.fetch_sub( 1, std::memory_order_relaxed );
+        return true;
+    }
+
+    worker_queue* mine = m_local[ self ];
+    if ( mine->deque.pop( request ) || mine->inbox.pop( request ) || m_workqueue.pop( request ) )
+    {
+        m_pending.fetch_sub( 1, std::memory_order_relaxed );
+        return true;
+    }
+
+    static thread_local unsigned int seed = 2654435761u * ( self + 1 );
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    int start = seed % m_thread_number;
+    for ( int i = 0; i < m_thread_number; ++i )
+    {
+        int victim = ( start + i ) % m_thread_number;
+        if ( victim == self )
+        {
+            continue;
+        }
+        //inbox里的任务对方还没开始处理，被偷走只损失一点亲和性
+        if ( m_local[ victim ]->deque.steal( request ) || m_local[ victim ]->inbox.pop( request ) )
+        {
+            m_pending.fetch_sub( 1, std::memory_order_relaxed );
+            return true;
+        }
+    }
+    return false;
+}
+
+//先自旋，队列一直为空才登记为空闲并挂起在信号量上；自适应模式下记下没有立刻拿到任务时等了多久
+template< typename T >
+T* threadpool< T >::take( int self )
+{
+    T* request = NULL;
+    if ( try_take( self, request ) )
+    {
+        return request;
+    }
+    uint64_t start = m_adaptive ? now_ns() : 0;
+    for ( int i = 1; i < SPIN_COUNT; ++i )
+    {
+        cpu_relax();
+        if ( try_take( self, request ) )
+        {
+            break;
+        }
+    }
+
+    if ( ! request )
+    {
+        m_idle.fetch_add( 1, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        //登记之后再查一次：append可能在登记之前入队，那时它看到的m_idle还是0，不会post
+        if ( ! try_take( self, request ) )
+        {
+            m_queuestat.wait(); //被唤醒后回到run()重新取，多余的post只会造成一次空转
+        }
+        m_idle.fetch_sub( 1, std::memory_order_relaxed );
+    }
+    if ( m_adaptive )
+    {
+        m_wait_ns.fetch_add( now_ns() - start, std::memory_order_relaxed );
+    }
+    return request;
+}
+
+/*
+自适应调整，由碰上时间点的那个工作线程顺手做。队列里积压的任务比干活的线程多、而它们几乎不用等任务，
+说明线程不够，唤醒一个；队列空着、干活的线程一半以上时间在等，说明线程多了，停掉编号最大的那个。
+每次只加减一个，避免来回抖动。
+*/
+template< typename T >
+void threadpool< T >::adjust()
+{
+    uint64_t now = now_ns();
+    uint64_t due = m_next_adjust.load( std::memory_order_relaxed );
+    if ( now < due || ! m_next_adjust.compare_exchange_strong( due, now + ADJUST_INTERVAL_NS ) )
+    {
+        return;
+    }
+    int active = m_active.load( std::memory_order_relaxed );
+    uint64_t elapsed = now - ( due - ADJUST_INTERVAL_NS );
+    double waiting = ( double )m_wait_ns.exchange( 0, std::memory_order_relaxed ) / ( ( double )elapsed * active );
+    size_t depth = queued();
+
+    if ( depth > ( size_t )active && waiting < 0.05 && active < m_thread_number )
+    {
+        m_active.store( active + 1, std::memory_order_relaxed );
+        m_parked[ active ].post();
+        LOG_INFO( "threadpool grows to %d workers (queue %d, waiting %.0f%%)", active + 1, ( int )depth, waiting * 100 );
+    }
+    else if ( depth == 0 && waiting > 0.5 && active > m_min_threads )
+    {
+        //编号为active-1的线程回到run()时发现自己超出范围，就停下来
+        m_active.store( active - 1, std::memory_order_relaxed );
+        LOG_INFO( "threadpool shrinks to %d workers (waiting %.0f%%)", active - 1, waiting * 100 );
+    }
+}
+
 template< typename T >
 void threadpool< T >::run()
 {
+    int self = m_next_worker.fetch_add( 1, std::memory_order_relaxed );
+    threadpool_worker_index = self;
+    cpu_topology::place_thread( m_first_slot >= 0 ? m_first_slot + self : -1 );
     while ( ! m_stop )
     {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if ( m_workqueue.empty() )
+        if ( m_adaptive )
         {
-            m_queuelocker.unlock();
-            continue;
+            if ( self >= m_active.load( std::memory_order_relaxed ) )
+            {
+                //刚才可能是被append的post叫醒的，把这次唤醒转给还在干活的线程，免得任务没人取
+                notify();
+                m_parked[ self ].wait();
+                continue;
+            }
+            adjust();
         }
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
+        T* request = take( self );
         if ( ! request )
         {
             continue;
@@ -0,0 +1,156 @@
+#include <time.h>
+
+#include "timer_wheel.h"
+
+timer_wheel::timer_wheel( int tick_ms ) : m_tick_ms( tick_ms > 0 ? tick_ms : 1 ), m_current( 0 ), m_count( 0 )
+{
+    for( int i = 0; i < ROOT_SIZE; ++i )
+    {
+        list_init( &m_root[i] );
+    }
+    for( int i = 0; i < LEVEL_SIZE; ++i )
+    {
+        list_init( &m_level1[i] );
+        list_init( &m_level2[i] );
+    }
+    m_current = now_ms() / m_tick_ms;
+}
+
+long timer_wheel::now_ms()
+{
+    //COARSE时钟走vDSO，不陷入内核，毫秒级精度对超时来说足够
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel::list_init( wheel_timer* head )
+{
+    head->prev = head;
+    head->next = head;
+}
+
+void timer_wheel::list_add( wheel_timer* head, wheel_timer* timer )
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void timer_wheel::add( wheel_timer* timer )
+{
+    unsigned long expire = timer->expire;
+    if( expire < m_current )
+    {
+        expire = m_current; //已经过期的放到下一个要处理的槽里
+    }
+    unsigned long delta = expire - m_current;
+    if( delta < ( unsigned long )ROOT_SIZE )
+    {
+        list_add( &m_root[ expire & ( ROOT_SIZE - 1 ) ], timer );
+    }
+    else if( delta < ( 1UL << ( ROOT_BITS + LEVEL_BITS ) ) )
+    {
+        list_add( &m_level1[ ( expire >> ROOT_BITS ) & ( LEVEL_SIZE - 1 ) ], timer );
+    }
+    else
+    {
+        unsigned long max_delta = ( 1UL << ( ROOT_BITS + 2 * LEVEL_BITS ) ) - 1;
+        if( delta > max_delta )
+        {
+            expire = m_current + max_delta; //超出范围的先挂在最远处，timer->expire不变，到时候重新比较再决定
+        }
+        list_add( &m_level2[ ( expire >> ( ROOT_BITS + LEVEL_BITS ) ) & ( LEVEL_SIZE - 1 ) ], timer );
+    }
+}
+
+void timer_wheel::schedule( wheel_timer* timer, long expire_ms )
+{
+    remove( timer );
+    timer->expire = ( unsigned long )( expire_ms + m_tick_ms - 1 ) / m_tick_ms; //向上取整，不会提前触发
+    add( timer );
+    ++m_count;
+}
+
+void timer_wheel::remove( wheel_timer* timer )
+{
+    if( ! timer->pending() )
+    {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = 0;
+    timer->next = 0;
+    --m_count;
+}
+
+//把上层一个槽里的定时器按剩余时间重新挂到下层
+void timer_wheel::cascade( wheel_timer* slots, int index )
+{
+    wheel_timer* head = &slots[ index ];
+    wheel_timer* timer = head->next;
+    list_init( head );
+    while( timer != head )
+    {
+        wheel_timer* next = timer->next;
+        add( timer );
+        timer = next;
+    }
+}
+
+void timer_wheel::advance( long now_ms, expire_callback cb, void* arg )
+{
+    unsigned long target = ( unsigned long )now_ms / m_tick_ms;
+    if( m_count == 0 )
+    {
+        //轮上没有定时器，直接跳到当前时间，不必逐个tick空转
+        if( m_current <= target )
+        {
+            m_current = target + 1;
+        }
+        return;
+    }
+    while( m_current <= target )
+    {
+        int index = m_current & ( ROOT_SIZE - 1 );
+        if( index == 0 )
+        {
+            int index1 = ( m_current >> ROOT_BITS ) & ( LEVEL_SIZE - 1 );
+            if( index1 == 0 )
+            {
+                cascade( m_level2, ( m_current >> ( ROOT_BITS + LEVEL_BITS ) ) & ( LEVEL_SIZE - 1 ) );
+            }
+            cascade( m_level1, index1 );
+        }
+
+        //先把整个槽摘下来再逐个回调，回调里可以安全地重新schedule或remove
+        wheel_timer expired;
+        wheel_timer* head = &m_root[ index ];
+        list_init( &expired );
+        if( head->next != head )
+        {
+            expired.next = head->next;
+            expired.prev = head->prev;
+            expired.next->prev = &expired;
+            expired.prev->next = &expired;
+            list_init( head );
+        }
+        ++m_current;
+
+        while( expired.next != &expired )
+        {
+            wheel_timer* timer = expired.next;
+            remove( timer );
+            if( timer->expire >= m_current )
+            {
+                //被截断到最远处的定时器，实际还没到期
+                add( timer );
+                ++m_count;
+                continue;
+            }
+            cb( timer->data, arg );
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+/*侵入式定时器节点，直接嵌在连接对象里，挂上/摘下/刷新都只是改几个指针，不分配内存*/
+struct wheel_timer
+{
+    wheel_timer() : prev( 0 ), next( 0 ), expire( 0 ), data( 0 ) {}
+    bool pending() const { return prev != 0; }
+
+    wheel_timer* prev;
+    wheel_timer* next;
+    unsigned long expire; //到期的tick
+    void* data; //定时器所属的对象，到期回调时原样传回
+};
+
+/*
+分层时间轮（和早期Linux内核的定时器一样）：第0层256个槽，每槽一个tick；
+第1、2层各64个槽，每槽分别覆盖256和256*64个tick。插入、删除都是O(1)，
+第0层转完一圈时把上一层对应槽里的定时器重新散到下层。超出范围的定时器按最远的槽处理。
+时间轮只属于一个reactor线程，不加锁。
+*/
+class timer_wheel
+{
+public:
+    typedef void ( *expire_callback )( void* data, void* arg );
+
+    explicit timer_wheel( int tick_ms );
+
+    void schedule( wheel_timer* timer, long expire_ms ); //已挂在轮上的先摘下再按新时间挂上
+    void remove( wheel_timer* timer );
+    void advance( long now_ms, expire_callback cb, void* arg ); //触发所有到期的定时器
+
+    bool empty() const { return m_count == 0; }
+    int tick_ms() const { return m_tick_ms; }
+
+    static long now_ms();
+
+private:
+    static const int ROOT_BITS = 8;
+    static const int LEVEL_BITS = 6;
+    static const int ROOT_SIZE = 1 << ROOT_BITS;
+    static const int LEVEL_SIZE = 1 << LEVEL_BITS;
+
+    void add( wheel_timer* timer );
+    void cascade( wheel_timer* slots, int index );
+    static void list_init( wheel_timer* head );
+    static void list_add( wheel_timer* head, wheel_timer* timer );
+
+private:
+    int m_tick_ms;
+    unsigned long m_current; //下一个要处理的tick
+    int m_count;
+    //每个槽是一个带哨兵的双向循环链表
+    wheel_timer m_root[ ROOT_SIZE ];
+    wheel_timer m_level1[ LEVEL_SIZE ];
+    wheel_timer m_level2[ LEVEL_SIZE ];
+};
+
+#endif
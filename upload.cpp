@@ -0,0 +1,95 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+
+#include "upload.h"
+
+struct upload_state
+{
+    int fd; //同目录下的临时文件
+    std::string temp;
+    std::string path;
+    bool existed; //目标原来就有，成功后回200，否则201
+    bool finished; //已经rename到位，close时不用再删临时文件
+};
+
+static void* upload_open( const char* url, const char* path, long length )
+{
+    //路径在解析请求行时已经解码过，这里不跟随..：带查询串、以/结尾、有以.开头的路径段（包括..和临时文件）的一律不收
+    if( strchr( url, '?' ) || strstr( url, "/." ) || url[ strlen( url ) - 1 ] == '/' )
+    {
+        errno = EACCES;
+        return NULL;
+    }
+    struct stat st;
+    bool existed = stat( path, &st ) == 0;
+    if( existed && ! S_ISREG( st.st_mode ) )
+    {
+        errno = EACCES;
+        return NULL;
+    }
+    std::string temp( path, strrchr( path, '/' ) + 1 - path );
+    temp.append( ".upload.XXXXXX" );
+    int fd = mkostemp( &temp[0], O_CLOEXEC );
+    if( fd < 0 )
+    {
+        return NULL; //目录不存在时errno是ENOENT，回404
+    }
+    fchmod( fd, 0644 ); //GET要求文件对其他人可读
+    upload_state* state = new upload_state;
+    state->fd = fd;
+    state->temp = temp;
+    state->path = path;
+    state->existed = existed;
+    state->finished = false;
+    return state;
+}
+
+static int upload_spool( void* arg )
+{
+    return ( ( upload_state* )arg )->fd;
+}
+
+static int upload_consume( void* arg, const char* data, int size )
+{
+    upload_state* state = ( upload_state* )arg;
+    while( size > 0 )
+    {
+        ssize_t n = write( state->fd, data, size );
+        if( n < 0 )
+        {
+            return -1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int upload_finish( void* arg, int spool_fd )
+{
+    upload_state* state = ( upload_state* )arg;
+    if( rename( state->temp.c_str(), state->path.c_str() ) < 0 )
+    {
+        return 500;
+    }
+    state->finished = true;
+    return state->existed ? 200 : 201;
+}
+
+static void upload_close( void* arg )
+{
+    upload_state* state = ( upload_state* )arg;
+    close( state->fd );
+    if( ! state->finished )
+    {
+        unlink( state->temp.c_str() ); //出错或者连接中途断开，不留半截文件
+    }
+    delete state;
+}
+
+const body_handler upload_handler = { upload_open, upload_spool, upload_consume, upload_finish, upload_close };
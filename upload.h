@@ -0,0 +1,13 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include "http_conn.h"
+
+/*
+上传：开了--upload PREFIX时，PREFIX下的URL接受PUT/POST，请求体存成doc_root下对应的文件。
+先写进同目录的临时文件，收完再rename过去，读的人看到的要么是旧文件要么是完整的新文件；大请求体由
+http_conn直接splice进这个临时文件。目录必须已经存在，URL里不能有以.开头的路径段
+*/
+extern const body_handler upload_handler;
+
+#endif
@@ -0,0 +1,765 @@
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "uring_reactor.h"
+#include "reactor.h"
+
+static int io_uring_setup( unsigned int entries, struct io_uring_params* params )
+{
+    return syscall( __NR_io_uring_setup, entries, params );
+}
+
+static int io_uring_enter( int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void* arg, size_t size )
+{
+    return syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, size );
+}
+
+static int io_uring_register( int fd, unsigned int opcode, void* arg, unsigned int nr_args )
+{
+    return syscall( __NR_io_uring_register, fd, opcode, arg, nr_args );
+}
+
+//多发recv从6.0开始才有，没法通过probe看出来，只能看内核版本
+static bool kernel_at_least( int major, int minor )
+{
+    struct utsname name;
+    int kernel_major = 0;
+    int kernel_minor = 0;
+    if( uname( &name ) < 0 || sscanf( name.release, "%d.%d", &kernel_major, &kernel_minor ) != 2 )
+    {
+        return false;
+    }
+    return kernel_major > major || ( kernel_major == major && kernel_minor >= minor );
+}
+
+uring_reactor::uring_reactor( int listenfd, http_conn* users, int max_fd ) :
+        m_ring_fd( -1 ), m_listenfd( listenfd ), m_users( users ), m_max_fd( max_fd ), m_conns( NULL ),
+        m_thread( 0 ), m_slot( -1 ), m_wheel( TIMER_TICK_MS ),
+        m_sq_ptr( MAP_FAILED ), m_sq_size( 0 ), m_sq_head( NULL ), m_sq_tail( NULL ), m_sq_mask( NULL ),
+        m_sq_array( NULL ), m_sqes( ( struct io_uring_sqe* )MAP_FAILED ), m_sqes_size( 0 ),
+        m_sq_local_tail( 0 ), m_to_submit( 0 ),
+        m_cq_ptr( MAP_FAILED ), m_cq_size( 0 ), m_cq_head( NULL ), m_cq_tail( NULL ), m_cq_mask( NULL ), m_cqes( NULL ),
+        m_buf_ring( ( struct io_uring_buf_ring* )MAP_FAILED ), m_buf_ring_size( 0 ), m_buffers( NULL ), m_buf_tail( 0 )
+{
+}
+
+uring_reactor::~uring_reactor()
+{
+    if( m_buf_ring != MAP_FAILED )
+    {
+        munmap( m_buf_ring, m_buf_ring_size );
+    }
+    if( m_sqes != MAP_FAILED )
+    {
+        munmap( m_sqes, m_sqes_size );
+    }
+    if( m_sq_ptr != MAP_FAILED )
+    {
+        munmap( m_sq_ptr, m_sq_size );
+    }
+    if( m_ring_fd != -1 )
+    {
+        close( m_ring_fd );
+    }
+    free( m_buffers );
+    free( m_conns );
+}
+
+bool uring_reactor::init()
+{
+    if( ! kernel_at_least( 6, 0 ) )
+    {
+        return false;
+    }
+
+    struct io_uring_params params;
+    memset( &params, 0, sizeof( params ) );
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = RING_ENTRIES * 4; //多发操作一次提交会产生很多完成事件
+    m_ring_fd = io_uring_setup( RING_ENTRIES, &params );
+    if( m_ring_fd < 0 )
+    {
+        m_ring_fd = -1;
+        return false;
+    }
+    unsigned int required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG;
+    if( ( params.features & required ) != required )
+    {
+        return false;
+    }
+
+    //提交队列和完成队列的环在同一块映射里
+    m_sq_size = params.sq_off.array + params.sq_entries * sizeof( unsigned int );
+    m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+    if( m_cq_size > m_sq_size )
+    {
+        m_sq_size = m_cq_size;
+    }
+    m_sq_ptr = mmap( NULL, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING );
+    if( m_sq_ptr == MAP_FAILED )
+    {
+        return false;
+    }
+    m_cq_ptr = m_sq_ptr;
+    m_sqes_size = params.sq_entries * sizeof( struct io_uring_sqe );
+    m_sqes = ( struct io_uring_sqe* )mmap( NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES );
+    if( m_sqes == MAP_FAILED )
+    {
+        return false;
+    }
+    char* sq = ( char* )m_sq_ptr;
+    m_sq_head = ( unsigned int* )( sq + params.sq_off.head );
+    m_sq_tail = ( unsigned int* )( sq + params.sq_off.tail );
+    m_sq_mask = ( unsigned int* )( sq + params.sq_off.ring_mask );
+    m_sq_array = ( unsigned int* )( sq + params.sq_off.array );
+    m_sq_local_tail = *m_sq_tail;
+    char* cq = ( char* )m_cq_ptr;
+    m_cq_head = ( unsigned int* )( cq + params.cq_off.head );
+    m_cq_tail = ( unsigned int* )( cq + params.cq_off.tail );
+    m_cq_mask = ( unsigned int* )( cq + params.cq_off.ring_mask );
+    m_cqes = ( struct io_uring_cqe* )( cq + params.cq_off.cqes );
+
+    //用到的操作都要支持
+    size_t probe_size = sizeof( struct io_uring_probe ) + 256 * sizeof( struct io_uring_probe_op );
+    struct io_uring_probe* probe = ( struct io_uring_probe* )calloc( 1, probe_size );
+    if( ! probe )
+    {
+        return false;
+    }
+    bool probed = io_uring_register( m_ring_fd, IORING_REGISTER_PROBE, probe, 256 ) == 0;
+    static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SPLICE,
+                               IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+    for( size_t i = 0; probed && i < sizeof( ops ) / sizeof( ops[0] ); ++i )
+    {
+        probed = ops[i] <= probe->last_op && ( probe->ops[ ops[i] ].flags & IO_URING_OP_SUPPORTED );
+    }
+    free( probe );
+    if( ! probed )
+    {
+        return false;
+    }
+
+    //提供缓冲区环：内核收数据时从这里挑一块，用完由我们放回
+    m_buf_ring_size = BUFFER_COUNT * sizeof( struct io_uring_buf );
+    m_buf_ring = ( struct io_uring_buf_ring* )mmap( NULL, m_buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( m_buf_ring == MAP_FAILED )
+    {
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset( &reg, 0, sizeof( reg ) );
+    reg.ring_addr = ( unsigned long )m_buf_ring;
+    reg.ring_entries = BUFFER_COUNT;
+    reg.bgid = BUFFER_GROUP;
+    if( io_uring_register( m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 )
+    {
+        return false;
+    }
+    m_buffers = ( char* )malloc( ( size_t )BUFFER_COUNT * BUFFER_SIZE );
+    m_conns = ( uring_conn* )calloc( m_max_fd, sizeof( uring_conn ) ); //没用到的fd不占物理内存
+    if( ! m_buffers || ! m_conns )
+    {
+        return false;
+    }
+    for( unsigned int i = 0; i < BUFFER_COUNT; ++i )
+    {
+        recycle_buffer( i );
+    }
+
+    arm_accept();
+    return true;
+}
+
+bool uring_reactor::start( int slot )
+{
+    m_slot = slot;
+    return pthread_create( &m_thread, NULL, worker, this ) == 0;
+}
+
+void uring_reactor::join()
+{
+    pthread_join( m_thread, NULL );
+}
+
+void* uring_reactor::worker( void* arg )
+{
+    uring_reactor* r = ( uring_reactor* )arg;
+    cpu_topology::place_thread( r->m_slot ); //先固定再跑loop，之后这个线程分配的内存都落在它的节点上
+    r->loop();
+    return r;
+}
+
+//user_data：操作类型8位 | fd的代数24位 | fd 32位
+unsigned long long uring_reactor::pack( OP op, unsigned int generation, int fd )
+{
+    return ( ( unsigned long long )op << 56 ) | ( ( unsigned long long )( generation & 0xffffff ) << 32 ) | ( unsigned int )fd;
+}
+
+struct io_uring_sqe* uring_reactor::get_sqe()
+{
+    unsigned int entries = *m_sq_mask + 1;
+    if( m_sq_local_tail - __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE ) >= entries )
+    {
+        submit_and_wait( false, 0 ); //队列满了先交给内核
+        if( m_sq_local_tail - __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE ) >= entries )
+        {
+            return NULL;
+        }
+    }
+    unsigned int index = m_sq_local_tail & *m_sq_mask;
+    struct io_uring_sqe* sqe = &m_sqes[ index ];
+    memset( sqe, 0, sizeof( *sqe ) );
+    m_sq_array[ index ] = index;
+    ++m_sq_local_tail;
+    ++m_to_submit;
+    return sqe;
+}
+
+//提交所有已填好的请求；wait为true时至少等到一个完成事件，timeout_ms小于0表示一直等
+int uring_reactor::submit_and_wait( bool wait, long timeout_ms )
+{
+    __atomic_store_n( m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE );
+    if( ! wait && m_to_submit == 0 )
+    {
+        return 0;
+    }
+    int ret = 0;
+    if( wait && timeout_ms >= 0 )
+    {
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = ( timeout_ms % 1000 ) * 1000000;
+        struct io_uring_getevents_arg arg;
+        memset( &arg, 0, sizeof( arg ) );
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = ( unsigned long )&ts;
+        ret = io_uring_enter( m_ring_fd, m_to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof( arg ) );
+    }
+    else
+    {
+        ret = io_uring_enter( m_ring_fd, m_to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, _NSIG / 8 );
+    }
+    if( ret > 0 )
+    {
+        m_to_submit -= ret < ( int )m_to_submit ? ret : m_to_submit;
+    }
+    return ret;
+}
+
+void uring_reactor::arm_accept()
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    if( ! sqe )
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = pack( OP_ACCEPT, 0, m_listenfd );
+}
+
+void uring_reactor::arm_recv( int fd )
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    if( ! sqe )
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = pack( OP_RECV, m_conns[fd].generation, fd );
+    m_conns[fd].recv_armed = true;
+}
+
+void uring_reactor::recycle_buffer( int bid )
+{
+    //C++里内核头文件的柔性数组前面多出一个空结构体，bufs的偏移不对，直接按数组访问
+    struct io_uring_buf* buf = ( struct io_uring_buf* )m_buf_ring + ( m_buf_tail & ( BUFFER_COUNT - 1 ) );
+    buf->addr = ( unsigned long )( m_buffers + ( size_t )bid * BUFFER_SIZE );
+    buf->len = BUFFER_SIZE;
+    buf->bid = bid;
+    ++m_buf_tail;
+    __atomic_store_n( &m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE );
+}
+
+void uring_reactor::handle_accept( int res, unsigned int flags )
+{
+    uint64_t start = server_stats::now();
+    if( ! ( flags & IORING_CQE_F_MORE ) )
+    {
+        arm_accept(); //多发accept出错后就停了，重新提交
+    }
+    if( res < 0 )
+    {
+        return;
+    }
+    int connfd = res;
+    if( connfd >= m_max_fd || http_conn::m_user_count >= m_max_fd )
+    {
+        close( connfd );
+        return;
+    }
+
+    uring_conn& c = m_conns[connfd];
+    c.inflight = 0;
+    c.closing = false;
+    c.recv_armed = false;
+    c.pipe[0] = -1;
+    c.pipe[1] = -1;
+    c.pipe_pending = 0;
+
+    struct sockaddr_in client_address;
+    memset( &client_address, 0, sizeof( client_address ) );
+    if( logger::access_enabled() )
+    {
+        //多发的accept不带地址，只有访问日志要用时才多一次getpeername
+        socklen_t client_addrlength = sizeof( client_address );
+        getpeername( connfd, ( struct sockaddr* )&client_address, &client_addrlength );
+    }
+    m_users[connfd].init( connfd, client_address, -1 );
+    arm_recv( connfd );
+    refresh_timer( connfd );
+    server_stats::record( PHASE_ACCEPT, start );
+}
+
+void uring_reactor::handle_recv( int fd, int res, unsigned int flags )
+{
+    uring_conn& c = m_conns[fd];
+    http_conn& conn = m_users[fd];
+    if( ! ( flags & IORING_CQE_F_MORE ) )
+    {
+        c.recv_armed = false;
+    }
+    int bid = ( flags & IORING_CQE_F_BUFFER ) ? ( int )( flags >> IORING_CQE_BUFFER_SHIFT ) : -1;
+    if( c.closing )
+    {
+        if( bid != -1 )
+        {
+            recycle_buffer( bid );
+        }
+        return;
+    }
+    if( res == -ENOBUFS )
+    {
+        arm_recv( fd ); //缓冲区暂时用光了，我们已经在归还，重新挂上即可
+        return;
+    }
+    if( res <= 0 )
+    {
+        if( bid != -1 )
+        {
+            recycle_buffer( bid );
+        }
+        close_conn( fd );
+        return;
+    }
+
+    //收到的数据拷进连接自己的读缓冲区，提供的缓冲区马上还回环里
+    bool ok = conn.receive( m_buffers + ( size_t )bid * BUFFER_SIZE, res );
+    recycle_buffer( bid );
+    if( ! ok )
+    {
+        close_conn( fd );
+        return;
+    }
+    if( ! c.recv_armed )
+    {
+        arm_recv( fd );
+    }
+    //正在发响应时先只收着，等这一批发完再解析（和epoll模式下只在EPOLLIN时读一样）
+    if( c.inflight == 0 && ! conn.has_output() )
+    {
+        process( fd );
+    }
+    else
+    {
+        refresh_timer( fd );
+    }
+}
+
+void uring_reactor::process( int fd )
+{
+    http_conn& conn = m_users[fd];
+    conn.process();
+    if( conn.closed() )
+    {
+        close_conn( fd ); //process出错时已经关了socket，这里只收尾
+        return;
+    }
+    if( conn.has_output() )
+    {
+        send_output( fd );
+    }
+    refresh_timer( fd );
+}
+
+void uring_reactor::send_output( int fd )
+{
+    http_conn& conn = m_users[fd];
+    uring_conn& c = m_conns[fd];
+    struct iovec* iov = NULL;
+    int iov_count = conn.output_iov( &iov );
+    off_t offset = 0;
+    size_t length = 0;
+    int file_fd = conn.output_file( &offset, &length );
+
+    if( c.pipe_pending > 0 )
+    {
+        //上一次没能全部进socket的数据还在管道里，先把它送走
+        struct io_uring_sqe* sqe = get_sqe();
+        if( ! sqe )
+        {
+            close_conn( fd );
+            return;
+        }
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = fd;
+        sqe->off = ( unsigned long long )-1;
+        sqe->splice_fd_in = c.pipe[0];
+        sqe->splice_off_in = ( unsigned long long )-1;
+        sqe->len = c.pipe_pending;
+        sqe->splice_flags = SPLICE_F_MOVE | ( length > c.pipe_pending ? SPLICE_F_MORE : 0 );
+        sqe->user_data = pack( OP_SPLICE_OUT, c.generation, fd );
+        ++c.inflight;
+        return;
+    }
+
+    if( iov_count > 0 )
+    {
+        memset( &c.msg, 0, sizeof( c.msg ) );
+        c.msg.msg_iov = iov;
+        c.msg.msg_iovlen = iov_count;
+        struct io_uring_sqe* sqe = get_sqe();
+        if( ! sqe )
+        {
+            close_conn( fd );
+            return;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = ( unsigned long )&c.msg;
+        sqe->msg_flags = file_fd != -1 ? MSG_MORE : 0; //和epoll模式一样，头部和文件体合并成满载的报文
+        sqe->user_data = pack( OP_SEND, c.generation, fd );
+        ++c.inflight;
+        return;
+    }
+
+    if( file_fd == -1 || length == 0 )
+    {
+        return;
+    }
+    if( c.pipe[0] == -1 && pipe2( c.pipe, O_NONBLOCK | O_CLOEXEC ) < 0 )
+    {
+        c.pipe[0] = -1;
+        c.pipe[1] = -1;
+        close_conn( fd );
+        return;
+    }
+    //文件->管道、管道->socket两个splice链接在一起提交，前一个完成后内核接着执行后一个
+    size_t chunk = length < SPLICE_CHUNK ? length : SPLICE_CHUNK;
+    struct io_uring_sqe* in = get_sqe();
+    struct io_uring_sqe* out = in ? get_sqe() : NULL;
+    if( ! out )
+    {
+        close_conn( fd );
+        return;
+    }
+    in->opcode = IORING_OP_SPLICE;
+    in->fd = c.pipe[1];
+    in->off = ( unsigned long long )-1;
+    in->splice_fd_in = file_fd;
+    in->splice_off_in = offset;
+    in->len = chunk;
+    in->splice_flags = SPLICE_F_MOVE;
+    in->flags = IOSQE_IO_LINK;
+    in->user_data = pack( OP_SPLICE_IN, c.generation, fd );
+
+    out->opcode = IORING_OP_SPLICE;
+    out->fd = fd;
+    out->off = ( unsigned long long )-1;
+    out->splice_fd_in = c.pipe[0];
+    out->splice_off_in = ( unsigned long long )-1;
+    out->len = chunk;
+    out->splice_flags = SPLICE_F_MOVE | ( length > chunk ? SPLICE_F_MORE : 0 );
+    out->user_data = pack( OP_SPLICE_OUT, c.generation, fd );
+    c.inflight += 2;
+}
+
+void uring_reactor::handle_send( int fd, OP op, int res )
+{
+    uring_conn& c = m_conns[fd];
+    http_conn& conn = m_users[fd];
+    --c.inflight;
+    bool failed = false;
+    bool finished = false;
+    switch( op )
+    {
+        case OP_SEND:
+        {
+            if( res <= 0 )
+            {
+                failed = true;
+            }
+            else if( ! conn.sent( res, false ) )
+            {
+                finished = true; //发完了，对方不要长连接
+            }
+            break;
+        }
+        case OP_SPLICE_IN:
+        {
+            //读到0说明文件被截短了，再也发不够Content-Length
+            if( res <= 0 )
+            {
+                failed = true;
+            }
+            else
+            {
+                c.pipe_pending += res;
+            }
+            break;
+        }
+        case OP_SPLICE_OUT:
+        {
+            if( res > 0 )
+            {
+                c.pipe_pending -= res;
+                if( ! conn.sent( res, true ) )
+                {
+                    finished = true;
+                }
+            }
+            else if( res == -EAGAIN )
+            {
+                //socket发送缓冲区满了，splice不会自己等，挂一个POLLOUT再把管道里的数据送出去
+                struct io_uring_sqe* poll = get_sqe();
+                struct io_uring_sqe* out = poll ? get_sqe() : NULL;
+                if( ! out )
+                {
+                    failed = true;
+                    break;
+                }
+                poll->opcode = IORING_OP_POLL_ADD;
+                poll->fd = fd;
+                poll->poll32_events = POLLOUT;
+                poll->flags = IOSQE_IO_LINK;
+                poll->user_data = pack( OP_POLL_OUT, c.generation, fd );
+                out->opcode = IORING_OP_SPLICE;
+                out->fd = fd;
+                out->off = ( unsigned long long )-1;
+                out->splice_fd_in = c.pipe[0];
+                out->splice_off_in = ( unsigned long long )-1;
+                out->len = c.pipe_pending;
+                out->splice_flags = SPLICE_F_MOVE;
+                out->user_data = pack( OP_SPLICE_OUT, c.generation, fd );
+                c.inflight += 2;
+            }
+            else if( res != -ECANCELED ) //-ECANCELED：链上前一个splice没搬满，管道里有多少由pipe_pending记着
+            {
+                failed = true;
+            }
+            break;
+        }
+        default:
+        {
+            break; //POLL_OUT只是为了触发后面链着的splice
+        }
+    }
+
+    if( c.closing )
+    {
+        if( c.inflight == 0 )
+        {
+            finalize_close( fd );
+        }
+        return;
+    }
+    if( failed || finished )
+    {
+        close_conn( fd );
+        return;
+    }
+    if( c.inflight > 0 )
+    {
+        return; //链上还有操作没完成
+    }
+    if( conn.has_output() || c.pipe_pending > 0 )
+    {
+        send_output( fd );
+        refresh_timer( fd );
+    }
+    else if( conn.pending_input() )
+    {
+        process( fd ); //发送期间收进来的流水线请求
+    }
+    else
+    {
+        refresh_timer( fd );
+    }
+}
+
+void uring_reactor::handle_cqe( const struct io_uring_cqe* cqe )
+{
+    OP op = ( OP )( cqe->user_data >> 56 );
+    unsigned int generation = ( cqe->user_data >> 32 ) & 0xffffff;
+    int fd = ( int )( cqe->user_data & 0xffffffff );
+    if( op == OP_ACCEPT )
+    {
+        handle_accept( cqe->res, cqe->flags );
+        return;
+    }
+    if( op == OP_CANCEL )
+    {
+        return;
+    }
+    if( fd < 0 || fd >= m_max_fd || generation != ( m_conns[fd].generation & 0xffffff ) )
+    {
+        //连接已经关掉了，这是它残留的完成事件；带着缓冲区的要还回去
+        if( cqe->flags & IORING_CQE_F_BUFFER )
+        {
+            recycle_buffer( cqe->flags >> IORING_CQE_BUFFER_SHIFT );
+        }
+        return;
+    }
+    if( op == OP_RECV )
+    {
+        handle_recv( fd, cqe->res, cqe->flags );
+    }
+    else
+    {
+        handle_send( fd, op, cqe->res );
+    }
+}
+
+void uring_reactor::refresh_timer( int fd )
+{
+    http_conn& conn = m_users[fd];
+    long deadline = conn.deadline();
+    if( deadline == 0 )
+    {
+        m_wheel.remove( &conn.m_timer );
+        return;
+    }
+    conn.m_timer.data = &conn;
+    m_wheel.schedule( &conn.m_timer, deadline );
+}
+
+/*
+关闭分两步：先取消这个fd上还在内核里的操作，发送类操作引用着连接的缓冲区和文件映射，
+要等它们的完成事件都回来了，才能在finalize_close里真正释放连接
+*/
+void uring_reactor::close_conn( int fd )
+{
+    uring_conn& c = m_conns[fd];
+    if( c.closing )
+    {
+        return;
+    }
+    c.closing = true;
+    m_wheel.remove( &m_users[fd].m_timer );
+    if( c.recv_armed )
+    {
+        //按user_data取消：process出错时socket已经关了，不能再按fd找
+        struct io_uring_sqe* sqe = get_sqe();
+        if( sqe )
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = pack( OP_RECV, c.generation, fd );
+            sqe->user_data = pack( OP_CANCEL, c.generation, fd );
+        }
+    }
+    if( c.inflight > 0 )
+    {
+        struct io_uring_sqe* sqe = get_sqe();
+        if( sqe )
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = pack( OP_CANCEL, c.generation, fd );
+        }
+        return;
+    }
+    finalize_close( fd );
+}
+
+void uring_reactor::finalize_close( int fd )
+{
+    uring_conn& c = m_conns[fd];
+    if( ! m_users[fd].closed() )
+    {
+        m_users[fd].close_conn();
+    }
+    if( c.pipe[0] != -1 )
+    {
+        close( c.pipe[0] );
+        close( c.pipe[1] );
+        c.pipe[0] = -1;
+        c.pipe[1] = -1;
+    }
+    c.pipe_pending = 0;
+    c.closing = false;
+    c.recv_armed = false;
+    ++c.generation; //之后这个fd号上残留的完成事件都会被丢掉
+}
+
+void uring_reactor::on_timeout( void* data, void* arg )
+{
+    uring_reactor* r = ( uring_reactor* )arg;
+    http_conn* conn = ( http_conn* )data;
+    if( conn->closed() )
+    {
+        return;
+    }
+    long deadline = conn->deadline();
+    if( deadline != 0 && deadline > timer_wheel::now_ms() )
+    {
+        r->m_wheel.schedule( &conn->m_timer, deadline );
+        return;
+    }
+    r->close_conn( conn - r->m_users );
+}
+
+void uring_reactor::loop()
+{
+    while( true )
+    {
+        //提交这一轮攒下的所有请求，同时等完成事件；有定时器时最多等一个tick
+        int ret = submit_and_wait( true, m_wheel.empty() ? -1 : TIMER_TICK_MS );
+        if( ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN )
+        {
+            LOG_ERROR( "io_uring_enter failure, errno is: %d", errno );
+            break;
+        }
+
+        unsigned int head = *m_cq_head;
+        unsigned int tail = __atomic_load_n( m_cq_tail, __ATOMIC_ACQUIRE );
+        while( head != tail )
+        {
+            handle_cqe( &m_cqes[ head & *m_cq_mask ] );
+            ++head;
+            if( head == tail )
+            {
+                //处理期间可能又有新的完成事件
+                __atomic_store_n( m_cq_head, head, __ATOMIC_RELEASE );
+                tail = __atomic_load_n( m_cq_tail, __ATOMIC_ACQUIRE );
+            }
+        }
+        __atomic_store_n( m_cq_head, head, __ATOMIC_RELEASE );
+        m_wheel.advance( timer_wheel::now_ms(), on_timeout, this );
+    }
+}
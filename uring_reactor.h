@@ -0,0 +1,109 @@
+#ifndef URING_REACTOR_H
+#define URING_REACTOR_H
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "http_conn.h"
+#include "timer_wheel.h"
+
+/*
+io_uring后端，和reactor一样负责一个监听socket上的所有连接，但不再是“就绪通知+自己调recv/writev”，
+而是把操作提交给内核、处理完成事件：
+- 多发accept：一次提交，之后每个新连接都产生一个完成事件；
+- 多发recv+提供缓冲区环：内核自己从环里挑缓冲区收数据，不必为每个连接常驻一个读缓冲区；
+- 响应的内存部分用sendmsg发，sendfile模式下文件体用链接在一起的两个splice（文件->管道->socket）发。
+请求在reactor线程上就地解析（和多reactor模式一样），不经过线程池。
+没有liburing，直接用io_uring_setup/io_uring_enter/io_uring_register三个系统调用。
+*/
+class uring_reactor
+{
+public:
+    uring_reactor( int listenfd, http_conn* users, int max_fd );
+    ~uring_reactor();
+
+    bool init(); //内核不支持需要的特性时返回false，调用方改用epoll
+    void loop();
+    bool start( int slot = -1 ); //在新线程中运行loop，slot是cpu_topology里的线程编号，-1表示不固定
+    void join();
+
+private:
+    enum OP { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_SPLICE_IN, OP_SPLICE_OUT, OP_POLL_OUT, OP_CANCEL };
+
+    //每个fd在io_uring侧的状态，和连接表一样按fd下标
+    struct uring_conn
+    {
+        unsigned int generation; //fd被关闭复用后加一，旧的完成事件据此丢弃
+        int inflight; //还在内核里的发送类操作，它们引用着连接的缓冲区，全部完成前不能释放
+        bool closing;
+        bool recv_armed;
+        int pipe[2]; //splice用的管道，第一次发文件体时才创建
+        size_t pipe_pending; //已经进了管道还没进socket的字节
+        struct msghdr msg;
+    };
+
+    static void* worker( void* arg );
+    static void on_timeout( void* data, void* arg );
+
+    struct io_uring_sqe* get_sqe();
+    int submit_and_wait( bool wait, long timeout_ms );
+    static unsigned long long pack( OP op, unsigned int generation, int fd );
+
+    void arm_accept();
+    void arm_recv( int fd );
+    void recycle_buffer( int bid );
+    void handle_cqe( const struct io_uring_cqe* cqe );
+    void handle_accept( int res, unsigned int flags );
+    void handle_recv( int fd, int res, unsigned int flags );
+    void handle_send( int fd, OP op, int res );
+    void process( int fd );
+    void send_output( int fd );
+    void refresh_timer( int fd );
+    void close_conn( int fd );
+    void finalize_close( int fd );
+
+private:
+    static const unsigned int RING_ENTRIES = 4096;
+    static const unsigned int BUFFER_COUNT = 1024; //提供缓冲区环的大小，必须是2的幂
+    static const unsigned int BUFFER_SIZE = 4096;
+    static const int BUFFER_GROUP = 0;
+    static const size_t SPLICE_CHUNK = 64 * 1024; //一次搬进管道的量，管道默认容量
+
+    int m_ring_fd;
+    int m_listenfd;
+    http_conn* m_users;
+    int m_max_fd;
+    uring_conn* m_conns;
+    pthread_t m_thread;
+    int m_slot;
+    timer_wheel m_wheel;
+
+    //提交队列
+    void* m_sq_ptr;
+    size_t m_sq_size;
+    unsigned int* m_sq_head;
+    unsigned int* m_sq_tail;
+    unsigned int* m_sq_mask;
+    unsigned int* m_sq_array;
+    struct io_uring_sqe* m_sqes;
+    size_t m_sqes_size;
+    unsigned int m_sq_local_tail; //已填好还没发布给内核的尾部
+    unsigned int m_to_submit;
+
+    //完成队列
+    void* m_cq_ptr;
+    size_t m_cq_size;
+    unsigned int* m_cq_head;
+    unsigned int* m_cq_tail;
+    unsigned int* m_cq_mask;
+    struct io_uring_cqe* m_cqes;
+
+    //提供缓冲区环
+    struct io_uring_buf_ring* m_buf_ring;
+    size_t m_buf_ring_size;
+    char* m_buffers;
+    unsigned short m_buf_tail;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+
+#include "mpmc_queue.h"
+
+/*
+Chase-Lev工作窃取双端队列（有界版本，内存序按Lê等人2013年的C11实现）。
+只有所属的工作线程在底部push/pop，按后进先出处理，刚碰过的连接数据还在自己的缓存里；
+其他线程只能在顶部steal，拿走的是最老的任务。只有队列里剩最后一个元素时，pop和steal才需要CAS竞争。
+*/
+template< typename T >
+class ws_deque
+{
+public:
+    explicit ws_deque( size_t capacity );
+    ~ws_deque();
+
+    bool push( T data ); //只能由所属线程调用，满则返回false
+    bool pop( T& data ); //只能由所属线程调用
+    bool steal( T& data ); //任意线程调用，空或者竞争失败返回false
+
+private:
+    ws_deque( const ws_deque& );
+    ws_deque& operator=( const ws_deque& );
+
+private:
+    std::atomic< T >* m_buffer;
+    int64_t m_mask;
+    alignas( CACHE_LINE_SIZE ) std::atomic< int64_t > m_top; //窃取端
+    alignas( CACHE_LINE_SIZE ) std::atomic< int64_t > m_bottom; //所属线程端
+    char m_pad[ CACHE_LINE_SIZE - sizeof( std::atomic< int64_t > ) ];
+};
+
+template< typename T >
+ws_deque< T >::ws_deque( size_t capacity ) : m_buffer( NULL ), m_mask( 0 )
+{
+    if( capacity < 2 )
+    {
+        throw std::exception();
+    }
+    size_t size = 2;
+    while( size < capacity )
+    {
+        size <<= 1;
+    }
+    m_buffer = new std::atomic< T >[ size ];
+    m_mask = size - 1;
+    m_top.store( 0, std::memory_order_relaxed );
+    m_bottom.store( 0, std::memory_order_relaxed );
+}
+
+template< typename T >
+ws_deque< T >::~ws_deque()
+{
+    delete [] m_buffer;
+}
+
+template< typename T >
+bool ws_deque< T >::push( T data )
+{
+    int64_t b = m_bottom.load( std::memory_order_relaxed );
+    int64_t t = m_top.load( std::memory_order_acquire );
+    if( b - t > m_mask )
+    {
+        return false;
+    }
+    m_buffer[ b & m_mask ].store( data, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+    m_bottom.store( b + 1, std::memory_order_relaxed );
+    return true;
+}
+
+template< typename T >
+bool ws_deque< T >::pop( T& data )
+{
+    int64_t b = m_bottom.load( std::memory_order_relaxed ) - 1;
+    m_bottom.store( b, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    int64_t t = m_top.load( std::memory_order_relaxed );
+    if( t > b )
+    {
+        m_bottom.store( b + 1, std::memory_order_relaxed ); //本来就是空的
+        return false;
+    }
+
+    data = m_buffer[ b & m_mask ].load( std::memory_order_relaxed );
+    if( t == b )
+    {
+        //最后一个元素，和窃取者抢
+        bool won = m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed );
+        m_bottom.store( b + 1, std::memory_order_relaxed );
+        return won;
+    }
+    return true;
+}
+
+template< typename T >
+bool ws_deque< T >::steal( T& data )
+{
+    int64_t t = m_top.load( std::memory_order_acquire );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    int64_t b = m_bottom.load( std::memory_order_acquire );
+    if( t >= b )
+    {
+        return false;
+    }
+    data = m_buffer[ t & m_mask ].load( std::memory_order_relaxed );
+    return m_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed );
+}
+
+#endif